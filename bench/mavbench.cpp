@@ -0,0 +1,1162 @@
+/*
+  microbenchmark for the MAVLink forwarding path
+
+  One user link parses a stream of datagrams and every message is
+  forwarded to --links UDP engineer links, as ProxySession does:
+  receive_message() on the user link, then send_message() on each
+  engineer link, with a UDPSendBatch open around every --batch
+  datagrams. The engineers share one socket and differ only in their
+  sendto() address, like UDP engineers on a port2. Their addresses
+  are loopback sockets that are never read, so the sendmmsg() cost is
+  measured and the kernel drops whatever overflows.
+
+  Reports messages parsed and frames forwarded per second, on one
+  core. With -k the engineer links sign, with a key in a scratch
+  keys.tdb under /tmp, as support engineers' links do. With -t they
+  are TCP connections instead, drained by a second thread, and the
+  bytes that arrived are reported too; compare -b 0 to see what
+  holding back stream output until the batch closes saves. Frames a
+  TCP link shed because the drain fell behind are counted. -w makes
+  them WSS links, with a scratch self-signed certificate and the
+  drain thread as the TLS client; -K hands them to kernel TLS after
+  the handshake, where the kernel has it.
+
+  With -r the frames of a tlog are parsed instead, in 10 KiB reads as
+  from a TCP socket, once with the library's byte-at-a-time
+  mavlink_parse_char() and once with receive_message(), which skips
+  to start bytes and takes whole frames at a time. -g does the same
+  with random bytes, as from a port scanner.
+
+  Before timing, -r and -g run both parsers over the same reads and
+  check that they give the same messages and counters, then do the
+  same with odd frames (bad CRCs, signed, MAVLink 1, cut off) split at
+  every offset. -d only does the checks, over the tlog, the random
+  bytes or neither.
+
+  -c times the frame CRC on its own for a range of frame sizes: the
+  generated headers' crc_accumulate() a byte at a time, the portable
+  slice-by-8 tables, and what crc16_x25() picks on this CPU.
+
+  -v times signature verification of signed frames, as on engineer
+  links: the library's mavlink_signature_check() and
+  MAVLink::check_signature() with each SHA-256 backend this CPU has.
+  It first runs both checks through the same sequence of good,
+  forged, replayed and stale frames and reports any difference.
+
+    make bench
+    ./bench/mavbench -l 4 -s 5
+    ./bench/mavbench -l 8 -k     # signed engineer links
+    ./bench/mavbench -l 0        # parse only
+    ./bench/mavbench -b 0        # no batching, one sendto() per frame
+    ./bench/mavbench -l 4 -t     # TCP engineers
+    ./bench/mavbench -l 4 -w     # WSS engineers, -K for kernel TLS
+    ./bench/mavbench -r flight.tlog
+    ./bench/mavbench -g          # parse noise
+    ./bench/mavbench -d -g       # parsers give the same results
+    ./bench/mavbench -c          # frame CRC
+    ./bench/mavbench -v          # signature verification
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "mavlink.h"
+#include "udpbatch.h"
+#include "util.h"
+#include "crc16.h"
+#include "sha256.h"
+#include "tlscontext.h"
+#include "libraries/mavlink2/generated/checksum.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <openssl/ssl.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+// frames per datagram and distinct datagrams in the input stream
+#define FRAMES_PER_DATAGRAM 4
+#define NUM_DATAGRAMS 256
+
+struct Datagram {
+    uint8_t data[FRAMES_PER_DATAGRAM * MAVLINK_MAX_PACKET_LEN];
+    ssize_t len;
+};
+
+/*
+  a typical telemetry mix: mostly ATTITUDE and GLOBAL_POSITION_INT,
+  with a HEARTBEAT now and then
+ */
+static void make_input(std::vector<Datagram> &input)
+{
+    uint8_t seq = 0;
+    for (unsigned i = 0; i < NUM_DATAGRAMS; i++) {
+        Datagram d {};
+        for (unsigned f = 0; f < FRAMES_PER_DATAGRAM; f++) {
+            mavlink_message_t msg {};
+            const uint32_t t_ms = i * 100 + f;
+            switch ((i * FRAMES_PER_DATAGRAM + f) % 8) {
+            case 0:
+                mavlink_msg_heartbeat_pack_chan(1, 1, CHAN_STATUSTEXT, &msg,
+                                                MAV_TYPE_QUADROTOR, MAV_AUTOPILOT_ARDUPILOTMEGA,
+                                                0, 0, MAV_STATE_ACTIVE);
+                break;
+            case 1: case 3: case 5: case 7:
+                mavlink_msg_attitude_pack_chan(1, 1, CHAN_STATUSTEXT, &msg,
+                                               t_ms, 0.01f * i, -0.02f * f, 1.5f, 0.001f, 0, -0.003f);
+                break;
+            default:
+                mavlink_msg_global_position_int_pack_chan(1, 1, CHAN_STATUSTEXT, &msg,
+                                                          t_ms, -353632620 + i, 1491652370 - i,
+                                                          584000, 20000 + f, 120, -40, 0, 9000);
+                break;
+            }
+            msg.seq = seq++;
+            d.len += mavlink_msg_to_send_buffer(&d.data[d.len], &msg);
+        }
+        input.push_back(d);
+    }
+}
+
+/*
+  bind a loopback UDP socket that is never read, to forward into
+ */
+static bool open_sink(int &fd, struct sockaddr_in &addr)
+{
+    fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        perror("socket");
+        return false;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        getsockname(fd, (struct sockaddr *)&addr, &len) != 0) {
+        perror("bind");
+        return false;
+    }
+    return true;
+}
+
+/*
+  a connected loopback TCP pair: fd for the engineer link, peer for
+  the drain thread
+ */
+static bool open_tcp_pair(int &fd, int &peer)
+{
+    struct sockaddr_in addr {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    const int listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listener == -1 || fd == -1 ||
+        bind(listener, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(listener, 1) != 0 ||
+        getsockname(listener, (struct sockaddr *)&addr, &len) != 0 ||
+        connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        perror("tcp");
+        return false;
+    }
+    peer = accept(listener, nullptr, nullptr);
+    close(listener);
+    if (peer == -1) {
+        perror("accept");
+        return false;
+    }
+    set_tcp_options(fd);
+    set_nonblocking(fd);
+    return true;
+}
+
+/*
+  read everything that arrives on fds until stop is set, through the
+  TLS client in ssls[i] where there is one
+ */
+static void drain(std::vector<int> fds, std::vector<SSL *> ssls, std::atomic<bool> *stop, std::atomic<uint64_t> *bytes)
+{
+    std::vector<struct pollfd> pfds;
+    for (int fd : fds) {
+        pfds.push_back(pollfd { fd, POLLIN, 0 });
+    }
+    uint8_t buf[65536];
+    while (!*stop) {
+        if (poll(pfds.data(), pfds.size(), 100) <= 0) {
+            continue;
+        }
+        for (size_t i = 0; i < pfds.size(); i++) {
+            if (!(pfds[i].revents & POLLIN)) {
+                continue;
+            }
+            if (ssls[i] == nullptr) {
+                const ssize_t n = recv(pfds[i].fd, buf, sizeof(buf), MSG_DONTWAIT);
+                if (n > 0) {
+                    *bytes += n;
+                }
+                continue;
+            }
+            int n;
+            while ((n = SSL_read(ssls[i], buf, sizeof(buf))) > 0) {
+                *bytes += n;
+            }
+        }
+    }
+}
+
+/*
+  a self-signed certificate for localhost in the current directory,
+  where tlscontext.cpp looks for it
+ */
+static bool make_cert(void)
+{
+    EVP_PKEY *pkey = EVP_EC_gen("P-256");
+    X509 *x = X509_new();
+    bool ok = false;
+    if (pkey != nullptr && x != nullptr) {
+        X509_set_version(x, 2);
+        ASN1_INTEGER_set(X509_get_serialNumber(x), 1);
+        X509_gmtime_adj(X509_getm_notBefore(x), 0);
+        X509_gmtime_adj(X509_getm_notAfter(x), 86400);
+        X509_set_pubkey(x, pkey);
+        X509_NAME *name = X509_get_subject_name(x);
+        X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char *)"localhost", -1, -1, 0);
+        X509_set_issuer_name(x, name);
+        FILE *kf = fopen("privkey.pem", "w");
+        FILE *cf = fopen("fullchain.pem", "w");
+        ok = X509_sign(x, pkey, EVP_sha256()) > 0 && kf != nullptr && cf != nullptr &&
+            PEM_write_PrivateKey(kf, pkey, nullptr, nullptr, 0, nullptr, nullptr) == 1 &&
+            PEM_write_X509(cf, x) == 1;
+        if (kf != nullptr) {
+            fclose(kf);
+        }
+        if (cf != nullptr) {
+            fclose(cf);
+        }
+    }
+    X509_free(x);
+    EVP_PKEY_free(pkey);
+    if (!ok) {
+        printf("failed to create a certificate\n");
+    }
+    return ok;
+}
+
+/*
+  turn a connected TCP pair into a WSS link: the TLS client and the
+  WebSocket upgrade run on peer in a thread while the WebSocket on fd
+  is pumped as ProxySession does
+ */
+static bool open_wss(int fd, int peer, SSL_CTX *client_ctx, SSL *&client, std::unique_ptr<WebSocket> &ws)
+{
+    client = SSL_new(client_ctx);
+    SSL_set_fd(client, peer);
+    std::atomic<bool> done { false };
+    bool ok = false;
+    std::thread t([&]() {
+        static const char request[] =
+            "GET / HTTP/1.1\r\nHost: localhost\r\nUpgrade: websocket\r\n"
+            "Connection: Upgrade\r\nSec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+            "Sec-WebSocket-Version: 13\r\n\r\n";
+        char reply[512];
+        size_t len = 0;
+        if (SSL_connect(client) == 1 && SSL_write(client, request, strlen(request)) > 0) {
+            int n;
+            while (len < sizeof(reply) - 1 &&
+                   (n = SSL_read(client, &reply[len], sizeof(reply) - 1 - len)) > 0) {
+                len += n;
+                reply[len] = 0;
+                if (strstr(reply, "\r\n\r\n") != nullptr) {
+                    ok = strncmp(reply, "HTTP/1.1 101", 12) == 0;
+                    break;
+                }
+            }
+        }
+        done = true;
+    });
+    struct pollfd pfd { fd, POLLIN, 0 };
+    const double start = time_seconds();
+    // the WebSocket looks at the ClientHello when it is created
+    if (poll(&pfd, 1, 2000) == 1) {
+        ws.reset(new WebSocket(fd));
+        while (!done && time_seconds() - start < 5) {
+            poll(&pfd, 1, 10);
+            uint8_t *data;
+            ws->receive(data);
+        }
+    }
+    if (!done) {
+        // unblock the client
+        shutdown(peer, SHUT_RDWR);
+    }
+    t.join();
+    set_nonblocking(peer);
+    if (!ok) {
+        printf("WSS handshake failed\n");
+    }
+    return ok;
+}
+
+// bytes per read when parsing a byte stream
+#define READ_SIZE 10240
+
+/*
+  the MAVLink frames of a tlog: each record is an 8 byte timestamp
+  followed by one frame
+ */
+static bool load_tlog(const char *path, std::vector<uint8_t> &frames)
+{
+    const int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) != 0) {
+        perror(path);
+        return false;
+    }
+    std::vector<uint8_t> data(st.st_size);
+    const bool ok = read(fd, data.data(), data.size()) == ssize_t(data.size());
+    close(fd);
+    if (!ok) {
+        printf("%s: short read\n", path);
+        return false;
+    }
+    size_t ofs = 8;
+    while (ofs + 2 <= data.size()) {
+        const uint8_t *f = &data[ofs];
+        size_t len;
+        if (f[0] == MAVLINK_STX && ofs + 3 <= data.size()) {
+            len = MAVLINK_NUM_NON_PAYLOAD_BYTES + f[1] +
+                ((f[2] & MAVLINK_IFLAG_SIGNED) ? MAVLINK_SIGNATURE_BLOCK_LEN : 0);
+        } else if (f[0] == MAVLINK_STX_MAVLINK1) {
+            len = MAVLINK_CORE_HEADER_MAVLINK1_LEN + 1 + MAVLINK_NUM_CHECKSUM_BYTES + f[1];
+        } else {
+            // lost sync, look for the next frame
+            ofs++;
+            continue;
+        }
+        if (ofs + len > data.size()) {
+            break;
+        }
+        frames.insert(frames.end(), f, f + len);
+        ofs += len + 8;
+    }
+    return true;
+}
+
+static bool same_message(const mavlink_message_t &a, const mavlink_message_t &b)
+{
+    if (a.magic != b.magic || a.len != b.len || a.incompat_flags != b.incompat_flags ||
+        a.compat_flags != b.compat_flags || a.seq != b.seq || a.sysid != b.sysid ||
+        a.compid != b.compid || a.msgid != b.msgid || a.checksum != b.checksum ||
+        memcmp(a.ck, b.ck, sizeof(a.ck)) != 0 ||
+        memcmp(_MAV_PAYLOAD(&a), _MAV_PAYLOAD(&b), a.len) != 0) {
+        return false;
+    }
+    return !(a.incompat_flags & MAVLINK_IFLAG_SIGNED) ||
+        memcmp(a.signature, b.signature, sizeof(a.signature)) == 0;
+}
+
+static bool same_counters(const mavlink_status_t &a, const mavlink_status_t &b)
+{
+    return a.parse_error == b.parse_error &&
+        a.packet_rx_success_count == b.packet_rx_success_count &&
+        a.packet_rx_drop_count == b.packet_rx_drop_count &&
+        a.msg_received == b.msg_received;
+}
+
+/*
+  parse data with receive_message() on a new link and with
+  mavlink_parse_char() on the library's own channel state, in reads
+  that end at cut and then every READ_SIZE bytes. Wherever
+  receive_message() gives a message or reaches the end of a read, the
+  library parser is run up to the same byte and has to have given the
+  same message (or none) and have the same counters. Adds the messages
+  to msgs; returns false on a difference
+ */
+static bool parse_same(const uint8_t *data, size_t size, size_t cut, uint64_t &msgs)
+{
+    MAVLink link;
+    link.init(-1, CHAN_COMM1, false, false, false);
+    memset(&m_mavlink_status[CHAN_COMM1], 0, sizeof(mavlink_status_t));
+    memset(&m_mavlink_buffer[CHAN_COMM1], 0, sizeof(mavlink_message_t));
+    const mavlink_status_t &lib_status = m_mavlink_status[CHAN_COMM1];
+    size_t lib_ofs = 0;
+    size_t ofs = 0;
+    while (ofs < size) {
+        const size_t end = ofs < cut ? cut : std::min(ofs + READ_SIZE, size);
+        uint8_t *buf = const_cast<uint8_t *>(&data[ofs]);
+        ssize_t len = end - ofs;
+        while (len > 0) {
+            mavlink_message_t ours {};
+            const bool got = link.receive_message(buf, len, ours);
+            const size_t upto = buf - data;
+            mavlink_message_t theirs {};
+            unsigned lib_got = 0;
+            size_t lib_at = 0;
+            while (lib_ofs < upto) {
+                mavlink_status_t r;
+                if (mavlink_parse_char(CHAN_COMM1, data[lib_ofs++], &theirs, &r)) {
+                    lib_got++;
+                    lib_at = lib_ofs;
+                }
+            }
+            const char *diff = nullptr;
+            if (got && (lib_got != 1 || lib_at != upto)) {
+                diff = "receive_message() gave a message mavlink_parse_char() didn't";
+            } else if (!got && lib_got != 0) {
+                diff = "mavlink_parse_char() gave a message receive_message() didn't";
+            } else if (got && !same_message(ours, theirs)) {
+                diff = "the parsers decoded a message differently";
+            } else if (!same_counters(link.parse_status(), lib_status)) {
+                diff = "the parser counters differ";
+            }
+            if (diff != nullptr) {
+                const mavlink_status_t &st = link.parse_status();
+                printf("%s at byte %zu of %zu (reads cut at %zu)\n", diff, upto, size, cut);
+                printf("  parse_error %u/%u rx_success %u/%u rx_drop %u/%u msg_received %u/%u\n",
+                       unsigned(st.parse_error), unsigned(lib_status.parse_error),
+                       unsigned(st.packet_rx_success_count), unsigned(lib_status.packet_rx_success_count),
+                       unsigned(st.packet_rx_drop_count), unsigned(lib_status.packet_rx_drop_count),
+                       unsigned(st.msg_received), unsigned(lib_status.msg_received));
+                return false;
+            }
+            msgs += got;
+        }
+        ofs = end;
+    }
+    return true;
+}
+
+/*
+  frames to trip the scanner up: v1 and v2, signed and unsigned, bad
+  CRCs, an unknown message, incompat flags the parser rejects, a cut
+  off frame and stray start bytes in noise
+ */
+static void make_parse_stream(std::vector<uint8_t> &stream)
+{
+    auto add = [&stream](const uint8_t *b, size_t n) {
+        stream.insert(stream.end(), b, b + n);
+    };
+    uint8_t frame[MAVLINK_MAX_PACKET_LEN];
+    mavlink_message_t msg {};
+
+    mavlink_msg_heartbeat_pack_chan(1, 1, CHAN_STATUSTEXT, &msg,
+                                    MAV_TYPE_QUADROTOR, MAV_AUTOPILOT_ARDUPILOTMEGA,
+                                    0, 0, MAV_STATE_ACTIVE);
+    add(frame, mavlink_msg_to_send_buffer(frame, &msg));
+
+    mavlink_msg_attitude_pack_chan(1, 1, CHAN_STATUSTEXT, &msg, 1000, 0.1f, -0.2f, 1.5f, 0.01f, 0, -0.03f);
+    const uint16_t att_len = mavlink_msg_to_send_buffer(frame, &msg);
+    add(frame, att_len);
+
+    static const uint8_t noise[] { 0x00, MAVLINK_STX, 0x05, MAVLINK_STX_MAVLINK1, 0x42, 0x10, 0x00 };
+    add(noise, sizeof(noise));
+
+    // the same ATTITUDE with a bad CRC, then signed, then signed with a bad CRC
+    uint8_t bad[MAVLINK_MAX_PACKET_LEN];
+    memcpy(bad, frame, att_len);
+    bad[att_len - 1] ^= 0x55;
+    add(bad, att_len);
+    const size_t crc_ofs = att_len - MAVLINK_NUM_CHECKSUM_BYTES;
+    frame[2] |= MAVLINK_IFLAG_SIGNED;
+    uint16_t crc = crc_calculate(&frame[1], crc_ofs - 1);
+    crc_accumulate(MAVLINK_MSG_ID_ATTITUDE_CRC, &crc);
+    frame[crc_ofs] = crc & 0xFF;
+    frame[crc_ofs + 1] = crc >> 8;
+    for (unsigned i = 0; i < MAVLINK_SIGNATURE_BLOCK_LEN; i++) {
+        frame[att_len + i] = i * 29 + 7;
+    }
+    const size_t signed_len = att_len + MAVLINK_SIGNATURE_BLOCK_LEN;
+    add(frame, signed_len);
+    frame[crc_ofs] ^= 0x55;
+    add(frame, signed_len);
+    frame[crc_ofs] ^= 0x55;
+
+    // incompat flags the parser doesn't know
+    frame[2] = 0x80;
+    add(frame, att_len);
+
+    // a message id the generated headers don't have, so no crc_extra
+    frame[2] = 0;
+    frame[7] = frame[8] = frame[9] = 0xEE;
+    crc = crc_calculate(&frame[1], crc_ofs - 1);
+    crc_accumulate(0, &crc);
+    frame[crc_ofs] = crc & 0xFF;
+    frame[crc_ofs + 1] = crc >> 8;
+    add(frame, att_len);
+
+    // MAVLink 1
+    m_mavlink_status[CHAN_STATUSTEXT].flags |= MAVLINK_STATUS_FLAG_OUT_MAVLINK1;
+    mavlink_msg_heartbeat_pack_chan(1, 1, CHAN_STATUSTEXT, &msg,
+                                    MAV_TYPE_GCS, MAV_AUTOPILOT_INVALID, 0, 0, MAV_STATE_ACTIVE);
+    const uint16_t v1_len = mavlink_msg_to_send_buffer(frame, &msg);
+    m_mavlink_status[CHAN_STATUSTEXT].flags &= ~MAVLINK_STATUS_FLAG_OUT_MAVLINK1;
+    add(frame, v1_len);
+
+    // a frame cut off by the next one
+    mavlink_msg_attitude_pack_chan(1, 1, CHAN_STATUSTEXT, &msg, 2000, 0.1f, -0.2f, 1.5f, 0.01f, 0, -0.03f);
+    add(frame, mavlink_msg_to_send_buffer(frame, &msg) / 2);
+    mavlink_msg_heartbeat_pack_chan(1, 1, CHAN_STATUSTEXT, &msg,
+                                    MAV_TYPE_QUADROTOR, MAV_AUTOPILOT_ARDUPILOTMEGA,
+                                    0, 0, MAV_STATE_ACTIVE);
+    add(frame, mavlink_msg_to_send_buffer(frame, &msg));
+    add(noise, sizeof(noise));
+}
+
+/*
+  compare receive_message() with mavlink_parse_char() on stream as it
+  is read, then on the made up frames of make_parse_stream() split in
+  two reads at every offset
+ */
+static bool parse_check(const std::vector<uint8_t> &stream)
+{
+    uint64_t msgs = 0;
+    if (!parse_same(stream.data(), stream.size(), 0, msgs)) {
+        return false;
+    }
+    std::vector<uint8_t> frames;
+    make_parse_stream(frames);
+    uint64_t split_msgs = 0;
+    for (size_t cut = 0; cut <= frames.size(); cut++) {
+        if (!parse_same(frames.data(), frames.size(), cut, split_msgs)) {
+            return false;
+        }
+    }
+    printf("receive_message matches mavlink_parse_char on %llu messages, and on %zu bytes of odd frames split at every offset\n",
+           (unsigned long long)msgs, frames.size());
+    return true;
+}
+
+/*
+  parse stream in READ_SIZE reads for about seconds with each parser
+ */
+static void parse_bench(const std::vector<uint8_t> &stream, double seconds)
+{
+    for (unsigned scanner = 0; scanner < 2; scanner++) {
+        MAVLink link;
+        link.init(-1, CHAN_COMM1, false, false, false);
+        mavlink_message_t msg;
+        mavlink_status_t status;
+        uint64_t bytes = 0;
+        uint64_t msgs = 0;
+        const double start = time_seconds();
+        double elapsed = 0;
+        while (elapsed < seconds / 2) {
+            for (size_t ofs = 0; ofs < stream.size(); ofs += READ_SIZE) {
+                const size_t n = std::min(size_t(READ_SIZE), stream.size() - ofs);
+                if (scanner) {
+                    uint8_t *buf = const_cast<uint8_t *>(&stream[ofs]);
+                    ssize_t len = n;
+                    while (len > 0 && link.receive_message(buf, len, msg)) {
+                        msgs++;
+                    }
+                } else {
+                    for (size_t i = 0; i < n; i++) {
+                        if (mavlink_parse_char(CHAN_COMM1, stream[ofs+i], &msg, &status)) {
+                            msgs++;
+                        }
+                    }
+                }
+                bytes += n;
+            }
+            elapsed = time_seconds() - start;
+        }
+        printf("%-14s %8.1f MB/s %10.0f msgs/s\n", scanner ? "frame scanner" : "byte parser",
+               bytes / elapsed * 1.0e-6, msgs / elapsed);
+    }
+}
+
+/*
+  time each CRC over header and payload (the bytes after the STX) of
+  frames of several sizes
+ */
+static void crc_bench(double seconds)
+{
+    uint8_t frame[MAVLINK_CORE_HEADER_LEN + MAVLINK_MAX_PAYLOAD_LEN];
+    for (size_t i = 0; i < sizeof(frame); i++) {
+        frame[i] = i * 7 + 3;
+    }
+    const char *names[3] { "bytewise", "slice-by-8", crc16_x25_impl() };
+    printf("%6s", "bytes");
+    for (const char *name : names) {
+        printf(" %12s", name);
+    }
+    printf("   (ns per frame)\n");
+    // HEARTBEAT, ATTITUDE, a short and a full FTP frame
+    for (size_t len : { 9 + 9, 9 + 28, 9 + 64, 9 + 251, 9 + 255 }) {
+        printf("%6zu", len);
+        uint16_t check[3];
+        for (unsigned impl = 0; impl < 3; impl++) {
+            uint64_t n = 0;
+            uint16_t crc = 0;
+            const double start = time_seconds();
+            double elapsed = 0;
+            while (elapsed < seconds / 15) {
+                for (unsigned i = 0; i < 10000; i++) {
+                    // chain the frames so none can be skipped
+                    frame[0] = crc;
+                    switch (impl) {
+                    case 0:
+                        crc_init(&crc);
+                        crc_accumulate_buffer(&crc, (const char *)frame, len);
+                        break;
+                    case 1:
+                        crc = crc16_x25_sliced(X25_INIT_CRC, frame, len);
+                        break;
+                    default:
+                        crc = crc16_x25(X25_INIT_CRC, frame, len);
+                        break;
+                    }
+                }
+                n += 10000;
+                elapsed = time_seconds() - start;
+            }
+            check[impl] = crc;
+            printf(" %12.1f", elapsed / n * 1.0e9);
+        }
+        if (check[1] != check[0] || check[2] != check[0]) {
+            printf("  CRC MISMATCH");
+        }
+        printf("\n");
+    }
+}
+
+// defined in mavlink.cpp with the other separate helpers, not declared by protocol.h
+bool mavlink_signature_check(mavlink_signing_t *signing, mavlink_signing_streams_t *signing_streams,
+                             const mavlink_message_t *msg);
+
+/*
+  a signed frame from sysid 1 on link_id 0 with the given payload
+  length and timestamp, both as the parser hands it over and as wire
+  bytes
+ */
+struct SignedFrame {
+    mavlink_message_t msg;
+    uint8_t wire[MAVLINK_MAX_PACKET_LEN];
+};
+
+static void make_signed(SignedFrame &f, const uint8_t key[32], uint8_t len, uint64_t tstamp, uint8_t sysid=1)
+{
+    mavlink_message_t &m = f.msg;
+    memset(&m, 0, sizeof(m));
+    m.magic = MAVLINK_STX;
+    m.len = len;
+    m.incompat_flags = MAVLINK_IFLAG_SIGNED;
+    m.sysid = sysid;
+    m.compid = 1;
+    m.msgid = MAVLINK_MSG_ID_ATTITUDE;
+    for (uint8_t i = 0; i < len; i++) {
+        _MAV_PAYLOAD_NON_CONST(&m)[i] = i * 13 + 5;
+    }
+    const size_t hlen = MAVLINK_CORE_HEADER_LEN + 1;
+    memcpy(f.wire, &m.magic, hlen + len);
+    m.checksum = crc16_x25(X25_INIT_CRC, &f.wire[1], hlen - 1 + len);
+    m.ck[0] = m.checksum & 0xFF;
+    m.ck[1] = m.checksum >> 8;
+    memcpy(&f.wire[hlen + len], m.ck, 2);
+    uint8_t *sig = m.signature;
+    sig[0] = 0;
+    memcpy(&sig[1], &tstamp, 6);
+    sha256_ctx ctx;
+    uint8_t hash[32];
+    sha256_init(&ctx);
+    sha256_update(&ctx, key, 32);
+    sha256_update(&ctx, &m.magic, hlen + len);
+    sha256_update(&ctx, m.ck, 2);
+    sha256_update(&ctx, sig, 7);
+    sha256_final_32bytes(&ctx, hash);
+    memcpy(&sig[7], hash, 6);
+    memcpy(&f.wire[hlen + len + 2], sig, MAVLINK_SIGNATURE_BLOCK_LEN);
+}
+
+/*
+  run the library's check and check_signature() over the same frames
+  from the same state, and compare results and state after each
+ */
+static bool verify_same(const uint8_t key[32])
+{
+    mavlink_signing_t signing[2] {};
+    mavlink_signing_streams_t streams[2] {};
+    const uint64_t now = 500000000ULL;
+    for (auto &s : signing) {
+        memcpy(s.secret_key, key, 32);
+        s.timestamp = now;
+    }
+    std::vector<SignedFrame> frames;
+    SignedFrame f;
+    for (unsigned i = 0; i < 3; i++) {
+        // a new stream, the next frame on it, and the same again
+        make_signed(f, key, 28, now + i, 1);
+        frames.push_back(f);
+        frames.push_back(f);
+    }
+    make_signed(f, key, 28, now + 10, 1);
+    f.msg.signature[7] ^= 1;
+    f.wire[MAVLINK_NUM_NON_PAYLOAD_BYTES + 28 + 7] ^= 1;
+    // forged, a recent and a stale new stream, then more streams than fit
+    frames.push_back(f);
+    make_signed(f, key, 9, now - 1, 2);
+    frames.push_back(f);
+    make_signed(f, key, 255, 1, 3);
+    frames.push_back(f);
+    for (unsigned i = 0; i < MAVLINK_MAX_SIGNING_STREAMS + 2; i++) {
+        make_signed(f, key, i % 40, now + 100 + i, 10 + i);
+        frames.push_back(f);
+    }
+    for (auto &fr : frames) {
+        const bool lib = mavlink_signature_check(&signing[0], &streams[0], &fr.msg);
+        const bool ours = MAVLink::check_signature(&signing[1], &streams[1], fr.msg, fr.wire);
+        if (lib != ours || signing[0].last_status != signing[1].last_status ||
+            signing[0].timestamp != signing[1].timestamp ||
+            memcmp(&streams[0], &streams[1], sizeof(streams[0])) != 0) {
+            printf("check_signature differs from mavlink_signature_check (status %u vs %u)\n",
+                   unsigned(signing[0].last_status), unsigned(signing[1].last_status));
+            return false;
+        }
+    }
+    printf("check_signature matches mavlink_signature_check on %zu frames\n", frames.size());
+    return true;
+}
+
+/*
+  verifies per second for several frame sizes. The frames are checked
+  with no signing streams, which costs the full hash and fails after
+  it with NO_STREAMS only if the signature was good
+ */
+static void verify_bench(double seconds)
+{
+    uint8_t key[32];
+    for (uint8_t i = 0; i < sizeof(key); i++) {
+        key[i] = i * 37 + 11;
+    }
+    if (!verify_same(key)) {
+        exit(1);
+    }
+    std::vector<const char *> names { "library" };
+    for (const char *b : { "portable", "sha-ni" }) {
+        if (sha256_set_backend(b)) {
+            names.push_back(b);
+        }
+    }
+    printf("%8s", "payload");
+    for (const char *name : names) {
+        printf(" %12s", name);
+    }
+    printf("   (verifies/s)\n");
+    // HEARTBEAT, ATTITUDE, a short and a full FTP frame
+    for (int len : { 9, 28, 64, 255 }) {
+        SignedFrame f;
+        make_signed(f, key, len, 1);
+        printf("%8d", len);
+        bool ok = true;
+        for (unsigned impl = 0; impl < names.size(); impl++) {
+            if (impl > 0) {
+                sha256_set_backend(names[impl]);
+            }
+            mavlink_signing_t signing {};
+            memcpy(signing.secret_key, key, sizeof(key));
+            uint64_t n = 0;
+            const double start = time_seconds();
+            double elapsed = 0;
+            while (elapsed < seconds / (4 * names.size())) {
+                for (unsigned i = 0; i < 10000; i++) {
+                    if (impl == 0) {
+                        mavlink_signature_check(&signing, nullptr, &f.msg);
+                    } else {
+                        MAVLink::check_signature(&signing, nullptr, f.msg, f.wire);
+                    }
+                }
+                n += 10000;
+                elapsed = time_seconds() - start;
+            }
+            ok = ok && signing.last_status == MAVLINK_SIGNING_STATUS_NO_STREAMS;
+            printf(" %12.0f", n / elapsed);
+        }
+        if (!ok) {
+            printf("  BAD SIGNATURE");
+        }
+        printf("\n");
+    }
+}
+
+// port2 of the scratch signing key
+#define BENCH_KEY_ID 10001
+
+static char scratch_dir[] = "/tmp/mavbench.XXXXXX";
+
+/*
+  work in a scratch directory for keys.tdb and the certificate, as
+  supportproxy works in its own
+ */
+static bool enter_scratch_dir(void)
+{
+    if (mkdtemp(scratch_dir) == nullptr || chdir(scratch_dir) != 0) {
+        perror(scratch_dir);
+        return false;
+    }
+    return true;
+}
+
+static void remove_scratch_dir(void)
+{
+    unlink(KEY_FILE);
+    unlink("privkey.pem");
+    unlink("fullchain.pem");
+    if (chdir("/") == 0) {
+        rmdir(scratch_dir);
+    }
+}
+
+// a scratch keys.tdb holding one signing key
+static bool setup_key(void)
+{
+    auto *db = db_open_transaction();
+    if (db == nullptr) {
+        return false;
+    }
+    struct KeyEntry k {};
+    k.magic = KEY_MAGIC;
+    for (uint8_t i = 0; i < sizeof(k.secret_key); i++) {
+        k.secret_key[i] = i * 37 + 11;
+    }
+    k.port1 = BENCH_KEY_ID - 1;
+    db_save_key(db, BENCH_KEY_ID, k);
+    db_close_commit(db);
+    return true;
+}
+
+/*
+  signed links only forward HEARTBEATs until the engineer has sent a
+  good signed packet. Have a link with the same key sign a HEARTBEAT
+  to a sink and feed that to each of them
+ */
+static bool unlock_signed(std::vector<MAVLink> &links)
+{
+    int sink;
+    struct sockaddr_in addr;
+    if (!open_sink(sink, addr)) {
+        return false;
+    }
+    const int gcs_sock = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    MAVLink gcs;
+    gcs.init(gcs_sock, CHAN_COMM2(MAX_COMM2_LINKS - 1), true, false, false, BENCH_KEY_ID);
+    gcs.set_sendto(addr, sizeof(addr));
+
+    mavlink_message_t msg {};
+    mavlink_msg_heartbeat_pack_chan(255, 190, CHAN_STATUSTEXT, &msg,
+                                    MAV_TYPE_GCS, MAV_AUTOPILOT_INVALID, 0, 0, MAV_STATE_ACTIVE);
+    bool ok = false;
+    uint8_t frame[MAVLINK_MAX_PACKET_LEN];
+    struct pollfd pfd { sink, POLLIN, 0 };
+    ssize_t n = -1;
+    if (gcs.send_message(msg) && poll(&pfd, 1, 1000) == 1) {
+        n = recv(sink, frame, sizeof(frame), 0);
+    }
+    if (n > 0) {
+        ok = true;
+        for (auto &link : links) {
+            uint8_t *buf = frame;
+            ssize_t len = n;
+            mavlink_message_t rx;
+            if (!link.receive_message(buf, len, rx)) {
+                ok = false;
+            }
+        }
+    }
+    if (!ok) {
+        printf("failed to get a signed HEARTBEAT accepted\n");
+    }
+    close(gcs_sock);
+    close(sink);
+    return ok;
+}
+
+static void usage(void)
+{
+    printf("mavbench: [-l links] [-b batch] [-s seconds] [-k] [-t] [-w] [-K] [-r tlog] [-g] [-d] [-c] [-v]\n");
+    printf("  -l  engineer links to forward each message to (default 1, 0 to only parse)\n");
+    printf("  -b  datagrams per UDPSendBatch (default 16, 0 for unbatched sends)\n");
+    printf("  -s  seconds to run for (default 3)\n");
+    printf("  -k  sign on the engineer links\n");
+    printf("  -t  TCP engineer links instead of UDP\n");
+    printf("  -w  WSS engineer links instead of UDP\n");
+    printf("  -K  kernel TLS on the WSS links, if available\n");
+    printf("  -r  compare the parsers on the frames of a tlog\n");
+    printf("  -g  compare the parsers on random bytes\n");
+    printf("  -d  only check that the parsers agree, not time them\n");
+    printf("  -c  time the frame CRC\n");
+    printf("  -v  time signature verification\n");
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned num_links = 1;
+    unsigned batch = 16;
+    double seconds = 3;
+    bool sign = false;
+    bool tcp = false;
+    bool wss = false;
+    bool ktls = false;
+    const char *tlog_path = nullptr;
+    bool noise = false;
+    bool parse_only = false;
+    bool crc = false;
+    bool verify = false;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "l:b:s:ktwKr:gdcvh")) != -1) {
+        switch (opt) {
+        case 'l':
+            num_links = atoi(optarg);
+            break;
+        case 'b':
+            batch = atoi(optarg);
+            break;
+        case 's':
+            seconds = atof(optarg);
+            break;
+        case 'k':
+            sign = true;
+            break;
+        case 't':
+            tcp = true;
+            break;
+        case 'w':
+            wss = true;
+            tcp = true;
+            break;
+        case 'K':
+            ktls = true;
+            break;
+        case 'r':
+            tlog_path = optarg;
+            break;
+        case 'g':
+            noise = true;
+            break;
+        case 'd':
+            parse_only = true;
+            break;
+        case 'c':
+            crc = true;
+            break;
+        case 'v':
+            verify = true;
+            break;
+        case 'h':
+        default:
+            usage();
+            exit(1);
+        }
+    }
+    if (num_links > MAX_COMM2_LINKS) {
+        printf("at most %u links\n", unsigned(MAX_COMM2_LINKS));
+        exit(1);
+    }
+
+    if (crc) {
+        crc_bench(seconds);
+        return 0;
+    }
+    if (verify) {
+        verify_bench(seconds);
+        return 0;
+    }
+    if (tlog_path != nullptr || noise || parse_only) {
+        std::vector<uint8_t> stream;
+        if (noise) {
+            srandom(1);
+            stream.resize(1U << 20);
+            for (auto &b : stream) {
+                b = random();
+            }
+        } else if (tlog_path != nullptr && !load_tlog(tlog_path, stream)) {
+            exit(1);
+        }
+        if (tlog_path != nullptr && stream.empty()) {
+            printf("%s: no frames\n", tlog_path);
+            exit(1);
+        }
+        printf("%zu bytes\n", stream.size());
+        if (!parse_check(stream)) {
+            exit(1);
+        }
+        if (!parse_only) {
+            parse_bench(stream, seconds);
+        }
+        return 0;
+    }
+
+    std::vector<Datagram> input;
+    make_input(input);
+
+    if ((sign || wss) && !enter_scratch_dir()) {
+        exit(1);
+    }
+    if (sign && !setup_key()) {
+        remove_scratch_dir();
+        exit(1);
+    }
+    SSL_CTX *client_ctx = nullptr;
+    if (wss) {
+        if (ktls) {
+            tls_context_use_ktls();
+        }
+        client_ctx = SSL_CTX_new(TLS_client_method());
+        if (!make_cert() || !tls_context_load() || client_ctx == nullptr) {
+            remove_scratch_dir();
+            exit(1);
+        }
+    }
+
+    const int eng_sock = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (eng_sock == -1) {
+        perror("socket");
+        exit(1);
+    }
+    // UDP sinks, or the far ends of the TCP links
+    std::vector<int> sinks(num_links, -1);
+    std::vector<int> tcp_fds;
+    // the TLS clients in the drain thread, and the server ends
+    std::vector<SSL *> clients(num_links, nullptr);
+    std::vector<std::unique_ptr<WebSocket>> websockets(num_links);
+    std::vector<MAVLink> links(num_links);
+    for (unsigned i = 0; i < num_links; i++) {
+        int fd = eng_sock;
+        struct sockaddr_in addr;
+        if (tcp) {
+            if (!open_tcp_pair(fd, sinks[i]) ||
+                (wss && !open_wss(fd, sinks[i], client_ctx, clients[i], websockets[i]))) {
+                exit(1);
+            }
+            tcp_fds.push_back(fd);
+        } else if (!open_sink(sinks[i], addr)) {
+            exit(1);
+        }
+        links[i].init(fd, CHAN_COMM2(i), sign, wss, tcp, sign ? BENCH_KEY_ID : -1);
+        if (wss) {
+            links[i].set_ws(websockets[i].get());
+        }
+        if (!tcp) {
+            links[i].set_sendto(addr, sizeof(addr));
+        }
+    }
+    if (sign && !unlock_signed(links)) {
+        remove_scratch_dir();
+        exit(1);
+    }
+
+    MAVLink user;
+    user.init(-1, CHAN_COMM1, false, false, false);
+
+    uint64_t parsed = 0;
+    uint64_t forwarded = 0;
+    uint64_t failed = 0;
+    mavlink_message_t msg;
+    std::atomic<bool> stop { false };
+    std::atomic<uint64_t> drained { 0 };
+    std::thread drainer;
+    if (tcp) {
+        drainer = std::thread(drain, sinks, clients, &stop, &drained);
+    }
+
+    const double start = time_seconds();
+    double elapsed = 0;
+
+    // feed input[first, last) through the user link to the engineers
+    auto dispatch = [&](unsigned first, unsigned last) {
+        for (unsigned i = first; i < last; i++) {
+            uint8_t *buf = input[i].data;
+            ssize_t len = input[i].len;
+            while (len > 0 && user.receive_message(buf, len, msg)) {
+                parsed++;
+                MAVLinkFanout fanout(msg);
+                for (auto &link : links) {
+                    if (link.send_message(fanout)) {
+                        forwarded++;
+                    } else {
+                        failed++;
+                    }
+                }
+            }
+        }
+    };
+
+    while (elapsed < seconds) {
+        const unsigned step = batch > 0 ? batch : 1;
+        for (unsigned i = 0; i < input.size(); i += step) {
+            const unsigned last = std::min(unsigned(input.size()), i + step);
+            if (batch > 0) {
+                // as around each event loop dispatch in a session
+                UDPSendBatch send_batch;
+                dispatch(i, last);
+            } else {
+                dispatch(i, last);
+            }
+        }
+        elapsed = time_seconds() - start;
+    }
+
+    printf("%u %s %s links, batch %u: %.0f msgs/s parsed, %.0f frames/s forwarded",
+           num_links, sign ? "signed" : "unsigned", wss ? "WSS" : tcp ? "TCP" : "UDP", batch,
+           parsed / elapsed, forwarded / elapsed);
+    if (tcp) {
+        // let the drain thread catch up
+        usleep(200000);
+        stop = true;
+        drainer.join();
+        printf(", %.0f bytes/s received", drained / elapsed);
+    }
+    if (failed > 0) {
+        printf(", %llu sends failed", (unsigned long long)failed);
+    }
+    uint64_t dropped = 0;
+    for (auto &link : links) {
+        for (uint8_t c = 0; c < MSG_CLASS_COUNT; c++) {
+            dropped += link.dropped(c);
+        }
+    }
+    if (dropped > 0) {
+        // shed from the output queues of TCP links the drain fell behind on
+        printf(", %llu frames shed", (unsigned long long)dropped);
+    }
+    printf("\n");
+
+    for (SSL *c : clients) {
+        SSL_free(c);
+    }
+    SSL_CTX_free(client_ctx);
+    for (int fd : sinks) {
+        close(fd);
+    }
+    for (int fd : tcp_fds) {
+        close(fd);
+    }
+    close(eng_sock);
+    if (sign || wss) {
+        remove_scratch_dir();
+    }
+    return 0;
+}
@@ -0,0 +1,265 @@
+/*
+  checks of the checksum and hash code against reference versions
+
+  The frame CRC has table and carry-less multiply versions picked by
+  CPU, and a mistake in one of them only shows on the CPUs that use
+  it. This runs them over buffers of every length up to a few frames,
+  at every alignment and from arbitrary starting values, and compares
+  them with a bit at a time CRC. Each SHA-256 backend this CPU has is
+  compared with OpenSSL the same way, fed in pieces of random sizes
+  as the signing code does.
+
+  The output queue of stream links is driven through random sends,
+  partial writes and TLS retries, and what comes out has to be whole
+  frames in the order they were queued, with every frame either
+  written or counted as shed. Exits non-zero on any difference.
+
+  Needs none of the generated headers, only libcrypto:
+
+    make check
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "crc16.h"
+#include "sha256.h"
+#include "outqueue.h"
+
+#include <openssl/sha.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+// longest buffer checked, a few frames with room for the alignments
+#define CHECK_MAX_LEN 1100
+
+// CRC-16/MCRF4XX one bit at a time, straight from the definition
+static uint16_t crc16_bitwise(uint16_t crc, const uint8_t *p, size_t len)
+{
+    while (len--) {
+        crc ^= *p++;
+        for (unsigned i = 0; i < 8; i++) {
+            crc = (crc & 1) ? (crc >> 1) ^ 0x8408 : crc >> 1;
+        }
+    }
+    return crc;
+}
+
+/*
+  crc16_x25() (whatever this CPU uses) and crc16_x25_sliced() against
+  crc16_bitwise(), whole and split in two at random points
+ */
+static bool check_crc(void)
+{
+    static uint8_t buf[CHECK_MAX_LEN + 16];
+    for (size_t i = 0; i < sizeof(buf); i++) {
+        buf[i] = random();
+    }
+    // the catalogue check value of CRC-16/MCRF4XX
+    const uint16_t check = crc16_x25(0xFFFF, "123456789", 9);
+    if (check != 0x6F91) {
+        printf("crc16_x25(\"123456789\") is 0x%04x, not 0x6F91\n", unsigned(check));
+        return false;
+    }
+    unsigned buffers = 0;
+    for (size_t len = 0; len <= CHECK_MAX_LEN; len++) {
+        for (size_t ofs = 0; ofs < 16; ofs++) {
+            const uint8_t *p = &buf[ofs];
+            const uint16_t init = random();
+            const uint16_t ref = crc16_bitwise(init, p, len);
+            const uint16_t sliced = crc16_x25_sliced(init, p, len);
+            const uint16_t picked = crc16_x25(init, p, len);
+            const size_t cut = len ? random() % len : 0;
+            const uint16_t split = crc16_x25(crc16_x25(init, p, cut), p + cut, len - cut);
+            if (sliced != ref || picked != ref || split != ref) {
+                printf("CRC mismatch: len %zu offset %zu init 0x%04x: bitwise 0x%04x slice-by-8 0x%04x %s 0x%04x split at %zu 0x%04x\n",
+                       len, ofs, unsigned(init), unsigned(ref), unsigned(sliced),
+                       crc16_x25_impl(), unsigned(picked), cut, unsigned(split));
+                return false;
+            }
+            buffers++;
+        }
+    }
+    printf("crc16_x25 (%s) and slice-by-8 match the bitwise CRC on %u buffers\n",
+           crc16_x25_impl(), buffers);
+    return true;
+}
+
+/*
+  each available sha256 backend against OpenSSL's SHA256(), with the
+  input split over several sha256_update() calls
+ */
+static bool check_sha256(void)
+{
+    static uint8_t buf[CHECK_MAX_LEN + 16];
+    for (size_t i = 0; i < sizeof(buf); i++) {
+        buf[i] = random();
+    }
+    const char *saved = sha256_backend();
+    bool ok = true;
+    static const char *const backends[] { "portable", "sha-ni" };
+    for (const char *backend : backends) {
+        if (!sha256_set_backend(backend)) {
+            printf("sha256 %s: not available on this CPU, skipped\n", backend);
+            continue;
+        }
+        unsigned buffers = 0;
+        for (size_t len = 0; len <= CHECK_MAX_LEN && ok; len++) {
+            for (size_t ofs = 0; ofs < 16; ofs += 5) {
+                const uint8_t *p = &buf[ofs];
+                uint8_t ref[SHA256_DIGEST_LENGTH];
+                SHA256(p, len, ref);
+
+                sha256_ctx ctx;
+                sha256_init(&ctx);
+                size_t done = 0;
+                while (done < len) {
+                    const size_t n = 1 + random() % (len - done);
+                    sha256_update(&ctx, p + done, n);
+                    done += n;
+                }
+                uint8_t ours[32];
+                sha256_final_32bytes(&ctx, ours);
+                if (memcmp(ours, ref, sizeof(ours)) != 0) {
+                    printf("SHA-256 mismatch: backend %s len %zu offset %zu\n", backend, len, ofs);
+                    ok = false;
+                    break;
+                }
+                buffers++;
+            }
+        }
+        if (ok) {
+            printf("sha256 %s matches OpenSSL on %u buffers\n", backend, buffers);
+        }
+    }
+    sha256_set_backend(saved);
+    return ok;
+}
+
+// random operations on the output queue
+#define CHECK_QUEUE_OPS 200000
+
+/*
+  OutputQueue under random load: frames of random class, key and
+  length, written by a socket that takes a random number of bytes
+  each time, sometimes wanting the same bytes again as TLS does
+ */
+static bool check_output_queue(void)
+{
+    OutputQueue q;
+    std::vector<std::string> frames;
+    std::string written;
+    // what TLS was given when it asked for a retry
+    std::string repeat;
+    bool congested = false;
+    unsigned writes = 0, repeats = 0;
+
+    // one write as MAVLink::write_output() does it, taking up to cap bytes
+    auto write = [&](size_t cap) {
+        while (q.size() != 0) {
+            size_t n;
+            const uint8_t *b = q.next(n);
+            if (!repeat.empty()) {
+                if (repeat.compare(0, std::string::npos, (const char *)b, n) != 0) {
+                    printf("output queue: pinned bytes changed before the retry\n");
+                    return false;
+                }
+                repeat.clear();
+            }
+            if (cap != 0 && random() % 8 == 0) {
+                // TLS took nothing and wants the same bytes again
+                q.pin(n);
+                repeat.assign((const char *)b, n);
+                repeats++;
+                congested = true;
+                return true;
+            }
+            const size_t ret = n < cap ? n : cap;
+            if (ret > 0) {
+                written.append((const char *)b, ret);
+                q.consume(ret);
+                cap -= ret;
+                writes++;
+            }
+            if (ret < n) {
+                congested = true;
+                return true;
+            }
+        }
+        congested = false;
+        return true;
+    };
+
+    for (unsigned i = 0; i < CHECK_QUEUE_OPS; i++) {
+        const unsigned op = random() % 10;
+        if (op < 7) {
+            // unique contents, so each frame can be found in the output
+            const uint8_t cls = random() % MSG_CLASS_COUNT;
+            const uint64_t key = random() % 5;
+            char header[16];
+            const int hlen = snprintf(header, sizeof(header), "<%u:", i);
+            std::string body(20 + random() % 260, 'x');
+            body.back() = '>';
+            frames.push_back(std::string(header, hlen) + body);
+            q.push(cls, key, (const uint8_t *)header, hlen, body.data(), body.size(), congested);
+            if (!congested && !write(random() % 300)) {
+                return false;
+            }
+        } else if (!write(random() % (op == 9 ? 40000 : 500))) {
+            return false;
+        }
+    }
+    if (!write(SIZE_MAX) || q.size() != 0) {
+        printf("output queue: %zu bytes left after an unlimited write\n", q.size());
+        return false;
+    }
+
+    // whole frames in queue order, some left out
+    size_t pos = 0, f = 0, got = 0;
+    while (pos < written.size()) {
+        while (f < frames.size() && written.compare(pos, frames[f].size(), frames[f]) != 0) {
+            f++;
+        }
+        if (f == frames.size()) {
+            printf("output queue: byte %zu of the output doesn't start a queued frame\n", pos);
+            return false;
+        }
+        pos += frames[f].size();
+        f++;
+        got++;
+    }
+    size_t shed = 0;
+    for (uint8_t c = 0; c < MSG_CLASS_COUNT; c++) {
+        shed += q.dropped(c);
+    }
+    if (got + shed != frames.size()) {
+        printf("output queue: %zu frames queued but %zu written and %zu shed\n",
+               frames.size(), got, shed);
+        return false;
+    }
+    printf("output queue wrote %zu of %zu frames whole and in order, %zu shed, in %u writes and %u TLS retries\n",
+           got, frames.size(), shed, writes, repeats);
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    srandom(argc > 1 ? atoi(argv[1]) : 1);
+    bool ok = check_crc();
+    ok = check_sha256() && ok;
+    ok = check_output_queue() && ok;
+    return ok ? 0 : 1;
+}
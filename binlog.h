@@ -130,6 +130,10 @@ public:
      */
     void tick(MAVLink &user_link);
 
+    // how often tick() needs to run while no traffic arrives, so the
+    // NACK_REPEAT_S re-NACKs go out on time
+    static constexpr double TICK_S = 0.1;
+
     void close();
 
 private:
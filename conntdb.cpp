@@ -6,12 +6,24 @@
 #include <errno.h>
 #include <unistd.h>
 #include <time.h>
+#include <pthread.h>
+#include <mutex>
 #include <vector>
 
+/*
+  one connections.tdb open per process at a time, held from
+  conn_db_open() until conn_db_close*(); see db_mutex in keydb.cpp
+ */
+static std::mutex conn_mutex;
+static const int conn_mutex_atfork = pthread_atfork(
+    []() { conn_mutex.lock(); },
+    []() { conn_mutex.unlock(); },
+    []() { conn_mutex.unlock(); });
+
 /*
   Open connections.tdb (cwd-relative, like keys.tdb). EBUSY can happen
   briefly when a concurrent transaction holds the open lock; retry with
-  a short backoff so heartbeat grandchildren don't drop their snapshot
+  a short backoff so the writer thread doesn't drop a snapshot
   for a transient lock collision.
  */
 TDB_CONTEXT *conn_db_open(void)
@@ -24,6 +36,8 @@ TDB_CONTEXT *conn_db_open(void)
         {0, 250 * 1000 * 1000},
     };
     TDB_CONTEXT *db = nullptr;
+    (void)conn_mutex_atfork;
+    conn_mutex.lock();
     for (size_t i = 0; i < sizeof(backoffs) / sizeof(backoffs[0]); i++) {
         if (i > 0) {
             nanosleep(&backoffs[i], nullptr);
@@ -33,9 +47,10 @@ TDB_CONTEXT *conn_db_open(void)
             return db;
         }
         if (errno != EBUSY) {
-            return nullptr;
+            break;
         }
     }
+    conn_mutex.unlock();
     return nullptr;
 }
 
@@ -46,7 +61,7 @@ TDB_CONTEXT *conn_db_open_transaction(void)
         return nullptr;
     }
     if (tdb_transaction_start(db) != 0) {
-        tdb_close(db);
+        conn_db_close(db);
         return nullptr;
     }
     return db;
@@ -55,19 +70,20 @@ TDB_CONTEXT *conn_db_open_transaction(void)
 void conn_db_close(TDB_CONTEXT *db)
 {
     tdb_close(db);
+    conn_mutex.unlock();
 }
 
 void conn_db_close_cancel(TDB_CONTEXT *db)
 {
     tdb_transaction_cancel(db);
-    tdb_close(db);
+    conn_db_close(db);
 }
 
 void conn_db_close_commit(TDB_CONTEXT *db)
 {
     tdb_transaction_prepare_commit(db);
     tdb_transaction_commit(db);
-    tdb_close(db);
+    conn_db_close(db);
 }
 
 static TDB_DATA make_key(struct ConnKey &k, int port2, int conn_index)
@@ -170,7 +186,7 @@ void conn_recreate_empty(void)
     }
     auto *db = conn_db_open();
     if (db != nullptr) {
-        tdb_close(db);
+        conn_db_close(db);
     }
 }
 
@@ -183,3 +199,93 @@ void conn_remove_port2(int port2)
     conn_delete_for_port2(db, port2);
     conn_db_close_commit(db);
 }
+
+struct port2_set_filter {
+    const std::vector<int> *port2s;
+    std::vector<struct ConnKey> matches;
+};
+
+static int collect_port2_set(struct tdb_context *db, TDB_DATA key,
+                             TDB_DATA data, void *ptr)
+{
+    (void)db;
+    (void)data;
+    auto *f = (struct port2_set_filter *)ptr;
+    if (key.dsize != sizeof(struct ConnKey)) {
+        return 0;
+    }
+    struct ConnKey k {};
+    memcpy(&k, key.dptr, sizeof(k));
+    for (int port2 : *f->port2s) {
+        if (k.port2 == port2) {
+            f->matches.push_back(k);
+            break;
+        }
+    }
+    return 0;
+}
+
+void conn_replace(const std::vector<int> &port2s,
+                  const std::vector<struct ConnEntry> &entries)
+{
+    auto *db = conn_db_open_transaction();
+    if (db == nullptr) {
+        return;
+    }
+    struct port2_set_filter f { &port2s, {} };
+    tdb_traverse(db, collect_port2_set, &f);
+    for (auto &k : f.matches) {
+        TDB_DATA kd;
+        kd.dptr = (uint8_t *)&k;
+        kd.dsize = sizeof(k);
+        tdb_delete(db, kd);
+    }
+    for (const auto &e : entries) {
+        conn_write(db, e);
+    }
+    conn_db_close_commit(db);
+}
+
+struct drop_filter {
+    int port2;
+    std::vector<struct ConnKey> *out;
+};
+
+static int collect_drops(struct tdb_context *db, TDB_DATA key,
+                         TDB_DATA data, void *ptr)
+{
+    (void)db;
+    auto *f = (struct drop_filter *)ptr;
+    if (key.dsize != sizeof(struct ConnKey)
+        || data.dsize < CONNENTRY_MIN_SIZE) {
+        return 0;
+    }
+    struct ConnKey k {};
+    memcpy(&k, key.dptr, sizeof(k));
+    if (f->port2 != -1 && k.port2 != f->port2) {
+        return 0;
+    }
+    struct ConnEntry e {};
+    size_t copy = data.dsize < sizeof(e) ? data.dsize : sizeof(e);
+    memcpy(&e, data.dptr, copy);
+    if (e.magic == CONN_MAGIC
+        && (e.flags & CONN_FLAG_DROP_REQUESTED) != 0) {
+        f->out->push_back(k);
+    }
+    return 0;
+}
+
+bool conn_take_drop_requests(int port2, std::vector<struct ConnKey> &out)
+{
+    auto *db = conn_db_open_transaction();
+    if (db == nullptr) {
+        return false;
+    }
+    struct drop_filter f { port2, &out };
+    tdb_traverse(db, collect_drops, &f);
+    for (const auto &k : out) {
+        conn_delete(db, k.port2, k.conn_index);
+    }
+    conn_db_close_commit(db);
+    return true;
+}
@@ -24,6 +24,8 @@
 #include <fcntl.h>
 #include <tdb.h>
 
+#include <vector>
+
 #define CONN_FILE "connections.tdb"
 
 #define CONN_MAGIC 0x436f6e6e45424553ULL  // "ConnEBES"
@@ -41,9 +43,9 @@
 //
 // CONN_FLAG_DROP_REQUESTED:  the web admin has asked the per-port-pair
 //   child to drop this specific connection. The webadmin sets the bit
-//   in TDB and sends SIGUSR1 to the child; the child's main_loop scans
-//   for entries matching its port2 with this bit set, closes the
-//   matching slot, and deletes the record.
+//   in TDB and sends SIGUSR1 to the owning pid; that process scans for
+//   entries with this bit set (only its own port2 in a child), closes
+//   the matching slot, and deletes the record.
 #define CONN_FLAG_DROP_REQUESTED (1u << 0)
 
 struct ConnEntry {
@@ -52,7 +54,7 @@ struct ConnEntry {
     uint64_t last_update;      // unix seconds
     int      port2;            // owning entry's primary key
     int      conn_index;       // 0 = mav1 (user); 1..MAX_COMM2_LINKS = conn2[i-1]
-    uint32_t pid;              // owning child pid (parent uses this for cleanup)
+    uint32_t pid;              // owning process pid (the child, or the main process with -r)
     uint32_t rx_msgs;          // mavlink messages parsed FROM this peer
     uint32_t tx_msgs;          // mavlink messages forwarded TO this peer
     uint32_t peer_ip_be;       // sockaddr_in.sin_addr.s_addr (network order)
@@ -85,3 +87,13 @@ int conn_delete_for_port2(TDB_CONTEXT *db, int port2);
 // One-shot helpers used by the parent (open + transaction internally).
 void conn_recreate_empty(void);
 void conn_remove_port2(int port2);
+
+// Replace all records for the given port2s with entries, in a single
+// transaction and a single traverse. Used for the heartbeat snapshot
+// so one write covers every session it is asked about.
+void conn_replace(const std::vector<int> &port2s,
+                  const std::vector<struct ConnEntry> &entries);
+
+// Collect and delete the DROP_REQUESTED records for port2 (-1 for
+// every port2). Returns false if the database couldn't be opened.
+bool conn_take_drop_requests(int port2, std::vector<struct ConnKey> &out);
@@ -0,0 +1,159 @@
+/*
+  CRC-16/MCRF4XX over buffers
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "crc16.h"
+
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <emmintrin.h>
+#include <wmmintrin.h>
+#define HAVE_CLMUL 1
+#endif
+
+// x^16 + x^12 + x^5 + 1, and the same bit-reversed as the CRC works on it
+#define CRC16_POLY 0x11021
+#define CRC16_POLY_REFLECTED 0x8408
+
+/*
+  slice-by-8 tables: t[0] is the usual byte at a time table, t[k][b]
+  the CRC of byte b followed by k zero bytes
+ */
+struct CRC16Tables {
+    uint16_t t[8][256];
+
+    constexpr CRC16Tables() : t() {
+        for (unsigned b = 0; b < 256; b++) {
+            uint16_t c = b;
+            for (unsigned i = 0; i < 8; i++) {
+                c = (c & 1) ? (c >> 1) ^ CRC16_POLY_REFLECTED : c >> 1;
+            }
+            t[0][b] = c;
+        }
+        for (unsigned k = 1; k < 8; k++) {
+            for (unsigned b = 0; b < 256; b++) {
+                t[k][b] = (t[k-1][b] >> 8) ^ t[0][t[k-1][b] & 0xFF];
+            }
+        }
+    }
+};
+
+static constexpr CRC16Tables tables;
+
+uint16_t crc16_x25_sliced(uint16_t crc, const void *buf, size_t len)
+{
+    const uint8_t *p = (const uint8_t *)buf;
+    const auto &t = tables.t;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    while (len >= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        v ^= crc;
+        crc = t[7][v & 0xFF] ^ t[6][(v >> 8) & 0xFF] ^
+            t[5][(v >> 16) & 0xFF] ^ t[4][(v >> 24) & 0xFF] ^
+            t[3][(v >> 32) & 0xFF] ^ t[2][(v >> 40) & 0xFF] ^
+            t[1][(v >> 48) & 0xFF] ^ t[0][v >> 56];
+        p += 8;
+        len -= 8;
+    }
+#endif
+    while (len--) {
+        crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xFF];
+    }
+    return crc;
+}
+
+#ifdef HAVE_CLMUL
+/*
+  x^n mod P, bit-reversed into a 64 bit word as pclmulqdq sees the
+  reflected data: bit 63-d holds x^d
+ */
+static constexpr uint64_t fold_constant(unsigned n)
+{
+    uint32_t r = 1;
+    for (unsigned i = 0; i < n; i++) {
+        r <<= 1;
+        if (r & 0x10000) {
+            r ^= CRC16_POLY;
+        }
+    }
+    uint64_t ret = 0;
+    for (unsigned d = 0; d < 16; d++) {
+        if (r & (1U << d)) {
+            ret |= 1ULL << (63 - d);
+        }
+    }
+    return ret;
+}
+
+/*
+  fold 16 bytes at a time: with the first 16 bytes as A (high half
+  A1, low half A0) and the next as B, A1*x^192 + A0*x^128 + B leaves
+  the same remainder mod P as A followed by B, and fits in 16 bytes.
+  A carry-less multiply of two reflected words comes out one bit
+  position up, hence x^191 and x^127. The last 16 bytes and the tail
+  then go through the tables. Needs len >= 16
+ */
+__attribute__((target("pclmul")))
+static uint16_t crc16_x25_clmul(uint16_t crc, const uint8_t *p, size_t len)
+{
+    const __m128i k = _mm_set_epi64x(fold_constant(127), fold_constant(191));
+    __m128i x = _mm_xor_si128(_mm_loadu_si128((const __m128i *)p), _mm_cvtsi32_si128(crc));
+    p += 16;
+    len -= 16;
+    while (len >= 16) {
+        const __m128i a1 = _mm_clmulepi64_si128(x, k, 0x00);
+        const __m128i a0 = _mm_clmulepi64_si128(x, k, 0x11);
+        x = _mm_xor_si128(_mm_xor_si128(a1, a0), _mm_loadu_si128((const __m128i *)p));
+        p += 16;
+        len -= 16;
+    }
+    uint8_t rem[16];
+    _mm_storeu_si128((__m128i *)rem, x);
+    return crc16_x25_sliced(crc16_x25_sliced(0, rem, sizeof(rem)), p, len);
+}
+
+static bool have_clmul(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("pclmul");
+}
+
+static const bool use_clmul = have_clmul();
+
+// below this the tables win over the setup of the fold
+#define CLMUL_MIN_LEN 48
+#endif // HAVE_CLMUL
+
+uint16_t crc16_x25(uint16_t crc, const void *buf, size_t len)
+{
+#ifdef HAVE_CLMUL
+    if (use_clmul && len >= CLMUL_MIN_LEN) {
+        return crc16_x25_clmul(crc, (const uint8_t *)buf, len);
+    }
+#endif
+    return crc16_x25_sliced(crc, buf, len);
+}
+
+const char *crc16_x25_impl(void)
+{
+#ifdef HAVE_CLMUL
+    if (use_clmul) {
+        return "pclmul";
+    }
+#endif
+    return "slice-by-8";
+}
@@ -0,0 +1,21 @@
+/*
+  CRC-16/MCRF4XX, the checksum MAVLink calls X.25 (crc_accumulate()
+  in the generated headers), over a buffer at a time
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+  continue crc over len bytes, as crc_accumulate() on each byte would.
+  Start from X25_INIT_CRC (0xFFFF). Uses carry-less multiply where the
+  CPU has it, slice-by-8 tables otherwise
+ */
+uint16_t crc16_x25(uint16_t crc, const void *buf, size_t len);
+
+// the portable slice-by-8 version, for comparison
+uint16_t crc16_x25_sliced(uint16_t crc, const void *buf, size_t len);
+
+// name of the version crc16_x25() uses on this CPU
+const char *crc16_x25_impl(void);
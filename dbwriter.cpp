@@ -0,0 +1,92 @@
+/*
+  keys.tdb and connections.tdb writes that a session must not wait for
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "dbwriter.h"
+
+#include <pthread.h>
+#include <signal.h>
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+/*
+  never destroyed: the writer thread may still be waiting on queued
+  when the process exits, and destroying a condition variable with a
+  waiter blocks
+ */
+struct Writer {
+    std::mutex mtx;
+    std::condition_variable queued, drained;
+    std::deque<std::function<void(void)>> jobs;
+    // the job being run, so a flush waits for it too
+    bool running = false;
+    bool started = false;
+};
+static Writer *w = new Writer;
+
+/*
+  a forked child has no writer thread, whatever the parent had: it
+  starts its own on its first job, with a fresh queue. Jobs the
+  parent had queued are the parent's to run
+ */
+static const int writer_atfork = pthread_atfork(
+    []() { w->mtx.lock(); },
+    []() { w->mtx.unlock(); },
+    []() { w = new Writer; });
+
+static void writer_thread(Writer *wr)
+{
+    // signals are for the main thread
+    sigset_t set;
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, nullptr);
+
+    std::unique_lock<std::mutex> lock(wr->mtx);
+    while (true) {
+        wr->queued.wait(lock, [wr]() { return !wr->jobs.empty(); });
+        auto job = std::move(wr->jobs.front());
+        wr->jobs.pop_front();
+        wr->running = true;
+        lock.unlock();
+        job();
+        lock.lock();
+        wr->running = false;
+        if (wr->jobs.empty()) {
+            wr->drained.notify_all();
+        }
+    }
+}
+
+void db_writer_post(std::function<void(void)> job)
+{
+    (void)writer_atfork;
+    std::lock_guard<std::mutex> lock(w->mtx);
+    w->jobs.push_back(std::move(job));
+    if (!w->started) {
+        w->started = true;
+        // detached, so nothing waits for it at exit
+        std::thread(writer_thread, w).detach();
+    }
+    w->queued.notify_one();
+}
+
+void db_writer_flush(void)
+{
+    std::unique_lock<std::mutex> lock(w->mtx);
+    w->drained.wait(lock, []() { return w->jobs.empty() && !w->running; });
+}
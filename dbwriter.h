@@ -0,0 +1,19 @@
+/*
+  keys.tdb and connections.tdb writes that a session must not wait for
+
+  Session counters, connections.tdb snapshots and removals, and signing
+  timestamps are queued for one writer thread per process, which runs
+  them in order. Sessions never block on a TDB transaction or on the
+  lock another thread holds, and nothing forks per write. The thread
+  starts on the first job; a forked child starts its own if it queues
+  any.
+ */
+#pragma once
+
+#include <functional>
+
+// run job on the writer thread, after the jobs queued before it
+void db_writer_post(std::function<void(void)> job);
+
+// wait until every job queued so far has run, before the process exits
+void db_writer_flush(void);
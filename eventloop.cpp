@@ -0,0 +1,107 @@
+/*
+  epoll based event loop
+ */
+#include "eventloop.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+
+EventLoop::EventLoop()
+{
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd == -1) {
+        perror("epoll_create1");
+    }
+}
+
+EventLoop::~EventLoop()
+{
+    for (auto &kv : watches) {
+        delete kv.second;
+    }
+    for (auto *w : retired) {
+        delete w;
+    }
+    if (epfd != -1) {
+        close(epfd);
+    }
+}
+
+bool EventLoop::add(int fd, uint32_t events, handler_t handler)
+{
+    if (fd < 0 || watches.count(fd) != 0) {
+        return false;
+    }
+    auto *w = new Watch { fd, std::move(handler), true };
+    struct epoll_event ev {};
+    ev.events = events;
+    ev.data.ptr = w;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+        delete w;
+        return false;
+    }
+    watches[fd] = w;
+    return true;
+}
+
+bool EventLoop::modify(int fd, uint32_t events)
+{
+    auto it = watches.find(fd);
+    if (it == watches.end()) {
+        return false;
+    }
+    struct epoll_event ev {};
+    ev.events = events;
+    ev.data.ptr = it->second;
+    return epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev) == 0;
+}
+
+void EventLoop::remove(int fd)
+{
+    auto it = watches.find(fd);
+    if (it == watches.end()) {
+        return;
+    }
+    Watch *w = it->second;
+    watches.erase(it);
+    epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
+    // the handler may be the one running right now, so keep the
+    // Watch (and its std::function) alive until dispatch finishes
+    w->live = false;
+    retired.push_back(w);
+}
+
+int EventLoop::poll(int timeout_ms)
+{
+    struct epoll_event events[MAX_EVENTS];
+    int ret = epoll_wait(epfd, events, MAX_EVENTS, timeout_ms);
+    if (ret <= 0) {
+        return ret;
+    }
+    for (int i = 0; i < ret; i++) {
+        auto *w = static_cast<Watch *>(events[i].data.ptr);
+        if (w->live) {
+            w->handler(events[i].events);
+        }
+    }
+    for (auto *w : retired) {
+        delete w;
+    }
+    retired.clear();
+    return ret;
+}
+
+void EventLoop::detach(void)
+{
+    // we may be inside a handler, so retire rather than free
+    for (auto &kv : watches) {
+        kv.second->live = false;
+        retired.push_back(kv.second);
+    }
+    watches.clear();
+    if (epfd != -1) {
+        close(epfd);
+        epfd = -1;
+    }
+}
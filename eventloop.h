@@ -0,0 +1,78 @@
+/*
+  epoll based event loop
+
+  Each registered fd carries its own handler, so a wakeup costs
+  O(ready fds) rather than a scan over every socket we own.
+  Registrations only change when a socket is opened or closed.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <sys/epoll.h>
+
+#include <functional>
+#include <unordered_map>
+#include <vector>
+
+class EventLoop {
+public:
+    typedef std::function<void(uint32_t events)> handler_t;
+
+    EventLoop();
+    ~EventLoop();
+    EventLoop(const EventLoop &) = delete;
+    EventLoop &operator=(const EventLoop &) = delete;
+
+    bool ok() const { return epfd != -1; }
+
+    /*
+      register fd. events is the usual EPOLLIN/EPOLLOUT/EPOLLET mask;
+      handler is called with the ready mask from poll()
+     */
+    bool add(int fd, uint32_t events, handler_t handler);
+
+    /*
+      change the event mask of an already registered fd
+     */
+    bool modify(int fd, uint32_t events);
+
+    /*
+      deregister fd. Must be called before close(): the epoll set is
+      keyed on the open file description, so a socket that is still
+      open in another process (e.g. the parent after fork) would
+      otherwise stay registered. Safe to call from inside a handler,
+      including for the fd currently being dispatched.
+     */
+    void remove(int fd);
+
+    bool contains(int fd) const { return watches.count(fd) != 0; }
+
+    /*
+      wait up to timeout_ms and dispatch ready handlers. Returns the
+      number of events dispatched, 0 on timeout or -1 on error
+      (errno set, EINTR included)
+     */
+    int poll(int timeout_ms);
+
+    /*
+      forget every registration and close our epoll fd without touching
+      the kernel set. For use in a forked child: the set is shared with
+      the parent, so deregistering from the child would change what the
+      parent is watching.
+     */
+    void detach(void);
+
+private:
+    static constexpr int MAX_EVENTS = 64;
+
+    struct Watch {
+        int fd;
+        handler_t handler;
+        bool live;
+    };
+
+    int epfd = -1;
+    std::unordered_map<int, Watch *> watches;
+    // removed during dispatch; freed once the current batch is done
+    std::vector<Watch *> retired;
+};
@@ -1,10 +1,32 @@
 #include "keydb.h"
 #include <string.h>
 #include <stdlib.h>
+#include <pthread.h>
+
+#include <mutex>
+
+/*
+  TDB refuses to open a file that is already open in the same process,
+  and its fcntl locks don't exclude threads of one process, so reactor
+  threads take turns: the lock is held from db_open() until
+  db_close(). The fork hooks make sure a forked worker never starts
+  with it held by a thread that doesn't exist in the child.
+ */
+static std::mutex db_mutex;
+static const int db_mutex_atfork = pthread_atfork(
+    []() { db_mutex.lock(); },
+    []() { db_mutex.unlock(); },
+    []() { db_mutex.unlock(); });
 
 TDB_CONTEXT *db_open(void)
 {
-    return tdb_open(KEY_FILE, 1000, 0, O_RDWR | O_CREAT, 0600);
+    (void)db_mutex_atfork;
+    db_mutex.lock();
+    auto *db = tdb_open(KEY_FILE, 1000, 0, O_RDWR | O_CREAT, 0600);
+    if (db == nullptr) {
+        db_mutex.unlock();
+    }
+    return db;
 }
 
 TDB_CONTEXT *db_open_transaction(void)
@@ -17,9 +39,29 @@ TDB_CONTEXT *db_open_transaction(void)
     return db;
 }
 
+/*
+  read the sequence number of keys.tdb without holding it open for
+  writing. Only writers that open it with TDB_SEQNUM (keydb_lib.py,
+  so keydb.py and the web admin) move it; the proxy's own counter and
+  timestamp updates don't
+ */
+bool db_get_seqnum(int &seqnum)
+{
+    db_mutex.lock();
+    auto *db = tdb_open(KEY_FILE, 0, 0, O_RDONLY, 0);
+    if (db == nullptr) {
+        db_mutex.unlock();
+        return false;
+    }
+    seqnum = tdb_get_seqnum(db);
+    db_close(db);
+    return true;
+}
+
 void db_close(TDB_CONTEXT *db)
 {
     tdb_close(db);
+    db_mutex.unlock();
 }
 
 void db_close_cancel(TDB_CONTEXT *db)
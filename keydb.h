@@ -33,6 +33,7 @@
 #define KEY_FLAG_BIDI_SIGN (1u << 1)  // require signed MAVLink on the user side too
 #define KEY_FLAG_TLOG      (1u << 2)  // record per-connection MAVProxy-format tlogs
 #define KEY_FLAG_BINLOG    (1u << 3)  // record ArduPilot bin logs over MAVLink
+#define KEY_FLAG_PASSTHROUGH (1u << 4)  // unsigned engineers; plain TCP links relayed by the kernel
 
 struct KeyEntry {
     uint64_t magic;
@@ -57,5 +58,6 @@ void db_close(TDB_CONTEXT *db);
 TDB_CONTEXT *db_open_transaction(void);
 void db_close_cancel(TDB_CONTEXT *db);
 void db_close_commit(TDB_CONTEXT *db);
+bool db_get_seqnum(int &seqnum);
 bool db_load_key(TDB_CONTEXT *tdb, int port2, struct KeyEntry &key);
 bool db_save_key(TDB_CONTEXT *tdb, int port2, const struct KeyEntry &key);
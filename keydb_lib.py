@@ -39,12 +39,14 @@ FLAG_ADMIN     = 1 << 0
 FLAG_BIDI_SIGN = 1 << 1   # require signed MAVLink on the user side too
 FLAG_TLOG      = 1 << 2   # record per-connection MAVProxy-format tlogs
 FLAG_BINLOG    = 1 << 3   # record ArduPilot bin logs over MAVLink
+FLAG_PASSTHROUGH = 1 << 4  # unsigned engineers; plain TCP links relayed by the kernel
 
 FLAG_NAMES = {
     "admin":     FLAG_ADMIN,
     "bidi_sign": FLAG_BIDI_SIGN,
     "tlog":      FLAG_TLOG,
     "binlog":    FLAG_BINLOG,
+    "passthrough": FLAG_PASSTHROUGH,
 }
 
 DEFAULT_LOG_RETENTION_DAYS = 7.0
@@ -163,6 +165,9 @@ class KeyEntry:
 
 
 def open_db(path='keys.tdb'):
+    # TDB_SEQNUM makes every store/delete bump the sequence number in
+    # the header, which is how the running supportproxy tells our
+    # changes from its own counter updates and knows when to reload.
     # tdb.open can return EBUSY under heavy concurrent open contention
     # (another process holds an exclusive lock through tdb_transaction_start
     # while we try to open). Retry with a short backoff: TDB's own locking
@@ -175,7 +180,7 @@ def open_db(path='keys.tdb'):
         if delay:
             time.sleep(delay)
         try:
-            return tdb.open(path, hash_size=1024, tdb_flags=0,
+            return tdb.open(path, hash_size=1024, tdb_flags=tdb.SEQNUM,
                             flags=os.O_RDWR, mode=0o600)
         except OSError as e:
             if e.errno != errno.EBUSY:
@@ -185,7 +190,7 @@ def open_db(path='keys.tdb'):
 
 
 def init_db(path='keys.tdb'):
-    return tdb.open(path, hash_size=1024, tdb_flags=0,
+    return tdb.open(path, hash_size=1024, tdb_flags=tdb.SEQNUM,
                     flags=os.O_RDWR | os.O_CREAT, mode=0o600)
 
 
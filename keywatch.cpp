@@ -0,0 +1,74 @@
+/*
+  notice writes to keys.tdb without polling it
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "keywatch.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+
+#include "keydb.h"
+
+KeyWatch::~KeyWatch()
+{
+    if (ifd != -1) {
+        close(ifd);
+    }
+}
+
+bool KeyWatch::open(void)
+{
+    ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (ifd == -1) {
+        perror("inotify_init1");
+        return false;
+    }
+    // KEY_FILE is relative to our working directory
+    if (inotify_add_watch(ifd, ".", IN_CLOSE_WRITE | IN_CREATE | IN_MOVED_TO) == -1) {
+        perror("inotify_add_watch");
+        close(ifd);
+        ifd = -1;
+        return false;
+    }
+    return true;
+}
+
+bool KeyWatch::changed(void)
+{
+    if (ifd == -1) {
+        return false;
+    }
+    bool ret = false;
+    union {
+        struct inotify_event align;
+        char buf[4096];
+    } u;
+    while (true) {
+        const ssize_t n = read(ifd, u.buf, sizeof(u.buf));
+        if (n <= 0) {
+            break;
+        }
+        for (ssize_t ofs = 0; ofs < n; ) {
+            const auto *ev = (const struct inotify_event *)&u.buf[ofs];
+            if (ev->len > 0 && strcmp(ev->name, KEY_FILE) == 0) {
+                ret = true;
+            }
+            ofs += sizeof(*ev) + ev->len;
+        }
+    }
+    return ret;
+}
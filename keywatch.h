@@ -0,0 +1,29 @@
+/*
+  notice writes to keys.tdb without polling it
+
+  The directory holding keys.tdb is watched with inotify for a close
+  after write, or for keys.tdb being created or renamed into place.
+  TDB writes through its mmap, which inotify doesn't see, but every
+  writer opens the file read-write and closes it when done, so a
+  close is the point where a change can have landed. Closes of a
+  read-write handle that didn't write anything show up too; the
+  caller compares the TDB sequence number to tell those apart.
+ */
+#pragma once
+
+class KeyWatch {
+public:
+    ~KeyWatch();
+
+    // start watching; false if inotify is not available
+    bool open(void);
+
+    // for the caller's event loop, -1 if not open
+    int fd(void) const { return ifd; }
+
+    // drain pending events. Returns true if any of them was for keys.tdb
+    bool changed(void);
+
+private:
+    int ifd = -1;
+};
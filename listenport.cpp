@@ -0,0 +1,168 @@
+/*
+  one configured port pair from keys.tdb
+ */
+#include "listenport.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include <unordered_map>
+
+#include "util.h"
+
+// first fd passed by systemd, as SD_LISTEN_FDS_START in sd-daemon.h
+#define LISTEN_FDS_START 3
+
+/*
+  listeners passed in LISTEN_FDS, keyed by port*2 + is_tcp. Filled by
+  listen_port_inherit() before any thread starts and only read after
+  that, except that entries not kept are taken out from the main
+  thread.
+
+  For socket activation we keep our copy for the life of the process:
+  the service manager holds the port bound anyway, so a port pair that
+  is closed and reopened (parent <-> child, removed and re-added) gets
+  a new dup of the same socket rather than a fresh bind. Those stay
+  kept across an upgrade. The other listeners an upgrade passes are
+  held by nobody else, so each is handed out once and a port is really
+  released when its entry is removed
+ */
+struct Inherited {
+    int fd;
+    bool keep;
+};
+static std::unordered_map<int, Inherited> inherited;
+
+static int inherited_key(int port, bool tcp)
+{
+    return port * 2 + (tcp ? 1 : 0);
+}
+
+unsigned listen_port_inherit(unsigned keep)
+{
+    const char *pid_str = getenv("LISTEN_PID");
+    const char *fds_str = getenv("LISTEN_FDS");
+    if (pid_str == nullptr || fds_str == nullptr || atoi(pid_str) != getpid()) {
+        return 0;
+    }
+    const int nfds = atoi(fds_str);
+    // not for our children
+    unsetenv("LISTEN_PID");
+    unsetenv("LISTEN_FDS");
+    unsetenv("LISTEN_FDNAMES");
+
+    unsigned count = 0;
+    for (int fd = LISTEN_FDS_START; fd < LISTEN_FDS_START + nfds; fd++) {
+        struct sockaddr_in addr {};
+        socklen_t addrlen = sizeof(addr);
+        int type = 0;
+        socklen_t typelen = sizeof(type);
+        if (getsockname(fd, (struct sockaddr *)&addr, &addrlen) != 0 ||
+            addr.sin_family != AF_INET ||
+            getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &typelen) != 0 ||
+            (type != SOCK_DGRAM && type != SOCK_STREAM)) {
+            printf("Ignoring passed fd %d: not an IPv4 UDP or TCP socket\n", fd);
+            close(fd);
+            continue;
+        }
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        if (type == SOCK_STREAM) {
+            set_tcp_options(fd);
+        }
+        const bool kept = unsigned(fd - LISTEN_FDS_START) < keep;
+        inherited[inherited_key(ntohs(addr.sin_port), type == SOCK_STREAM)] = Inherited { fd, kept };
+        count++;
+    }
+    return count;
+}
+
+void listen_port_kept(std::vector<int> &fds)
+{
+    for (const auto &i : inherited) {
+        if (i.second.keep) {
+            fds.push_back(i.second.fd);
+        }
+    }
+}
+
+bool listen_port_is_kept(int port, bool tcp)
+{
+    auto it = inherited.find(inherited_key(port, tcp));
+    return it != inherited.end() && it->second.keep;
+}
+
+/*
+  a passed listener for port if there is one, otherwise -1. shared is
+  set if it is a dup of one we keep
+ */
+static int take_inherited(int port, bool tcp, bool &shared)
+{
+    shared = false;
+    auto it = inherited.find(inherited_key(port, tcp));
+    if (it == inherited.end()) {
+        return -1;
+    }
+    if (it->second.keep) {
+        shared = true;
+        return fcntl(it->second.fd, F_DUPFD_CLOEXEC, 0);
+    }
+    const int fd = it->second.fd;
+    inherited.erase(it);
+    return fd;
+}
+
+static int open_udp(int port, bool &shared)
+{
+    const int fd = take_inherited(port, false, shared);
+    return fd != -1 ? fd : open_socket_in_udp(port);
+}
+
+static int open_tcp(int port)
+{
+    bool shared;
+    const int fd = take_inherited(port, true, shared);
+    return fd != -1 ? fd : open_socket_in_tcp(port);
+}
+
+void listen_port_open(struct listen_port *p)
+{
+    if (p->sock1_udp == -1) {
+	p->sock1_udp = open_udp(p->port1, p->sock1_udp_shared);
+	if (p->sock1_udp == -1) {
+	    printf("[%d] Failed to open UDP port %d - %s\n", p->port2, p->port1, strerror(errno));
+	}
+    }
+    if (p->sock2_udp == -1) {
+	bool shared;
+	p->sock2_udp = open_udp(p->port2, shared);
+	if (p->sock2_udp == -1) {
+	    printf("[%d] Failed to open UDP port %d - %s\n", p->port2, p->port2, strerror(errno));
+	}
+    }
+    if (p->sock1_tcp == -1) {
+	p->sock1_tcp = open_tcp(p->port1);
+	if (p->sock1_tcp == -1) {
+	    printf("[%d] Failed to open TCP port %d - %s\n", p->port2, p->port1, strerror(errno));
+	}
+    }
+    if (p->sock2_listen == -1) {
+	p->sock2_listen = open_tcp(p->port2);
+	if (p->sock2_listen == -1) {
+	    printf("[%d] Failed to open TCP port %d - %s\n", p->port2, p->port2, strerror(errno));
+	}
+    }
+}
+
+void listen_port_close(struct listen_port *p)
+{
+    close_fd(p->sock1_udp);
+    close_fd(p->sock2_udp);
+    close_fd(p->sock1_tcp);
+    close_fd(p->sock2_listen);
+}
@@ -0,0 +1,62 @@
+/*
+  one configured port pair from keys.tdb
+ */
+#pragma once
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <vector>
+
+class WebSocket;
+class ProxySession;
+
+struct listen_port {
+    struct listen_port *next;
+    int port1, port2;
+    int sock1_udp, sock2_udp;
+    int sock1_tcp, sock2_listen;
+    pid_t pid;
+    uint32_t flags;
+    uint8_t  fc_sysid;     // 0 = match any; otherwise the FC's MAVLink
+                           // sysid for binlog reboot detection
+    bool seen;     // set true by handle_record() during reload_ports()
+                   // for any entry that's still in the DB; entries left
+                   // unseen after a reload have been removed.
+    bool removed;  // entry no longer in keys.tdb. We keep the struct
+                   // around (don't free it under a running child) but
+                   // close listening sockets and skip it everywhere.
+    WebSocket *ws = nullptr;
+    // sock1_udp is a dup of a socket-activation listener, whose open
+    // file description every later reopen shares: the session must
+    // not connect() it to its user
+    bool sock1_udp_shared = false;
+    // in reactor mode (-r) the session runs on a reactor thread
+    // instead of in a forked child
+    ProxySession *session = nullptr;
+};
+
+/*
+  take over listeners passed in LISTEN_FDS, by systemd socket
+  activation or by the binary we were upgraded from.
+  listen_port_open() then uses these by port and only binds the ones
+  that weren't passed. The first keep of them (all of them for socket
+  activation) are kept: every open of their port gets a dup of the
+  socket. The rest are each used once.
+  Returns how many were taken; call once, before starting any thread
+ */
+unsigned listen_port_inherit(unsigned keep);
+
+/*
+  the listeners listen_port_inherit() kept, to be passed on first
+  when upgrading, and whether port has one
+ */
+void listen_port_kept(std::vector<int> &fds);
+bool listen_port_is_kept(int port, bool tcp);
+
+/*
+  open whichever of the four listening sockets of p are not open yet,
+  and close all of them
+ */
+void listen_port_open(struct listen_port *p);
+void listen_port_close(struct listen_port *p);
@@ -25,12 +25,41 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <signal.h>
+#include <errno.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+#include <map>
 #include "util.h"
 #include "tlog.h"
+#include "uring.h"
+#include "udpbatch.h"
+#include "crc16.h"
+#include "dbwriter.h"
+
+/*
+  how far behind signing.timestamp (in 10us units) a new signing
+  stream may start, as mavlink_signature_check() allows
+ */
+#ifdef MAVLINK_SIGNING_TIMESTAMP_LIMIT
+#define SIGNING_NEW_STREAM_LIMIT (MAVLINK_SIGNING_TIMESTAMP_LIMIT * 100ULL * 1000ULL)
+#else
+#define SIGNING_NEW_STREAM_LIMIT (6000ULL * 1000ULL)
+#endif
 
 mavlink_system_t mavlink_system = {0, 0};
 
-bool MAVLink::got_bad_signature[MAVLINK_COMM_NUM_BUFFERS];
+thread_local mavlink_status_t m_mavlink_status[MAVLINK_COMM_NUM_BUFFERS];
+thread_local mavlink_message_t m_mavlink_buffer[MAVLINK_COMM_NUM_BUFFERS];
+
+/*
+  signing timestamps waiting to be written to keys.tdb, indexed by
+  key_id. Shared by all links on a thread so one write covers them all
+ */
+static thread_local std::map<int, uint64_t> pending_timestamps;
+static thread_local double last_timestamp_flush_s;
 
 // unused comm_send_buffer (as we handle packets as UDP buffers)
 void comm_send_buffer(mavlink_channel_t chan, const uint8_t *buf, uint8_t len)
@@ -50,17 +79,35 @@ void tlog_write_message(TlogWriter *tlog, const mavlink_message_t &msg)
     }
 }
 
+MAVLink::~MAVLink()
+{
+    if (out_deferred) {
+        UDPSendBatch::cancel(this);
+    }
+}
+
 /*
   init connection
  */
-void MAVLink::init(int _fd, mavlink_channel_t _chan, bool signing_required, bool _allow_websocket, bool _is_tcp, int _key_id)
+void MAVLink::init(int _fd, uint8_t _link_id, bool signing_required, bool _allow_websocket, bool _is_tcp, int _key_id)
 {
+    if (out_deferred) {
+        UDPSendBatch::cancel(this);
+        out_deferred = false;
+    }
+    out_queue.clear();
+    out_queue.clear_dropped();
+    out_blocked = false;
+    out_failed = false;
+
     fd = _fd;
-    chan = _chan;
+    link_id = _link_id;
     key_id = _key_id;
     is_tcp = _is_tcp;
 
     got_signed_packet = false;
+    got_any_signed = false;
+    accept_unsigned = false;
     key_loaded = false;
     last_signing_save_s = 0;
     last_signing_warning_s = 0;
@@ -68,11 +115,15 @@ void MAVLink::init(int _fd, mavlink_channel_t _chan, bool signing_required, bool
     last_compid = 0;
     bad_sig_count = 0;
     allow_websocket = _allow_websocket;
-    got_bad_signature[chan] = false;
+    got_bad_signature = false;
     use_sendto = false;
+    ws = nullptr;
+    uring = nullptr;
 
     ZERO_STRUCT(signing_streams);
     ZERO_STRUCT(signing);
+    ZERO_STRUCT(chan_state.status);
+    chan_state.owner = this;
 
     if (signing_required) {
 	load_signing_key();
@@ -85,8 +136,15 @@ void MAVLink::init(int _fd, mavlink_channel_t _chan, bool signing_required, bool
  */
 ssize_t MAVLink::send_data(const void *buf, ssize_t len)
 {
-    if (ws) {
-	return ws->send(buf, len);
+    if (ws || is_tcp) {
+        queue_output(buf, len);
+	return len;
+    }
+    if (uring != nullptr) {
+	return uring->send(fd, buf, len, use_sendto ? &send_addr : nullptr, send_len);
+    }
+    if (UDPSendBatch::queue(fd, buf, len, use_sendto ? &send_addr : nullptr, send_len)) {
+	return len;
     }
     if (use_sendto) {
 	return ::sendto(fd, buf, len, 0, (const sockaddr *)&send_addr, send_len);
@@ -94,33 +152,548 @@ ssize_t MAVLink::send_data(const void *buf, ssize_t len)
     return ::send(fd, buf, len, 0);
 }
 
+/*
+  priority class of each message, see MsgClass. Telemetry here is
+  sent at a rate and only its latest value matters; messages that
+  carry an index or instance (BATTERY_STATUS, SERVO_OUTPUT_RAW,
+  ADSB_VEHICLE, ...) stay normal, as collapsing them would lose
+  instances
+ */
+static constexpr uint8_t msg_class(uint32_t msgid)
+{
+    switch (msgid) {
+    case MAVLINK_MSG_ID_HEARTBEAT:
+    case MAVLINK_MSG_ID_SYS_STATUS:
+    case MAVLINK_MSG_ID_SYSTEM_TIME:
+    case MAVLINK_MSG_ID_GPS_RAW_INT:
+    case MAVLINK_MSG_ID_SCALED_IMU:
+    case MAVLINK_MSG_ID_RAW_IMU:
+    case MAVLINK_MSG_ID_SCALED_PRESSURE:
+    case MAVLINK_MSG_ID_ATTITUDE:
+    case MAVLINK_MSG_ID_ATTITUDE_QUATERNION:
+    case MAVLINK_MSG_ID_LOCAL_POSITION_NED:
+    case MAVLINK_MSG_ID_GLOBAL_POSITION_INT:
+    case MAVLINK_MSG_ID_RC_CHANNELS_RAW:
+    case MAVLINK_MSG_ID_MISSION_CURRENT:
+    case MAVLINK_MSG_ID_NAV_CONTROLLER_OUTPUT:
+    case MAVLINK_MSG_ID_RC_CHANNELS:
+    case MAVLINK_MSG_ID_VFR_HUD:
+    case MAVLINK_MSG_ID_ATTITUDE_TARGET:
+    case MAVLINK_MSG_ID_POSITION_TARGET_GLOBAL_INT:
+    case MAVLINK_MSG_ID_SCALED_IMU2:
+    case MAVLINK_MSG_ID_SCALED_IMU3:
+    case MAVLINK_MSG_ID_GPS2_RAW:
+    case MAVLINK_MSG_ID_POWER_STATUS:
+    case MAVLINK_MSG_ID_SCALED_PRESSURE2:
+    case MAVLINK_MSG_ID_VIBRATION:
+    case MAVLINK_MSG_ID_EXTENDED_SYS_STATE:
+    case MAVLINK_MSG_ID_AHRS:
+    case MAVLINK_MSG_ID_AHRS2:
+    case MAVLINK_MSG_ID_HWSTATUS:
+    case MAVLINK_MSG_ID_MEMINFO:
+    case MAVLINK_MSG_ID_WIND:
+    case MAVLINK_MSG_ID_RANGEFINDER:
+    case MAVLINK_MSG_ID_EKF_STATUS_REPORT:
+    case MAVLINK_MSG_ID_RPM:
+        return MSG_CLASS_TELEMETRY;
+
+    case MAVLINK_MSG_ID_SET_MODE:
+    case MAVLINK_MSG_ID_PARAM_REQUEST_READ:
+    case MAVLINK_MSG_ID_PARAM_REQUEST_LIST:
+    case MAVLINK_MSG_ID_PARAM_VALUE:
+    case MAVLINK_MSG_ID_PARAM_SET:
+    case MAVLINK_MSG_ID_MISSION_ITEM:
+    case MAVLINK_MSG_ID_MISSION_REQUEST:
+    case MAVLINK_MSG_ID_MISSION_SET_CURRENT:
+    case MAVLINK_MSG_ID_MISSION_REQUEST_LIST:
+    case MAVLINK_MSG_ID_MISSION_COUNT:
+    case MAVLINK_MSG_ID_MISSION_CLEAR_ALL:
+    case MAVLINK_MSG_ID_MISSION_ITEM_REACHED:
+    case MAVLINK_MSG_ID_MISSION_ACK:
+    case MAVLINK_MSG_ID_MISSION_REQUEST_INT:
+    case MAVLINK_MSG_ID_MISSION_ITEM_INT:
+    case MAVLINK_MSG_ID_COMMAND_INT:
+    case MAVLINK_MSG_ID_COMMAND_LONG:
+    case MAVLINK_MSG_ID_COMMAND_ACK:
+    case MAVLINK_MSG_ID_FILE_TRANSFER_PROTOCOL:
+    case MAVLINK_MSG_ID_LOG_REQUEST_LIST:
+    case MAVLINK_MSG_ID_LOG_ENTRY:
+    case MAVLINK_MSG_ID_LOG_REQUEST_DATA:
+    case MAVLINK_MSG_ID_LOG_DATA:
+    case MAVLINK_MSG_ID_LOG_ERASE:
+    case MAVLINK_MSG_ID_LOG_REQUEST_END:
+    case MAVLINK_MSG_ID_FENCE_POINT:
+    case MAVLINK_MSG_ID_FENCE_FETCH_POINT:
+    case MAVLINK_MSG_ID_RALLY_POINT:
+    case MAVLINK_MSG_ID_RALLY_FETCH_POINT:
+        return MSG_CLASS_RELIABLE;
+
+    default:
+        return MSG_CLASS_NORMAL;
+    }
+}
+
+/*
+  class and collapse key of a serialised frame
+ */
+static uint8_t frame_class(const uint8_t *buf, size_t len, uint64_t &key)
+{
+    uint32_t msgid;
+    if (len >= MAVLINK_NUM_HEADER_BYTES && buf[0] == MAVLINK_STX) {
+        msgid = buf[7] | (buf[8] << 8) | (uint32_t(buf[9]) << 16);
+        key = (uint64_t(msgid) << 16) | (buf[5] << 8) | buf[6];
+    } else if (len >= 6 && buf[0] == MAVLINK_STX_MAVLINK1) {
+        msgid = buf[5];
+        key = (uint64_t(msgid) << 16) | (buf[3] << 8) | buf[4];
+    } else {
+        key = UINT64_MAX;
+        return MSG_CLASS_NORMAL;
+    }
+    return msg_class(msgid);
+}
+
+/*
+  add a frame to a stream link's queue, and write the queue unless a
+  send batch will
+ */
+void MAVLink::queue_output(const void *buf, size_t len)
+{
+    if (out_failed) {
+        return;
+    }
+    uint64_t fkey;
+    const uint8_t cls = frame_class((const uint8_t *)buf, len, fkey);
+    uint8_t header[WebSocket::MAX_HEADER_LEN];
+    const size_t hlen = ws ? WebSocket::frame_header(len, header) : 0;
+    const bool was_empty = out_queue.size() == 0;
+    if (!out_queue.push(cls, fkey, header, hlen, buf, len, out_blocked)) {
+        return;
+    }
+    if (was_empty) {
+        out_first_s = time_seconds();
+    }
+
+    if (out_blocked) {
+        // on_writable() will carry on
+        return;
+    }
+    if (!out_deferred) {
+        out_deferred = UDPSendBatch::defer(this);
+        if (!out_deferred) {
+            write_output();
+        }
+        return;
+    }
+    if (out_queue.size() > OUTPUT_MAX_BYTES ||
+        time_seconds() - out_first_s >= OUTPUT_MAX_DELAY_S) {
+        write_output();
+    }
+}
+
+/*
+  write as much of the queue as the socket takes, in one send() or
+  TLS record per call
+ */
+void MAVLink::write_output(void)
+{
+    while (out_queue.size() != 0 && !out_failed) {
+        size_t n;
+        const uint8_t *b = out_queue.next(n);
+        ssize_t ret;
+        if (ws) {
+            ret = ws->write(b, n);
+        } else {
+            ret = ::send(fd, b, n, MSG_NOSIGNAL);
+            if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                ret = 0;
+            }
+        }
+        if (ret < 0) {
+            if (errno == EINTR && !ws) {
+                continue;
+            }
+            /*
+              the stream is broken. The next send_message() reports
+              it; shut the socket down so its reader sees it end too.
+              The session owns the fd, WebSocket links included, and
+              closes it
+             */
+            on_hangup();
+            shutdown(fd, SHUT_RDWR);
+            return;
+        }
+        if (ret == 0 && ws != nullptr && ws->write_must_repeat()) {
+            // TLS wants exactly these bytes again next time
+            out_queue.pin(n);
+        }
+        if (ret > 0) {
+            out_queue.consume(ret);
+        }
+        if (size_t(ret) < n) {
+            out_blocked = true;
+            return;
+        }
+    }
+    out_blocked = false;
+}
+
+void MAVLink::flush_output(void)
+{
+    // the batch has already let go of us
+    out_deferred = false;
+    write_output();
+}
+
+void MAVLink::on_hangup(void)
+{
+    out_failed = true;
+    out_queue.clear();
+    out_blocked = false;
+}
+
+void MAVLink::on_writable(void)
+{
+    if (out_blocked) {
+        write_output();
+    }
+}
+
+void MAVLink::finish_output(void)
+{
+    if (out_deferred) {
+        UDPSendBatch::cancel(this);
+        out_deferred = false;
+    }
+    write_output();
+}
+
 ssize_t MAVLink::send_buf(const void *buf, ssize_t len)
 {
     return send_data(buf, len);
 }
 
+/*
+  equivalent of mavlink_parse_char() on this link's own parser state
+ */
+uint8_t MAVLink::parse_char(uint8_t c, mavlink_message_t &msg, mavlink_status_t &status)
+{
+    uint8_t ret = mavlink_frame_char_buffer(&rx_msg, &chan_state.status, c, &msg, &status);
+    if (ret == MAVLINK_FRAMING_BAD_CRC || ret == MAVLINK_FRAMING_BAD_SIGNATURE) {
+        parse_failed(c);
+        return 0;
+    }
+    return ret;
+}
+
+/*
+  treat a frame that failed its CRC or signature as a parse failure
+  and resync, as mavlink_parse_char() does. c is its last byte
+ */
+void MAVLink::parse_failed(uint8_t c)
+{
+    chan_state.status.parse_error++;
+    chan_state.status.msg_received = MAVLINK_FRAMING_INCOMPLETE;
+    chan_state.status.parse_state = MAVLINK_PARSE_STATE_IDLE;
+    if (c == MAVLINK_STX) {
+        chan_state.status.parse_state = MAVLINK_PARSE_STATE_GOT_STX;
+        rx_msg.len = 0;
+        mavlink_start_checksum(&rx_msg);
+    }
+}
+
+/*
+  offset of the first byte in buf that could start a frame, or len.
+  The parser ignores everything else between frames, so this is where
+  port scanners and line noise go
+ */
+static size_t find_stx(const uint8_t *buf, size_t len)
+{
+    size_t i = 0;
+#if defined(__SSE2__)
+    const __m128i stx2 = _mm_set1_epi8(char(MAVLINK_STX));
+    const __m128i stx1 = _mm_set1_epi8(char(MAVLINK_STX_MAVLINK1));
+    for (; i + 16 <= len; i += 16) {
+        const __m128i b = _mm_loadu_si128((const __m128i *)(buf + i));
+        const unsigned mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(b, stx2),
+                                                             _mm_cmpeq_epi8(b, stx1)));
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#elif defined(__ARM_NEON)
+    const uint8x16_t stx2 = vdupq_n_u8(MAVLINK_STX);
+    const uint8x16_t stx1 = vdupq_n_u8(MAVLINK_STX_MAVLINK1);
+    for (; i + 16 <= len; i += 16) {
+        const uint8x16_t b = vld1q_u8(buf + i);
+        const uint8x16_t eq = vorrq_u8(vceqq_u8(b, stx2), vceqq_u8(b, stx1));
+        // four bits per byte
+        const uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+        if (mask != 0) {
+            return i + (__builtin_ctzll(mask) >> 2);
+        }
+    }
+#endif
+    for (; i < len; i++) {
+        if (buf[i] == MAVLINK_STX || buf[i] == MAVLINK_STX_MAVLINK1) {
+            break;
+        }
+    }
+    return i;
+}
+
+/*
+  parse the frame that starts at buf[0] in one go, while the parser is
+  idle. rx_msg, chan_state.status and msg end up as if each byte had
+  gone through parse_char(), which is also what ret is set to for the
+  last one. Returns the bytes taken, or 0 to leave the frame to
+  parse_char(): it runs past the end of buf, or has incompat flags the
+  byte parser rejects part way through
+ */
+size_t MAVLink::parse_frame(const uint8_t *buf, size_t len, mavlink_message_t &msg, uint8_t &ret)
+{
+    mavlink_status_t &status = chan_state.status;
+    const bool v1 = buf[0] == MAVLINK_STX_MAVLINK1;
+    const size_t header_len = v1 ? MAVLINK_CORE_HEADER_MAVLINK1_LEN+1 : MAVLINK_NUM_HEADER_BYTES;
+    if (len < header_len) {
+        return 0;
+    }
+    const uint8_t payload_len = buf[1];
+    const uint8_t incompat_flags = v1 ? 0 : buf[2];
+    if ((incompat_flags & ~MAVLINK_IFLAG_MASK) != 0) {
+        return 0;
+    }
+    const bool is_signed = (incompat_flags & MAVLINK_IFLAG_SIGNED) != 0;
+    const size_t crc_ofs = header_len + payload_len;
+    const size_t frame_len = crc_ofs + MAVLINK_NUM_CHECKSUM_BYTES + (is_signed ? MAVLINK_SIGNATURE_BLOCK_LEN : 0);
+    if (len < frame_len) {
+        return 0;
+    }
+
+    auto &m = rx_msg;
+    m.magic = buf[0];
+    m.len = payload_len;
+    if (v1) {
+        status.flags |= MAVLINK_STATUS_FLAG_IN_MAVLINK1;
+        m.incompat_flags = 0;
+        m.compat_flags = 0;
+        m.seq = buf[2];
+        m.sysid = buf[3];
+        m.compid = buf[4];
+        m.msgid = buf[5];
+    } else {
+        status.flags &= ~MAVLINK_STATUS_FLAG_IN_MAVLINK1;
+        m.incompat_flags = incompat_flags;
+        m.compat_flags = buf[3];
+        m.seq = buf[4];
+        m.sysid = buf[5];
+        m.compid = buf[6];
+        m.msgid = buf[7] | (buf[8]<<8) | (uint32_t(buf[9])<<16);
+    }
+#ifdef MAVLINK_CHECK_MESSAGE_LENGTH
+    if (payload_len < mavlink_min_message_length(&m) || payload_len > mavlink_max_message_length(&m)) {
+        return 0;
+    }
+#endif
+    memcpy(_MAV_PAYLOAD_NON_CONST(&m), &buf[header_len], payload_len);
+    status.packet_idx = payload_len;
+
+    const mavlink_msg_entry_t *e = mavlink_get_msg_entry(m.msgid);
+    uint16_t crc = frame_crc(buf, crc_ofs, e ? e->crc_extra : 0);
+    m.checksum = crc;
+    if (e && payload_len < e->max_msg_len) {
+        memset(&_MAV_PAYLOAD_NON_CONST(&m)[payload_len], 0, e->max_msg_len - payload_len);
+    }
+    m.ck[0] = buf[crc_ofs];
+    m.ck[1] = buf[crc_ofs+1];
+    status.parse_state = MAVLINK_PARSE_STATE_IDLE;
+    status.parse_error = 0;
+
+    if (m.ck[0] != (crc & 0xFF) || m.ck[1] != (crc >> 8)) {
+        // a signed frame's signature is then parsed as noise
+        status.msg_received = MAVLINK_FRAMING_BAD_CRC;
+        if (!is_signed) {
+            // the byte parser asks about unsigned frames even then
+            if (status.signing && status.signing->accept_unsigned_callback) {
+                status.signing->accept_unsigned_callback(&status, m.msgid);
+            }
+            memcpy(&msg, &m, sizeof(msg));
+        }
+        msg.checksum = m.ck[0] | (m.ck[1]<<8);
+        parse_failed(m.ck[1]);
+        ret = 0;
+        return crc_ofs + MAVLINK_NUM_CHECKSUM_BYTES;
+    }
+
+    status.msg_received = MAVLINK_FRAMING_OK;
+    if (is_signed) {
+        memcpy(m.signature, &buf[crc_ofs + MAVLINK_NUM_CHECKSUM_BYTES], MAVLINK_SIGNATURE_BLOCK_LEN);
+        status.signature_wait = 0;
+        bool sig_ok = check_signature(status.signing, status.signing_streams, m, buf);
+        if (!sig_ok &&
+            status.signing->accept_unsigned_callback &&
+            status.signing->accept_unsigned_callback(&status, m.msgid)) {
+            sig_ok = true;
+        }
+        if (!sig_ok) {
+            status.msg_received = MAVLINK_FRAMING_BAD_SIGNATURE;
+        }
+    } else if (status.signing &&
+               (status.signing->accept_unsigned_callback == nullptr ||
+                !status.signing->accept_unsigned_callback(&status, m.msgid))) {
+        status.msg_received = MAVLINK_FRAMING_BAD_SIGNATURE;
+    }
+    memcpy(&msg, &m, sizeof(msg));
+
+    if (status.msg_received != MAVLINK_FRAMING_OK) {
+        parse_failed(buf[frame_len-1]);
+        ret = 0;
+        return frame_len;
+    }
+    status.current_rx_seq = m.seq;
+    if (status.packet_rx_success_count == 0) {
+        status.packet_rx_drop_count = 0;
+    }
+    status.packet_rx_success_count++;
+    ret = MAVLINK_FRAMING_OK;
+    return frame_len;
+}
+
+/*
+  the signed bytes after the key (header, payload, CRC, link ID and
+  timestamp) are contiguous on the wire, so hash them from there
+  rather than field by field from the message as the library does
+ */
+bool MAVLink::check_signature(mavlink_signing_t *s, mavlink_signing_streams_t *streams,
+                              const mavlink_message_t &m, const uint8_t *frame)
+{
+    if (s == nullptr) {
+        return true;
+    }
+    const uint8_t *psig = m.signature;
+    const size_t signed_len = MAVLINK_CORE_HEADER_LEN + 1 + m.len + MAVLINK_NUM_CHECKSUM_BYTES + 7;
+    sha256_ctx ctx;
+    uint8_t hash[32];
+    sha256_init(&ctx);
+    sha256_update(&ctx, s->secret_key, sizeof(s->secret_key));
+    sha256_update(&ctx, frame, signed_len);
+    sha256_final_32bytes(&ctx, hash);
+    if (memcmp(hash, psig + 7, 6) != 0) {
+        s->last_status = MAVLINK_SIGNING_STATUS_BAD_SIGNATURE;
+        return false;
+    }
+
+    union {
+        uint64_t t64;
+        uint8_t t8[8];
+    } tstamp, last;
+    const uint8_t sig_link_id = psig[0];
+    tstamp.t64 = 0;
+    memcpy(tstamp.t8, psig+1, 6);
+
+    if (streams == nullptr) {
+        s->last_status = MAVLINK_SIGNING_STATUS_NO_STREAMS;
+        return false;
+    }
+    uint16_t i;
+    for (i=0; i<streams->num_signing_streams; i++) {
+        if (m.sysid == streams->stream[i].sysid &&
+            m.compid == streams->stream[i].compid &&
+            sig_link_id == streams->stream[i].link_id) {
+            break;
+        }
+    }
+    if (i == streams->num_signing_streams) {
+        if (streams->num_signing_streams >= MAVLINK_MAX_SIGNING_STREAMS) {
+            s->last_status = MAVLINK_SIGNING_STATUS_TOO_MANY_STREAMS;
+            return false;
+        }
+        // a new stream may start at most the limit behind our timestamp
+        if (tstamp.t64 + SIGNING_NEW_STREAM_LIMIT < s->timestamp) {
+            s->last_status = MAVLINK_SIGNING_STATUS_OLD_TIMESTAMP;
+            return false;
+        }
+        streams->stream[i].sysid = m.sysid;
+        streams->stream[i].compid = m.compid;
+        streams->stream[i].link_id = sig_link_id;
+        streams->num_signing_streams++;
+    } else {
+        last.t64 = 0;
+        memcpy(last.t8, streams->stream[i].timestamp_bytes, 6);
+        if (tstamp.t64 <= last.t64) {
+            s->last_status = MAVLINK_SIGNING_STATUS_REPLAY;
+            return false;
+        }
+    }
+    memcpy(streams->stream[i].timestamp_bytes, psig+1, 6);
+    if (tstamp.t64 > s->timestamp) {
+        s->timestamp = tstamp.t64;
+    }
+    s->last_status = MAVLINK_SIGNING_STATUS_OK;
+    return true;
+}
+
+/*
+  X.25 CRC of a frame's header and payload (buf[1] to buf[len-1]),
+  finished with the message's crc_extra
+ */
+uint16_t MAVLink::frame_crc(const uint8_t *buf, size_t len, uint8_t crc_extra)
+{
+    uint16_t crc = crc16_x25(X25_INIT_CRC, &buf[1], len-1);
+    crc_accumulate(crc_extra, &crc);
+    return crc;
+}
+
 bool MAVLink::receive_message(uint8_t *&buf, ssize_t &len, mavlink_message_t &msg)
 {
     mavlink_status_t status {};
     status.packet_rx_drop_count = 0;
-    got_bad_signature[chan] = false;
-    while (len--) {
-	if (mavlink_parse_char(chan, *buf++, &msg, &status)) {
-	    if (key_id != -1) {
+    got_bad_signature = false;
+    auto &state = chan_state.status;
+    while (len > 0) {
+        uint8_t ret = 0;
+        if (state.parse_state <= MAVLINK_PARSE_STATE_IDLE) {
+            /*
+              between frames: skip to the next start byte and take a
+              frame that is all there in one piece. Frames cut off by
+              the end of the read, and anything odd, go byte by byte
+             */
+            const size_t skip = find_stx(buf, len);
+            if (skip > 0) {
+                state.msg_received = MAVLINK_FRAMING_INCOMPLETE;
+                state.parse_error = 0;
+                buf += skip;
+                len -= skip;
+                continue;
+            }
+            const size_t n = parse_frame(buf, len, msg, ret);
+            buf += n;
+            len -= n;
+            if (n == 0) {
+                ret = parse_char(*buf++, msg, status);
+                len--;
+            }
+        } else {
+            ret = parse_char(*buf++, msg, status);
+            len--;
+        }
+	if (ret) {
+            const bool is_signed = (msg.incompat_flags & MAVLINK_IFLAG_SIGNED) != 0;
+            got_any_signed |= is_signed;
+	    if (key_id != -1 && !(accept_unsigned && !is_signed)) {
 		if (!key_loaded) {
                     if (periodic_warning()) {
                         mav_printf(MAV_SEVERITY_CRITICAL, "Need to setup support signing key");
                     }
                     return false;
                 } else {
-                    if ((msg.incompat_flags & MAVLINK_IFLAG_SIGNED) == 0) {
+                    if (!is_signed) {
                         if (periodic_warning()) {
                             mav_printf(MAV_SEVERITY_CRITICAL, "Need to use support signing key");
                         }
                         got_signed_packet = false;
                         return false;
                     }
-		    if (got_bad_signature[chan]) {
+		    if (got_bad_signature) {
 			if (periodic_warning()) {
                             switch (signing.last_status) {
                             case MAVLINK_SIGNING_STATUS_BAD_SIGNATURE:
@@ -183,24 +756,25 @@ bool MAVLink::receive_message(uint8_t *&buf, ssize_t &len, mavlink_message_t &ms
 
 bool MAVLink::send_message(const mavlink_message_t &msg)
 {
-    mavlink_message_t msg2 = msg;
-    uint8_t buf[300];
+    MAVLinkFanout fanout(msg);
+    return send_message(fanout);
+}
+
+bool MAVLink::send_message(MAVLinkFanout &fanout)
+{
+    const mavlink_message_t &msg = fanout.msg;
     if (is_tcp) {
-	if (socket_is_dead(fd)) {
-	    return false;
-	}
-	// if congested then drop this message, so we don't block
-	// other links
-	if (tcp_writable_bytes(fd) < 400) {
-	    return true;
-	}
+        /*
+          link health comes from the event loop (on_hangup()) and
+          from send() errors; a congested link queues, or sheds by
+          MsgClass
+         */
+        if (out_failed) {
+            return false;
+        }
     }
-    if (key_id == -1) {
-        // strip signing
-        msg2.incompat_flags &= ~MAVLINK_IFLAG_SIGNED;
-    } else {
-        // add signing
-        msg2.incompat_flags |= MAVLINK_IFLAG_SIGNED;
+    if (key_id != -1) {
+        // signed by encode() once the key is loaded
         if (!got_signed_packet && msg.msgid != MAVLINK_MSG_ID_HEARTBEAT) {
             // don't send anything but HEARTBEAT until support engineer sends a signed packet
             // we return true so connection stays alive
@@ -215,29 +789,161 @@ bool MAVLink::send_message(const mavlink_message_t &msg)
             update_signing_timestamp();
         }
     }
-    const uint8_t crc_extra = mavlink_get_crc_extra(&msg2);
-    const uint8_t min_len = mavlink_min_message_length(&msg2);
-    const uint8_t max_len = mavlink_max_message_length(&msg2);
-    if (min_len == 0 && max_len == 0) {
+
+    // keep the sequence numbers aligned so if there are multiple system IDs we get correct
+    // packet loss information. The frame carries msg.seq, our own
+    // messages follow on from it
+    chan_state.status.current_tx_seq = msg.seq + 1;
+
+    /*
+      a batched UDP send is encoded straight into its queue slot, so
+      the only copy of the message is the one into the outgoing frame
+     */
+    static_assert(MAVLINK_MAX_PACKET_LEN <= UDPSendBatch::SLOT_SIZE, "batch slot too small for a frame");
+    uint8_t buf[MAVLINK_MAX_PACKET_LEN];
+    uint8_t *slot = nullptr;
+    if (ws == nullptr && uring == nullptr && !is_tcp) {
+        slot = UDPSendBatch::reserve(fd, use_sendto ? &send_addr : nullptr, send_len);
+    }
+    const uint16_t len = encode(fanout, slot != nullptr ? slot : buf);
+    if (len == 0) {
         ::printf("Unknown MAVLink msg ID %u\n", unsigned(msg.msgid));
         return false;
     }
-    mavlink_status_t *status = mavlink_get_channel_status(chan);
-    if (status == nullptr) {
+    if (slot != nullptr) {
+        UDPSendBatch::commit(len);
+        return true;
+    }
+    return send_data(buf, len) == len;
+}
+
+/*
+  write fanout's message for this link into out, building the shared
+  frame on first use
+ */
+uint16_t MAVLink::encode(MAVLinkFanout &fanout, uint8_t *out)
+{
+    if (fanout.unknown) {
+        return 0;
+    }
+    const mavlink_status_t &status = chan_state.status;
+    const bool sign = status.signing != nullptr &&
+        (status.signing->flags & MAVLINK_SIGNING_FLAG_SIGN_OUTGOING);
+    auto &f = sign ? fanout.signed_frame : fanout.plain;
+    if (f.len == 0 && !build_frame(fanout.msg, sign, f)) {
+        fanout.unknown = true;
+        return 0;
+    }
+    memcpy(out, f.buf, f.len);
+    if (!sign) {
+        return f.len;
+    }
+    return sign_frame(fanout, out, f.len);
+}
+
+/*
+  serialise msg into f, up to and including the CRC: the same bytes as
+  finalize() followed by mavlink_msg_to_send_buffer(), with msg.seq as
+  the sequence number, but read from msg in place rather than from a
+  finalized copy of the whole mavlink_message_t. Payload bytes past
+  msg.len count as zero, as finalize() clears them, and the payload is
+  trimmed from max_msg_len down
+ */
+bool MAVLink::build_frame(const mavlink_message_t &msg, bool sign, MAVLinkFanout::Frame &f)
+{
+    const mavlink_msg_entry_t *e = mavlink_get_msg_entry(msg.msgid);
+    if (e == nullptr) {
         return false;
     }
+    uint8_t *out = f.buf;
+    const uint8_t *payload = (const uint8_t *)_MAV_PAYLOAD(&msg);
+    uint8_t len = msg.len < e->max_msg_len ? msg.len : e->max_msg_len;
+    while (len > 1 && payload[len-1] == 0) {
+        len--;
+    }
+    uint8_t *p = &out[MAVLINK_NUM_HEADER_BYTES];
+    memcpy(p, payload, len);
+    if (len == 0) {
+        // an all-zero payload still sends one byte
+        p[0] = 0;
+        len = 1;
+    }
 
-    // keep the sequence numbers aligned so if there are multiple system IDs we get correct
-    // packet loss information
-    status->current_tx_seq = msg.seq;
+    out[0] = MAVLINK_STX;
+    out[1] = len;
+    out[2] = sign ? MAVLINK_IFLAG_SIGNED : 0;
+    out[3] = 0;
+    out[4] = msg.seq;
+    out[5] = msg.sysid;
+    out[6] = msg.compid;
+    out[7] = msg.msgid & 0xFF;
+    out[8] = (msg.msgid >> 8) & 0xFF;
+    out[9] = (msg.msgid >> 16) & 0xFF;
 
-    mavlink_finalize_message_buffer(&msg2, msg2.sysid, msg2.compid, status, min_len, max_len, crc_extra);
+    // header and payload are contiguous, so one pass covers both
+    uint16_t crc = crc16_x25(X25_INIT_CRC, &out[1], MAVLINK_CORE_HEADER_LEN + len);
+    crc_accumulate(e->crc_extra, &crc);
+    p[len] = crc & 0xFF;
+    p[len+1] = crc >> 8;
 
-    uint16_t len = mavlink_msg_to_send_buffer(buf, &msg2);
-    if (len > 0) {
-	return send_data(buf, len) == len;
+    f.len = MAVLINK_NUM_HEADER_BYTES + len + MAVLINK_NUM_CHECKSUM_BYTES;
+    return true;
+}
+
+/*
+  append this link's signature to the len byte frame in out, as
+  mavlink_sign_packet() would. The signature is the first 6 bytes of
+  SHA-256 over key, frame, link_id and timestamp; everything up to
+  the link_id is the same for all links sharing a key, so that part
+  of the hash is computed once per message
+ */
+uint16_t MAVLink::sign_frame(MAVLinkFanout &fanout, uint8_t *out, uint16_t len)
+{
+    if (!fanout.have_midstate ||
+        memcmp(fanout.midstate_key, signing.secret_key, sizeof(signing.secret_key)) != 0) {
+        sha256_init(&fanout.midstate);
+        sha256_update(&fanout.midstate, signing.secret_key, sizeof(signing.secret_key));
+        sha256_update(&fanout.midstate, out, len);
+        memcpy(fanout.midstate_key, signing.secret_key, sizeof(signing.secret_key));
+        fanout.have_midstate = true;
     }
-    return false;
+
+    uint8_t *sig = &out[len];
+    union {
+        uint64_t t64;
+        uint8_t t8[8];
+    } tstamp;
+    tstamp.t64 = signing.timestamp++;
+    sig[0] = signing.link_id;
+    memcpy(&sig[1], tstamp.t8, 6);
+
+    sha256_ctx ctx = fanout.midstate;
+    sha256_update(&ctx, sig, 7);
+    uint8_t hash[32];
+    sha256_final_32bytes(&ctx, hash);
+    memcpy(&sig[7], hash, 6);
+    return len + MAVLINK_SIGNATURE_BLOCK_LEN;
+}
+
+/*
+  finalize msg with this link's sequence number and signing state.
+  A message that has been finalized before has its CRC bytes sitting
+  in the payload just past len, so clear the tail first or they would
+  be sent as payload
+ */
+bool MAVLink::finalize(mavlink_message_t &msg)
+{
+    const uint8_t crc_extra = mavlink_get_crc_extra(&msg);
+    const uint8_t min_len = mavlink_min_message_length(&msg);
+    const uint8_t max_len = mavlink_max_message_length(&msg);
+    if (min_len == 0 && max_len == 0) {
+        return false;
+    }
+    if (msg.len < max_len) {
+        memset(_MAV_PAYLOAD_NON_CONST(&msg) + msg.len, 0, max_len - msg.len);
+    }
+    mavlink_finalize_message_buffer(&msg, msg.sysid, msg.compid, &chan_state.status, min_len, max_len, crc_extra);
+    return true;
 }
 
 /*
@@ -245,12 +951,11 @@ bool MAVLink::send_message(const mavlink_message_t &msg)
  */
 bool MAVLink::accept_unsigned_callback(const mavlink_status_t *status, uint32_t msgId)
 {
-    // we accept all and use status to check in receive_message()
-    if (status->signing) {
-	auto _chan = mavlink_channel_t(status->signing->link_id);
-	if (_chan < MAVLINK_COMM_NUM_BUFFERS) {
-	    got_bad_signature[_chan] = true;
-	}
+    // we accept all and use status to check in receive_message().
+    // status is the first member of the link's channel_state
+    auto *state = reinterpret_cast<const channel_state *>(status);
+    if (state->owner != nullptr) {
+        state->owner->got_bad_signature = true;
     }
     return true;
 }
@@ -276,11 +981,7 @@ bool MAVLink::save_key(TDB_CONTEXT *tdb)
  */
 void MAVLink::load_signing_key(void)
 {
-    mavlink_status_t *status = mavlink_get_channel_status(chan);
-    if (status == nullptr) {
-        ::printf("Failed to load signing key for %d - no status\n", key_id);
-        return;        
-    }
+    mavlink_status_t *status = &chan_state.status;
     auto *db = db_open();
     // we fallback to the default key ID of 0 if no signing key
     if (!load_key(db)) {
@@ -292,7 +993,7 @@ void MAVLink::load_signing_key(void)
     key_loaded = true;
 
     memcpy(signing.secret_key, key.secret_key, sizeof(key.secret_key));
-    signing.link_id = uint8_t(chan);
+    signing.link_id = link_id;
 
     // Start signing.timestamp at max(saved + 15s, current wall clock).
     //
@@ -344,8 +1045,22 @@ void MAVLink::load_signing_key(void)
 }
 
 /*
-  update signing timestamp. This is called when we get GPS lock
-  timestamp_usec is since 1/1/1970 (the epoch)
+  convert wall clock time to a signing timestamp (10usec units since
+  1/1/2015)
+ */
+static uint64_t signing_timestamp_now(void)
+{
+    const uint64_t epoch_offset = 1420070400ULL;
+    double now_s = time_seconds();
+    uint64_t now_mavlink = 0;
+    if (now_s > epoch_offset) {
+        now_mavlink = uint64_t(now_s - epoch_offset) * 100ULL * 1000ULL;
+    }
+    return now_mavlink;
+}
+
+/*
+  update signing timestamp
  */
 void MAVLink::update_signing_timestamp()
 {
@@ -354,87 +1069,71 @@ void MAVLink::update_signing_timestamp()
         return;
     }
     last_signing_save_s = now;
-    uint64_t signing_timestamp = now;
-    // this is the offset from 1/1/1970 to 1/1/2015
-    const uint64_t epoch_offset = 1420070400ULL;
-    if (signing_timestamp > epoch_offset) {
-        signing_timestamp -= epoch_offset;
-    }
+    const uint64_t signing_timestamp = signing_timestamp_now();
 
-    // convert to 10usec units
-    signing_timestamp *= 100 * 1000ULL;
+    if (signing.timestamp < signing_timestamp) {
+        signing.timestamp = signing_timestamp;
+    }
 
-    // increase signing timestamp on any links that have signing
-    for (uint8_t i=0; i<MAVLINK_COMM_NUM_BUFFERS; i++) {
-	mavlink_channel_t _chan = (mavlink_channel_t)(MAVLINK_COMM_0 + i);
-	mavlink_status_t *status = mavlink_get_channel_status(_chan);
-        if (status && status->signing && status->signing->timestamp < signing_timestamp) {
-            status->signing->timestamp = signing_timestamp;
-        }
+    /*
+      Cap saved value at current real time. The +15s buffer added in
+      load_signing_key() is a per-load replay guard; allowing it to
+      round-trip through the save would let the buffer compound across
+      sequential short-lived sessions until signing.timestamp parks far
+      enough in the future that incoming packets get rejected as
+      MAVLINK_SIGNING_STATUS_OLD_TIMESTAMP.
+     */
+    uint64_t v = signing.timestamp;
+    if (v > signing_timestamp) {
+        v = signing_timestamp;
+    }
+    uint64_t &pending = pending_timestamps[key_id];
+    if (v > pending) {
+        pending = v;
     }
 
-    // save to stable storage as a child process to minimise latency
-    // in this process
-    signal(SIGCHLD, SIG_IGN);
-    if (fork() == 0) {
-	save_signing_timestamp();
-	exit(0);
+    if (now - last_timestamp_flush_s >= 10) {
+        flush_signing_timestamps();
     }
 }
 
-
 /*
-  save the signing timestamp periodically
+  write all pending signing timestamps to keys.tdb. The write happens
+  on the writer thread so the links in this process never wait on the
+  database lock
  */
-void MAVLink::save_signing_timestamp(void)
+void MAVLink::flush_signing_timestamps(void)
 {
-    auto *db = db_open_transaction();
-    if (db == nullptr) {
-        return;
-    }
-    if (!load_key(db)) {
-        printf("Bad key %d\n", key_id);
-        db_close_cancel(db);
+    last_timestamp_flush_s = time_seconds();
+    if (pending_timestamps.empty()) {
         return;
     }
-    bool need_save = false;
-
-    // Cap saved value at current real time. The +15s buffer added in
-    // load_signing_key() is a per-load replay guard; allowing it to
-    // round-trip through this save would let the buffer compound across
-    // sequential short-lived sessions until signing.timestamp parks far
-    // enough in the future that incoming packets get rejected as
-    // MAVLINK_SIGNING_STATUS_OLD_TIMESTAMP. Using the legitimate
-    // wall-clock advancement here keeps the stored timestamp in sync
-    // with reality.
-    double now_s = time_seconds();
-    const uint64_t epoch_offset = 1420070400ULL;
-    uint64_t now_mavlink = 0;
-    if (now_s > epoch_offset) {
-        now_mavlink = uint64_t(now_s - epoch_offset) * 100ULL * 1000ULL;
-    }
-
-    for (uint8_t i=0; i<MAVLINK_COMM_NUM_BUFFERS; i++) {
-	mavlink_channel_t _chan = (mavlink_channel_t)(MAVLINK_COMM_0 + i);
-	const mavlink_status_t *status = mavlink_get_channel_status(_chan);
-        if (status && status->signing) {
-            uint64_t v = status->signing->timestamp;
-            if (v > now_mavlink) {
-                v = now_mavlink;
+    std::map<int, uint64_t> timestamps;
+    timestamps.swap(pending_timestamps);
+    db_writer_post([timestamps]() {
+        auto *db = db_open_transaction();
+        if (db == nullptr) {
+            return;
+        }
+        bool need_save = false;
+        for (const auto &kv : timestamps) {
+            struct KeyEntry k;
+            if (!db_load_key(db, kv.first, k)) {
+                printf("Bad key %d\n", kv.first);
+                continue;
             }
-            if (v > key.timestamp) {
-                key.timestamp = v;
+            if (kv.second > k.timestamp) {
+                k.timestamp = kv.second;
+                db_save_key(db, kv.first, k);
                 need_save = true;
             }
         }
-    }
-    if (need_save) {
-        // save updated key
-	save_key(db);
-	db_close_commit(db);
-    } else {
-        db_close_cancel(db);
-    }
+        if (need_save) {
+            db_close_commit(db);
+        } else {
+            db_close_cancel(db);
+        }
+    });
 }
 
 /*
@@ -466,13 +1165,10 @@ void MAVLink::mav_printf(uint8_t severity, const char *fmt, ...)
 
     // also send signed so for old timestamp the client gets a chance
     // to update the timestamp
-    mavlink_message_t msg2 {};
-    mavlink_msg_statustext_pack_chan(last_sysid, last_compid,
-				     chan,
-				     &msg2,
-                                     severity,
-                                     text,
-                                     0, 0);
+    mavlink_message_t msg2 = msg;
+    if (!finalize(msg2)) {
+        return;
+    }
     uint16_t len2 = mavlink_msg_to_send_buffer(buf, &msg2);
     if (len2 > 0) {
 	send_data(buf, len2);
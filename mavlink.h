@@ -6,6 +6,9 @@
 #include "mavlink_msgs.h"
 #include "keydb.h"
 #include "websocket.h"
+#include "sha256.h"
+#include "udpbatch.h"
+#include "outqueue.h"
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -13,6 +16,7 @@
 typedef ssize_t (*send_fn_t)(int, const void *, size_t , int);
 
 class TlogWriter;
+class UringIO;
 
 /*
   Serialize a parsed mavlink_message_t to wire bytes and write it as one
@@ -22,14 +26,57 @@ class TlogWriter;
  */
 void tlog_write_message(TlogWriter *tlog, const mavlink_message_t &msg);
 
+/*
+  one message encoded once for many links. The first link to send it
+  builds the frame (header, payload, CRC), and the first signed link
+  also the SHA-256 state over its key and that frame. Later links
+  reuse both: an unsigned link copies the finished frame, and a signed
+  link with the same key only hashes its own link_id and timestamp.
+  Create one per message and pass it to send_message() for each
+  destination
+ */
+class MAVLinkFanout {
+public:
+    explicit MAVLinkFanout(const mavlink_message_t &_msg) : msg(_msg) {}
+    MAVLinkFanout(const MAVLinkFanout &) = delete;
+    MAVLinkFanout &operator=(const MAVLinkFanout &) = delete;
+
+private:
+    friend class MAVLink;
+
+    struct Frame {
+        // header, payload and CRC, 0 until built
+        uint16_t len;
+        uint8_t buf[MAVLINK_MAX_PACKET_LEN];
+    };
+
+    const mavlink_message_t &msg;
+    bool unknown = false;
+    Frame plain {};
+    Frame signed_frame {};
+
+    // hash of midstate_key followed by signed_frame
+    bool have_midstate = false;
+    uint8_t midstate_key[32];
+    sha256_ctx midstate;
+};
+
 /*
   abstraction for MAVLink on UDP
  */
-class MAVLink {
+class MAVLink : public DeferredOutput {
 public:
-    void init(int fd, mavlink_channel_t chan, bool signing_required, bool allow_websocket, bool is_tcp, int key_id=-1);
+    MAVLink() = default;
+    ~MAVLink();
+    /*
+      link_id identifies this link in outgoing signatures and in the
+      signing streams; each MAVLink object keeps its own parser and
+      signing state, so any number of links can live in one process
+     */
+    void init(int fd, uint8_t link_id, bool signing_required, bool allow_websocket, bool is_tcp, int key_id=-1);
     bool receive_message(uint8_t *&buf, ssize_t &len, mavlink_message_t &msg);
     bool send_message(const mavlink_message_t &msg);
+    bool send_message(MAVLinkFanout &fanout);
     /*
       Send already-serialised MAVLink bytes (header + payload + CRC,
       optionally signature) to the peer through this connection's
@@ -48,16 +95,86 @@ public:
 	send_addr = _send_addr;
 	send_len = _send_len;
     }
+    /*
+      queue UDP sends on an io_uring instead of sending directly. TCP
+      and WebSocket links keep sending inline, as they need ordering
+      and congestion checks
+     */
+    void set_uring(UringIO *_uring) {
+	uring = _uring;
+    }
+    /*
+      take frames without a signature as they are, for pass-through
+      entries. Signed frames are still checked. Call after init()
+     */
+    void set_accept_unsigned(bool v) {
+	accept_unsigned = v;
+    }
+    // a signed frame has come in on this link
+    bool saw_signed(void) const {
+	return got_any_signed;
+    }
+    // nothing queued to send and the parser isn't inside a frame
+    bool between_frames(void) const {
+	return out_queue.size() == 0 && chan_state.status.parse_state <= MAVLINK_PARSE_STATE_IDLE;
+    }
+    // the parser's state and counters, as the library keeps them per channel
+    const mavlink_status_t &parse_status(void) const {
+	return chan_state.status;
+    }
+
+    /*
+      signing timestamps are advanced in memory by every link and
+      written back to keys.tdb in one batch per call, by a job queued
+      for the dbwriter thread. Pending timestamps are per thread;
+      owners call this on the thread that runs the links, when a
+      session ends.
+     */
+    static void flush_signing_timestamps(void);
+
+    /*
+      mavlink_signature_check() on a signed frame that is whole in
+      memory at frame (from the STX), as receive_message() has them.
+      Same result and stream/timestamp updates; the hash goes through
+      sha256.cpp, which uses the CPU's SHA instructions where it can
+     */
+    static bool check_signature(mavlink_signing_t *signing, mavlink_signing_streams_t *streams,
+                                const mavlink_message_t &m, const uint8_t *frame);
+
+    /*
+      TCP and WebSocket links queue their frames. The queue is written
+      in one send() or one TLS record when the UDPSendBatch that is
+      open closes (or straight away without one), earlier once
+      OUTPUT_MAX_BYTES are waiting or the oldest has waited
+      OUTPUT_MAX_DELAY_S. What the socket doesn't take waits for
+      on_writable(), up to OutputQueue::QUEUE_MAX bytes, with frames
+      shed by MsgClass beyond that
+     */
+    void flush_output(void) override;
+    // the socket has room again (EPOLLOUT)
+    void on_writable(void);
+    // the socket reported an error or hangup; sends fail from now on
+    void on_hangup(void);
+    // write what is queued and stop deferring, before closing the socket
+    void finish_output(void);
+    // frames shed by this link, per MsgClass
+    uint32_t dropped(uint8_t cls) const {
+        return out_queue.dropped(cls);
+    }
+    static constexpr size_t OUTPUT_MAX_BYTES = 4096;
+    static constexpr double OUTPUT_MAX_DELAY_S = 0.002;
 
 private:
     struct KeyEntry key;
     int fd;
-    mavlink_channel_t chan;
+    uint8_t link_id;
     int key_id;
     bool is_tcp;
     bool key_loaded = false;
     bool got_signed_packet = false;
-    static bool got_bad_signature[MAVLINK_COMM_NUM_BUFFERS];
+    bool got_bad_signature = false;
+    bool accept_unsigned = false;
+    bool got_any_signed = false;
     bool allow_websocket;
     bool use_sendto;
     struct sockaddr_in send_addr;
@@ -66,6 +183,17 @@ private:
     mavlink_signing_streams_t signing_streams {};
     mavlink_signing_t signing {};
 
+    /*
+      per-link replacement for the library's global channel tables.
+      status must stay the first member: accept_unsigned_callback()
+      only gets the status pointer and uses it to find the owner.
+     */
+    struct channel_state {
+        mavlink_status_t status;
+        MAVLink *owner;
+    } chan_state {};
+    mavlink_message_t rx_msg {};
+
     // last time we saved the timestamp
     double last_signing_save_s = 0;
 
@@ -80,9 +208,21 @@ private:
 
     void load_signing_key(void);
     void update_signing_timestamp(void);
-    void save_signing_timestamp(void);
     bool load_key(TDB_CONTEXT *db);
     bool save_key(TDB_CONTEXT *db);
+    uint8_t parse_char(uint8_t c, mavlink_message_t &msg, mavlink_status_t &status);
+    void parse_failed(uint8_t c);
+    size_t parse_frame(const uint8_t *buf, size_t len, mavlink_message_t &msg, uint8_t &ret);
+    static uint16_t frame_crc(const uint8_t *buf, size_t len, uint8_t crc_extra);
+    bool finalize(mavlink_message_t &msg);
+    /*
+      write fanout's message as a frame for this link (signed or not)
+      into out, which holds MAVLINK_MAX_PACKET_LEN bytes. Returns its
+      length, 0 for an unknown message
+     */
+    uint16_t encode(MAVLinkFanout &fanout, uint8_t *out);
+    static bool build_frame(const mavlink_message_t &msg, bool sign, MAVLinkFanout::Frame &f);
+    uint16_t sign_frame(MAVLinkFanout &fanout, uint8_t *out, uint16_t len);
 
     bool periodic_warning(void);
     void mav_printf(uint8_t severity, const char *fmt, ...);
@@ -90,6 +230,18 @@ private:
     void handle_setup_signing(const mavlink_message_t &msg);
 
     ssize_t send_data(const void *buf, ssize_t len);
+    void queue_output(const void *buf, size_t len);
+    void write_output(void);
+
+    // stream output, framed for WebSocket links
+    OutputQueue out_queue;
+    bool out_deferred = false;
+    // the socket didn't take everything last time
+    bool out_blocked = false;
+    // a write failed, the stream is unusable
+    bool out_failed = false;
+    double out_first_s = 0;
 
-    WebSocket *ws;
+    WebSocket *ws = nullptr;
+    UringIO *uring = nullptr;
 };
@@ -10,11 +10,18 @@
 
 #define MAVLINK_SEND_UART_BYTES(chan, buf, len) comm_send_buffer(chan, buf, len)
 
-// 2 comm channels per available proxy connection, plus one for STATUSTEXT msgs
 #define MAX_COMM2_LINKS 100
-#define MAVLINK_COMM_NUM_BUFFERS (MAX_COMM2_LINKS+2)
 
-// mavlink channel mapping
+// Parser and signing state lives in each MAVLink object, so the
+// library's global channel tables only back the unsigned pack_chan()
+// helpers used for locally generated messages. Those tables are per
+// thread (defined in mavlink.cpp) so reactor threads never share them
+#define MAVLINK_COMM_NUM_BUFFERS 2
+#define MAVLINK_EXTERNAL_RX_STATUS
+#define MAVLINK_EXTERNAL_RX_BUFFER
+
+// mavlink channel mapping. CHAN_COMM1 and CHAN_COMM2(i) are link ids
+// (they appear in outgoing signatures), not library channels
 #define CHAN_COMM1 MAVLINK_COMM_0
 #define CHAN_STATUSTEXT MAVLINK_COMM_1
 #define CHAN_COMM2(i) mavlink_channel_t((int(MAVLINK_COMM_2)+(i)))
@@ -31,6 +38,9 @@
 /// MAVLink system definition
 extern mavlink_system_t mavlink_system;
 
+extern thread_local mavlink_status_t m_mavlink_status[MAVLINK_COMM_NUM_BUFFERS];
+extern thread_local mavlink_message_t m_mavlink_buffer[MAVLINK_COMM_NUM_BUFFERS];
+
 void comm_send_buffer(mavlink_channel_t chan, const uint8_t *buf, uint8_t len);
 
 #define MAVLINK_USE_CONVENIENCE_FUNCTIONS
@@ -0,0 +1,210 @@
+/*
+  output queue of a stream link
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "outqueue.h"
+#include "util.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+bool OutputQueue::push(uint8_t cls, uint64_t key, const uint8_t *header, size_t hlen,
+                       const void *body, size_t len, bool congested)
+{
+    const size_t flen = hlen + len;
+    if (congested && !make_room(cls, key, flen)) {
+        dropped_count[cls]++;
+        return false;
+    }
+    if (queued == 0) {
+        // only dead frames left, if anything
+        clear();
+    }
+    const size_t ofs = buf.size();
+    buf.insert(buf.end(), header, header + hlen);
+    const uint8_t *b = (const uint8_t *)body;
+    buf.insert(buf.end(), b, b + len);
+    if (cls == MSG_CLASS_TELEMETRY) {
+        latest[key] = seq;
+    }
+    frames.push_back(Frame { key, uint32_t(ofs), seq++, uint16_t(flen), cls, false, false });
+    queued += flen;
+    return true;
+}
+
+/*
+  make room for need more bytes of class cls on a congested link: an
+  older value of the same telemetry message goes first, then the
+  oldest frames of the lower classes. Frames of a higher class are
+  never shed for it. Returns false if there is still no room
+ */
+bool OutputQueue::make_room(uint8_t cls, uint64_t key, size_t need)
+{
+    if (cls == MSG_CLASS_TELEMETRY) {
+        const auto it = latest.find(key);
+        const size_t i = it != latest.end() ? find_frame(it->second) : frames.size();
+        if (i < frames.size() && !frames[i].locked && !frames[i].dead) {
+            drop_frame(i);
+        }
+    }
+    /*
+      each class carries on from where it last stopped, so a link that
+      stays congested doesn't rescan the frames it already passed
+     */
+    const uint8_t shed_max = cls < MSG_CLASS_RELIABLE ? cls : uint8_t(MSG_CLASS_NORMAL);
+    for (uint8_t c = MSG_CLASS_TELEMETRY; c <= shed_max; c++) {
+        size_t &i = shed_from[c];
+        for (; i < frames.size() && queued + need > QUEUE_MAX; i++) {
+            const auto &f = frames[i];
+            if (f.cls == c && !f.locked && !f.dead) {
+                drop_frame(i);
+            }
+        }
+    }
+    // a link that doesn't drain doesn't get to compact before a write,
+    // so shed bytes also go once they outweigh the live ones
+    if (buf.size() - head - queued > queued) {
+        compact();
+    }
+    const size_t limit = cls == MSG_CLASS_RELIABLE ? QUEUE_RELIABLE_MAX : QUEUE_MAX;
+    return queued + need <= limit;
+}
+
+// index of the frame numbered s in frames, or its size if gone
+size_t OutputQueue::find_frame(uint32_t s) const
+{
+    const auto it = std::lower_bound(frames.begin(), frames.end(), s,
+                                     [](const Frame &f, uint32_t v) { return int32_t(f.seq - v) < 0; });
+    if (it == frames.end() || it->seq != s) {
+        return frames.size();
+    }
+    return it - frames.begin();
+}
+
+void OutputQueue::drop_frame(size_t i)
+{
+    auto &f = frames[i];
+    f.dead = true;
+    dead++;
+    queued -= f.len;
+    dropped_count[f.cls]++;
+}
+
+const uint8_t *OutputQueue::next(size_t &n)
+{
+    /*
+      shed frames have to leave the stream before it is written.
+      Otherwise written bytes are only squeezed out once they are
+      half the buffer, so a partial write costs no memmove. Pinned
+      frames are locked, so their bytes may move but not change
+     */
+    if (dead != 0 || (head != 0 && head >= buf.size() / 2)) {
+        compact();
+    }
+    n = pinned != 0 ? pinned : queued;
+    return buf.data() + head;
+}
+
+void OutputQueue::pin(size_t n)
+{
+    pinned = n;
+    size_t done = 0;
+    for (auto &f : frames) {
+        if (done >= n) {
+            break;
+        }
+        f.locked = true;
+        done += f.len;
+    }
+}
+
+// forget the first n bytes of the queue, which the socket took
+void OutputQueue::consume(size_t n)
+{
+    pinned = 0;
+    head += n;
+    queued -= n;
+    size_t popped = 0;
+    while (n > 0) {
+        auto &f = frames.front();
+        if (n < f.len) {
+            f.ofs += n;
+            f.len -= n;
+            f.locked = true;
+            break;
+        }
+        n -= f.len;
+        frames.pop_front();
+        popped++;
+    }
+    if (queued == 0) {
+        clear();
+        return;
+    }
+    for (auto &i : shed_from) {
+        i = i > popped ? i - popped : 0;
+    }
+}
+
+/*
+  drop dead frames and written bytes from buf, so what is left to
+  write is contiguous from the start
+ */
+void OutputQueue::compact(void)
+{
+    size_t w = 0, k = 0;
+    for (size_t i = 0; i < frames.size(); i++) {
+        Frame f = frames[i];
+        if (f.dead) {
+            continue;
+        }
+        memmove(&buf[w], &buf[f.ofs], f.len);
+        f.ofs = w;
+        w += f.len;
+        frames[k++] = f;
+    }
+    frames.resize(k);
+    buf.resize(w);
+    head = 0;
+    dead = 0;
+    ZERO_STRUCT(shed_from);
+    // drop the keys of frames that have gone, if they pile up
+    if (latest.size() > frames.size()) {
+        latest.clear();
+        for (const auto &f : frames) {
+            if (f.cls == MSG_CLASS_TELEMETRY) {
+                latest[f.key] = f.seq;
+            }
+        }
+    }
+}
+
+void OutputQueue::clear(void)
+{
+    buf.clear();
+    frames.clear();
+    head = 0;
+    queued = 0;
+    dead = 0;
+    pinned = 0;
+    ZERO_STRUCT(shed_from);
+    latest.clear();
+}
+
+void OutputQueue::clear_dropped(void)
+{
+    ZERO_STRUCT(dropped_count);
+}
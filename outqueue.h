@@ -0,0 +1,113 @@
+/*
+  output queue of a stream link
+
+  Frames are appended as they are sent and written out from the front
+  in as few send() calls as the socket allows. When the link is
+  congested, frames are shed by MsgClass to keep the queue bounded,
+  without ever leaving part of a frame in the stream.
+
+  Written bytes are skipped by moving a head offset and shed frames
+  are only marked dead; both are squeezed out in one pass before a
+  write, not per frame.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <deque>
+#include <unordered_map>
+#include <vector>
+
+/*
+  priority classes for frames queued on a congested stream link,
+  lowest first. When the queue is full, telemetry is shed before
+  anything else and collapses to the latest value of each message;
+  command, parameter and mission traffic is only ever dropped when the
+  queue is full of it
+ */
+enum MsgClass : uint8_t {
+    MSG_CLASS_TELEMETRY,
+    MSG_CLASS_NORMAL,
+    MSG_CLASS_RELIABLE,
+    MSG_CLASS_COUNT
+};
+
+class OutputQueue {
+public:
+    static constexpr size_t QUEUE_MAX = 32768;
+    // further room for MSG_CLASS_RELIABLE frames only
+    static constexpr size_t QUEUE_RELIABLE_MAX = 65536;
+
+    /*
+      append a frame of hlen bytes of header (a WebSocket frame
+      header, may be none) and len bytes of body. key names the
+      message for collapsing telemetry. With congested set, older
+      frames are shed to keep within QUEUE_MAX first; returns false,
+      counting the frame as dropped, if that doesn't make room
+     */
+    bool push(uint8_t cls, uint64_t key, const uint8_t *header, size_t hlen,
+              const void *body, size_t len, bool congested);
+
+    /*
+      the bytes to write next, contiguous: everything queued, or
+      exactly what was given last time after pin()
+     */
+    const uint8_t *next(size_t &n);
+
+    // the socket took the first n bytes given by next()
+    void consume(size_t n);
+
+    // TLS has to be given the same n bytes again, they can't be shed
+    void pin(size_t n);
+
+    // forget everything queued, for a link that has failed
+    void clear(void);
+
+    // bytes of live frames still to be written
+    size_t size(void) const {
+        return queued;
+    }
+
+    // frames shed, per MsgClass
+    uint32_t dropped(uint8_t cls) const {
+        return dropped_count[cls];
+    }
+    void clear_dropped(void);
+
+private:
+    bool make_room(uint8_t cls, uint64_t key, size_t need);
+    void drop_frame(size_t i);
+    void compact(void);
+    size_t find_frame(uint32_t seq) const;
+
+    // a frame in buf
+    struct Frame {
+        // msgid, sysid and compid, for collapsing telemetry
+        uint64_t key;
+        // its unwritten bytes in buf
+        uint32_t ofs;
+        // queue order, wrapping
+        uint32_t seq;
+        uint16_t len;
+        uint8_t cls;
+        // partly written, or handed to TLS that must see it again
+        bool locked;
+        // shed, its bytes leave buf at the next compact()
+        bool dead;
+    };
+
+    std::vector<uint8_t> buf;
+    size_t head = 0;
+    size_t queued = 0;
+    // dead frames in frames
+    size_t dead = 0;
+    std::deque<Frame> frames;
+    // frames before this index hold no sheddable frame of the class
+    size_t shed_from[MSG_CLASS_COUNT] {};
+    uint32_t seq = 0;
+    // the newest telemetry frame queued under each key, by seq
+    std::unordered_map<uint64_t, uint32_t> latest;
+    // bytes the next TLS write has to retry with
+    size_t pinned = 0;
+    uint32_t dropped_count[MSG_CLASS_COUNT] {};
+};
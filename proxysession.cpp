@@ -0,0 +1,1259 @@
+/*
+  one proxy session: the user (conn1) and support engineer (conn2)
+  links of a single port pair
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "proxysession.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "util.h"
+#include "keydb.h"
+#include "session.h"
+#include "websocket.h"
+#include "uring.h"
+#include "udpbatch.h"
+#include "dbwriter.h"
+
+thread_local unsigned char ProxySession::buf[10240];
+thread_local ProxySession::RxBatch ProxySession::rx;
+
+// every socket is registered edge-triggered, so each handler drains
+// its socket until EAGAIN: a readiness edge is only reported again
+// once new data arrives
+static const uint32_t ev_in = EPOLLIN | EPOLLET;
+/*
+  stream sockets also report when a congested link can take more
+  output, and when the peer goes away, so their links never have to
+  ask the kernel before a send
+ */
+static const uint32_t ev_inout = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+static const uint32_t ev_hangup = EPOLLERR | EPOLLHUP;
+
+// report what a congested link shed, by MsgClass
+static void print_dropped(unsigned port2, const char *name, const MAVLink &mav)
+{
+    const uint32_t telem = mav.dropped(MSG_CLASS_TELEMETRY);
+    const uint32_t normal = mav.dropped(MSG_CLASS_NORMAL);
+    const uint32_t reliable = mav.dropped(MSG_CLASS_RELIABLE);
+    if (telem + normal + reliable == 0) {
+        return;
+    }
+    printf("[%u] %s %s dropped %u telemetry, %u other, %u command/mission frames\n",
+           port2, time_string(), name, unsigned(telem), unsigned(normal), unsigned(reliable));
+}
+
+void Connection2::close(void)
+{
+    mav.finish_output();
+    close_fd(sock);
+    tcp_active = false;
+    used = false;
+    delete ws;
+    ws = nullptr;
+    connected_at = 0;
+    rx_msgs = 0;
+    tx_msgs = 0;
+}
+
+// no traffic for this long ends the session, or a UDP engineer
+#define IDLE_TIMEOUT_S 10
+// connections.tdb heartbeat
+#define SNAPSHOT_INTERVAL_S 5
+
+ProxySession::ProxySession(struct listen_port *_p, EventLoop &_loop, TimerWheel &_timers, notify_t _on_event) :
+    p(_p),
+    loop(_loop),
+    timers(_timers),
+    on_event(_on_event),
+    last_event_s(time_seconds()),
+    bidi((_p->flags & KEY_FLAG_BIDI_SIGN) != 0),
+    conn1_key_id(bidi ? _p->port2 : -1),
+    // session_n is computed once at session start and shared between
+    // the tlog and the binlog writer so the paired files — sessionN.tlog
+    // + sessionN.bin — share their N regardless of which writer
+    // activates first or whether one of them never does. Sessions that
+    // log neither skip the directory scan.
+    session_n((_p->flags & (KEY_FLAG_TLOG | KEY_FLAG_BINLOG)) != 0 ?
+              next_session_n(uint32_t(_p->port2), "logs") : 0),
+    tlog_enabled((_p->flags & KEY_FLAG_TLOG) != 0),
+    binlog_enabled((_p->flags & KEY_FLAG_BINLOG) != 0),
+    accept_unsigned((_p->flags & KEY_FLAG_PASSTHROUGH) != 0),
+    // logging and user signing need every frame parsed
+    passthrough_allowed(accept_unsigned &&
+                        (_p->flags & (KEY_FLAG_TLOG | KEY_FLAG_BINLOG | KEY_FLAG_BIDI_SIGN)) == 0),
+    my_pid(getpid())
+{
+    if (binlog_enabled) {
+        // Per-entry sysid filter for SYSTEM_TIME-based reboot
+        // detection. 0 (default) accepts any sysid.
+        binlog.set_fc_sysid_filter(p->fc_sysid);
+    }
+}
+
+ProxySession::~ProxySession()
+{
+    if (!finished) {
+        finish();
+    }
+}
+
+/*
+  let the owner know this session needs servicing at the end of the
+  wakeup
+ */
+void ProxySession::notify(void)
+{
+    if (on_event && !event_pending) {
+        event_pending = true;
+        on_event(this);
+    }
+}
+
+// note I/O activity
+void ProxySession::touch(void)
+{
+    last_event_s = time_seconds();
+    notify();
+}
+
+/*
+  tlog: opened lazily on first received frame so an idle session that
+  never sees traffic doesn't leave behind an empty session file.
+ */
+void ProxySession::ensure_tlog_open(void)
+{
+    if (tlog_enabled && !tlog.is_open()) {
+        tlog.open(uint32_t(p->port2), session_n);
+    }
+}
+
+TlogWriter *ProxySession::tlog_ptr(void)
+{
+    return tlog_enabled ? &tlog : nullptr;
+}
+
+/*
+  binlog: ArduPilot bin logs over MAVLink. Activates when the first
+  REMOTE_LOG_DATA_BLOCK arrives from the user side; while enabled,
+  both REMOTE_LOG_DATA_BLOCK (184) and REMOTE_LOG_BLOCK_STATUS (185)
+  are stripped from the user→engineer forward path so the support
+  engineer's session isn't polluted by log traffic. Engineer→user
+  direction is unchanged.
+
+  Returns true if the message was consumed by binlog and the caller
+  should NOT forward it to the engineer side. BinlogWriter::handle_block
+  does its own lazy file-open, gated on seqno==0 so we don't
+  sparse-extend the file from a mid-stream seqno. observe() is called
+  on every message for SYSTEM_TIME-based reboot detection and never
+  strips.
+ */
+bool ProxySession::binlog_handle_user_msg(const mavlink_message_t &m)
+{
+    if (!binlog_enabled) {
+        return false;
+    }
+    binlog.observe(m);
+    if (m.msgid != MAVLINK_MSG_ID_REMOTE_LOG_DATA_BLOCK
+        && m.msgid != MAVLINK_MSG_ID_REMOTE_LOG_BLOCK_STATUS) {
+        return false;
+    }
+    if (m.msgid == MAVLINK_MSG_ID_REMOTE_LOG_DATA_BLOCK) {
+        binlog.handle_block(uint32_t(p->port2), session_n, m);
+    }
+    return true;  // strip from user→engineer
+}
+
+// stop watching fd, whichever of the loop or the ring has it
+void ProxySession::unwatch(int fd)
+{
+    loop.remove(fd);
+    if (uring != nullptr) {
+        uring->remove(fd);
+    }
+}
+
+void ProxySession::close_conn2(Connection2 &c2)
+{
+    if (c2.used) {
+        print_dropped(p->port2, "conn2", c2.mav);
+    }
+    if (c2.sock != -1) {
+        unwatch(c2.sock);
+    }
+    c2.close();
+}
+
+/*
+  close a conn2 slot and update the slot counts. max_conn2_count stays
+  one past the highest slot in use, as every scan relies on that
+ */
+void ProxySession::release_conn2(Connection2 &c2)
+{
+    if (!c2.used) {
+        return;
+    }
+    if (passthrough && &c2 == &conn2[passthrough_slot]) {
+        end_passthrough("engineer left");
+    }
+    close_conn2(c2);
+    if (conn2_count > 0) {
+        conn2_count--;
+    }
+    while (max_conn2_count > 0 && !conn2[max_conn2_count-1].used) {
+        max_conn2_count--;
+    }
+}
+
+// stop watching and close one of the listen_port sockets
+void ProxySession::drop_fd(int &fd)
+{
+    if (fd != -1) {
+        unwatch(fd);
+        close_fd(fd);
+    }
+}
+
+/*
+  find or create a free conn2 slot
+ */
+Connection2 *ProxySession::alloc_conn2(uint8_t &idx)
+{
+    for (idx=0; idx<conn2.size(); idx++) {
+        if (!conn2[idx].used) {
+            break;
+        }
+    }
+    if (idx == conn2.size()) {
+        if (conn2.size() >= MAX_COMM2_LINKS) {
+            return nullptr;
+        }
+        conn2.emplace_back();
+    }
+    conn2_count++;
+    max_conn2_count = MAX(max_conn2_count, uint8_t(idx+1));
+    return &conn2[idx];
+}
+
+// forward one user-side message to every engineer
+void ProxySession::forward_to_conn2(const mavlink_message_t &msg)
+{
+    // encoded and hashed once, whatever the number of engineers
+    MAVLinkFanout fanout(msg);
+    for (uint8_t i=0; i<max_conn2_count; i++) {
+        auto &c2 = conn2[i];
+        if (!c2.used) {
+            continue;
+        }
+        if (c2.is_udp) {
+            // UDP engineers are only timed out on inactivity
+            c2.mav.send_message(fanout);
+            c2.tx_msgs++;
+            continue;
+        }
+        if (!c2.mav.send_message(fanout)) {
+            release_conn2(c2);
+        } else {
+            c2.tx_msgs++;
+        }
+    }
+}
+
+/*
+  parse user-side bytes and hand each message to tlog, binlog and the
+  engineers. Parse whenever there's anywhere for the bytes to go: a
+  connected engineer (forward), tlog recording, or binlog recording.
+  Without one of those, the bytes are discarded.
+ */
+void ProxySession::handle_user_bytes(uint8_t *data, ssize_t n)
+{
+    if (conn2_count == 0 && !binlog_enabled && !tlog_enabled) {
+        return;
+    }
+    mavlink_message_t msg {};
+    uint8_t *buf0 = data;
+    while (n > 0 && mav1.receive_message(buf0, n, msg)) {
+        mav1_rx_msgs++;
+        ensure_tlog_open();
+        tlog_write_message(tlog_ptr(), msg);
+        if (binlog_handle_user_msg(msg)) {
+            continue;  // strip REMOTE_LOG_* from user→engineer
+        }
+        forward_to_conn2(msg);
+    }
+}
+
+/*
+  parse engineer bytes and forward to the user. Returns false if the
+  user link failed, which ends the session.
+ */
+bool ProxySession::handle_conn2_bytes(Connection2 &c2, uint8_t *data, ssize_t n)
+{
+    if (!have_conn1) {
+        return true;
+    }
+    mavlink_message_t msg {};
+    uint8_t *buf0 = data;
+    while (n > 0 && c2.mav.receive_message(buf0, n, msg)) {
+        c2.rx_msgs++;
+        ensure_tlog_open();
+        tlog_write_message(tlog_ptr(), msg);
+        if (!mav1.send_message(msg)) {
+            return false;
+        }
+        mav1_tx_msgs++;
+    }
+    return true;
+}
+
+/*
+  read a batch of datagrams from fd into rx. Returns the count, or -1
+  with errno set
+ */
+int ProxySession::recv_batch(int fd)
+{
+    for (unsigned i = 0; i < RX_BATCH; i++) {
+        rx.iov[i].iov_base = rx.data[i];
+        rx.iov[i].iov_len = RX_DATAGRAM;
+        memset(&rx.msgs[i].msg_hdr, 0, sizeof(rx.msgs[i].msg_hdr));
+        rx.msgs[i].msg_hdr.msg_name = &rx.from[i];
+        rx.msgs[i].msg_hdr.msg_namelen = sizeof(rx.from[i]);
+        rx.msgs[i].msg_hdr.msg_iov = &rx.iov[i];
+        rx.msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    return recvmmsg(fd, rx.msgs, RX_BATCH, MSG_DONTWAIT, nullptr);
+}
+
+/*
+  UDP user data
+ */
+void ProxySession::on_user_udp(uint32_t events)
+{
+    touch();
+    while (!finished && p->sock1_udp != -1) {
+        const int n = recv_batch(p->sock1_udp);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                finished = true;
+            }
+            return;
+        }
+        for (int i = 0; i < n && !finished && p->sock1_udp != -1; i++) {
+            user_udp_packet(rx.data[i], rx.msgs[i].msg_len, rx.from[i], rx.msgs[i].msg_hdr.msg_namelen);
+        }
+        if (n < int(RX_BATCH)) {
+            // drained; the next datagram is a new edge
+            return;
+        }
+    }
+}
+
+// sock1_udp completion from the ring
+void ProxySession::on_user_udp_data(uint8_t *data, ssize_t n, const struct sockaddr_in *from, socklen_t fromlen)
+{
+    touch();
+    if (finished) {
+        return;
+    }
+    if (n < 0) {
+        finished = true;
+        return;
+    }
+    user_udp_packet(data, n, *from, fromlen);
+}
+
+/*
+  one datagram from the user
+ */
+void ProxySession::user_udp_packet(uint8_t *data, ssize_t n, const struct sockaddr_in &from, socklen_t fromlen)
+{
+    // the user picked UDP, so stop listening for a TCP user
+    drop_fd(p->sock1_tcp);
+    if (have_conn1 && p->sock1_udp_shared &&
+        (from.sin_addr.s_addr != mav1_peer.sin_addr.s_addr || from.sin_port != mav1_peer.sin_port)) {
+        // what connect() would have filtered out
+        return;
+    }
+    last_pkt1 = time_seconds();
+    count1++;
+    if (!have_conn1) {
+        /*
+          a socket-activation listener stays shared with every later
+          reopen of port1, so connecting it would leave those deaf to
+          any other user; reply with sendto() instead
+         */
+        if (!p->sock1_udp_shared &&
+            connect(p->sock1_udp, (const struct sockaddr *)&from, fromlen) != 0) {
+            finished = true;
+            return;
+        }
+        mav1.init(p->sock1_udp, CHAN_COMM1, bidi, false, false, conn1_key_id);
+        if (p->sock1_udp_shared) {
+            mav1.set_sendto(from, fromlen);
+        }
+        mav1.set_uring(uring);
+        have_conn1 = true;
+        start_binlog_timer();
+        mav1_peer = from;
+        mav1_connected_at = time(nullptr);
+        mav1_is_tcp = false;
+        // trigger an immediate connections.tdb snapshot so the web
+        // UI sees the new conn quickly
+        last_conn_save_s = 0;
+        printf("[%d] %s have UDP conn1 for from %s\n", unsigned(p->port2), time_string(), addr_to_str(from));
+    }
+    handle_user_bytes(data, n);
+}
+
+/*
+  UDP support engineer data
+ */
+void ProxySession::on_conn2_udp(uint32_t events)
+{
+    touch();
+    while (!finished && p->sock2_udp != -1) {
+        const int n = recv_batch(p->sock2_udp);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                finished = true;
+            }
+            return;
+        }
+        for (int i = 0; i < n && !finished && p->sock2_udp != -1; i++) {
+            conn2_udp_packet(rx.data[i], rx.msgs[i].msg_len, rx.from[i], rx.msgs[i].msg_hdr.msg_namelen);
+        }
+        if (n < int(RX_BATCH)) {
+            return;
+        }
+    }
+}
+
+// sock2_udp completion from the ring
+void ProxySession::on_conn2_udp_data(uint8_t *data, ssize_t n, const struct sockaddr_in *from, socklen_t fromlen)
+{
+    touch();
+    if (finished) {
+        return;
+    }
+    if (n < 0) {
+        finished = true;
+        return;
+    }
+    conn2_udp_packet(data, n, *from, fromlen);
+}
+
+/*
+  one datagram from a support engineer
+ */
+void ProxySession::conn2_udp_packet(uint8_t *data, ssize_t n, const struct sockaddr_in &from, socklen_t fromlen)
+{
+    count2++;
+    const double now = time_seconds();
+
+    // find existing slot
+    Connection2 *c2 = nullptr;
+    for (uint8_t i=0; i<max_conn2_count; i++) {
+        auto &c = conn2[i];
+        if (c.used && c.is_udp &&
+            from.sin_addr.s_addr == c.from.sin_addr.s_addr &&
+            from.sin_port == c.from.sin_port &&
+            fromlen == c.fromlen) {
+            // found it
+            c2 = &c;
+            c2->last_pkt = now;
+            break;
+        }
+    }
+
+    if (c2 == nullptr) {
+        if (passthrough) {
+            end_passthrough("UDP engineer joined");
+        }
+        uint8_t idx;
+        c2 = alloc_conn2(idx);
+        if (c2 != nullptr) {
+            c2->from = from;
+            c2->fromlen = fromlen;
+            c2->tcp_active = true;
+            c2->sock = -1;
+            c2->is_udp = true;
+            c2->mav.init(p->sock2_udp, CHAN_COMM2(idx), true, false, false, p->port2);
+            c2->mav.set_accept_unsigned(accept_unsigned);
+            c2->mav.set_sendto(from, fromlen);
+            c2->mav.set_uring(uring);
+            c2->used = true;
+            c2->last_pkt = now;
+            if (!conn2_timer.pending()) {
+                timers.schedule(conn2_timer, IDLE_TIMEOUT_S + 0.01,
+                                [this]() { on_conn2_timer(); });
+            }
+            c2->connected_at = time(nullptr);
+            c2->rx_msgs = 0;
+            c2->tx_msgs = 0;
+            last_conn_save_s = 0;  // immediate snapshot
+            printf("[%u] %s have UDP conn2[%u] from %s\n",
+                   unsigned(p->port2), time_string(),
+                   unsigned(idx+1),
+                   addr_to_str(from));
+        }
+    }
+
+    if (c2 != nullptr && !handle_conn2_bytes(*c2, data, n)) {
+        finished = true;
+    }
+}
+
+/*
+  TCP user data, on the accepted conn1 socket
+ */
+void ProxySession::on_user_tcp(uint32_t events)
+{
+    if (passthrough) {
+        on_passthrough();
+        return;
+    }
+    if (events & ev_hangup) {
+        mav1.on_hangup();
+    } else if (events & EPOLLOUT) {
+        mav1.on_writable();
+    }
+    if (!(events & (EPOLLIN | EPOLLRDHUP | ev_hangup))) {
+        return;
+    }
+    touch();
+    while (!finished && p->sock1_tcp != -1) {
+        if (count1 == 0 && p->ws == nullptr && WebSocket::detect(p->sock1_tcp)) {
+            p->ws = new WebSocket(p->sock1_tcp);
+            mav1.set_ws(p->ws);
+            printf("[%d] %s WebSocket%s conn1\n", unsigned(p->port2), time_string(),
+                   p->ws->is_SSL()?" SSL":"");
+        }
+        if (uring != nullptr && p->ws == nullptr) {
+            // plain TCP: the ring takes the reads over from here, the
+            // loop only reports when a congested link can write again
+            loop.remove(p->sock1_tcp);
+            loop.add(p->sock1_tcp, EPOLLOUT | EPOLLET, [this](uint32_t ev) {
+                if (ev & ev_hangup) {
+                    mav1.on_hangup();
+                } else {
+                    mav1.on_writable();
+                }
+            });
+            uring->add_recv(p->sock1_tcp, false,
+                            [this](uint8_t *data, ssize_t n, const struct sockaddr_in *, socklen_t) {
+                                on_user_tcp_data(data, n);
+                            });
+            return;
+        }
+        ssize_t n;
+        uint8_t *data = buf;
+        if (p->ws) {
+            // frames are parsed where they were received
+            n = p->ws->receive(data);
+            if (n < 0) {
+                printf("[%d] %s EOF TCP conn1\n", unsigned(p->port2), time_string());
+                finished = true;
+                return;
+            }
+            if (n == 0) {
+                // all read, no complete frame left
+                return;
+            }
+        } else {
+            n = recv(p->sock1_tcp, buf, sizeof(buf)-1, 0);
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+                return;
+            }
+            if (n <= 0) {
+                printf("[%d] %s EOF TCP conn1\n", unsigned(p->port2), time_string());
+                finished = true;
+                return;
+            }
+        }
+        last_pkt1 = time_seconds();
+        count1++;
+        handle_user_bytes(data, n);
+        if (try_passthrough()) {
+            return;
+        }
+    }
+}
+
+// sock1_tcp completion from the ring
+void ProxySession::on_user_tcp_data(uint8_t *data, ssize_t n)
+{
+    touch();
+    if (finished) {
+        return;
+    }
+    if (n <= 0) {
+        printf("[%d] %s EOF TCP conn1\n", unsigned(p->port2), time_string());
+        finished = true;
+        return;
+    }
+    last_pkt1 = time_seconds();
+    count1++;
+    handle_user_bytes(data, n);
+}
+
+/*
+  TCP user new connection. Only one user is accepted; the listener is
+  replaced by the connected socket.
+ */
+void ProxySession::on_user_listen(uint32_t events)
+{
+    touch();
+    if (have_conn1 || p->sock1_tcp == -1) {
+        return;
+    }
+    struct sockaddr_in from;
+    socklen_t fromlen = sizeof(from);
+    int fd2 = accept(p->sock1_tcp, (struct sockaddr *)&from, &fromlen);
+    if (fd2 < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            finished = true;
+        }
+        return;
+    }
+    // the user picked TCP, so stop listening for a UDP user
+    drop_fd(p->sock1_udp);
+    set_tcp_options(fd2);
+    set_nonblocking(fd2);
+    drop_fd(p->sock1_tcp);
+    p->sock1_tcp = fd2;
+    have_conn1 = true;
+    start_binlog_timer();
+    mav1_peer = from;
+    mav1_connected_at = time(nullptr);
+    mav1_is_tcp = true;
+    last_conn_save_s = 0;  // immediate snapshot
+    printf("[%d] %s have TCP conn1 for from %s\n", unsigned(p->port2), time_string(), addr_to_str(from));
+    mav1.init(p->sock1_tcp, CHAN_COMM1, bidi, false, true, conn1_key_id);
+    last_pkt1 = time_seconds();
+    // registering an already-readable socket reports it straight away
+    loop.add(p->sock1_tcp, ev_inout, [this](uint32_t ev) { on_user_tcp(ev); });
+}
+
+/*
+  TCP support engineer data, one handler per conn2 slot
+ */
+void ProxySession::on_conn2_tcp(uint8_t i, uint32_t events)
+{
+    auto &c2 = conn2[i];
+    if (passthrough && i == passthrough_slot) {
+        on_passthrough();
+        return;
+    }
+    if (c2.used && (events & ev_hangup)) {
+        c2.mav.on_hangup();
+    } else if (c2.used && (events & EPOLLOUT)) {
+        c2.mav.on_writable();
+    }
+    if (!(events & (EPOLLIN | EPOLLRDHUP | ev_hangup))) {
+        return;
+    }
+    touch();
+    while (!finished && c2.used && c2.sock != -1) {
+        if (!c2.tcp_active && c2.ws == nullptr && WebSocket::detect(c2.sock)) {
+            c2.ws = new WebSocket(c2.sock);
+            c2.mav.set_ws(c2.ws);
+            printf("[%d] %s WebSocket%s conn2\n", unsigned(p->port2), time_string(), c2.ws->is_SSL()?" SSL":"");
+        }
+        if (uring != nullptr && c2.ws == nullptr) {
+            // plain TCP: the ring takes the reads over from here
+            loop.remove(c2.sock);
+            loop.add(c2.sock, EPOLLOUT | EPOLLET, [this, i](uint32_t ev) {
+                if (ev & ev_hangup) {
+                    conn2[i].mav.on_hangup();
+                } else {
+                    conn2[i].mav.on_writable();
+                }
+            });
+            uring->add_recv(c2.sock, false,
+                            [this, i](uint8_t *data, ssize_t n, const struct sockaddr_in *, socklen_t) {
+                                on_conn2_tcp_data(i, data, n);
+                            });
+            return;
+        }
+        ssize_t n;
+        uint8_t *data = buf;
+        if (c2.ws) {
+            n = c2.ws->receive(data);
+            if (n == 0) {
+                // all read, no complete frame left
+                return;
+            }
+        } else {
+            n = recv(c2.sock, buf, sizeof(buf)-1, 0);
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+                return;
+            }
+        }
+        if (n <= 0) {
+            printf("[%d] %s EOF TCP conn2[%u]\n", unsigned(p->port2), time_string(), unsigned(i+1));
+            release_conn2(c2);
+            return;
+        }
+        count2++;
+        c2.tcp_active = true;
+        if (!handle_conn2_bytes(c2, data, n)) {
+            finished = true;
+            return;
+        }
+        if (try_passthrough()) {
+            return;
+        }
+    }
+}
+
+// conn2[i] TCP completion from the ring
+void ProxySession::on_conn2_tcp_data(uint8_t i, uint8_t *data, ssize_t n)
+{
+    touch();
+    auto &c2 = conn2[i];
+    if (finished || !c2.used) {
+        return;
+    }
+    if (n <= 0) {
+        printf("[%d] %s EOF TCP conn2[%u]\n", unsigned(p->port2), time_string(), unsigned(i+1));
+        release_conn2(c2);
+        return;
+    }
+    count2++;
+    c2.tcp_active = true;
+    if (!handle_conn2_bytes(c2, data, n)) {
+        finished = true;
+    }
+}
+
+/*
+  new TCP support engineer connections
+ */
+void ProxySession::on_conn2_listen(uint32_t events)
+{
+    touch();
+    while (!finished && p->sock2_listen != -1) {
+        struct sockaddr_in from;
+        socklen_t fromlen = sizeof(from);
+        int fd2 = accept(p->sock2_listen, (struct sockaddr *)&from, &fromlen);
+        if (fd2 < 0) {
+            return;
+        }
+        if (conn2_count >= MAX_COMM2_LINKS) {
+            close(fd2);
+            continue;
+        }
+
+        set_tcp_options(fd2);
+        set_nonblocking(fd2);
+        if (passthrough) {
+            end_passthrough("another engineer joined");
+        }
+
+        uint8_t i;
+        auto *c2 = alloc_conn2(i);
+        if (c2 == nullptr) {
+            printf("[%d] %s too many TCP connections BUG: max %u\n", unsigned(p->port2), time_string(), unsigned(MAX_COMM2_LINKS));
+            close(fd2);
+            continue;
+        }
+        c2->sock = fd2;
+        c2->tcp_active = false;
+        c2->used = true;
+        c2->is_udp = false;
+        c2->from = from;
+        c2->fromlen = fromlen;
+        c2->connected_at = time(nullptr);
+        c2->rx_msgs = 0;
+        c2->tx_msgs = 0;
+        last_conn_save_s = 0;  // immediate snapshot
+        printf("[%d] %s have TCP conn2[%u] for from %s\n", unsigned(p->port2), time_string(), unsigned(i+1), addr_to_str(from));
+        c2->mav.init(c2->sock, CHAN_COMM2(i), true, true, true, p->port2);
+        c2->mav.set_accept_unsigned(accept_unsigned);
+        loop.add(c2->sock, ev_inout, [this, i](uint32_t ev) { on_conn2_tcp(i, ev); });
+    }
+}
+
+/*
+  pass-through: the user and a single engineer, both on plain TCP,
+  are relayed by the kernel with splice() through a pipe each way, so
+  their bytes never come up to user space. Both links are parsed as
+  usual until then, which is how WebSocket and signing engineers are
+  told apart. The switch waits until both parsers are between frames
+  and nothing is queued, so no frame is cut in two. Any other engineer
+  joining, or this one leaving, ends it
+ */
+bool ProxySession::try_passthrough(void)
+{
+    if (!passthrough_allowed || passthrough || finished || uring != nullptr ||
+        !have_conn1 || !mav1_is_tcp || p->ws != nullptr || count1 == 0 ||
+        conn2_count != 1) {
+        return false;
+    }
+    uint8_t i = 0;
+    while (i < max_conn2_count && !conn2[i].used) {
+        i++;
+    }
+    auto &c2 = conn2[i];
+    if (c2.is_udp || c2.ws != nullptr || !c2.tcp_active || c2.mav.saw_signed() ||
+        !c2.mav.between_frames() || !mav1.between_frames()) {
+        return false;
+    }
+    int up[2], down[2];
+    if (pipe2(up, O_NONBLOCK | O_CLOEXEC) != 0) {
+        return false;
+    }
+    if (pipe2(down, O_NONBLOCK | O_CLOEXEC) != 0) {
+        close(up[0]);
+        close(up[1]);
+        return false;
+    }
+    to_conn2 = SplicePipe { up[0], up[1], 0 };
+    to_conn1 = SplicePipe { down[0], down[1], 0 };
+    passthrough = true;
+    passthrough_slot = i;
+    printf("[%d] %s pass-through conn1 <-> conn2[%u]\n", unsigned(p->port2), time_string(), unsigned(i+1));
+    // the readiness edges that brought us here are used up
+    on_passthrough();
+    return true;
+}
+
+/*
+  move what src has to dst through pp, until src has nothing more or
+  dst is full. dst reporting EPOLLOUT brings us back for the rest
+ */
+ProxySession::RelayResult ProxySession::splice_relay(int src, SplicePipe &pp, int dst, bool &moved)
+{
+    while (true) {
+        while (pp.len > 0) {
+            const ssize_t n = splice(pp.rd, nullptr, dst, nullptr, pp.len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return errno == EAGAIN ? RELAY_OK : RELAY_DST_FAILED;
+            }
+            pp.len -= n;
+        }
+        const ssize_t n = splice(src, nullptr, pp.wr, nullptr, sizeof(buf), SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && errno == EAGAIN) {
+            return RELAY_OK;
+        }
+        if (n <= 0) {
+            return RELAY_SRC_DONE;
+        }
+        pp.len += n;
+        moved = true;
+    }
+}
+
+// either socket of a pass-through pair is ready
+void ProxySession::on_passthrough(void)
+{
+    touch();
+    auto &c2 = conn2[passthrough_slot];
+    bool moved1 = false, moved2 = false;
+    const auto up = splice_relay(p->sock1_tcp, to_conn2, c2.sock, moved1);
+    const auto down = up == RELAY_OK ? splice_relay(c2.sock, to_conn1, p->sock1_tcp, moved2) : RELAY_OK;
+    if (moved1) {
+        last_pkt1 = time_seconds();
+        count1++;
+    }
+    if (moved2) {
+        count2++;
+    }
+    if (up == RELAY_SRC_DONE || down == RELAY_DST_FAILED) {
+        printf("[%d] %s EOF TCP conn1\n", unsigned(p->port2), time_string());
+        finished = true;
+        return;
+    }
+    if (up == RELAY_DST_FAILED || down == RELAY_SRC_DONE) {
+        printf("[%d] %s EOF TCP conn2[%u]\n", unsigned(p->port2), time_string(), unsigned(passthrough_slot+1));
+        release_conn2(c2);
+    }
+}
+
+/*
+  back to parsing, with why printed. What is still in the pipes is
+  sent on if the socket takes it, and otherwise goes through the
+  parsers, which find the next frame; a frame cut by the switch is
+  lost, as on any reconnect. why is nullptr when the session ends
+ */
+void ProxySession::end_passthrough(const char *why)
+{
+    passthrough = false;
+    auto &c2 = conn2[passthrough_slot];
+    struct Leftover {
+        SplicePipe &pp;
+        int dst;
+        bool from_user;
+    } leftovers[] {
+        { to_conn2, c2.sock, true },
+        { to_conn1, p->sock1_tcp, false },
+    };
+    for (auto &l : leftovers) {
+        while (why != nullptr && l.pp.len > 0 && l.dst != -1) {
+            const ssize_t n = splice(l.pp.rd, nullptr, l.dst, nullptr, l.pp.len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n <= 0) {
+                break;
+            }
+            l.pp.len -= n;
+        }
+        while (why != nullptr && l.pp.len > 0) {
+            const ssize_t n = read(l.pp.rd, buf, sizeof(buf));
+            if (n <= 0) {
+                break;
+            }
+            l.pp.len -= n;
+            if (l.from_user) {
+                handle_user_bytes(buf, n);
+            } else if (c2.used && !handle_conn2_bytes(c2, buf, n)) {
+                finished = true;
+            }
+        }
+        close(l.pp.rd);
+        close(l.pp.wr);
+        l.pp = SplicePipe {};
+    }
+    if (why == nullptr) {
+        return;
+    }
+    printf("[%d] %s pass-through ended: %s\n", unsigned(p->port2), time_string(), why);
+    // have the loop report whatever is waiting, as its edges were used up
+    for (int fd : { p->sock1_tcp, c2.sock }) {
+        if (fd != -1) {
+            loop.modify(fd, ev_inout);
+        }
+    }
+}
+
+bool ProxySession::start(void)
+{
+    if (!loop.ok() || !timers.ok()) {
+        return false;
+    }
+    // the listeners were opened blocking; we drain until EAGAIN
+    const int listeners[] { p->sock1_udp, p->sock2_udp, p->sock1_tcp, p->sock2_listen };
+    for (int fd : listeners) {
+        if (fd != -1) {
+            set_nonblocking(fd);
+        }
+    }
+    if (uring != nullptr) {
+        if (p->sock1_udp != -1) {
+            uring->add_recv(p->sock1_udp, true,
+                            [this](uint8_t *data, ssize_t n, const struct sockaddr_in *from, socklen_t fromlen) {
+                                on_user_udp_data(data, n, from, fromlen);
+                            });
+        }
+        if (p->sock2_udp != -1) {
+            uring->add_recv(p->sock2_udp, true,
+                            [this](uint8_t *data, ssize_t n, const struct sockaddr_in *from, socklen_t fromlen) {
+                                on_conn2_udp_data(data, n, from, fromlen);
+                            });
+        }
+    } else {
+        if (p->sock1_udp != -1) {
+            loop.add(p->sock1_udp, ev_in, [this](uint32_t ev) { on_user_udp(ev); });
+        }
+        if (p->sock2_udp != -1) {
+            loop.add(p->sock2_udp, ev_in, [this](uint32_t ev) { on_conn2_udp(ev); });
+        }
+    }
+    if (p->sock1_tcp != -1) {
+        loop.add(p->sock1_tcp, ev_in, [this](uint32_t ev) { on_user_listen(ev); });
+    }
+    if (p->sock2_listen != -1) {
+        loop.add(p->sock2_listen, ev_in, [this](uint32_t ev) { on_conn2_listen(ev); });
+    }
+    timers.schedule(idle_timer, IDLE_TIMEOUT_S, [this]() { on_idle_timer(); });
+    timers.schedule(snapshot_timer, SNAPSHOT_INTERVAL_S, [this]() { on_snapshot_timer(); });
+    return true;
+}
+
+bool ProxySession::idle(double now) const
+{
+    if (have_conn1 && now - last_pkt1 > IDLE_TIMEOUT_S) {
+        return true;
+    }
+    return now - last_event_s > IDLE_TIMEOUT_S;
+}
+
+/*
+  Traffic only moves last_event_s / last_pkt1 forward, so rather than
+  rescheduling on every packet the timer fires at the earliest time
+  the session could have gone idle, and is pushed back if it hasn't
+ */
+void ProxySession::on_idle_timer(void)
+{
+    const double now = time_seconds();
+    if (idle(now)) {
+        finished = true;
+        notify();
+        return;
+    }
+    double due = last_event_s;
+    if (have_conn1 && last_pkt1 < due) {
+        due = last_pkt1;
+    }
+    // just past the deadline, as idle() wants it exceeded
+    timers.schedule(idle_timer, due + IDLE_TIMEOUT_S - now + 0.01,
+                    [this]() { on_idle_timer(); });
+}
+
+/*
+  drop UDP engineers we haven't heard from, then wait for the next one
+  that could time out
+ */
+void ProxySession::on_conn2_timer(void)
+{
+    const double now = time_seconds();
+    double oldest = 0;
+    for (uint8_t i=0; i<max_conn2_count; i++) {
+        auto &c2 = conn2[i];
+        if (!c2.used || !c2.is_udp) {
+            continue;
+        }
+        if (now - c2.last_pkt > IDLE_TIMEOUT_S) {
+            printf("[%d] %s dead UDP conn2[%u]\n",
+                   unsigned(p->port2), time_string(),
+                   unsigned(i));
+            release_conn2(c2);
+            notify();
+            continue;
+        }
+        if (oldest == 0 || c2.last_pkt < oldest) {
+            oldest = c2.last_pkt;
+        }
+    }
+    if (oldest != 0) {
+        timers.schedule(conn2_timer, oldest + IDLE_TIMEOUT_S - now + 0.01,
+                        [this]() { on_conn2_timer(); });
+    }
+}
+
+/*
+  keep the binlog START / NACK retries going while the vehicle is
+  quiet
+ */
+void ProxySession::on_binlog_timer(void)
+{
+    if (!binlog_enabled || !have_conn1 || finished) {
+        return;
+    }
+    binlog.tick(mav1);
+    start_binlog_timer();
+}
+
+void ProxySession::start_binlog_timer(void)
+{
+    if (binlog_enabled) {
+        timers.schedule(binlog_timer, BinlogWriter::TICK_S,
+                        [this]() { on_binlog_timer(); });
+    }
+}
+
+void ProxySession::on_snapshot_timer(void)
+{
+    // the owner writes it along with those of the other sessions
+    notify();
+    timers.schedule(snapshot_timer, SNAPSHOT_INTERVAL_S,
+                    [this]() { on_snapshot_timer(); });
+}
+
+void ProxySession::service(double now)
+{
+    event_pending = false;
+
+    if (max_conn2_count > MAX_COMM2_LINKS) {
+        printf("BUG: max_conn2_count=%d\n", int(max_conn2_count));
+        exit(1);
+    }
+
+    // Pump binlog state: before the first DATA_BLOCK this emits the
+    // magic START to nudge the vehicle into streaming (and to make
+    // its pre-arm logging check pass); afterwards it drains pending
+    // ACKs / NACKs. Needs to fire whenever binlog is enabled, not
+    // just when the file is open, since the START phase predates
+    // the file.
+    if (binlog_enabled && have_conn1) {
+        binlog.tick(mav1);
+    }
+}
+
+/*
+  drop one connection (0 is the user, which ends the session)
+ */
+void ProxySession::drop(int idx)
+{
+    if (idx == 0) {
+        printf("[%d] %s drop user requested -> ending session\n",
+               p->port2, time_string());
+        finished = true;
+    } else if (idx >= 1 && idx <= int(conn2.size())) {
+        auto &c2 = conn2[idx - 1];
+        if (c2.used) {
+            printf("[%d] %s drop conn2[%d] requested\n",
+                   p->port2, time_string(), idx - 1);
+            release_conn2(c2);
+        }
+    }
+}
+
+/*
+  Heartbeat snapshot of live connections to connections.tdb, throttled
+  to 5s. New connections reset the throttle so the web UI sees them
+  quickly; its http-equiv refresh runs at the same cadence.
+ */
+bool ProxySession::snapshot_due(double now) const
+{
+    return now - last_conn_save_s >= SNAPSHOT_INTERVAL_S;
+}
+
+void ProxySession::snapshot(std::vector<struct ConnEntry> &entries, double now)
+{
+    last_conn_save_s = now;
+    time_t now_t = time(nullptr);
+    if (have_conn1) {
+        struct ConnEntry e {};
+        e.magic = CONN_MAGIC;
+        e.connected_at = mav1_connected_at;
+        e.last_update = now_t;
+        e.port2 = p->port2;
+        e.conn_index = 0;
+        e.pid = my_pid;
+        e.rx_msgs = mav1_rx_msgs;
+        e.tx_msgs = mav1_tx_msgs;
+        e.peer_ip_be = mav1_peer.sin_addr.s_addr;
+        e.peer_port_be = mav1_peer.sin_port;
+        if (p->ws) {
+            e.transport = p->ws->is_SSL() ? CONN_TRANSPORT_WSS : CONN_TRANSPORT_WS;
+        } else {
+            e.transport = mav1_is_tcp ? CONN_TRANSPORT_TCP : CONN_TRANSPORT_UDP;
+        }
+        e.is_user = 1;
+        entries.push_back(e);
+    }
+    for (uint8_t i = 0; i < max_conn2_count; i++) {
+        const auto &c2 = conn2[i];
+        if (!c2.used) {
+            continue;
+        }
+        struct ConnEntry e {};
+        e.magic = CONN_MAGIC;
+        e.connected_at = c2.connected_at;
+        e.last_update = now_t;
+        e.port2 = p->port2;
+        e.conn_index = i + 1;
+        e.pid = my_pid;
+        e.rx_msgs = c2.rx_msgs;
+        e.tx_msgs = c2.tx_msgs;
+        e.peer_ip_be = c2.from.sin_addr.s_addr;
+        e.peer_port_be = c2.from.sin_port;
+        if (c2.is_udp) {
+            e.transport = CONN_TRANSPORT_UDP;
+        } else if (c2.ws) {
+            e.transport = c2.ws->is_SSL() ? CONN_TRANSPORT_WSS : CONN_TRANSPORT_WS;
+        } else {
+            e.transport = CONN_TRANSPORT_TCP;
+        }
+        e.is_user = 0;
+        entries.push_back(e);
+    }
+}
+
+void ProxySession::save_snapshots(const std::vector<ProxySession *> &sessions, double now)
+{
+    if (sessions.empty()) {
+        return;
+    }
+    std::vector<int> port2s;
+    std::vector<struct ConnEntry> entries;
+    for (auto *s : sessions) {
+        port2s.push_back(s->port2());
+        s->snapshot(entries, now);
+    }
+    db_writer_post([port2s, entries]() { conn_replace(port2s, entries); });
+}
+
+void ProxySession::finish(void)
+{
+    finished = true;
+    timers.cancel(idle_timer);
+    timers.cancel(conn2_timer);
+    timers.cancel(binlog_timer);
+    timers.cancel(snapshot_timer);
+    // sends may still be queued for the sockets closed below
+    UDPSendBatch::flush();
+    for (auto &c2 : conn2) {
+        close_conn2(c2);
+    }
+    conn2_count = 0;
+    max_conn2_count = 0;
+    if (passthrough) {
+        end_passthrough(nullptr);
+    }
+    mav1.finish_output();
+    print_dropped(p->port2, "conn1", mav1);
+    delete p->ws;
+    p->ws = nullptr;
+    drop_fd(p->sock1_udp);
+    drop_fd(p->sock2_udp);
+    drop_fd(p->sock1_tcp);
+    drop_fd(p->sock2_listen);
+    tlog.close();
+    binlog.close();
+
+    MAVLink::flush_signing_timestamps();
+
+    if (count1 == 0 && count2 == 0) {
+        return;
+    }
+    printf("[%d] %s Closed connection count1=%u count2=%u\n",
+           p->port2,
+           time_string(),
+           unsigned(count1),
+           unsigned(count2));
+    // update database, from the writer thread
+    const int port2 = p->port2;
+    const uint32_t c1 = count1, c2 = count2;
+    db_writer_post([port2, c1, c2]() {
+        auto *db = db_open_transaction();
+        if (db == nullptr) {
+            return;
+        }
+        struct KeyEntry ke;
+        if (db_load_key(db, port2, ke)) {
+            ke.count1 += c1;
+            ke.count2 += c2;
+            ke.connections++;
+            db_save_key(db, port2, ke);
+            db_close_commit(db);
+        } else {
+            db_close_cancel(db);
+        }
+    });
+}
@@ -0,0 +1,226 @@
+/*
+  one proxy session: the user (conn1) and support engineer (conn2)
+  links of a single port pair
+
+  The session registers its sockets with an EventLoop it is given, so
+  it runs the same way whether it owns a forked child's loop or shares
+  a reactor thread's loop with the other sessions of that thread.
+  Timeouts and periodic work run from timers on the TimerWheel of that
+  loop rather than on the next packet.
+ */
+#pragma once
+
+#include "mavlink.h"
+#include "listenport.h"
+#include "eventloop.h"
+#include "conntdb.h"
+#include "tlog.h"
+#include "binlog.h"
+#include "timerwheel.h"
+
+#include <deque>
+#include <functional>
+#include <vector>
+
+class Connection2 {
+public:
+    int sock = -1;
+    bool used = false;
+    bool tcp_active = false;
+    MAVLink mav;
+    WebSocket *ws = nullptr;
+    struct sockaddr_in from;
+    socklen_t fromlen = 0;
+    bool is_udp = false;
+    double last_pkt = 0;
+    // for connections.tdb visibility
+    time_t connected_at = 0;
+    uint32_t rx_msgs = 0;
+    uint32_t tx_msgs = 0;
+
+    void close(void);
+};
+
+class UringIO;
+
+class ProxySession {
+public:
+    typedef std::function<void(ProxySession *)> notify_t;
+
+    /*
+      take over the listening sockets of p. keys.tdb and
+      connections.tdb writes go to the writer thread (dbwriter.h), so
+      they never block the loop. on_event, if set, is called (once until service() runs) when a
+      handler has done I/O, so the owner can service just the sessions
+      that were active in a wakeup.
+     */
+    ProxySession(struct listen_port *p, EventLoop &loop, TimerWheel &timers, notify_t on_event = nullptr);
+    ~ProxySession();
+    ProxySession(const ProxySession &) = delete;
+    ProxySession &operator=(const ProxySession &) = delete;
+
+    /*
+      receive (and send UDP) through u instead of the loop where the
+      socket allows it. Call before start()
+     */
+    void set_uring(UringIO *u) { uring = u; }
+
+    // register the listening sockets. Returns false on failure
+    bool start(void);
+
+    bool done(void) const { return finished; }
+    int port2(void) const { return p->port2; }
+    struct listen_port *port(void) const { return p; }
+
+    // true if the session has had no traffic for too long
+    bool idle(double now) const;
+
+    // work after a wakeup with I/O: binlog pumping
+    void service(double now);
+
+    // drop one connection on request from the web admin
+    void drop(int conn_index);
+
+    // connections.tdb heartbeat. A timer notifies the owner when one
+    // is due
+    bool snapshot_due(double now) const;
+    void snapshot(std::vector<struct ConnEntry> &entries, double now);
+
+    /*
+      deregister and close every socket of the session, including the
+      listen_port ones, and record the session in keys.tdb
+     */
+    void finish(void);
+
+    /*
+      write one connections.tdb snapshot covering every session given,
+      from the writer thread so we don't block on disk I/O
+     */
+    static void save_snapshots(const std::vector<ProxySession *> &sessions, double now);
+
+private:
+    struct listen_port *p;
+    EventLoop &loop;
+    TimerWheel &timers;
+    notify_t on_event;
+    UringIO *uring = nullptr;
+    bool event_pending = false;
+    bool finished = false;
+
+    bool have_conn1 = false;
+    double last_pkt1 = 0;
+    double last_event_s;
+    uint32_t count1 = 0, count2 = 0;
+
+    // bidi-sign: enforce signing on the user side too. mav1 then loads the
+    // same key keys.tdb stores for the engineer side, so unsigned and
+    // wrong-key user packets are rejected before being forwarded.
+    const bool bidi;
+    const int conn1_key_id;
+
+    /*
+      we allow more than one connection on the support engineer side.
+      Slots are created on first use (a deque keeps references stable
+      as it grows) so an idle session stays small
+     */
+    uint8_t max_conn2_count = 0;
+    uint8_t conn2_count = 0;
+    MAVLink mav1;
+    std::deque<Connection2> conn2;
+
+    const unsigned session_n;
+    TlogWriter tlog;
+    const bool tlog_enabled;
+    BinlogWriter binlog;
+    const bool binlog_enabled;
+
+    /*
+      KEY_FLAG_PASSTHROUGH: engineers need not sign, and a plain TCP
+      user with a single plain TCP engineer is relayed with splice(),
+      see try_passthrough()
+     */
+    const bool accept_unsigned;
+    const bool passthrough_allowed;
+    bool passthrough = false;
+    uint8_t passthrough_slot = 0;
+    struct SplicePipe {
+        int rd = -1;
+        int wr = -1;
+        // bytes in the pipe
+        size_t len = 0;
+    };
+    SplicePipe to_conn1, to_conn2;
+    enum RelayResult { RELAY_OK, RELAY_SRC_DONE, RELAY_DST_FAILED };
+    RelayResult splice_relay(int src, SplicePipe &pp, int dst, bool &moved);
+    bool try_passthrough(void);
+    void on_passthrough(void);
+    void end_passthrough(const char *why);
+
+    // live state mirrored into connections.tdb
+    struct sockaddr_in mav1_peer {};
+    time_t mav1_connected_at = 0;
+    uint32_t mav1_rx_msgs = 0, mav1_tx_msgs = 0;
+    bool mav1_is_tcp = false;
+    double last_conn_save_s = 0;
+    const pid_t my_pid;
+
+    // receive buffer, shared by every session on the thread
+    static thread_local unsigned char buf[10240];
+
+    /*
+      datagrams are read up to RX_BATCH at a time with recvmmsg(),
+      into buffers shared by every session on the thread
+     */
+    static constexpr unsigned RX_BATCH = 32;
+    static constexpr unsigned RX_DATAGRAM = 4096;
+    struct RxBatch {
+        struct mmsghdr msgs[RX_BATCH];
+        struct iovec iov[RX_BATCH];
+        struct sockaddr_in from[RX_BATCH];
+        uint8_t data[RX_BATCH][RX_DATAGRAM];
+    };
+    static thread_local RxBatch rx;
+    int recv_batch(int fd);
+
+    // session end on inactivity, dead UDP engineers, binlog START and
+    // NACK retries, connections.tdb heartbeat
+    Timer idle_timer;
+    Timer conn2_timer;
+    Timer binlog_timer;
+    Timer snapshot_timer;
+    void on_idle_timer(void);
+    void on_conn2_timer(void);
+    void on_binlog_timer(void);
+    void on_snapshot_timer(void);
+    void start_binlog_timer(void);
+
+    void notify(void);
+    void touch(void);
+    void unwatch(int fd);
+    void ensure_tlog_open(void);
+    TlogWriter *tlog_ptr(void);
+    bool binlog_handle_user_msg(const mavlink_message_t &m);
+    void close_conn2(Connection2 &c2);
+    void release_conn2(Connection2 &c2);
+    void drop_fd(int &fd);
+    Connection2 *alloc_conn2(uint8_t &idx);
+    void forward_to_conn2(const mavlink_message_t &msg);
+    void handle_user_bytes(uint8_t *data, ssize_t n);
+    bool handle_conn2_bytes(Connection2 &c2, uint8_t *data, ssize_t n);
+    void user_udp_packet(uint8_t *data, ssize_t n, const struct sockaddr_in &from, socklen_t fromlen);
+    void conn2_udp_packet(uint8_t *data, ssize_t n, const struct sockaddr_in &from, socklen_t fromlen);
+
+    // readiness handlers (EventLoop)
+    void on_user_udp(uint32_t events);
+    void on_conn2_udp(uint32_t events);
+    void on_user_tcp(uint32_t events);
+    void on_user_listen(uint32_t events);
+    void on_conn2_tcp(uint8_t i, uint32_t events);
+    void on_conn2_listen(uint32_t events);
+
+    // completion handlers (UringIO)
+    void on_user_udp_data(uint8_t *data, ssize_t n, const struct sockaddr_in *from, socklen_t fromlen);
+    void on_conn2_udp_data(uint8_t *data, ssize_t n, const struct sockaddr_in *from, socklen_t fromlen);
+    void on_user_tcp_data(uint8_t *data, ssize_t n);
+    void on_conn2_tcp_data(uint8_t i, uint8_t *data, ssize_t n);
+};
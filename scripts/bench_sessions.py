@@ -0,0 +1,229 @@
+#!/usr/bin/env python3
+"""
+Compare the resource cost of many concurrent sessions with one child
+per port pair (the default) and with all sessions in one process (-r).
+
+Creates a scratch keys.tdb with N port pairs, starts supportproxy in
+each mode, and for every pair runs a UDP user sending MAVLink2
+HEARTBEATs at --rate Hz plus a UDP engineer that the proxy forwards
+them to. After --duration seconds it reports the total memory (PSS)
+and CPU time of supportproxy and all its children.
+
+With --syscalls supportproxy runs under strace -f -c and the total
+syscall count is reported too (strace adds a lot of overhead, so
+compare CPU times from runs without it).
+
+  ./scripts/bench_sessions.py --sessions 200 --duration 20
+  ./scripts/bench_sessions.py --uring --syscalls
+"""
+import argparse
+import os
+import selectors
+import signal
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+
+REPO_ROOT = os.path.abspath(os.path.join(os.path.dirname(__file__), os.pardir))
+sys.path.insert(0, REPO_ROOT)
+
+import keydb_lib  # noqa: E402
+
+HEARTBEAT_CRC_EXTRA = 50
+
+
+def x25_crc(data, crc=0xffff):
+    for b in data:
+        tmp = b ^ (crc & 0xff)
+        tmp = (tmp ^ (tmp << 4)) & 0xff
+        crc = ((crc >> 8) ^ (tmp << 8) ^ (tmp << 3) ^ (tmp >> 4)) & 0xffff
+    return crc
+
+
+def heartbeat_frame(seq, sysid=1, compid=1):
+    """unsigned MAVLink2 HEARTBEAT. mavlink_version is last and non-zero,
+    so no payload trimming applies"""
+    payload = struct.pack('<IBBBBB', 0, 2, 3, 0, 4, 3)
+    # len, incompat_flags, compat_flags, seq, sysid, compid, msgid (24 bit)
+    header = bytes([len(payload), 0, 0, seq & 0xff, sysid, compid, 0, 0, 0])
+    crc = x25_crc(header + payload)
+    crc = x25_crc(bytes([HEARTBEAT_CRC_EXTRA]), crc)
+    return bytes([0xfd]) + header + payload + struct.pack('<H', crc)
+
+
+def make_db(workdir, base_port, sessions):
+    db = keydb_lib.init_db(os.path.join(workdir, 'keys.tdb'))
+    db.transaction_start()
+    pairs = []
+    for i in range(sessions):
+        port1 = base_port + 2 * i
+        port2 = port1 + 1
+        keydb_lib.add_entry(db, port1, port2, 'bench%d' % i, 'bench')
+        pairs.append((port1, port2))
+    db.transaction_prepare_commit()
+    db.transaction_commit()
+    db.close()
+    return pairs
+
+
+def process_tree(pid):
+    """pid and all its descendants"""
+    children = {}
+    for d in os.listdir('/proc'):
+        if not d.isdigit():
+            continue
+        try:
+            with open('/proc/%s/stat' % d) as f:
+                fields = f.read().rsplit(')', 1)[1].split()
+        except OSError:
+            continue
+        children.setdefault(int(fields[1]), []).append(int(d))
+    out = []
+    todo = [pid]
+    while todo:
+        p = todo.pop()
+        out.append(p)
+        todo.extend(children.get(p, []))
+    return out
+
+
+def memory_kib(pid):
+    """proportional set size, so pages a forked child still shares with
+    the parent are not counted twice. Falls back to VmRSS"""
+    try:
+        with open('/proc/%d/smaps_rollup' % pid) as f:
+            for line in f:
+                if line.startswith('Pss:'):
+                    return int(line.split()[1])
+    except OSError:
+        pass
+    with open('/proc/%d/status' % pid) as f:
+        for line in f:
+            if line.startswith('VmRSS:'):
+                return int(line.split()[1])
+    return 0
+
+
+def usage(pids):
+    """total memory in KiB and CPU seconds over pids"""
+    tick = os.sysconf('SC_CLK_TCK')
+    rss = 0
+    cpu = 0.0
+    for p in pids:
+        try:
+            rss += memory_kib(p)
+            with open('/proc/%d/stat' % p) as f:
+                fields = f.read().rsplit(')', 1)[1].split()
+            cpu += (int(fields[11]) + int(fields[12])) / tick
+        except OSError:
+            pass
+    return rss, cpu
+
+
+def strace_total(path):
+    """total calls from an strace -c summary"""
+    with open(path) as f:
+        for line in f:
+            fields = line.split()
+            if fields and fields[-1] == 'total':
+                # % time, seconds, usecs/call, calls, [errors,] total
+                return int(fields[3])
+    return 0
+
+
+def run(binary, args, workdir, pairs, rate, duration, syscalls):
+    cmd = [binary] + args
+    strace_out = os.path.join(workdir, 'strace.txt')
+    if syscalls:
+        cmd = ['strace', '-f', '-c', '-o', strace_out] + cmd
+    proc = subprocess.Popen(cmd, cwd=workdir,
+                            stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    time.sleep(2)
+    sel = selectors.DefaultSelector()
+    links = []
+    for port1, port2 in pairs:
+        user = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        user.connect(('127.0.0.1', port1))
+        eng = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        eng.connect(('127.0.0.1', port2))
+        eng.setblocking(False)
+        sel.register(eng, selectors.EVENT_READ)
+        links.append((user, eng))
+
+    received = 0
+    seq = 0
+    start = time.time()
+    next_send = start
+    while time.time() - start < duration:
+        now = time.time()
+        if now >= next_send:
+            frame = heartbeat_frame(seq)
+            seq += 1
+            for user, eng in links:
+                user.send(frame)
+                # the engineer must keep talking or the proxy times it out
+                eng.send(frame)
+            next_send += 1.0 / rate
+        for key, _ in sel.select(timeout=max(0.0, next_send - time.time())):
+            try:
+                while True:
+                    key.fileobj.recv(2048)
+                    received += 1
+            except BlockingIOError:
+                pass
+
+    pids = process_tree(proc.pid)
+    if syscalls:
+        # the tracer is not part of the proxy
+        pids = pids[1:]
+    rss, cpu = usage(pids)
+    # stop the whole tree: the log cleanup child would outlive the
+    # parent, and strace only writes its summary once every tracee exits
+    for p in pids:
+        try:
+            os.kill(p, signal.SIGTERM)
+        except OSError:
+            pass
+    proc.wait()
+    for user, eng in links:
+        user.close()
+        eng.close()
+    nsyscalls = strace_total(strace_out) if syscalls else 0
+    return len(pids), rss, cpu, received, nsyscalls
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--binary', default=os.path.join(REPO_ROOT, 'supportproxy'))
+    parser.add_argument('--sessions', type=int, default=100)
+    parser.add_argument('--base-port', type=int, default=30000)
+    parser.add_argument('--rate', type=float, default=4.0, help='heartbeats/s per link')
+    parser.add_argument('--duration', type=float, default=15.0)
+    parser.add_argument('--threads', type=int, default=1, help='reactor threads (-t)')
+    parser.add_argument('--uring', action='store_true', help='add a reactor run with -u')
+    parser.add_argument('--syscalls', action='store_true', help='count syscalls with strace')
+    args = parser.parse_args()
+
+    modes = [('fork', []), ('reactor', ['-t', str(args.threads)])]
+    if args.uring:
+        modes.append(('uring', ['-t', str(args.threads), '-u']))
+
+    print("%-10s %6s %10s %10s %10s %10s %10s" %
+          ('mode', 'procs', 'PSS MiB', 'KiB/sess', 'CPU s', 'fwd msgs', 'syscalls'))
+    for mode, extra in modes:
+        with tempfile.TemporaryDirectory() as workdir:
+            pairs = make_db(workdir, args.base_port, args.sessions)
+            nprocs, rss, cpu, received, nsyscalls = run(args.binary, extra, workdir, pairs,
+                                                        args.rate, args.duration,
+                                                        args.syscalls)
+            print("%-10s %6d %10.1f %10.1f %10.2f %10d %10d" %
+                  (mode, nprocs, rss / 1024.0, rss / float(args.sessions),
+                   cpu, received, nsyscalls))
+
+
+if __name__ == '__main__':
+    main()
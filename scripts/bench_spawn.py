@@ -0,0 +1,54 @@
+#!/usr/bin/env python3
+"""
+Measure session spawn time against the number of configured port
+pairs, in the default fork-per-session mode.
+
+For each entry count a scratch keys.tdb is created with that many
+idle port pairs (four listening sockets each) plus --trials pairs that
+are used once each; the time from the first datagram on a pair to its
+first forwarded HEARTBEAT is reported as in bench_startup.py. With
+spawn cost independent of the entry count the columns stay flat.
+
+  ./scripts/bench_spawn.py --counts 100,1000,5000,10000
+"""
+import argparse
+import os
+import resource
+import sys
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+
+import bench_sessions  # noqa: E402
+import bench_startup  # noqa: E402
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--binary', default=os.path.join(bench_sessions.REPO_ROOT, 'supportproxy'))
+    parser.add_argument('--counts', default='100,1000,5000,10000')
+    parser.add_argument('--trials', type=int, default=20)
+    parser.add_argument('--base-port', type=int, default=20000)
+    args = parser.parse_args()
+
+    # four sockets per entry; supportproxy inherits the limit
+    soft, hard = resource.getrlimit(resource.RLIMIT_NOFILE)
+    resource.setrlimit(resource.RLIMIT_NOFILE, (hard, hard))
+
+    print("%8s %8s %10s %10s" % ('entries', 'ok', 'p50 ms', 'p90 ms'))
+    for count in [int(c) for c in args.counts.split(',')]:
+        if 2 * (count + args.trials) + args.base_port > 65535:
+            print("%8d too many for --base-port %d" % (count, args.base_port))
+            continue
+        res = sorted(bench_startup.run(args.binary, [], args.trials, count, args.base_port))
+        if not res:
+            print("%8d %8d" % (count, 0))
+            continue
+        print("%8d %8d %10.2f %10.2f" %
+              (count, len(res),
+               1000 * res[len(res) // 2],
+               1000 * res[min(len(res) - 1, len(res) * 9 // 10)]))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,101 @@
+#!/usr/bin/env python3
+"""
+Measure how long a new session takes to forward its first message,
+with sessions forked on demand (the default) and handed to a pool of
+pre-forked workers (-p).
+
+Creates a scratch keys.tdb with --extra idle port pairs (the parent's
+size matters for fork) plus one pair per trial. For each trial a UDP
+engineer sends one datagram to port2, which starts the session, and a
+UDP user then sends HEARTBEATs to port1 every 0.5ms until the
+engineer receives one. The time from the engineer's datagram to that
+first forwarded HEARTBEAT is the startup latency.
+
+  ./scripts/bench_startup.py --trials 50 --workers 4
+"""
+import argparse
+import os
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+
+import bench_sessions  # noqa: E402
+
+
+def trial(port1, port2, timeout=5.0):
+    eng = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    eng.connect(('127.0.0.1', port2))
+    eng.setblocking(False)
+    user = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    user.connect(('127.0.0.1', port1))
+    frame = bench_sessions.heartbeat_frame(0)
+    try:
+        t0 = time.perf_counter()
+        eng.send(frame)
+        while time.perf_counter() - t0 < timeout:
+            user.send(frame)
+            try:
+                eng.recv(2048)
+                return time.perf_counter() - t0
+            except BlockingIOError:
+                pass
+            time.sleep(0.0005)
+        return None
+    finally:
+        eng.close()
+        user.close()
+
+
+def run(binary, args, trials, extra, base_port):
+    with tempfile.TemporaryDirectory() as workdir:
+        pairs = bench_sessions.make_db(workdir, base_port, extra + trials)
+        proc = subprocess.Popen([binary] + args, cwd=workdir,
+                                stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        time.sleep(2)
+        results = []
+        try:
+            for port1, port2 in pairs[extra:]:
+                lat = trial(port1, port2)
+                if lat is not None:
+                    results.append(lat)
+                # let the pool refill, as it would between real sessions
+                time.sleep(0.05)
+        finally:
+            for p in bench_sessions.process_tree(proc.pid):
+                try:
+                    os.kill(p, 15)
+                except OSError:
+                    pass
+            proc.wait()
+    return results
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--binary', default=os.path.join(bench_sessions.REPO_ROOT, 'supportproxy'))
+    parser.add_argument('--trials', type=int, default=50)
+    parser.add_argument('--extra', type=int, default=1000, help='idle port pairs')
+    parser.add_argument('--workers', type=int, default=4, help='pool size for -p')
+    parser.add_argument('--base-port', type=int, default=30000)
+    args = parser.parse_args()
+
+    print("%-8s %8s %10s %10s %10s" % ('mode', 'ok', 'p50 ms', 'p90 ms', 'max ms'))
+    for mode, extra in (('fork', []), ('pool', ['-p', str(args.workers)])):
+        res = sorted(run(args.binary, extra, args.trials, args.extra, args.base_port))
+        if not res:
+            print("%-8s %8d" % (mode, 0))
+            continue
+        print("%-8s %8d %10.2f %10.2f %10.2f" %
+              (mode, len(res),
+               1000 * res[len(res) // 2],
+               1000 * res[min(len(res) - 1, len(res) * 9 // 10)],
+               1000 * res[-1]))
+
+
+if __name__ == '__main__':
+    main()
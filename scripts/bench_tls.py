@@ -0,0 +1,133 @@
+#!/usr/bin/env python3
+"""
+Measure WSS handshake latency and the supportproxy CPU time spent per
+handshake.
+
+Creates a scratch keys.tdb with two port pairs and a self-signed
+certificate, starts supportproxy and opens --trials WSS connections to
+port2, alternating between the pairs so that consecutive connections
+are served by different session children. Each connection completes
+the TLS handshake and the WebSocket upgrade and is then closed. With
+--resume every connection offers the session of the one before, as an
+engineer's client reconnecting after a drop does.
+
+Reports the time from TCP connect to the end of the TLS handshake, how
+many handshakes resumed a session, and the CPU time of supportproxy
+and its children per handshake. Point --binary at an older build to
+compare.
+
+  ./scripts/bench_tls.py --trials 200
+  ./scripts/bench_tls.py --trials 200 --resume
+"""
+import argparse
+import base64
+import os
+import socket
+import ssl
+import subprocess
+import sys
+import tempfile
+import time
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+
+import bench_sessions  # noqa: E402
+
+
+def cpu_seconds(pids):
+    """CPU time of pids, and of the children they have reaped"""
+    tick = os.sysconf('SC_CLK_TCK')
+    cpu = 0.0
+    for p in pids:
+        try:
+            with open('/proc/%d/stat' % p) as f:
+                fields = f.read().rsplit(')', 1)[1].split()
+            cpu += sum(int(x) for x in fields[11:15]) / tick
+        except OSError:
+            pass
+    return cpu
+
+
+def handshake(ctx, port, session):
+    """one WSS connection. Returns (seconds, reused, session)"""
+    sock = socket.create_connection(('127.0.0.1', port), timeout=5)
+    t0 = time.perf_counter()
+    tls = ctx.wrap_socket(sock, session=session)
+    elapsed = time.perf_counter() - t0
+    key = base64.b64encode(os.urandom(16)).decode()
+    tls.sendall(('GET / HTTP/1.1\r\nHost: localhost\r\nUpgrade: websocket\r\n'
+                 'Connection: Upgrade\r\nSec-WebSocket-Key: %s\r\n'
+                 'Sec-WebSocket-Version: 13\r\n\r\n' % key).encode())
+    # reading the response also takes in TLS 1.3 session tickets
+    reply = tls.recv(1024)
+    reused = tls.session_reused
+    session = tls.session if reply.startswith(b'HTTP/1.1 101') else None
+    tls.close()
+    return elapsed, reused, session
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--binary', default=os.path.join(bench_sessions.REPO_ROOT, 'supportproxy'))
+    parser.add_argument('--trials', type=int, default=100)
+    parser.add_argument('--resume', action='store_true')
+    parser.add_argument('--base-port', type=int, default=20000)
+    args = parser.parse_args()
+
+    ctx = ssl.SSLContext(ssl.PROTOCOL_TLS_CLIENT)
+    ctx.check_hostname = False
+    ctx.verify_mode = ssl.CERT_NONE
+
+    with tempfile.TemporaryDirectory() as workdir:
+        pairs = bench_sessions.make_db(workdir, args.base_port, 2)
+        subprocess.check_call([
+            'openssl', 'req', '-x509', '-newkey', 'rsa:2048', '-nodes',
+            '-keyout', 'privkey.pem', '-out', 'fullchain.pem',
+            '-days', '1', '-subj', '/CN=localhost',
+        ], cwd=workdir, stderr=subprocess.DEVNULL)
+        proc = subprocess.Popen([args.binary], cwd=workdir,
+                                stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        time.sleep(2)
+        times = []
+        reused = 0
+        try:
+            # start both sessions outside the measurement
+            for _, port2 in pairs:
+                handshake(ctx, port2, None)
+            time.sleep(0.5)
+            cpu0 = cpu_seconds(bench_sessions.process_tree(proc.pid))
+            session = None
+            for i in range(args.trials):
+                try:
+                    t, r, s = handshake(ctx, pairs[i % 2][1], session)
+                except (OSError, ssl.SSLError) as e:
+                    print("trial %d: %s" % (i, e))
+                    continue
+                times.append(t)
+                reused += r
+                if args.resume:
+                    session = s
+            cpu = cpu_seconds(bench_sessions.process_tree(proc.pid)) - cpu0
+        finally:
+            for p in bench_sessions.process_tree(proc.pid):
+                try:
+                    os.kill(p, 15)
+                except OSError:
+                    pass
+            proc.wait()
+
+    if not times:
+        print("no handshakes completed")
+        sys.exit(1)
+    times.sort()
+    print("%8s %8s %10s %10s %12s" % ('ok', 'resumed', 'p50 ms', 'p90 ms', 'cpu ms/hs'))
+    print("%8d %8d %10.2f %10.2f %12.2f" %
+          (len(times), reused,
+           1000 * times[len(times) // 2],
+           1000 * times[min(len(times) - 1, len(times) * 9 // 10)],
+           1000 * cpu / len(times)))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,55 @@
+#!/usr/bin/env python3
+"""
+Write a systemd socket unit that binds the UDP and TCP listeners of
+every entry in keys.tdb, for socket activation of supportproxy.
+
+systemd binds the ports and keeps them bound across restarts of
+supportproxy.service, so datagrams and connections that arrive while
+the proxy restarts are queued instead of refused. supportproxy picks
+the sockets up from LISTEN_FDS by port and only binds itself the
+ones that are missing, e.g. for entries added since the unit was
+generated. Re-run after adding entries and `systemctl restart
+supportproxy.socket` to pass them in as well.
+
+  ./scripts/gen_socket_unit.py ~/proxy/keys.tdb > /etc/systemd/system/supportproxy.socket
+"""
+import argparse
+import os
+import sys
+
+sys.path.insert(0, os.path.abspath(os.path.join(os.path.dirname(__file__), os.pardir)))
+
+import keydb_lib  # noqa: E402
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('keydb', nargs='?', default='keys.tdb')
+    args = parser.parse_args()
+
+    db = keydb_lib.open_db(args.keydb)
+    db.transaction_start()
+    try:
+        entries = keydb_lib.list_entries(db)
+    finally:
+        db.transaction_cancel()
+        db.close()
+
+    print("[Unit]")
+    print("Description=SupportProxy listening sockets (%u port pairs)" % len(entries))
+    print("")
+    print("[Socket]")
+    # supportproxy only takes IPv4 sockets; a bare port would be [::]
+    for e in entries:
+        for port in (e.port1, e.port2):
+            print("ListenDatagram=0.0.0.0:%u" % port)
+            print("ListenStream=0.0.0.0:%u" % port)
+    print("")
+    print("[Install]")
+    print("WantedBy=sockets.target")
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
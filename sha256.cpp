@@ -39,6 +39,12 @@
 #include <string.h>
 #include <arpa/inet.h>
 
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define HAVE_SHA_NI 1
+#endif
+
 #define Ch(x,y,z) (((x) & (y)) ^ ((~(x)) & (z)))
 #define Maj(x,y,z) (((x) & (y)) ^ ((x) & (z)) ^ ((y) & (z)))
 
@@ -82,20 +88,20 @@ void sha256_init(sha256_ctx *m)
     m->counter[7] = 0x5be0cd19;
 }
 
-static inline void sha256_calc(sha256_ctx *m, uint32_t *in)
+static inline void sha256_calc(uint32_t counter[8], const uint32_t *in)
 {
     uint32_t AA, BB, CC, DD, EE, FF, GG, HH;
     uint32_t data[64];
     int i;
 
-    AA = m->counter[0];
-    BB = m->counter[1];
-    CC = m->counter[2];
-    DD = m->counter[3];
-    EE = m->counter[4];
-    FF = m->counter[5];
-    GG = m->counter[6];
-    HH = m->counter[7];
+    AA = counter[0];
+    BB = counter[1];
+    CC = counter[2];
+    DD = counter[3];
+    EE = counter[4];
+    FF = counter[5];
+    GG = counter[6];
+    HH = counter[7];
 
     for (i = 0; i < 16; ++i)
 	data[i] = in[i];
@@ -119,14 +125,127 @@ static inline void sha256_calc(sha256_ctx *m, uint32_t *in)
 	AA = T1 + T2;
     }
 
-    m->counter[0] += AA;
-    m->counter[1] += BB;
-    m->counter[2] += CC;
-    m->counter[3] += DD;
-    m->counter[4] += EE;
-    m->counter[5] += FF;
-    m->counter[6] += GG;
-    m->counter[7] += HH;
+    counter[0] += AA;
+    counter[1] += BB;
+    counter[2] += CC;
+    counter[3] += DD;
+    counter[4] += EE;
+    counter[5] += FF;
+    counter[6] += GG;
+    counter[7] += HH;
+}
+
+// hash whole 64 byte blocks into counter
+static void sha256_blocks_portable(uint32_t counter[8], const uint8_t *p, size_t blocks)
+{
+    while (blocks--) {
+        uint32_t current[16];
+        for (int i = 0; i < 16; i++) {
+            current[i] = (uint32_t(p[0]) << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+            p += 4;
+        }
+        sha256_calc(counter, current);
+    }
+}
+
+#ifdef HAVE_SHA_NI
+/*
+  the same with the SHA extensions (sha256rnds2 does two rounds, on
+  the state split as ABEF and CDGH)
+ */
+__attribute__((target("sha,sse4.1")))
+static void sha256_blocks_shani(uint32_t counter[8], const uint8_t *p, size_t blocks)
+{
+    const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&counter[0]), 0xB1);
+    __m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&counter[4]), 0x1B);
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+    while (blocks--) {
+        const __m128i abef = state0;
+        const __m128i cdgh = state1;
+        __m128i w[4];
+#pragma GCC unroll 16
+        for (int g = 0; g < 16; g++) {
+            __m128i &wg = w[g & 3];
+            if (g < 4) {
+                wg = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 16*g)), bswap);
+            } else {
+                wg = _mm_sha256msg2_epu32(
+                    _mm_add_epi32(_mm_sha256msg1_epu32(w[g & 3], w[(g+1) & 3]),
+                                  _mm_alignr_epi8(w[(g+3) & 3], w[(g+2) & 3], 4)),
+                    w[(g+3) & 3]);
+            }
+            __m128i msg = _mm_add_epi32(wg, _mm_loadu_si128((const __m128i *)&sha256_constant_256[4*g]));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+            msg = _mm_shuffle_epi32(msg, 0x0E);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+        }
+        state0 = _mm_add_epi32(state0, abef);
+        state1 = _mm_add_epi32(state1, cdgh);
+        p += 64;
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1B);
+    state1 = _mm_shuffle_epi32(state1, 0xB1);
+    _mm_storeu_si128((__m128i *)&counter[0], _mm_blend_epi16(tmp, state1, 0xF0));
+    _mm_storeu_si128((__m128i *)&counter[4], _mm_alignr_epi8(state1, tmp, 8));
+}
+
+static bool have_sha_ni(void)
+{
+    unsigned eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_SSE4_1)) {
+        return false;
+    }
+    return __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & bit_SHA);
+}
+#endif // HAVE_SHA_NI
+
+typedef void (*sha256_blocks_t)(uint32_t counter[8], const uint8_t *p, size_t blocks);
+
+static const struct {
+    const char *name;
+    sha256_blocks_t fn;
+    bool (*available)(void);
+} backends[] = {
+    { "portable", sha256_blocks_portable, nullptr },
+#ifdef HAVE_SHA_NI
+    { "sha-ni", sha256_blocks_shani, have_sha_ni },
+#endif
+};
+
+// the last backend this CPU has
+static unsigned pick_backend(void)
+{
+    unsigned i = sizeof(backends) / sizeof(backends[0]);
+    while (--i > 0 && !backends[i].available()) {
+    }
+    return i;
+}
+
+/*
+  index into backends; zero, so portable, for anything hashed during
+  static initialisation before this is set
+ */
+static unsigned backend = pick_backend();
+
+const char *sha256_backend(void)
+{
+    return backends[backend].name;
+}
+
+bool sha256_set_backend(const char *name)
+{
+    for (unsigned i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+        if (strcmp(backends[i].name, name) == 0 &&
+            (backends[i].available == nullptr || backends[i].available())) {
+            backend = i;
+            return true;
+        }
+    }
+    return false;
 }
 
 void sha256_update(sha256_ctx *m, const void *v, uint32_t len)
@@ -140,6 +259,14 @@ void sha256_update(sha256_ctx *m, const void *v, uint32_t len)
 	++m->sz[1];
     offset = (old_sz / 8) % 64;
     while(len > 0){
+        if (offset == 0 && len >= 64) {
+            // whole blocks straight from the input
+            const uint32_t blocks = len / 64;
+            backends[backend].fn(m->counter, p, blocks);
+            p += blocks * 64;
+            len -= blocks * 64;
+            continue;
+        }
 	uint32_t l = 64 - offset;
         if (len < l) {
             l = len;
@@ -149,18 +276,7 @@ void sha256_update(sha256_ctx *m, const void *v, uint32_t len)
 	p += l;
 	len -= l;
 	if(offset == 64){
-	    int i;
-	    uint32_t current[16];
-	    const uint32_t *u = m->u.save_u32;
-	    for (i = 0; i < 16; i++){
-                const uint8_t *p1 = (const uint8_t *)&u[i];
-                uint8_t *p2 = (uint8_t *)&current[i];
-                p2[0] = p1[3];
-                p2[1] = p1[2];
-                p2[2] = p1[1];
-                p2[3] = p1[0];
-	    }
-	    sha256_calc(m, current);
+	    backends[backend].fn(m->counter, m->u.save_bytes, 1);
 	    offset = 0;
 	}
     }
@@ -34,7 +34,7 @@
  * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
  * SUCH DAMAGE.
  */
-
+#pragma once
 
 #include <stdint.h>
 
@@ -50,3 +50,11 @@ typedef struct {
 void sha256_init(sha256_ctx *m);
 void sha256_update(sha256_ctx *m, const void *v, uint32_t len);
 void sha256_final_32bytes(sha256_ctx *m, uint8_t result[32]);
+
+/*
+  the block function is picked at startup: the x86 SHA extensions
+  ("sha-ni") when the CPU has them, else "portable". These name it,
+  or force one (for benchmarks); false if it isn't available
+ */
+const char *sha256_backend(void);
+bool sha256_set_backend(const char *name);
@@ -0,0 +1,299 @@
+/*
+  reactor thread owning a subset of the port pairs (-r mode)
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "shard.h"
+
+#include <stdio.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "util.h"
+#include "conntdb.h"
+#include "proxysession.h"
+#include "uring.h"
+#include "udpbatch.h"
+#include "dbwriter.h"
+
+#include <algorithm>
+
+Shard::Shard(unsigned _index, bool _use_uring) :
+    index(_index),
+    use_uring(_use_uring)
+{
+}
+
+/*
+  port2 values tend to be regularly spaced (a pair per two ports is
+  common), which a plain modulo would map onto a few shards, so mix
+  the bits first
+ */
+unsigned Shard::index_for(int port2, unsigned n)
+{
+    uint32_t h = uint32_t(port2) * 2654435761U;
+    return (h >> 16) % n;
+}
+
+bool Shard::start(void)
+{
+    if (!loop.ok() || !timers.ok()) {
+        return false;
+    }
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wake_fd == -1) {
+        perror("eventfd");
+        return false;
+    }
+    loop.add(wake_fd, EPOLLIN, [this](uint32_t) { handle_commands(); });
+    if (use_uring) {
+        uring = UringIO::create(loop);
+    }
+    thread = std::thread([this]() { run(); });
+    thread.detach();
+    return true;
+}
+
+void Shard::post(const PortCommand &cmd)
+{
+    while (!queue.push(cmd)) {
+        // full: the shard is behind, give it a moment to drain
+        usleep(1000);
+    }
+    const uint64_t one = 1;
+    if (write(wake_fd, &one, sizeof(one)) != sizeof(one) && errno != EAGAIN) {
+        perror("eventfd write");
+    }
+}
+
+void Shard::handle_commands(void)
+{
+    uint64_t v;
+    if (read(wake_fd, &v, sizeof(v)) != sizeof(v)) {
+        // spurious wakeup; still drain the queue
+    }
+    PortCommand cmd;
+    while (queue.pop(cmd)) {
+        switch (cmd.type) {
+        case PortCommand::ADD:
+            add_port(cmd);
+            break;
+        case PortCommand::UPDATE: {
+            auto it = ports.find(cmd.port2);
+            if (it != ports.end()) {
+                it->second->flags = cmd.flags;
+                it->second->fc_sysid = cmd.fc_sysid;
+            }
+            break;
+        }
+        case PortCommand::REMOVE:
+            remove_port(cmd.port2);
+            break;
+        case PortCommand::DROP: {
+            auto it = ports.find(cmd.port2);
+            if (it == ports.end() || it->second->session == nullptr) {
+                break;
+            }
+            auto *p = it->second;
+            p->session->drop(cmd.conn_index);
+            if (p->session->done()) {
+                restart_port(p);
+            }
+            break;
+        }
+        }
+    }
+}
+
+void Shard::add_port(const PortCommand &cmd)
+{
+    if (ports.count(cmd.port2) != 0) {
+        // REMOVE always precedes a re-ADD, so this is a duplicate
+        return;
+    }
+    auto *p = new struct listen_port;
+    p->next = nullptr;
+    p->port1 = cmd.port1;
+    p->port2 = cmd.port2;
+    p->sock1_udp = -1;
+    p->sock2_udp = -1;
+    p->sock1_tcp = -1;
+    p->sock2_listen = -1;
+    p->pid = 0;
+    p->flags = cmd.flags;
+    p->fc_sysid = cmd.fc_sysid;
+    p->seen = true;
+    p->removed = false;
+    ports[p->port2] = p;
+    listen_port_open(p);
+    watch_port(p);
+}
+
+void Shard::remove_port(int port2)
+{
+    auto it = ports.find(port2);
+    if (it == ports.end()) {
+        return;
+    }
+    auto *p = it->second;
+    ports.erase(it);
+    p->removed = true;
+    end_session(p);
+    unwatch_port(p);
+    listen_port_close(p);
+    delete p;
+}
+
+/*
+  watch the listening sockets of an idle port pair; the first packet
+  or connection starts a session
+ */
+void Shard::watch_port(struct listen_port *p)
+{
+    const int fds[] { p->sock1_udp, p->sock2_udp, p->sock1_tcp, p->sock2_listen };
+    for (int fd : fds) {
+        if (fd != -1 && !loop.contains(fd)) {
+            loop.add(fd, EPOLLIN, [this, p](uint32_t) { start_session(p); });
+        }
+    }
+}
+
+void Shard::unwatch_port(struct listen_port *p)
+{
+    const int fds[] { p->sock1_udp, p->sock2_udp, p->sock1_tcp, p->sock2_listen };
+    for (int fd : fds) {
+        if (fd != -1) {
+            loop.remove(fd);
+        }
+    }
+}
+
+void Shard::start_session(struct listen_port *p)
+{
+    if (p->session != nullptr) {
+        return;
+    }
+    unwatch_port(p);
+    p->session = new ProxySession(p, loop, timers,
+                                  [this](ProxySession *s) { touched.push_back(s); });
+    p->session->set_uring(uring);
+    printf("[%d] New session on thread %u\n", p->port2, index);
+    if (!p->session->start()) {
+        restart_port(p);
+    }
+}
+
+void Shard::end_session(struct listen_port *p)
+{
+    if (p->session == nullptr) {
+        return;
+    }
+    // a command handled in this wakeup can end a session that also did
+    // I/O in it
+    touched.erase(std::remove(touched.begin(), touched.end(), p->session), touched.end());
+    p->session->finish();
+    delete p->session;
+    p->session = nullptr;
+    printf("[%d] Session ended\n", p->port2);
+    // drop any live-connection records the session wrote, after the
+    // snapshots it queued
+    const int port2 = p->port2;
+    db_writer_post([port2]() { conn_remove_port2(port2); });
+}
+
+/*
+  end the session of p and go back to listening for a new one
+ */
+void Shard::restart_port(struct listen_port *p)
+{
+    end_session(p);
+    if (!p->removed) {
+        listen_port_open(p);
+        watch_port(p);
+    }
+}
+
+void Shard::run(void)
+{
+    // signals are for the main thread
+    sigset_t set;
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, nullptr);
+
+    // the wheel belongs to this thread from here on
+    timers.schedule(reopen_timer, 5, [this]() { on_reopen_timer(); });
+    timers.schedule(flush_timer, 10, [this]() { on_flush_timer(); });
+
+    while (true) {
+        int ret;
+        {
+            // UDP sends from the handlers leave together
+            UDPSendBatch batch;
+            ret = loop.poll(-1);
+        }
+        if (ret == -1 && errno != EINTR) {
+            perror("epoll_wait");
+            break;
+        }
+        const double now = time_seconds();
+
+        /*
+          post-I/O work for the sessions that were active or had a
+          timer fire (idle timeout, heartbeat), and one
+          connections.tdb snapshot for all of them that are due
+         */
+        std::vector<ProxySession *> snap;
+        if (!touched.empty()) {
+            std::vector<ProxySession *> active;
+            active.swap(touched);
+            for (auto *s : active) {
+                s->service(now);
+                if (s->done()) {
+                    restart_port(s->port());
+                } else if (s->snapshot_due(now)) {
+                    snap.push_back(s);
+                }
+            }
+        }
+        ProxySession::save_snapshots(snap, now);
+    }
+}
+
+/*
+  retry listeners that failed to open, every 5 seconds
+ */
+void Shard::on_reopen_timer(void)
+{
+    for (auto &kv : ports) {
+        auto *p = kv.second;
+        if (p->session == nullptr) {
+            listen_port_open(p);
+            watch_port(p);
+        }
+    }
+    timers.schedule(reopen_timer, 5, [this]() { on_reopen_timer(); });
+}
+
+/*
+  signing timestamps reach keys.tdb even when traffic stops
+ */
+void Shard::on_flush_timer(void)
+{
+    MAVLink::flush_signing_timestamps();
+    timers.schedule(flush_timer, 10, [this]() { on_flush_timer(); });
+}
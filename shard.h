@@ -0,0 +1,86 @@
+/*
+  reactor thread owning a subset of the port pairs (-r mode)
+
+  Port pairs are assigned to a shard by a hash of port2, so every
+  socket and session of one port pair lives on one thread and the
+  forwarding path needs no locks. The main thread keeps reading
+  keys.tdb and passes changes to the owning shard through a lock-free
+  queue, waking it with an eventfd.
+ */
+#pragma once
+
+#include <stdint.h>
+
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "eventloop.h"
+#include "listenport.h"
+#include "spscqueue.h"
+#include "timerwheel.h"
+
+class ProxySession;
+class UringIO;
+
+struct PortCommand {
+    enum Type : uint8_t {
+        ADD,      // start listening on a new (or re-added) port pair
+        UPDATE,   // flags or fc_sysid changed, used by the next session
+        REMOVE,   // end any session and stop listening
+        DROP,     // web admin asked to drop one connection
+    } type;
+    int port1;
+    int port2;
+    uint32_t flags;
+    uint8_t fc_sysid;
+    int conn_index;
+};
+
+class Shard {
+public:
+    // use_uring: give the sessions of this shard an io_uring
+    Shard(unsigned index, bool use_uring);
+    Shard(const Shard &) = delete;
+    Shard &operator=(const Shard &) = delete;
+
+    // start the thread. Returns false on failure
+    bool start(void);
+
+    // queue a command for this shard. Main thread only
+    void post(const PortCommand &cmd);
+
+    // pick the shard for port2 out of n
+    static unsigned index_for(int port2, unsigned n);
+
+private:
+    const unsigned index;
+    const bool use_uring;
+    EventLoop loop;
+    TimerWheel timers { loop };
+    UringIO *uring = nullptr;
+    int wake_fd = -1;
+    SPSCQueue<PortCommand, 1024> queue;
+    std::thread thread;
+
+    // port pairs owned by this shard, by port2
+    std::unordered_map<int, struct listen_port *> ports;
+
+    // sessions that did I/O in the current wakeup
+    std::vector<ProxySession *> touched;
+
+    Timer reopen_timer;
+    Timer flush_timer;
+    void on_reopen_timer(void);
+    void on_flush_timer(void);
+
+    void run(void);
+    void handle_commands(void);
+    void add_port(const PortCommand &cmd);
+    void remove_port(int port2);
+    void watch_port(struct listen_port *p);
+    void unwatch_port(struct listen_port *p);
+    void start_session(struct listen_port *p);
+    void end_session(struct listen_port *p);
+    void restart_port(struct listen_port *p);
+};
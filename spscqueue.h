@@ -0,0 +1,44 @@
+/*
+  bounded lock-free single producer / single consumer queue
+
+  One thread may push and one other thread may pop, with no locks on
+  either side. N must be a power of two.
+ */
+#pragma once
+
+#include <stddef.h>
+
+#include <atomic>
+
+template <typename T, size_t N>
+class SPSCQueue {
+    static_assert(N != 0 && (N & (N-1)) == 0, "N must be a power of two");
+public:
+    // producer side. Returns false if the queue is full
+    bool push(const T &v) {
+        const size_t t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) == N) {
+            return false;
+        }
+        slots[t & (N-1)] = v;
+        tail.store(t+1, std::memory_order_release);
+        return true;
+    }
+
+    // consumer side. Returns false if the queue is empty
+    bool pop(T &v) {
+        const size_t h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire)) {
+            return false;
+        }
+        v = slots[h & (N-1)];
+        head.store(h+1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    T slots[N];
+    // on separate cache lines so the two sides don't false-share
+    alignas(64) std::atomic<size_t> head {0};
+    alignas(64) std::atomic<size_t> tail {0};
+};
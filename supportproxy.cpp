@@ -31,18 +31,29 @@
 #include <netinet/in.h>
 #include <sys/wait.h>
 #include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <poll.h>
 #include <signal.h>
+#include <limits.h>
 
 #include "mavlink.h"
 #include "util.h"
 #include "keydb.h"
 #include "conntdb.h"
-#include "tlog.h"
-#include "binlog.h"
-#include "session.h"
 #include "cleanup.h"
-#include "websocket.h"
-
+#include "eventloop.h"
+#include "proxysession.h"
+#include "shard.h"
+#include "uring.h"
+#include "udpbatch.h"
+#include "workerpool.h"
+#include "keywatch.h"
+#include "tlscontext.h"
+#include "timerwheel.h"
+#include "dbwriter.h"
+
+#include <string>
+#include <unordered_map>
 #include <vector>
 
 /*
@@ -58,47 +69,105 @@ static void sigusr1_handler(int)
     g_drops_pending = 1;
 }
 
-#define MAX_EPOLL_EVENTS 64
-
-struct listen_port {
-    struct listen_port *next;
-    int port1, port2;
-    int sock1_udp, sock2_udp;
-    int sock1_tcp, sock2_listen;
-    pid_t pid;
-    uint32_t flags;
-    uint8_t  fc_sysid;     // 0 = match any; otherwise the FC's MAVLink
-                           // sysid for binlog reboot detection
-    bool seen;     // set true by handle_record() during reload_ports()
-                   // for any entry that's still in the DB; entries left
-                   // unseen after a reload have been removed.
-    bool removed;  // entry no longer in keys.tdb. We keep the struct
-                   // around (don't free it under a running child) but
-                   // close listening sockets and skip it everywhere.
-    WebSocket *ws = nullptr;
-};
+/*
+  SIGHUP asks for keys.tdb to be reloaded now, whether or not its
+  sequence number moved
+ */
+static volatile sig_atomic_t g_reload_pending = 0;
+
+static void sighup_handler(int)
+{
+    g_reload_pending = 1;
+}
+
+/*
+  SIGUSR2 asks the parent to re-exec its binary, e.g. after installing
+  a new one, without dropping running sessions. See upgrade()
+ */
+static volatile sig_atomic_t g_upgrade_pending = 0;
+
+static void sigusr2_handler(int)
+{
+    g_upgrade_pending = 1;
+}
+
+/*
+  set by the binary we were exec'ed from on SIGUSR2: how many of the
+  LISTEN_FDS it kept from socket activation, then the session children
+  it left running, as "kept;port2:pid,port2:pid,..."
+ */
+#define UPGRADE_ENV "SUPPORTPROXY_CHILDREN"
+
+// those children by port2, until load_ports() has claimed them
+static std::unordered_map<int, pid_t> upgrade_children;
+
+// what to exec on SIGUSR2
+static char **saved_argv;
+static char exe_path[PATH_MAX];
 
 static struct listen_port *ports;
 
+/*
+  indexes over the ports list, so that handling one keys.tdb record or
+  one exited child doesn't scan it; with a scan per record a reload
+  would be O(n^2). Entries are never freed, so these only grow
+ */
+static std::unordered_map<int, struct listen_port *> ports_by_port2;
+static std::unordered_map<pid_t, struct listen_port *> ports_by_pid;
+
+static void set_port_pid(struct listen_port *p, pid_t pid)
+{
+    if (p->pid != 0) {
+        ports_by_pid.erase(p->pid);
+    }
+    p->pid = pid;
+    if (pid != 0) {
+        ports_by_pid[pid] = p;
+    }
+}
+
 // PID of the long-lived log-cleanup child forked from main() that
 // ages out old .tlog / .bin files. Tracked separately from
 // per-port-pair children so check_children() can respawn it if it
 // dies, rather than printing "No child for X found".
 static pid_t cleanup_child_pid = 0;
 static void fork_cleanup_child(void);
+static void child_started(pid_t pid);
 
 static uint32_t count_ports(void)
 {
-    uint32_t count = 0;
-    for (auto *p = ports; p; p=p->next) {
-        count++;
-    }
-    return count;
+    return ports_by_port2.size();
 }
 
 static void open_sockets(struct listen_port *p);
 static void close_sockets(struct listen_port *p);
 
+/*
+  sessions run in forked children by default; with -r they run on
+  reactor threads, each owning the port pairs that hash to it. The
+  main thread then only tracks keys.tdb and never opens the sockets
+ */
+static std::vector<Shard *> shards;
+
+// -u: session socket I/O through io_uring where built in
+static bool use_uring;
+
+static Shard *shard_for(int port2)
+{
+    return shards[Shard::index_for(port2, shards.size())];
+}
+
+static void post_port(PortCommand::Type type, const struct listen_port *p)
+{
+    PortCommand cmd {};
+    cmd.type = type;
+    cmd.port1 = p->port1;
+    cmd.port2 = p->port2;
+    cmd.flags = p->flags;
+    cmd.fc_sysid = p->fc_sysid;
+    shard_for(p->port2)->post(cmd);
+}
+
 /*
   Reconcile a single keys.tdb record with our in-memory port list.
 
@@ -116,40 +185,50 @@ static void close_sockets(struct listen_port *p);
  */
 static void upsert_port(int port1, int port2, uint32_t flags, uint8_t fc_sysid)
 {
-    for (auto *p = ports; p; p=p->next) {
-        if (p->port2 == port2) {
-            p->seen = true;
-            if (p->removed) {
-                // came back: re-add as a fresh listener
-                printf("[%d] re-added (port1=%d)\n", port2, port1);
-                p->removed = false;
-                p->port1 = port1;
-                p->flags = flags;
-                p->fc_sysid = fc_sysid;
-                if (p->pid == 0) {
-                    open_sockets(p);
-                }
-            } else if (p->port1 != port1) {
-                printf("[%d] port1 changed %d -> %d\n",
-                       port2, p->port1, port1);
-                close_sockets(p);
-                if (p->pid != 0) {
-                    // running child still binds the old port1; signal it
-                    // to exit so check_children reopens with the new one
-                    kill(p->pid, SIGTERM);
-                }
-                p->port1 = port1;
-                p->flags = flags;
-                p->fc_sysid = fc_sysid;
-                if (p->pid == 0) {
-                    open_sockets(p);
-                }
-            } else {
-                p->flags = flags;
-                p->fc_sysid = fc_sysid;
+    auto it = ports_by_port2.find(port2);
+    if (it != ports_by_port2.end()) {
+        auto *p = it->second;
+        p->seen = true;
+        if (p->removed) {
+            // came back: re-add as a fresh listener
+            printf("[%d] re-added (port1=%d)\n", port2, port1);
+            p->removed = false;
+            p->port1 = port1;
+            p->flags = flags;
+            p->fc_sysid = fc_sysid;
+            if (!shards.empty()) {
+                post_port(PortCommand::ADD, p);
+            } else if (p->pid == 0) {
+                open_sockets(p);
+            }
+        } else if (p->port1 != port1) {
+            printf("[%d] port1 changed %d -> %d\n",
+                   port2, p->port1, port1);
+            if (!shards.empty()) {
+                post_port(PortCommand::REMOVE, p);
+            }
+            close_sockets(p);
+            if (p->pid != 0) {
+                // running child still binds the old port1; signal it
+                // to exit so check_children reopens with the new one
+                kill(p->pid, SIGTERM);
+            }
+            p->port1 = port1;
+            p->flags = flags;
+            p->fc_sysid = fc_sysid;
+            if (!shards.empty()) {
+                post_port(PortCommand::ADD, p);
+            } else if (p->pid == 0) {
+                open_sockets(p);
+            }
+        } else if (p->flags != flags || p->fc_sysid != fc_sysid) {
+            p->flags = flags;
+            p->fc_sysid = fc_sysid;
+            if (!shards.empty()) {
+                post_port(PortCommand::UPDATE, p);
             }
-            return;
         }
+        return;
     }
     struct listen_port *p = new struct listen_port;
     p->next = ports;
@@ -165,8 +244,22 @@ static void upsert_port(int port1, int port2, uint32_t flags, uint8_t fc_sysid)
     p->seen = true;
     p->removed = false;
     ports = p;
+    ports_by_port2[port2] = p;
     printf("Added port %d/%d\n", port1, port2);
-    open_sockets(p);
+    auto up = upgrade_children.find(port2);
+    if (up != upgrade_children.end()) {
+        // a session child of the binary we replaced still holds the
+        // sockets; they are reopened when it exits
+        set_port_pid(p, up->second);
+        child_started(up->second);
+        upgrade_children.erase(up);
+        return;
+    }
+    if (!shards.empty()) {
+        post_port(PortCommand::ADD, p);
+    } else {
+        open_sockets(p);
+    }
 }
 
 
@@ -188,66 +281,65 @@ static int handle_record(struct tdb_context *db, TDB_DATA key, TDB_DATA data, vo
     return 0;
 }
 
-static void close_fd(int &fd)
+/*
+  the parent's event loop. Listening sockets of idle port pairs are
+  watched here. Reset to nullptr in forked children, which must not
+  touch it.
+ */
+static EventLoop *parent_loop;
+
+static void handle_connection(struct listen_port *p);
+static void main_loop(struct listen_port *p);
+
+// a forked child must not touch the parent's event loop
+static void detach_parent_loop(void)
 {
-    if (fd != -1) {
-	close(fd);
-	fd = -1;
+    if (parent_loop != nullptr) {
+        parent_loop->detach();
+        parent_loop = nullptr;
     }
 }
 
-class Connection2 {
-public:
-    int sock = -1;
-    bool used = false;
-    bool tcp_active = false;
-    MAVLink mav;
-    WebSocket *ws = nullptr;
-    struct sockaddr_in from;
-    socklen_t fromlen = 0;
-    bool is_udp = false;
-    double last_pkt = 0;
-    // for connections.tdb visibility
-    time_t connected_at = 0;
-    uint32_t rx_msgs = 0;
-    uint32_t tx_msgs = 0;
-
-    void close(void) {
-	close_fd(sock);
-	tcp_active = false;
-	used = false;
-	delete ws;
-	ws = nullptr;
-	connected_at = 0;
-	rx_msgs = 0;
-	tx_msgs = 0;
+// -p: pre-forked session workers
+static WorkerPool pool(main_loop, detach_parent_loop, child_started);
+
+/*
+  watch the listening sockets of an idle port pair in the parent loop
+ */
+static void watch_port(struct listen_port *p)
+{
+    if (parent_loop == nullptr || p->pid != 0 || p->removed) {
+        return;
     }
-};
+    const int fds[] { p->sock1_udp, p->sock2_udp, p->sock1_tcp, p->sock2_listen };
+    for (int fd : fds) {
+        if (fd != -1 && !parent_loop->contains(fd)) {
+            parent_loop->add(fd, EPOLLIN, [p](uint32_t) { handle_connection(p); });
+        }
+    }
+}
 
-static void main_loop(struct listen_port *p)
+static void unwatch_port(struct listen_port *p)
 {
-    unsigned char buf[10240] {};
-    bool have_conn1=false;
-    double last_pkt1=0;
-    uint32_t count1=0, count2=0;
-    int fdmax = -1;
-    // bidi-sign: enforce signing on the user side too. mav1 then loads the
-    // same key keys.tdb stores for the engineer side, so unsigned and
-    // wrong-key user packets are rejected before being forwarded.
-    const bool bidi = (p->flags & KEY_FLAG_BIDI_SIGN) != 0;
-    const int conn1_key_id = bidi ? p->port2 : -1;
-    /*
-      we allow more than one connection on the support engineer side
-     */
-    uint8_t max_conn2_count = 0;
-    uint8_t conn2_count = 0;
-    MAVLink mav_blank;
-    MAVLink mav1;
-    Connection2 conn2[MAX_COMM2_LINKS];
+    if (parent_loop == nullptr) {
+        return;
+    }
+    const int fds[] { p->sock1_udp, p->sock2_udp, p->sock1_tcp, p->sock2_listen };
+    for (int fd : fds) {
+        if (fd != -1) {
+            parent_loop->remove(fd);
+        }
+    }
+}
 
+/*
+  run a session for one port pair in a forked child
+ */
+static void main_loop(struct listen_port *p)
+{
     // Webadmin sends SIGUSR1 to ask us to drop a specific connection.
     // The signal handler just sets a flag; we scan connections.tdb at
-    // the top of each main_loop iteration to find the target slot(s).
+    // the top of each loop iteration to find the target slot(s).
     {
         struct sigaction sa = {};
         sa.sa_handler = sigusr1_handler;
@@ -255,762 +347,315 @@ static void main_loop(struct listen_port *p)
         sigaction(SIGUSR1, &sa, nullptr);
     }
 
-    // session_n is computed once at fork start and shared between the
-    // tlog and (further down) the binlog writer so the paired files
-    // — sessionN.tlog + sessionN.bin — share their N regardless of
-    // which writer activates first or whether one of them never does.
-    const unsigned session_n = next_session_n(uint32_t(p->port2), "logs");
-
-    // tlog: opened lazily on first received frame so an idle child that
-    // never sees traffic doesn't leave behind an empty session file.
-    TlogWriter tlog;
-    const bool tlog_enabled = (p->flags & KEY_FLAG_TLOG) != 0;
-    auto ensure_tlog_open = [&]() {
-        if (tlog_enabled && !tlog.is_open()) {
-            tlog.open(uint32_t(p->port2), session_n);
-        }
-    };
-    auto tlog_ptr = [&]() -> TlogWriter * {
-        return tlog_enabled ? &tlog : nullptr;
-    };
-
-    // binlog: ArduPilot bin logs over MAVLink. Activates when the
-    // first REMOTE_LOG_DATA_BLOCK arrives from the user side; while
-    // enabled, both REMOTE_LOG_DATA_BLOCK (184) and
-    // REMOTE_LOG_BLOCK_STATUS (185) are stripped from the user→
-    // engineer forward path so the support engineer's session isn't
-    // polluted by log traffic. Engineer→user direction is unchanged.
-    BinlogWriter binlog;
-    const bool binlog_enabled = (p->flags & KEY_FLAG_BINLOG) != 0;
-    if (binlog_enabled) {
-        // Per-entry sysid filter for SYSTEM_TIME-based reboot
-        // detection. 0 (default) accepts any sysid.
-        binlog.set_fc_sysid_filter(p->fc_sysid);
-    }
-    // Tap helper: returns true if the message was consumed by binlog
-    // and the caller should NOT forward it to the engineer side.
-    // BinlogWriter::handle_block does its own lazy file-open, gated
-    // on seqno==0 so we don't sparse-extend the file from a mid-
-    // stream seqno. observe() is called on every message for
-    // SYSTEM_TIME-based reboot detection and never strips.
-    auto binlog_handle_user_msg = [&](const mavlink_message_t &m) -> bool {
-        if (!binlog_enabled) {
-            return false;
-        }
-        binlog.observe(m);
-        if (m.msgid != MAVLINK_MSG_ID_REMOTE_LOG_DATA_BLOCK
-            && m.msgid != MAVLINK_MSG_ID_REMOTE_LOG_BLOCK_STATUS) {
-            return false;
-        }
-        if (m.msgid == MAVLINK_MSG_ID_REMOTE_LOG_DATA_BLOCK) {
-            binlog.handle_block(uint32_t(p->port2), session_n, m);
-        }
-        return true;  // strip from user→engineer
-    };
-
-    // Live state mirrored into connections.tdb so the web UI can show
-    // who is connected right now. Captured here, snapshotted into TDB
-    // on a 10s heartbeat below (mirroring save_signing_timestamp's
-    // fork-and-write pattern in mavlink.cpp).
-    struct sockaddr_in mav1_peer {};
-    time_t mav1_connected_at = 0;
-    uint32_t mav1_rx_msgs = 0, mav1_tx_msgs = 0;
-    bool mav1_is_tcp = false;
-    double last_conn_save_s = 0;
-    const pid_t my_pid = getpid();
-
-    fdmax = MAX(fdmax, p->sock1_udp);
-    fdmax = MAX(fdmax, p->sock2_udp);
-    fdmax = MAX(fdmax, p->sock1_tcp);
-    fdmax = MAX(fdmax, p->sock2_listen);
-
-    // Pull DROP_REQUESTED entries for our port2 out of connections.tdb,
-    // close the matching slots, and delete the records. Returns true if
-    // the user side was dropped (caller should exit main_loop).
-    auto process_drops = [&]() -> bool {
-        std::vector<int> indices;
-        struct collect_ctx {
-            int port2;
-            std::vector<int> *out;
-        } ctx { p->port2, &indices };
-
-        auto cb = [](struct tdb_context *, TDB_DATA key, TDB_DATA data,
-                     void *vptr) -> int {
-            auto *c = static_cast<collect_ctx *>(vptr);
-            if (key.dsize != sizeof(struct ConnKey)
-                || data.dsize < CONNENTRY_MIN_SIZE) {
-                return 0;
-            }
-            struct ConnKey k {};
-            memcpy(&k, key.dptr, sizeof(k));
-            if (k.port2 != c->port2) {
-                return 0;
-            }
-            struct ConnEntry e {};
-            size_t copy = data.dsize < sizeof(e) ? data.dsize : sizeof(e);
-            memcpy(&e, data.dptr, copy);
-            if (e.magic == CONN_MAGIC
-                && (e.flags & CONN_FLAG_DROP_REQUESTED) != 0) {
-                c->out->push_back(k.conn_index);
-            }
-            return 0;
-        };
+    EventLoop loop;
+    TimerWheel timers(loop);
+    UringIO *uring = use_uring ? UringIO::create(loop) : nullptr;
+    ProxySession session(p, loop, timers);
+    session.set_uring(uring);
+    if (!session.start()) {
+        session.finish();
+        db_writer_flush();
+        delete uring;
+        return;
+    }
 
-        auto *db = conn_db_open_transaction();
-        if (db == nullptr) {
-            return false;
-        }
-        tdb_traverse(db, cb, &ctx);
-        for (int idx : indices) {
-            conn_delete(db, p->port2, idx);
-        }
-        conn_db_close_commit(db);
-
-        bool exit_loop = false;
-        for (int idx : indices) {
-            if (idx == 0) {
-                printf("[%d] %s drop user requested -> ending session\n",
-                       p->port2, time_string());
-                exit_loop = true;
-            } else if (idx >= 1 && idx <= MAX_COMM2_LINKS) {
-                auto &c2 = conn2[idx - 1];
-                if (c2.used) {
-                    printf("[%d] %s drop conn2[%d] requested\n",
-                           p->port2, time_string(), idx - 1);
-                    c2.close();
-                    if (conn2_count > 0) {
-                        conn2_count--;
-                    }
-                    if (max_conn2_count > 0 && idx == max_conn2_count) {
-                        max_conn2_count--;
-                    }
-                }
-            }
-        }
-        return exit_loop;
+    // signing timestamps reach keys.tdb even when traffic stops
+    Timer flush_timer;
+    std::function<void(void)> flush = [&]() {
+        MAVLink::flush_signing_timestamps();
+        timers.schedule(flush_timer, 10, flush);
     };
+    timers.schedule(flush_timer, 10, flush);
 
-    while (1) {
+    while (!session.done()) {
         if (g_drops_pending) {
             g_drops_pending = 0;
-            if (process_drops()) {
+            std::vector<struct ConnKey> drops;
+            conn_take_drop_requests(p->port2, drops);
+            for (const auto &k : drops) {
+                session.drop(k.conn_index);
+            }
+            if (session.done()) {
                 break;
             }
         }
-        fd_set fds;
-        int ret;
-        struct timeval tval;
-        double now = time_seconds();
 
-        if (have_conn1 && now - last_pkt1 > 10) {
-            break;
+        // the session's own timers end it when idle
+        int ret;
+        {
+            // UDP sends from the handlers leave together
+            UDPSendBatch batch;
+            ret = loop.poll(-1);
         }
-
-	FD_ZERO(&fds);
-	if (p->sock1_udp != -1) {
-	    FD_SET(p->sock1_udp, &fds);
-	}
-	if (p->sock2_udp != -1) {
-	    FD_SET(p->sock2_udp, &fds);
-	}
-	if (p->sock1_tcp != -1) {
-	    FD_SET(p->sock1_tcp, &fds);
-	}
-	if (p->sock2_listen != -1) {
-	    FD_SET(p->sock2_listen, &fds);
-	}
-	for (uint8_t i=0; i<max_conn2_count; i++) {
-	    const auto &c2 = conn2[i];
-	    if (c2.sock != -1) {
-		FD_SET(c2.sock, &fds);
-	    }
-	}
-
-        tval.tv_sec = 10;
-        tval.tv_usec = 0;
-
-	ret = select(fdmax+1, &fds, NULL, NULL, &tval);
         if (ret == -1 && errno == EINTR) continue;
-        if (ret <= 0) break;
-
-	now = time_seconds();
-
-	if (max_conn2_count > MAX_COMM2_LINKS) {
-	    printf("BUG: max_conn2_count=%d\n", int(max_conn2_count));
-	    exit(1);
-	}
-
-	/*
-	  check for dead UDP conn2
-	 */
-	for (uint8_t i=0; i<max_conn2_count; i++) {
-	    auto &c2 = conn2[i];
-	    if (c2.used && c2.is_udp && now - c2.last_pkt > 10) {
-		printf("[%d] %s dead UDP conn2[%u]\n",
-		       unsigned(p->port2), time_string(),
-		       unsigned(i));
-		c2.close();
-	    }
-	}
-
-	/*
-	  check for UDP user data
-	 */
-	if (p->sock1_udp != -1 &&
-	    FD_ISSET(p->sock1_udp, &fds)) {
-	    close_fd(p->sock1_tcp);
-	    struct sockaddr_in from;
-            socklen_t fromlen = sizeof(from);
-	    ssize_t n = recvfrom(p->sock1_udp, buf, sizeof(buf), 0,
-                             (struct sockaddr *)&from, &fromlen);
-	    if (n < 0) break;
-            last_pkt1 = now;
-            count1++;
-            if (!have_conn1) {
-                if (connect(p->sock1_udp, (struct sockaddr *)&from, fromlen) != 0) {
-                    break;
-                }
-		mav1.init(p->sock1_udp, CHAN_COMM1, bidi, false, false, conn1_key_id);
-                have_conn1 = true;
-		mav1_peer = from;
-		mav1_connected_at = time(nullptr);
-		mav1_is_tcp = false;
-		// trigger an immediate connections.tdb snapshot on the next
-		// loop iteration so the web UI sees the new conn quickly
-		last_conn_save_s = 0;
-		printf("[%d] %s have UDP conn1 for from %s\n", unsigned(p->port2), time_string(), addr_to_str(from));
-            }
-            mavlink_message_t msg {};
-	    // Parse user-side bytes whenever there's anywhere for them to
-	    // go: a connected engineer (forward), tlog recording, or
-	    // binlog recording. Without one of those, the bytes are read
-	    // off the socket but discarded.
-	    if (conn2_count > 0 || binlog_enabled || tlog_enabled) {
-		uint8_t *buf0 = buf;
-		while (n > 0 && mav1.receive_message(buf0, n, msg)) {
-		    mav1_rx_msgs++;
-		    ensure_tlog_open();
-		    tlog_write_message(tlog_ptr(), msg);
-		    if (binlog_handle_user_msg(msg)) {
-			continue;  // strip REMOTE_LOG_* from user→engineer
-		    }
-		    for (uint8_t i=0; i<max_conn2_count; i++) {
-			auto &c2 = conn2[i];
-			if (!c2.used) {
-			    continue;
-			}
-			if (!c2.is_udp && c2.sock != -1) {
-			    if (!c2.mav.send_message(msg)) {
-				c2.close();
-				if (conn2_count == max_conn2_count) {
-				    max_conn2_count--;
-				}
-				conn2_count--;
-			    } else {
-				c2.tx_msgs++;
-			    }
-			}
-			if (c2.is_udp) {
-			    c2.mav.send_message(msg);
-			    c2.tx_msgs++;
-			}
-		    }
-		}
-	    }
+        if (ret < 0) break;
+        if (session.done()) break;
+
+        const double now = time_seconds();
+        session.service(now);
+
+        /*
+          snapshot live connections to connections.tdb from the
+          writer thread so we don't block on disk I/O
+         */
+        if (session.snapshot_due(now)) {
+            ProxySession::save_snapshots(std::vector<ProxySession *> { &session }, now);
         }
+    }
 
-	/*
-	  check for UDP support engineer data
-	 */
-	if (p->sock2_udp != -1 &&
-	    FD_ISSET(p->sock2_udp, &fds)) {
-	    struct sockaddr_in from;
-            socklen_t fromlen = sizeof(from);
-	    ssize_t n = recvfrom(p->sock2_udp, buf, sizeof(buf), 0,
-                             (struct sockaddr *)&from, &fromlen);
-	    if (n < 0) break;
-	    count2++;
-
-	    // find existing slot
-	    int idx = -1;
-	    for (uint8_t i=0; i<max_conn2_count; i++) {
-		auto &c2 = conn2[i];
-		if (c2.used && c2.is_udp &&
-		    from.sin_addr.s_addr == c2.from.sin_addr.s_addr &&
-		    from.sin_port == c2.from.sin_port &&
-		    fromlen == c2.fromlen) {
-		    // found it
-		    idx = &c2 - &conn2[0];
-		    c2.last_pkt = now;
-		    break;
-		}
-	    }
-
-	    if (idx == -1) {
-		// find a free slot
-		for (auto &c2 : conn2) {
-		    if (!c2.used) {
-			idx = int(&c2 - &conn2[0]),
-			c2.from = from;
-			c2.fromlen = fromlen;
-			c2.tcp_active = true;
-			c2.sock = -1;
-			c2.is_udp = true;
-			conn2_count++;
-			max_conn2_count = MAX(max_conn2_count, conn2_count);
-			c2.mav.init(p->sock2_udp, CHAN_COMM2(idx), true, false, false, p->port2);
-			c2.mav.set_sendto(from, fromlen);
-			c2.used = true;
-			c2.last_pkt = now;
-			c2.connected_at = time(nullptr);
-			c2.rx_msgs = 0;
-			c2.tx_msgs = 0;
-			last_conn_save_s = 0;  // immediate snapshot
-			printf("[%u] %s have UDP conn2[%u] from %s\n",
-			       unsigned(p->port2), time_string(),
-			       unsigned(idx+1),
-			       addr_to_str(from));
-			break;
-		    }
-		}
-	    }
-
-	    if (idx != -1) {
-		mavlink_message_t msg {};
-		if (have_conn1) {
-		    uint8_t *buf0 = buf;
-		    bool failed = false;
-		    auto &c2 = conn2[idx];
-		    while (n > 0 && c2.mav.receive_message(buf0, n, msg)) {
-			c2.rx_msgs++;
-			ensure_tlog_open();
-			tlog_write_message(tlog_ptr(), msg);
-			if (!mav1.send_message(msg)) {
-			    failed = true;
-			    break;
-			}
-			mav1_tx_msgs++;
-		    }
-		    if (failed) {
-			break;
-		    }
-		}
-	    }
-	}
-
-	/*
-	  check for TCP user new connections
-	 */
-	if (!have_conn1 &&
-	    p->sock1_tcp != -1 &&
-	    FD_ISSET(p->sock1_tcp, &fds)) {
-	    close_fd(p->sock1_udp);
-	    struct sockaddr_in from;
-	    socklen_t fromlen = sizeof(from);
-	    int fd2 = accept(p->sock1_tcp, (struct sockaddr *)&from, &fromlen);
-	    if (fd2 < 0) {
-		break;
-	    }
-	    set_tcp_options(fd2);
-	    set_nonblocking(fd2);
-	    close(p->sock1_tcp);
-	    p->sock1_tcp = fd2;
-	    fdmax = MAX(fdmax, p->sock1_tcp);
-	    have_conn1 = true;
-	    mav1_peer = from;
-	    mav1_connected_at = time(nullptr);
-	    mav1_is_tcp = true;
-	    last_conn_save_s = 0;  // immediate snapshot
-	    printf("[%d] %s have TCP conn1 for from %s\n", unsigned(p->port2), time_string(), addr_to_str(from));
-	    mav1.init(p->sock1_tcp, CHAN_COMM1, bidi, false, true, conn1_key_id);
-	    last_pkt1 = now;
-	    continue;
-	}
-
-	/*
-	  check for TCP user data
-	 */
-	if (p->sock1_tcp != -1 &&
-	    FD_ISSET(p->sock1_tcp, &fds)) {
-	    close_fd(p->sock1_udp);
-
-	    if (count1 == 0 && WebSocket::detect(p->sock1_tcp)) {
-		p->ws = new WebSocket(p->sock1_tcp);
-		if (p->ws == nullptr) {
-		    break;
-		}
-		mav1.set_ws(p->ws);
-		printf("[%d] %s WebSocket%s conn1\n", unsigned(p->port2), time_string(),
-		       p->ws->is_SSL()?" SSL":"");
-	    }
-	    ssize_t n;
-	    if (p->ws) {
-		n = p->ws->recv(buf, sizeof(buf)-1);
-	    } else {
-		n = recv(p->sock1_tcp, buf, sizeof(buf)-1, 0);
-	    }
-	    if (p->ws) {
-		    if (n < 0) { printf("[%d] %s EOF TCP conn1\n", unsigned(p->port2), time_string()); break; }
-		    if (n == 0) { /* no complete frame yet */ ; }
-		} else {
-		    if (n <= 0) { printf("[%d] %s EOF TCP conn1\n", unsigned(p->port2), time_string()); break; }
-		}
-	    last_pkt1 = now;
-            count1++;
-	    mavlink_message_t msg {};
-	    // Parse whenever a downstream consumer needs it (engineer
-	    // forward, tlog, or binlog). Otherwise just discard.
-	    if (conn2_count > 0 || binlog_enabled || tlog_enabled) {
-		uint8_t *buf0 = buf;
-		while (n > 0 && mav1.receive_message(buf0, n, msg)) {
-		    mav1_rx_msgs++;
-		    ensure_tlog_open();
-		    tlog_write_message(tlog_ptr(), msg);
-		    if (binlog_handle_user_msg(msg)) {
-			continue;  // strip REMOTE_LOG_* from user→engineer
-		    }
-		    for (uint8_t i=0; i<max_conn2_count; i++) {
-			auto &c2 = conn2[i];
-			if (!c2.used) {
-			    continue;
-			}
-			if (!c2.mav.send_message(msg)) {
-			    c2.close();
-			    if (conn2_count == max_conn2_count) {
-				max_conn2_count--;
-			    }
-			    conn2_count--;
-			} else {
-			    c2.tx_msgs++;
-			}
-		    }
-		}
-	    }
-	}
-
-	/*
-	  check for new TCP support engineer connection
-	 */
-	if (p->sock2_listen != -1 &&
-	    FD_ISSET(p->sock2_listen, &fds)) {
-	    struct sockaddr_in from;
-	    socklen_t fromlen = sizeof(from);
-	    int fd2 = accept(p->sock2_listen, (struct sockaddr *)&from, &fromlen);
-	    if (fd2 < 0) {
-		continue;
-	    }
-	    if (conn2_count >= MAX_COMM2_LINKS) {
-		close(fd2);
-		continue;
-	    }
-
-	    set_tcp_options(fd2);
-	    set_nonblocking(fd2);
-
-	    uint8_t i;
-	    for (i=0; i<MAX_COMM2_LINKS; i++) {
-		if (!conn2[i].used) {
-		    break;
-		}
-	    }
-	    if (i == MAX_COMM2_LINKS) {
-		printf("[%d] %s too many TCP connections BUG: max %u\n", unsigned(p->port2), time_string(), unsigned(MAX_COMM2_LINKS));
-		close(fd2);
-		continue;
-	    }
-	    auto &c2 = conn2[i];
-	    c2.sock = fd2;
-	    c2.tcp_active = false;
-	    c2.used = true;
-	    c2.is_udp = false;
-	    c2.from = from;
-	    c2.fromlen = fromlen;
-	    c2.connected_at = time(nullptr);
-	    c2.rx_msgs = 0;
-	    c2.tx_msgs = 0;
-	    last_conn_save_s = 0;  // immediate snapshot
-	    fdmax = MAX(fdmax, c2.sock);
-	    printf("[%d] %s have TCP conn2[%u] for from %s\n", unsigned(p->port2), time_string(), unsigned(i+1), addr_to_str(from));
-	    c2.mav.init(c2.sock, CHAN_COMM2(i), true, true, true, p->port2);
-	    conn2_count++;
-	    max_conn2_count = MAX(max_conn2_count, conn2_count);
-	    continue;
-	}
+    session.finish();
+    // the session's last writes, before the child exits
+    db_writer_flush();
+    delete uring;
+}
 
-	/*
-	  check for new TCP support engineer data
-	 */
-	for (uint8_t i=0; i<max_conn2_count; i++) {
-	    auto &c2 = conn2[i];
-	    if (c2.is_udp || !c2.used || c2.sock == -1) {
-		continue;
-	    }
-	    if (FD_ISSET(c2.sock, &fds)) {
-		if (!c2.tcp_active && WebSocket::detect(c2.sock)) {
-		    c2.ws = new WebSocket(c2.sock);
-		    if (c2.ws == nullptr) {
-			break;
-		    }
-		    c2.mav.set_ws(c2.ws);
-		    printf("[%d] %s WebSocket%s conn2\n", unsigned(p->port2), time_string(), c2.ws->is_SSL()?" SSL":"");
-		}
-		ssize_t n;
-		if (c2.ws) {
-		    n = c2.ws->recv(buf, sizeof(buf)-1);
-		} else {
-		    n = recv(c2.sock, buf, sizeof(buf)-1, 0);
-		}
-		if (c2.ws) {
-		            if (n < 0) {
-		                printf("[%d] %s EOF TCP conn2[%u]\n", unsigned(p->port2), time_string(), unsigned(i+1));
-		                c2.close();
-		                if (conn2_count == max_conn2_count) { max_conn2_count--; }
-		                conn2_count--;
-		                continue;
-		            }
-		            if (n == 0) {
-		                // no complete frame yet
-		                continue;
-		            }
-		        } else {
-		            if (n <= 0) {
-		                printf("[%d] %s EOF TCP conn2[%u]\n", unsigned(p->port2), time_string(), unsigned(i+1));
-		                c2.close();
-		                if (conn2_count == max_conn2_count) { max_conn2_count--; }
-		                conn2_count--;
-		                continue;
-		            }
-		        }
-		buf[n] = 0;
-		count2++;
-		c2.tcp_active = true;
-		mavlink_message_t msg {};
-		if (have_conn1) {
-		    uint8_t *buf0 = buf;
-		    bool failed = false;
-		    while (n > 0 && c2.mav.receive_message(buf0, n, msg)) {
-			c2.rx_msgs++;
-			ensure_tlog_open();
-			tlog_write_message(tlog_ptr(), msg);
-			if (!mav1.send_message(msg)) {
-			    failed = true;
-			    break;
-			}
-			mav1_tx_msgs++;
-		    }
-		    if (failed) {
-			break;
-		    }
-		}
-	    }
-	}
+/*
+  close all sockets
+ */
+static void close_sockets(struct listen_port *p)
+{
+    // the parent loop must forget a socket before it is closed here:
+    // a forked child may still hold it open
+    unwatch_port(p);
+    close_fd(p->sock1_udp);
+    close_fd(p->sock2_udp);
+    close_fd(p->sock1_tcp);
+    close_fd(p->sock2_listen);
+}
 
-	// Pump binlog state: before the first DATA_BLOCK this emits the
-	// magic START to nudge the vehicle into streaming (and to make
-	// its pre-arm logging check pass); afterwards it drains pending
-	// ACKs / NACKs. Needs to fire whenever binlog is enabled, not
-	// just when the file is open, since the START phase predates
-	// the file.
-	if (binlog_enabled && have_conn1) {
-	    binlog.tick(mav1);
-	}
+/*
+  open one socket pair
+ */
+static void open_sockets(struct listen_port *p)
+{
+    listen_port_open(p);
+    watch_port(p);
+}
 
-	/*
-	  Heartbeat snapshot of live connections to connections.tdb.
-	  Throttled to 5s and forked into a grandchild so we don't
-	  block main_loop on disk I/O. Same pattern as
-	  save_signing_timestamp() in mavlink.cpp. The web UI's
-	  http-equiv refresh runs at the same cadence.
-	 */
-	{
-	    double snap_now = time_seconds();
-	    if (snap_now - last_conn_save_s > 5) {
-		last_conn_save_s = snap_now;
-		signal(SIGCHLD, SIG_IGN);
-		if (fork() == 0) {
-		    auto *db = conn_db_open_transaction();
-		    if (db != nullptr) {
-			conn_delete_for_port2(db, p->port2);
-			time_t now_t = time(nullptr);
-			if (have_conn1) {
-			    struct ConnEntry e {};
-			    e.magic = CONN_MAGIC;
-			    e.connected_at = mav1_connected_at;
-			    e.last_update = now_t;
-			    e.port2 = p->port2;
-			    e.conn_index = 0;
-			    e.pid = my_pid;
-			    e.rx_msgs = mav1_rx_msgs;
-			    e.tx_msgs = mav1_tx_msgs;
-			    e.peer_ip_be = mav1_peer.sin_addr.s_addr;
-			    e.peer_port_be = mav1_peer.sin_port;
-			    if (p->ws) {
-				e.transport = p->ws->is_SSL() ? CONN_TRANSPORT_WSS : CONN_TRANSPORT_WS;
-			    } else {
-				e.transport = mav1_is_tcp ? CONN_TRANSPORT_TCP : CONN_TRANSPORT_UDP;
-			    }
-			    e.is_user = 1;
-			    conn_write(db, e);
-			}
-			for (uint8_t i = 0; i < max_conn2_count; i++) {
-			    const auto &c2 = conn2[i];
-			    if (!c2.used) {
-				continue;
-			    }
-			    struct ConnEntry e {};
-			    e.magic = CONN_MAGIC;
-			    e.connected_at = c2.connected_at;
-			    e.last_update = now_t;
-			    e.port2 = p->port2;
-			    e.conn_index = i + 1;
-			    e.pid = my_pid;
-			    e.rx_msgs = c2.rx_msgs;
-			    e.tx_msgs = c2.tx_msgs;
-			    e.peer_ip_be = c2.from.sin_addr.s_addr;
-			    e.peer_port_be = c2.from.sin_port;
-			    if (c2.is_udp) {
-				e.transport = CONN_TRANSPORT_UDP;
-			    } else if (c2.ws) {
-				e.transport = c2.ws->is_SSL() ? CONN_TRANSPORT_WSS : CONN_TRANSPORT_WS;
-			    } else {
-				e.transport = CONN_TRANSPORT_TCP;
-			    }
-			    e.is_user = 0;
-			    conn_write(db, e);
-			}
-			conn_db_close_commit(db);
-		    }
-		    exit(0);
-		}
-	    }
-	}
+/*
+  children of the parent: session children, pool workers and the log
+  cleanup child. In the default mode each is watched through a pidfd
+  in the parent loop, so an exit is handled in the wakeup it happens
+  in: the port pair's connections.tdb records go and its listeners
+  reopen within milliseconds, however busy the loop is.
+  check_children() still polls once a second each child without a
+  pidfd (kernels before 5.3, the main thread in reactor mode), and
+  nothing else
+ */
+struct ChildInfo {
+    int pidfd;
+    double started_s;
+};
+static std::unordered_map<pid_t, ChildInfo> child_info;
+// entries of child_info with no pidfd
+static unsigned unwatched_children;
+
+// fork to exit, logged once a minute when something changed
+static struct {
+    uint32_t started;
+    uint32_t exited;
+    uint32_t signalled;
+    uint32_t failed;
+    double lifetime_s;
+} child_stats;
+
+static void reap_child(pid_t pid);
+
+static void watch_child(pid_t pid, ChildInfo &c)
+{
+    if (parent_loop == nullptr || c.pidfd != -1) {
+        return;
     }
-
-    if (count1 != 0 || count2 != 0) {
-        printf("[%d] %s Closed connection count1=%u count2=%u\n",
-               p->port2,
-               time_string(),
-               unsigned(count1),
-	       unsigned(count2));
-        // update database
-        auto *db = db_open_transaction();
-        if (db != nullptr) {
-            struct KeyEntry ke;
-            if (db_load_key(db, p->port2, ke)) {
-                ke.count1 += count1;
-		ke.count2 += count2;
-                ke.connections++;
-                db_save_key(db, p->port2, ke);
-                db_close_commit(db);
-            } else {
-                db_close_cancel(db);
-            }
-        }
+#ifdef SYS_pidfd_open
+    // close-on-exec, as pidfds always are
+    c.pidfd = syscall(SYS_pidfd_open, pid, 0);
+#endif
+    if (c.pidfd != -1) {
+        parent_loop->add(c.pidfd, EPOLLIN, [pid](uint32_t) { reap_child(pid); });
+        unwatched_children--;
     }
 }
 
-static void close_socket(int *s)
+/*
+  note a child we forked, or one adopted from the binary we replaced
+ */
+static void child_started(pid_t pid)
+{
+    child_stats.started++;
+    auto &c = child_info[pid];
+    c = ChildInfo { -1, time_seconds() };
+    unwatched_children++;
+    watch_child(pid, c);
+}
+
+// watch the children forked before the parent loop existed
+static void watch_children(void)
 {
-    if (*s != -1) {
-	close(*s);
-	*s = -1;
+    for (auto &c : child_info) {
+        watch_child(c.first, c.second);
     }
 }
 
 /*
-  close all sockets
+  stop watching pid. Returns how long it ran, or -1 if it isn't one
+  we knew about
  */
-static void close_sockets(struct listen_port *p)
+static double forget_child(pid_t pid)
 {
-    close_socket(&p->sock1_udp);
-    close_socket(&p->sock2_udp);
-    close_socket(&p->sock1_tcp);
-    close_socket(&p->sock2_listen);
+    auto it = child_info.find(pid);
+    if (it == child_info.end()) {
+        return -1;
+    }
+    if (it->second.pidfd != -1) {
+        if (parent_loop != nullptr) {
+            parent_loop->remove(it->second.pidfd);
+        }
+        close(it->second.pidfd);
+    } else {
+        unwatched_children--;
+    }
+    const double lifetime = time_seconds() - it->second.started_s;
+    child_info.erase(it);
+    return lifetime;
+}
+
+// how a child ended, for the log
+static std::string exit_reason(int wstatus)
+{
+    if (WIFSIGNALED(wstatus)) {
+        return " on signal " + std::to_string(WTERMSIG(wstatus));
+    }
+    if (WIFEXITED(wstatus) && WEXITSTATUS(wstatus) != 0) {
+        return " with status " + std::to_string(WEXITSTATUS(wstatus));
+    }
+    return "";
 }
 
 /*
-  open one socket pair
+  a child has been reaped
  */
-static void open_sockets(struct listen_port *p)
+static void child_exited(pid_t pid, int wstatus)
 {
-    if (p->sock1_udp == -1) {
-	p->sock1_udp = open_socket_in_udp(p->port1);
-	if (p->sock1_udp == -1) {
-	    printf("[%d] Failed to open UDP port %d - %s\n", p->port2, p->port1, strerror(errno));
-	}
+    const double lifetime = forget_child(pid);
+    if (lifetime >= 0) {
+        child_stats.exited++;
+        child_stats.lifetime_s += lifetime;
+        if (WIFSIGNALED(wstatus)) {
+            child_stats.signalled++;
+        } else if (WIFEXITED(wstatus) && WEXITSTATUS(wstatus) != 0) {
+            child_stats.failed++;
+        }
     }
-    if (p->sock2_udp == -1) {
-	p->sock2_udp = open_socket_in_udp(p->port2);
-	if (p->sock2_udp == -1) {
-	    printf("[%d] Failed to open UDP port %d - %s\n", p->port2, p->port2, strerror(errno));
-	}
+    const std::string reason = exit_reason(wstatus);
+    if (pool.reap(pid)) {
+        printf("Idle worker %d exited%s\n", int(pid), reason.c_str());
+        return;
     }
-    if (p->sock1_tcp == -1) {
-	p->sock1_tcp = open_socket_in_tcp(p->port1);
-	if (p->sock1_tcp == -1) {
-	    printf("[%d] Failed to open TCP port %d - %s\n", p->port2, p->port1, strerror(errno));
-	}
+    if (pid == cleanup_child_pid) {
+        printf("log cleanup child %d exited%s; respawning\n", int(pid), reason.c_str());
+        cleanup_child_pid = 0;
+        fork_cleanup_child();
+        return;
     }
-    if (p->sock2_listen == -1) {
-	p->sock2_listen = open_socket_in_tcp(p->port2);
-	if (p->sock2_listen == -1) {
-	    printf("[%d] Failed to open TCP port %d - %s\n", p->port2, p->port2, strerror(errno));
-	}
+    auto it = ports_by_pid.find(pid);
+    if (it == ports_by_pid.end()) {
+        printf("No child for %d found\n", int(pid));
+        return;
+    }
+    auto *p = it->second;
+    if (lifetime >= 0) {
+        printf("[%d] Child %d exited after %.1fs%s\n", p->port2, int(pid), lifetime, reason.c_str());
+    } else {
+        printf("[%d] Child %d exited%s\n", p->port2, int(pid), reason.c_str());
+    }
+    set_port_pid(p, 0);
+    // drop any live-connection records the child wrote
+    conn_remove_port2(p->port2);
+    // Don't reopen listening sockets for an entry that was
+    // removed from keys.tdb between fork and exit; that would
+    // rebind the port for a record that no longer exists.
+    if (!p->removed) {
+        open_sockets(p);
+    }
+}
+
+// pid's pidfd is readable: it has exited
+static void reap_child(pid_t pid)
+{
+    int wstatus = 0;
+    pid_t ret;
+    do {
+        ret = waitpid(pid, &wstatus, WNOHANG);
+    } while (ret == -1 && errno == EINTR);
+    if (ret == pid) {
+        child_exited(pid, wstatus);
+    } else if (ret == -1) {
+        // reaped already, nothing more will come
+        forget_child(pid);
     }
 }
 
 /*
-  check for child exit
+  reap those of our children with no pidfd that have exited. Only
+  pids in child_info are waited for, so a child forked by some other
+  part of the process (or a library) is left to whoever forked it
  */
 static void check_children(void)
 {
-    int wstatus = 0;
-    while (true) {
-        pid_t pid = waitpid(-1, &wstatus, WNOHANG);
-        if (pid <= 0) {
-            break;
-        }
-        if (pid == cleanup_child_pid) {
-            printf("log cleanup child %d exited; respawning\n", int(pid));
-            cleanup_child_pid = 0;
-            fork_cleanup_child();
+    if (unwatched_children == 0) {
+        return;
+    }
+    std::vector<std::pair<pid_t, int>> exited;
+    for (const auto &c : child_info) {
+        if (c.second.pidfd != -1) {
             continue;
         }
-        bool found_child = false;
-        for (auto *p = ports; p; p=p->next) {
-            if (p->pid == pid) {
-                printf("[%d] Child %d exited\n", p->port2, int(pid));
-                p->pid = 0;
-		// drop any live-connection records the child wrote
-		conn_remove_port2(p->port2);
-		found_child = true;
-		// Don't reopen listening sockets for an entry that was
-		// removed from keys.tdb between fork and exit; that would
-		// rebind the port for a record that no longer exists.
-		if (!p->removed) {
-			open_sockets(p);
-		}
-                break;
-            }
-        }
-        if (!found_child) {
-            printf("No child for %d found\n", int(pid));
+        int wstatus = 0;
+        pid_t ret;
+        do {
+            ret = waitpid(c.first, &wstatus, WNOHANG);
+        } while (ret == -1 && errno == EINTR);
+        if (ret == c.first) {
+            exited.emplace_back(ret, wstatus);
+        } else if (ret == -1) {
+            // reaped already: its port still has to reopen
+            exited.emplace_back(c.first, 0);
         }
     }
+    // child_exited() changes child_info, and may fork
+    for (const auto &e : exited) {
+        child_exited(e.first, e.second);
+    }
+}
+
+static void print_child_stats(void)
+{
+    static uint32_t last_started, last_exited;
+    if (child_stats.started == last_started && child_stats.exited == last_exited) {
+        return;
+    }
+    last_started = child_stats.started;
+    last_exited = child_stats.exited;
+    printf("Children: %u started, %u exited (%u on a signal, %u with an error), %u running, mean lifetime %.1fs\n",
+           unsigned(child_stats.started), unsigned(child_stats.exited),
+           unsigned(child_stats.signalled), unsigned(child_stats.failed),
+           unsigned(child_info.size()),
+           child_stats.exited ? child_stats.lifetime_s / child_stats.exited : 0.0);
 }
 
 /*
-  fork the long-lived cleanup child once. The child closes all listening
-  sockets it inherited from the parent (so it doesn't keep the ports
-  bound), then runs log_cleanup_loop forever.
+  fork the long-lived cleanup child once. The child closes every fd it
+  inherited past stdio (so it doesn't keep the ports bound, whether
+  the parent or the reactor threads own them), then runs
+  log_cleanup_loop forever.
  */
 static void fork_cleanup_child(void)
 {
     pid_t pid = fork();
     if (pid == 0) {
-        for (auto *p = ports; p; p = p->next) {
-            close_sockets(p);
-        }
+        detach_parent_loop();
+        pool.close_in_child();
+        close_fds_from(3);
         log_cleanup_loop();
         _exit(0);
     }
@@ -1019,6 +664,7 @@ static void fork_cleanup_child(void)
         return;
     }
     cleanup_child_pid = pid;
+    child_started(pid);
     printf("log cleanup child %d started\n", int(pid));
 }
 
@@ -1027,32 +673,49 @@ static void fork_cleanup_child(void)
  */
 static void handle_connection(struct listen_port *p)
 {
-    pid_t pid = fork();
+    unwatch_port(p);
+    pid_t pid = pool.hand_off(p);
+    if (pid != -1) {
+	set_port_pid(p, pid);
+	printf("[%d] New session in worker %d\n", p->port2, int(p->pid));
+	close_sockets(p);
+	return;
+    }
+    pid = fork();
     if (pid == 0) {
-	for (auto *p2 = ports; p2; p2=p2->next) {
-	    if (p2 != p) {
-		close_sockets(p2);
-	    }
-	}
+	detach_parent_loop();
+	pool.close_in_child();
+	// keep only our own sockets, in a few syscalls however many port
+	// pairs the parent has open
+	const int keep[] { p->sock1_udp, p->sock2_udp, p->sock1_tcp, p->sock2_listen };
+	close_fds_except(keep, 4);
 	main_loop(p);
 	exit(0);
     }
-    p->pid = pid;
+    set_port_pid(p, pid);
+    child_started(pid);
     printf("[%d] New child %d\n", p->port2, int(p->pid));
 
     close_sockets(p);
 }
 
-static void reload_ports(void)
-{
-    // mark every port pair we know about as "unseen". upsert_port()
-    // will set seen=true for any port2 it finds in the DB; entries
-    // still unseen after the traverse are gone from keys.tdb and
-    // need to be torn down.
-    for (auto *p = ports; p; p = p->next) {
-        p->seen = false;
-    }
+/*
+  sequence number of keys.tdb as of the last traverse, so a reload
+  only traverses when a record has changed since
+ */
+static int keys_seqnum;
+
+// set when inotify saw keys.tdb written
+static bool keys_touched;
+static KeyWatch key_watch;
 
+/*
+  load every record of keys.tdb. Records we already have with the same
+  port1/flags/fc_sysid are left alone, so only changed entries touch
+  sockets or children
+ */
+static void load_ports(void)
+{
     // wrap the traversal in a transaction so we see a consistent snapshot
     // even if keydb.py / the web admin UI is mutating in parallel
     auto *db = db_open_transaction();
@@ -1060,8 +723,22 @@ static void reload_ports(void)
         printf("Database not found\n");
         exit(1);
     }
+    keys_seqnum = tdb_get_seqnum(db);
     tdb_traverse(db, handle_record, nullptr);
     db_close_cancel(db);
+}
+
+static void reload_ports(void)
+{
+    // mark every port pair we know about as "unseen". upsert_port()
+    // will set seen=true for any port2 it finds in the DB; entries
+    // still unseen after the traverse are gone from keys.tdb and
+    // need to be torn down.
+    for (auto *p = ports; p; p = p->next) {
+        p->seen = false;
+    }
+
+    load_ports();
 
     // any port pair not seen during the traverse has been removed from
     // keys.tdb. Close listening sockets, signal the running child to
@@ -1071,6 +748,11 @@ static void reload_ports(void)
         if (!p->seen && !p->removed) {
             printf("[%d] removed from keys.tdb\n", p->port2);
             p->removed = true;
+            if (!shards.empty()) {
+                // the shard ends the session and clears connections.tdb
+                post_port(PortCommand::REMOVE, p);
+                continue;
+            }
             close_sockets(p);
             if (p->pid != 0) {
                 kill(p->pid, SIGTERM);
@@ -1079,7 +761,10 @@ static void reload_ports(void)
         }
     }
 
-    // see if any sockets need opening
+    // see if any sockets need opening. Shards retry their own
+    if (!shards.empty()) {
+        return;
+    }
     for (auto *p = ports; p; p=p->next) {
 	if (p->pid == 0 && !p->removed) {
 	    open_sockets(p);
@@ -1088,110 +773,456 @@ static void reload_ports(void)
 }
 
 /*
-  wait for incoming connections
+  reload keys.tdb if it was changed since the last reload, or on
+  SIGHUP. Checking costs one read-only open of the header; a traverse
+  only happens when the sequence number moved
  */
-static void wait_connection(void)
+static void check_reload(void)
 {
-    int epfd = epoll_create1(0);
-    if (epfd == -1) {
-        perror("epoll_create1");
-        exit(1);
+    const bool forced = g_reload_pending;
+    g_reload_pending = 0;
+    keys_touched = false;
+    if (forced) {
+        printf("SIGHUP: reloading %s\n", KEY_FILE);
+    } else {
+        int seqnum;
+        if (!db_get_seqnum(seqnum) || seqnum == keys_seqnum) {
+            return;
+        }
+    }
+    reload_ports();
+}
+
+static void watch_keys(void)
+{
+    struct sigaction sa = {};
+    sa.sa_handler = sighup_handler;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGHUP, &sa, nullptr);
+
+    if (!key_watch.open()) {
+        printf("Not watching %s, changes are picked up every 5 seconds\n", KEY_FILE);
     }
+}
 
-    /*
-      rebuild epoll structure for current list of connections
-     */
-    auto rebuild_epoll_set = [&]() {
-        epoll_ctl(epfd, EPOLL_CTL_DEL, -1, nullptr); // dummy cleanup if needed
-        for (auto *p = ports; p; p = p->next) {
-            if (p->pid != 0 || p->removed) continue;
+/*
+  read the session children handed over by upgrade(), and how many of
+  the passed listeners are kept ones. Returns true if we were started
+  that way
+ */
+static bool take_upgrade_children(unsigned &kept)
+{
+    const char *env = getenv(UPGRADE_ENV);
+    if (env == nullptr) {
+        return false;
+    }
+    int port2, pid, n = 0;
+    kept = 0;
+    if (sscanf(env, "%u;%n", &kept, &n) == 1 && n > 0) {
+        env += n;
+    } else {
+        kept = 0;
+    }
+    while (sscanf(env, "%d:%d,%n", &port2, &pid, &n) == 2) {
+        upgrade_children[port2] = pid;
+        env += n;
+    }
+    unsetenv(UPGRADE_ENV);
+    return true;
+}
 
-            struct epoll_event ev = {};
-            ev.events = EPOLLIN;
-            ev.data.ptr = p;
+/*
+  re-exec exe_path, normally a newly installed binary, in place.
+
+  Session children keep running the old code until their session
+  ends. They stay our children across the exec, and the new binary is
+  told which port pair each one serves, so it reaps them and reopens
+  their ports as usual. The listening sockets of idle port pairs are
+  passed as LISTEN_FDS and picked up by listen_port_inherit(), so no
+  port is unbound at any point. Listeners from socket activation are
+  all passed, busy ports' included, and stay kept in the new binary.
+  Only new sessions run the new code: a live session is not migrated,
+  its state stays in the old child. Idle pool workers are stopped
+  and the new binary forks its own.
+
+  Returns only if the exec can't be attempted; once the fds have been
+  rearranged a failure exits, leaving the children running
+ */
+static void upgrade(void)
+{
+    if (access(exe_path, X_OK) != 0) {
+        printf("Upgrade: can't run %s - %s\n", exe_path, strerror(errno));
+        return;
+    }
 
-            if (p->sock1_udp != -1) {
-                ev.data.fd = p->sock1_udp;
-                epoll_ctl(epfd, EPOLL_CTL_ADD, p->sock1_udp, &ev);
-            }
-            if (p->sock2_udp != -1) {
-                ev.data.fd = p->sock2_udp;
-                epoll_ctl(epfd, EPOLL_CTL_ADD, p->sock2_udp, &ev);
-            }
-            if (p->sock1_tcp != -1) {
-                ev.data.fd = p->sock1_tcp;
-                epoll_ctl(epfd, EPOLL_CTL_ADD, p->sock1_tcp, &ev);
+    // kept listeners first, so the new binary knows them by position
+    std::vector<int> fds;
+    listen_port_kept(fds);
+    std::string children = std::to_string(fds.size()) + ";";
+    for (auto *p = ports; p; p = p->next) {
+        if (p->removed) {
+            continue;
+        }
+        if (p->pid != 0) {
+            children += std::to_string(p->port2) + ":" + std::to_string(p->pid) + ",";
+            continue;
+        }
+        const struct {
+            int fd;
+            int port;
+            bool tcp;
+        } socks[] {
+            { p->sock1_udp, p->port1, false },
+            { p->sock2_udp, p->port2, false },
+            { p->sock1_tcp, p->port1, true },
+            { p->sock2_listen, p->port2, true },
+        };
+        for (const auto &k : socks) {
+            // a dup of a kept one is passed as that
+            if (k.fd != -1 && !listen_port_is_kept(k.port, k.tcp)) {
+                fds.push_back(k.fd);
             }
-            if (p->sock2_listen != -1) {
-                ev.data.fd = p->sock2_listen;
-                epoll_ctl(epfd, EPOLL_CTL_ADD, p->sock2_listen, &ev);
+        }
+    }
+
+    // LISTEN_FDS wants them at 3 onwards. Copy them above that range
+    // first, so no dup2() below overwrites one we haven't moved yet
+    const int n = fds.size();
+    std::vector<int> moved;
+    for (int fd : fds) {
+        const int fd2 = fcntl(fd, F_DUPFD_CLOEXEC, 3 + n);
+        if (fd2 == -1) {
+            printf("Upgrade: fcntl failed - %s\n", strerror(errno));
+            for (int m : moved) {
+                close(m);
             }
+            return;
         }
-    };
+        moved.push_back(fd2);
+    }
+
+    printf("Upgrading to %s with %d listeners and %u running sessions\n",
+           exe_path, n, unsigned(ports_by_pid.size()));
+    fflush(stdout);
+
+    // writes still queued would be lost in the exec
+    db_writer_flush();
 
-    rebuild_epoll_set();
+    // the new binary forks its own. Reap this one first: it would
+    // otherwise exit under the new binary as a child it doesn't know
+    if (cleanup_child_pid != 0) {
+        const pid_t pid = cleanup_child_pid;
+        cleanup_child_pid = 0;
+        kill(pid, SIGTERM);
+        while (waitpid(pid, nullptr, 0) == -1 && errno == EINTR) {
+        }
+        forget_child(pid);
+    }
+    // their control sockets close on exec and they would exit the same
+    // way, unknown to the new binary and never reaped
+    for (pid_t pid : pool.stop()) {
+        forget_child(pid);
+    }
+
+    for (int i = 0; i < n; i++) {
+        // dup2() leaves FD_CLOEXEC clear on the copy
+        if (dup2(moved[i], 3 + i) == -1) {
+            perror("dup2");
+            exit(1);
+        }
+    }
+    setenv("LISTEN_PID", std::to_string(getpid()).c_str(), 1);
+    setenv("LISTEN_FDS", std::to_string(n).c_str(), 1);
+    setenv(UPGRADE_ENV, children.c_str(), 1);
+    execv(exe_path, saved_argv);
+    perror("execv");
+    exit(1);
+}
+
+/*
+  wait for incoming connections
+ */
+static void wait_connection(void)
+{
+    EventLoop loop;
+    if (!loop.ok()) {
+        exit(1);
+    }
+    parent_loop = &loop;
+    for (auto *p = ports; p; p = p->next) {
+        watch_port(p);
+    }
+    watch_children();
+    if (key_watch.fd() != -1) {
+        loop.add(key_watch.fd(), EPOLLIN, [](uint32_t) {
+            if (key_watch.changed()) {
+                keys_touched = true;
+            }
+        });
+    }
 
     double last_reload = time_seconds();
-    struct epoll_event events[MAX_EPOLL_EVENTS];
+    double last_check = last_reload;
+    double last_stats = last_reload;
 
     while (true) {
-	int ret = epoll_wait(epfd, events, MAX_EPOLL_EVENTS, 1000); // 1 second timeout
-
-        if (ret == -1) {
-            if (errno == EINTR) continue;
+        int ret = loop.poll(1000); // 1 second timeout
+        if (ret == -1 && errno != EINTR) {
             perror("epoll_wait");
             break;
         }
+        const double now = time_seconds();
 
-        if (ret == 0) {
+        // replace the workers that took sessions, now that those have
+        // their sockets
+        pool.refill();
+
+        if (now - last_check >= 1) {
+            last_check = now;
             check_children();
-            double now = time_seconds();
-            if (now - last_reload > 5) {
-                last_reload = now;
-                reload_ports();
-                close(epfd);
-                epfd = epoll_create1(0);
-                rebuild_epoll_set();
-            }
-            continue;
+            tls_context_check_reload();
+        }
+        if (now - last_stats >= 60) {
+            last_stats = now;
+            print_child_stats();
+        }
+
+        // the sequence number is also checked every few seconds in
+        // case an inotify event was missed
+        if (keys_touched || g_reload_pending || now - last_reload > 5) {
+            last_reload = now;
+            check_reload();
         }
 
-        for (int i = 0; i < ret; i++) {
-            int fd = events[i].data.fd;
+        if (g_upgrade_pending) {
+            g_upgrade_pending = 0;
+            // pick up any children that already exited, so their
+            // ports are passed on rather than left to the new binary
+            check_children();
+            upgrade();
+        }
+    }
+    parent_loop = nullptr;
+}
+
+/*
+  the main thread in reactor mode: the shards do all the socket work,
+  this keeps keys.tdb in sync and routes drop requests to them
+ */
+static void wait_reactor(void)
+{
+    double last_reload = time_seconds();
+    double last_check = last_reload;
+    double last_stats = last_reload;
 
-            for (auto *p = ports; p; p = p->next) {
-                if (p->pid != 0 || p->removed) continue;
-                if ((p->sock1_udp == fd || p->sock2_udp == fd ||
-                     p->sock1_tcp == fd || p->sock2_listen == fd)) {
-                    handle_connection(p);
-                    break;
-                }
+    struct pollfd pfd { key_watch.fd(), POLLIN, 0 };
+
+    while (true) {
+        // SIGUSR1 and SIGHUP cut the sleep short. A negative fd is
+        // ignored by poll()
+        if (poll(&pfd, 1, 1000) > 0 && key_watch.changed()) {
+            keys_touched = true;
+        }
+        const double now = time_seconds();
+
+        if (g_drops_pending) {
+            g_drops_pending = 0;
+            std::vector<struct ConnKey> drops;
+            conn_take_drop_requests(-1, drops);
+            for (const auto &k : drops) {
+                PortCommand cmd {};
+                cmd.type = PortCommand::DROP;
+                cmd.port2 = k.port2;
+                cmd.conn_index = k.conn_index;
+                shard_for(k.port2)->post(cmd);
             }
         }
+
+        if (now - last_check >= 1) {
+            last_check = now;
+            check_children();
+            tls_context_check_reload();
+        }
+        if (now - last_stats >= 60) {
+            last_stats = now;
+            print_child_stats();
+        }
+
+        if (keys_touched || g_reload_pending || now - last_reload > 5) {
+            last_reload = now;
+            check_reload();
+        }
+
+        if (g_upgrade_pending) {
+            g_upgrade_pending = 0;
+            // sessions are threads of this process and would not
+            // survive the exec
+            printf("Upgrade on SIGUSR2 is not supported with -r\n");
+        }
     }
-    close(epfd);
+}
+
+static void usage(void)
+{
+    printf("Usage: supportproxy [-r] [-t THREADS] [-u] [-p WORKERS] [-k]\n");
+    printf("  -r          run sessions on reactor threads instead of one child per port pair\n");
+    printf("  -t THREADS  number of reactor threads (implies -r, default 1)\n");
+    printf("  -u          use io_uring for session sockets (IO_URING=1 builds)\n");
+    printf("  -p WORKERS  keep WORKERS pre-forked session workers ready (not with -r)\n");
+    printf("  -k          hand WSS connections to kernel TLS after the handshake, if available\n");
 }
 
 int main(int argc, char *argv[])
 {
     setvbuf(stdout, nullptr, _IOLBF, 4096);
+
+    saved_argv = argv;
+    const ssize_t len = readlink("/proc/self/exe", exe_path, sizeof(exe_path) - 1);
+    if (len > 0) {
+        exe_path[len] = 0;
+    } else {
+        strncpy(exe_path, argv[0], sizeof(exe_path) - 1);
+    }
+
+    bool reactor_mode = false;
+    unsigned nthreads = 1;
+    unsigned pool_size = 0;
+    bool use_ktls = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "rt:up:kh")) != -1) {
+        switch (opt) {
+        case 'r':
+            reactor_mode = true;
+            break;
+        case 't':
+            reactor_mode = true;
+            nthreads = atoi(optarg);
+            if (nthreads < 1 || nthreads > 256) {
+                printf("Bad thread count %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'u':
+            use_uring = true;
+            break;
+        case 'p':
+            pool_size = atoi(optarg);
+            if (pool_size > 1024) {
+                printf("Bad worker count %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'k':
+            use_ktls = true;
+            break;
+        default:
+            usage();
+            exit(opt == 'h' ? 0 : 1);
+        }
+    }
+
+    if (use_uring) {
+        EventLoop probe;
+        auto *u = UringIO::create(probe);
+        if (u == nullptr) {
+            printf("io_uring not available, using epoll\n");
+            use_uring = false;
+        }
+        delete u;
+    }
+
+    unsigned kept = 0;
+    const bool upgraded = take_upgrade_children(kept);
+    const unsigned passed = listen_port_inherit(upgraded ? kept : UINT_MAX);
+    if (upgraded) {
+        printf("Upgraded: %u listeners and %u running sessions handed over\n",
+               passed, unsigned(upgrade_children.size()));
+    } else if (passed > 0) {
+        printf("Using %u listeners from socket activation\n", passed);
+    }
+
     printf("Opening sockets\n");
     // Wipe any connections.tdb records left behind by a previous run.
     // Per-port-pair children write into this file; on a fresh start no
     // record can be live yet. Doing this in the parent before any fork
-    // means we never race with a live writer.
-    conn_recreate_empty();
-    auto *db = db_open_transaction();
-    if (db == nullptr) {
-        printf("Database not found\n");
-        exit(1);
+    // means we never race with a live writer. After an upgrade the
+    // children that wrote them are still running.
+    if (!upgraded) {
+        conn_recreate_empty();
     }
-    tdb_traverse(db, handle_record, nullptr);
+
+    {
+        // a peer that has gone away shows up as a send() error on its
+        // link, including inside SSL_write()
+        struct sigaction sa = {};
+        sa.sa_handler = SIG_IGN;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGPIPE, &sa, nullptr);
+    }
+
+    {
+        struct sigaction sa = {};
+        sa.sa_handler = sigusr2_handler;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGUSR2, &sa, nullptr);
+    }
+
+    // before any session child or reactor thread, which all share it
+    if (use_ktls) {
+        tls_context_use_ktls();
+    }
+    if (!tls_context_load()) {
+        printf("WSS connections will fail until the certificate is installed\n");
+    }
+
+    if (reactor_mode) {
+        // drop requests from the webadmin now come to this process
+        struct sigaction sa = {};
+        sa.sa_handler = sigusr1_handler;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGUSR1, &sa, nullptr);
+
+        // fork before any thread exists so the child starts clean
+        fork_cleanup_child();
+
+        for (unsigned i = 0; i < nthreads; i++) {
+            auto *shard = new Shard(i, use_uring);
+            if (!shard->start()) {
+                printf("Failed to start reactor thread %u\n", i);
+                exit(1);
+            }
+            shards.push_back(shard);
+        }
+        printf("Running sessions on %u reactor thread(s)\n", nthreads);
+        if (pool_size > 0) {
+            printf("-p has no effect with reactor threads\n");
+        }
+    }
+
+    load_ports();
     printf("Added %u ports\n", unsigned(count_ports()));
-    db_close_cancel(db);
+    watch_keys();
+
+    // handed-over children whose entry was removed from keys.tdb in
+    // the meantime; check_children() reaps them
+    for (const auto &c : upgrade_children) {
+        printf("[%d] removed from keys.tdb, ending session %d\n", c.first, int(c.second));
+        kill(c.second, SIGTERM);
+    }
+    upgrade_children.clear();
+
+    if (reactor_mode) {
+        wait_reactor();
+        return 0;
+    }
 
     fork_cleanup_child();
 
+    if (pool_size > 0) {
+        pool.set_size(pool_size);
+        printf("Started %u session workers\n", pool_size);
+    }
+
     wait_connection();
 
     return 0;
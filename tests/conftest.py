@@ -14,23 +14,28 @@ os.environ['TEST_PORT_USER'] = str(14552 + _WORKER_ID * 2)
 os.environ['TEST_PORT_ENGINEER'] = str(14553 + _WORKER_ID * 2)
 os.environ['TEST_PORT_USER_BIDI'] = str(14652 + _WORKER_ID * 2)
 os.environ['TEST_PORT_ENGINEER_BIDI'] = str(14653 + _WORKER_ID * 2)
+os.environ['TEST_PORT_USER_PASSTHROUGH'] = str(14752 + _WORKER_ID * 2)
+os.environ['TEST_PORT_ENGINEER_PASSTHROUGH'] = str(14753 + _WORKER_ID * 2)
 
+import signal
 import subprocess
 import threading
 import time
 import pytest
 from test_config import (TEST_PORT_USER, TEST_PORT_ENGINEER, TEST_PASSPHRASE,
                          TEST_PORT_USER_BIDI, TEST_PORT_ENGINEER_BIDI,
-                         KEYDB_PY, SUPPORTPROXY_BIN)
+                         TEST_PORT_USER_PASSTHROUGH,
+                         TEST_PORT_ENGINEER_PASSTHROUGH,
+                         KEYDB_PY, SUPPORTPROXY_BIN, PROXY_MODES)
 
 os.environ['MAVLINK_DIALECT'] = 'ardupilotmega'
 os.environ['MAVLINK20'] = '1'  # Ensure MAVLink2 is used
 
 
 class SupportProxyProcess:
-    def __init__(self, executable=SUPPORTPROXY_BIN, cwd=None):
+    def __init__(self, executable=SUPPORTPROXY_BIN, cwd=None, args=()):
         self.proc = subprocess.Popen(
-            [executable],
+            [executable] + list(args),
             stdout=subprocess.PIPE,
             stderr=subprocess.PIPE,
             bufsize=1,
@@ -84,6 +89,60 @@ class SupportProxyProcess:
             self.proc.kill()
 
 
+@pytest.fixture(params=[m[1] for m in PROXY_MODES],
+                ids=[m[0] for m in PROXY_MODES])
+def proxy_args(request):
+    """command line of each session mode in PROXY_MODES, for tests that
+    start their own proxy"""
+    return request.param
+
+
+def start_proxy(workdir, args, port1, port2, **popen_args):
+    """start supportproxy in workdir and wait until it has loaded the
+    port pair port1/port2. Its output is collected in proc._lines.
+    popen_args go to subprocess.Popen"""
+    proc = subprocess.Popen(
+        [SUPPORTPROXY_BIN] + list(args), cwd=str(workdir),
+        stdout=subprocess.PIPE, stderr=subprocess.STDOUT,
+        bufsize=1, text=True, **popen_args,
+    )
+    proc._lines = []
+    proc._ready = threading.Event()
+
+    def _drain():
+        for line in iter(proc.stdout.readline, ''):
+            proc._lines.append(line)
+            if 'Added port %d/%d' % (port1, port2) in line:
+                proc._ready.set()
+        proc.stdout.close()
+
+    proc._thread = threading.Thread(target=_drain, daemon=True)
+    proc._thread.start()
+    if not proc._ready.wait(timeout=10):
+        proc.kill()
+        proc.wait(timeout=2)
+        raise RuntimeError('proxy did not load test port pair')
+    return proc
+
+
+def terminate_proxy(proc):
+    proc.send_signal(signal.SIGTERM)
+    try:
+        proc.wait(timeout=5)
+    except subprocess.TimeoutExpired:
+        proc.kill()
+        proc.wait(timeout=2)
+
+
+def wait_for(predicate, timeout=5.0):
+    deadline = time.time() + timeout
+    while time.time() < deadline:
+        if predicate():
+            return True
+        time.sleep(0.1)
+    return False
+
+
 @pytest.fixture(scope="session", autouse=True)
 def _worker_cwd(tmp_path_factory):
     """Each xdist worker runs in its own tmpdir so workers don't share a
@@ -93,11 +152,15 @@ def _worker_cwd(tmp_path_factory):
     yield workdir
 
 
-@pytest.fixture(scope="session")
-def test_server(_worker_cwd):
-    """Pytest fixture to provide a test server instance."""
+@pytest.fixture(scope="session", params=[m[1] for m in PROXY_MODES],
+                ids=[m[0] for m in PROXY_MODES])
+def test_server(request, _worker_cwd):
+    """Pytest fixture to provide a test server instance, once per
+    session mode in PROXY_MODES."""
     workdir = _worker_cwd
-    print(f"DEBUG: Setting up test_server (worker={_WORKER_ID}, cwd={workdir})")
+    mode_args = request.param
+    print(f"DEBUG: Setting up test_server (worker={_WORKER_ID}, cwd={workdir}, "
+          f"args={mode_args})")
 
     # Initialize the per-worker keys.tdb in the worker's cwd. We use the
     # absolute KEYDB_PY because cwd is no longer the repo root.
@@ -105,9 +168,10 @@ def test_server(_worker_cwd):
 
     port1, port2 = TEST_PORT_USER, TEST_PORT_ENGINEER
     port1_b, port2_b = TEST_PORT_USER_BIDI, TEST_PORT_ENGINEER_BIDI
+    port1_p, port2_p = TEST_PORT_USER_PASSTHROUGH, TEST_PORT_ENGINEER_PASSTHROUGH
 
     # Idempotent: remove any prior entries, then add the test entries.
-    for p2 in (port2, port2_b):
+    for p2 in (port2, port2_b, port2_p):
         subprocess.run(['python', KEYDB_PY, 'remove', str(p2)],
                        capture_output=True)
 
@@ -129,14 +193,26 @@ def test_server(_worker_cwd):
     ], capture_output=True, text=True)
     assert result.returncode == 0, f"Failed to set bidi_sign: {result.stderr}"
 
+    # Third pair with KEY_FLAG_PASSTHROUGH for the pass-through tests.
+    result = subprocess.run([
+        'python', KEYDB_PY, 'add', str(port1_p), str(port2_p),
+        'test_user_passthrough', TEST_PASSPHRASE
+    ], capture_output=True, text=True)
+    assert result.returncode == 0, f"Failed to setup passthrough database: {result.stderr}"
+
+    result = subprocess.run([
+        'python', KEYDB_PY, 'setflag', str(port2_p), 'passthrough'
+    ], capture_output=True, text=True)
+    assert result.returncode == 0, f"Failed to set passthrough: {result.stderr}"
+
     # Verify database entries
     result = subprocess.run(['python', KEYDB_PY, 'list'],
                             capture_output=True, text=True)
     print(f"DEBUG: Database contents before starting SupportProxy:\n{result.stdout}")
 
     # Generate a per-worker self-signed cert for the proxy's WSS listener.
-    # The proxy reads fullchain.pem/privkey.pem from cwd when a TLS client
-    # ClientHello arrives. The cert never needs to validate (test client
+    # The proxy loads fullchain.pem/privkey.pem from cwd at startup (and
+    # again whenever they change). The cert never needs to validate (test client
     # disables verification), it just has to load.
     subprocess.check_call([
         'openssl', 'req', '-x509', '-newkey', 'rsa:2048', '-nodes',
@@ -145,11 +221,13 @@ def test_server(_worker_cwd):
     ], stderr=subprocess.DEVNULL)
 
     print("DEBUG: Starting SupportProxy with database ready...")
-    server = SupportProxyProcess()  # cwd is already the worker's tmpdir
+    # cwd is already the worker's tmpdir
+    server = SupportProxyProcess(args=mode_args)
 
-    # Wait for SupportProxy to load both port pairs before yielding.
+    # Wait for SupportProxy to load all port pairs before yielding.
     markers = {f"Added port {port1}/{port2}": False,
-               f"Added port {port1_b}/{port2_b}": False}
+               f"Added port {port1_b}/{port2_b}": False,
+               f"Added port {port1_p}/{port2_p}": False}
     max_wait = 10
     start_time = time.time()
 
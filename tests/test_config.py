@@ -24,6 +24,25 @@ TEST_PORT_ENGINEER_BIDI = int(os.environ.get('TEST_PORT_ENGINEER_BIDI',
                                              str(TEST_PORT_ENGINEER + 100)))
 TEST_PORTS_BIDI = (TEST_PORT_USER_BIDI, TEST_PORT_ENGINEER_BIDI)
 
+# Third pair, seeded with KEY_FLAG_PASSTHROUGH for the pass-through
+# tests: unsigned engineers, and a kernel relay between TCP links.
+TEST_PORT_USER_PASSTHROUGH = int(os.environ.get('TEST_PORT_USER_PASSTHROUGH',
+                                                str(TEST_PORT_USER + 200)))
+TEST_PORT_ENGINEER_PASSTHROUGH = int(os.environ.get('TEST_PORT_ENGINEER_PASSTHROUGH',
+                                                    str(TEST_PORT_ENGINEER + 200)))
+TEST_PORTS_PASSTHROUGH = (TEST_PORT_USER_PASSTHROUGH, TEST_PORT_ENGINEER_PASSTHROUGH)
+
+# Session modes the proxy is started in by the test_server fixture and
+# the kill/drop tests: (id, extra command line options). The reactor
+# runs every session on two threads of the main process instead of
+# one forked child each; the pool hands sessions to two pre-forked
+# workers.
+PROXY_MODES = [
+    ('fork', []),
+    ('reactor', ['-r', '-t', '2']),
+    ('pool', ['-p', '2']),
+]
+
 # Authentication configuration
 TEST_PASSPHRASE = "shared_test_auth"
 
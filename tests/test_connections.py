@@ -3,16 +3,19 @@ Connection Tests for SupportProxy using PyMAVLink with authentication.
 Tests UDP, TCP, and mixed connection scenarios with proper MAVLink2 authentication.
 """
 from pymavlink import mavutil
+import base64
 import errno
 import socket
 import ssl
 import subprocess
 import sys
 import os
+import struct
 import time
 import pytest
 import threading
-from test_config import (TEST_PORTS, TEST_PORTS_BIDI, TEST_PASSPHRASE,
+from test_config import (TEST_PORTS, TEST_PORTS_BIDI, TEST_PORTS_PASSTHROUGH,
+                         TEST_PASSPHRASE,
                          KEYDB_PY,
                          MAX_TCP_ENGINEER_CONNECTIONS,
                          MULTIPLE_CONNECTIONS_TEST_DURATION)
@@ -63,7 +66,9 @@ class BaseConnectionTest:
         as it exits and the parent prints "Child N exited" only after
         it has called open_sockets() to re-listen. We require the
         parent's marker because that's the one that signals the next
-        test can race-free."""
+        test can race-free. In reactor mode there is no child: the
+        shard thread prints "Session ended" and reopens the listeners
+        straight after."""
         print("DEBUG: Waiting for SupportProxy to close + reopen sockets...")
         start_time = time.time()
         seen_close = False
@@ -77,6 +82,8 @@ class BaseConnectionTest:
                 seen_close = True
             if not seen_reopen and "exited" in output and "Child" in output:
                 seen_reopen = True
+            if not seen_reopen and "Session ended" in output:
+                seen_reopen = True
             if seen_reopen:
                 # parent has reopened listen sockets — safe to proceed
                 print("DEBUG: ✅ SupportProxy ready for next test")
@@ -837,5 +844,395 @@ class TestConnectionsTDB(BaseConnectionTest):
             "stale connection records left behind for port2=%d" % port2
 
 
+class TestPassthrough(BaseConnectionTest):
+    """Entries with the passthrough flag (set by conftest with
+    ``keydb.py setflag PORT2 passthrough``) take unsigned engineers,
+    and a TCP user with a single TCP engineer is relayed by the kernel
+    with splice(). A second engineer, on any transport, takes the
+    session back to parsing and both engineers are served."""
+
+    def _log_until(self, test_server, needle, timeout=10.0):
+        """wait for needle in the proxy's output, keeping what was read
+        for later calls"""
+        deadline = time.time() + timeout
+        while True:
+            stdout, stderr = test_server.get_new_output_since_last_check()
+            self._log += stdout + stderr
+            if needle in self._log:
+                return True
+            if time.time() >= deadline:
+                return False
+            time.sleep(0.1)
+
+    def _exchange(self, user, engineers, seconds):
+        """every side sends a HEARTBEAT and a SYSTEM_TIME every 0.2s for
+        a while. SYSTEM_TIME is what counts, as an unsigned engineer
+        gets the user's HEARTBEATs even without the flag. Returns how
+        many of the user's each engineer got, and how many of each
+        engineer's the user got, by engineer sysid"""
+        to_engineer = {e.source_system: 0 for e in engineers}
+        to_user = {e.source_system: 0 for e in engineers}
+        deadline = time.time() + seconds
+        while time.time() < deadline:
+            now_us = int(time.time() * 1000000)
+            user.mav.heartbeat_send(
+                mavutil.mavlink.MAV_TYPE_QUADROTOR,
+                mavutil.mavlink.MAV_AUTOPILOT_ARDUPILOTMEGA, 0, 0, 0)
+            user.mav.system_time_send(now_us, 1)
+            for e in engineers:
+                e.mav.heartbeat_send(
+                    mavutil.mavlink.MAV_TYPE_GCS,
+                    mavutil.mavlink.MAV_AUTOPILOT_INVALID, 0, 0, 0)
+                e.mav.system_time_send(now_us, 1)
+            time.sleep(0.2)
+            for e in engineers:
+                while True:
+                    m = e.recv_match(type='SYSTEM_TIME', blocking=False)
+                    if m is None:
+                        break
+                    if m.get_srcSystem() == 1:
+                        to_engineer[e.source_system] += 1
+            while True:
+                m = user.recv_match(type='SYSTEM_TIME', blocking=False)
+                if m is None:
+                    break
+                if m.get_srcSystem() in to_user:
+                    to_user[m.get_srcSystem()] += 1
+        return to_engineer, to_user
+
+    def test_unsigned_engineer_needs_flag(self, test_server):
+        """an unsigned TCP engineer hears nothing on an entry without
+        the flag, and the user hears nothing from it"""
+        self._log = ''
+        port1, port2 = TEST_PORTS
+        user = self.create_connection('tcp', port1, source_system=1)
+        engineer = self.create_connection('tcp', port2, source_system=2)
+        try:
+            to_engineer, to_user = self._exchange(user, [engineer], 4)
+            assert to_engineer[2] == 0 and to_user[2] == 0, \
+                'unsigned engineer relayed without the passthrough flag: %r %r' % (
+                    to_engineer, to_user)
+        finally:
+            user.close()
+            engineer.close()
+            self.wait_for_connection_close(test_server)
+
+    def test_relay_both_ways(self, test_server):
+        """with the flag, an unsigned TCP engineer and a TCP user are
+        switched to the kernel relay, and bytes flow both ways"""
+        self._log = ''
+        port1, port2 = TEST_PORTS_PASSTHROUGH
+        user = self.create_connection('tcp', port1, source_system=1)
+        engineer = self.create_connection('tcp', port2, source_system=2)
+        try:
+            self._exchange(user, [engineer], 2)
+            self.assert_with_proxy_log(
+                test_server, self._log_until(test_server, 'pass-through conn1 <-> conn2[1]'),
+                'session never switched to pass-through')
+            # only what went through the relay counts from here
+            to_engineer, to_user = self._exchange(user, [engineer], 3)
+            self.assert_with_proxy_log(
+                test_server, to_engineer[2] > 0 and to_user[2] > 0,
+                'pass-through relay: engineer got %d, user got %d' % (
+                    to_engineer[2], to_user[2]))
+            assert 'pass-through ended' not in self._log
+        finally:
+            user.close()
+            engineer.close()
+            self.wait_for_connection_close(test_server)
+
+    @pytest.mark.parametrize('second', ['tcp', 'udp', 'ws'])
+    def test_second_engineer_ends_relay(self, test_server, second):
+        """a second engineer joining ends the relay, after which the
+        user reaches both engineers and hears from both"""
+        self._log = ''
+        port1, port2 = TEST_PORTS_PASSTHROUGH
+        user = self.create_connection('tcp', port1, source_system=1)
+        engineer = self.create_connection('tcp', port2, source_system=2)
+        other = None
+        try:
+            self._exchange(user, [engineer], 2)
+            self.assert_with_proxy_log(
+                test_server, self._log_until(test_server, 'pass-through conn1 <-> conn2[1]'),
+                'session never switched to pass-through')
+
+            other = self.create_connection(second, port2, source_system=3)
+            self._exchange(user, [engineer, other], 2)
+            self.assert_with_proxy_log(
+                test_server, self._log_until(test_server, 'pass-through ended'),
+                '%s engineer joining did not end pass-through' % second)
+
+            to_engineer, to_user = self._exchange(user, [engineer, other], 3)
+            self.assert_with_proxy_log(
+                test_server, all(n > 0 for n in to_engineer.values()) and
+                all(n > 0 for n in to_user.values()),
+                'after a %s engineer joined: engineers got %r, user got %r' % (
+                    second, to_engineer, to_user))
+        finally:
+            user.close()
+            engineer.close()
+            if other is not None:
+                other.close()
+            self.wait_for_connection_close(test_server)
+
+
+class RawWebSocket:
+    """A minimal WebSocket client that writes frames exactly as it is
+    told to, so a test can fragment messages, put control frames
+    between fragments and pack several frames into one write. pymavlink's
+    client always sends one whole frame per message."""
+
+    OP_CONTINUATION = 0x0
+    OP_BINARY = 0x2
+    OP_CLOSE = 0x8
+    OP_PING = 0x9
+    OP_PONG = 0xA
+
+    def __init__(self, port, use_tls=False):
+        sock = socket.create_connection(('127.0.0.1', port), timeout=5)
+        if use_tls:
+            sock = ssl.create_default_context().wrap_socket(
+                sock, server_hostname='localhost')
+        key = base64.b64encode(os.urandom(16)).decode()
+        sock.sendall((
+            'GET / HTTP/1.1\r\n'
+            'Host: localhost\r\n'
+            'Upgrade: websocket\r\n'
+            'Connection: Upgrade\r\n'
+            'Sec-WebSocket-Key: %s\r\n'
+            'Sec-WebSocket-Version: 13\r\n\r\n' % key).encode())
+        resp = b''
+        while b'\r\n\r\n' not in resp:
+            chunk = sock.recv(4096)
+            if not chunk:
+                raise RuntimeError('proxy closed during the handshake')
+            resp += chunk
+        head, self.buf = resp.split(b'\r\n\r\n', 1)
+        status = head.split(b'\r\n', 1)[0]
+        if b' 101 ' not in status:
+            raise RuntimeError('handshake refused: %r' % status)
+        self.sock = sock
+
+    @staticmethod
+    def frame(opcode, payload, fin=True):
+        """a masked client frame"""
+        b0 = (0x80 if fin else 0) | opcode
+        n = len(payload)
+        if n < 126:
+            header = bytes([b0, 0x80 | n])
+        elif n < 65536:
+            header = bytes([b0, 0x80 | 126]) + struct.pack('>H', n)
+        else:
+            header = bytes([b0, 0x80 | 127]) + struct.pack('>Q', n)
+        mask = os.urandom(4)
+        return header + mask + bytes(b ^ mask[i % 4]
+                                     for i, b in enumerate(payload))
+
+    def send(self, data):
+        self.sock.sendall(data)
+
+    def _next_frame(self):
+        buf = self.buf
+        if len(buf) < 2:
+            return None
+        n = buf[1] & 0x7F
+        pos = 2
+        if n == 126:
+            if len(buf) < 4:
+                return None
+            n = struct.unpack('>H', buf[2:4])[0]
+            pos = 4
+        elif n == 127:
+            if len(buf) < 10:
+                return None
+            n = struct.unpack('>Q', buf[2:10])[0]
+            pos = 10
+        if len(buf) < pos + n:
+            return None
+        self.buf = buf[pos + n:]
+        return buf[0] & 0x0F, buf[pos:pos + n]
+
+    def recv_frame(self, timeout=5.0):
+        """the next frame from the proxy as (opcode, payload), or None
+        on timeout or once the proxy has closed the connection"""
+        deadline = time.time() + timeout
+        while True:
+            f = self._next_frame()
+            if f is not None:
+                return f
+            remaining = deadline - time.time()
+            if remaining <= 0:
+                return None
+            self.sock.settimeout(remaining)
+            try:
+                chunk = self.sock.recv(65536)
+            except (socket.timeout, TimeoutError):
+                return None
+            except (ssl.SSLError, OSError):
+                return None
+            if not chunk:
+                return None
+            self.buf += chunk
+
+    def recv_control(self, opcode, timeout=5.0):
+        """skip forwarded data frames until a control frame of this
+        opcode arrives; its payload, or None"""
+        deadline = time.time() + timeout
+        while time.time() < deadline:
+            f = self.recv_frame(deadline - time.time())
+            if f is None:
+                return None
+            if f[0] == opcode:
+                return f[1]
+        return None
+
+    def close(self):
+        try:
+            self.sock.close()
+        except OSError:
+            pass
+
+
+@pytest.mark.parametrize('transport', ['ws', 'wss'])
+class TestWebSocketFraming(BaseConnectionTest):
+    """The proxy's own WebSocket framing (websocket.cpp), driven by a
+    raw client on the user port: fragmented messages, a ping between
+    fragments, a frame over 1 KiB, several frames in one TCP segment or
+    TLS record, and the close handshake. The user sends HEARTBEATs
+    whose custom_mode numbers them, and a signed UDP engineer checks
+    which of them the proxy forwarded."""
+
+    def _heartbeat(self, number):
+        mav = mavutil.mavlink.MAVLink(None, srcSystem=1, srcComponent=1)
+        return mav.heartbeat_encode(
+            mavutil.mavlink.MAV_TYPE_QUADROTOR,
+            mavutil.mavlink.MAV_AUTOPILOT_ARDUPILOTMEGA,
+            0, number, 0).pack(mav)
+
+    def _engineer_numbers(self, engineer, numbers):
+        """drain what the engineer has, adding the custom_mode of user
+        HEARTBEATs to numbers"""
+        while True:
+            m = engineer.recv_match(type='HEARTBEAT', blocking=False)
+            if m is None:
+                return
+            if m.get_srcSystem() == 1:
+                numbers.add(m.custom_mode)
+
+    def _start(self, test_server, transport):
+        """a raw WebSocket user and a signed UDP engineer the proxy
+        already forwards between"""
+        port1, port2 = TEST_PORTS
+        ws = RawWebSocket(port1, use_tls=(transport == 'wss'))
+        engineer = self.create_connection('udp', port2, source_system=2)
+        self.setup_signing(engineer, passphrase_to_key(TEST_PASSPHRASE))
+        seen = set()
+        deadline = time.time() + 10
+        while time.time() < deadline and 1 not in seen:
+            ws.send(ws.frame(ws.OP_BINARY, self._heartbeat(1)))
+            engineer.mav.heartbeat_send(
+                mavutil.mavlink.MAV_TYPE_GCS,
+                mavutil.mavlink.MAV_AUTOPILOT_INVALID, 0, 0, 0)
+            time.sleep(0.2)
+            self._engineer_numbers(engineer, seen)
+        self.assert_with_proxy_log(
+            test_server, 1 in seen,
+            "%s user: engineer never heard the first HEARTBEAT" % transport)
+        return ws, engineer
+
+    def _expect_numbers(self, test_server, engineer, wanted, what):
+        seen = set()
+        deadline = time.time() + 5
+        while time.time() < deadline and not wanted <= seen:
+            time.sleep(0.1)
+            self._engineer_numbers(engineer, seen)
+        self.assert_with_proxy_log(
+            test_server, wanted <= seen,
+            "%s: engineer is missing HEARTBEATs %r"
+            % (what, sorted(wanted - seen)))
+
+    def _finish(self, test_server, ws, engineer):
+        ws.close()
+        engineer.close()
+        self.wait_for_connection_close(test_server)
+
+    def test_fragmented_message(self, test_server, transport):
+        """one MAVLink frame split over a BINARY and two CONTINUATION
+        frames, each in its own write"""
+        ws, engineer = self._start(test_server, transport)
+        try:
+            hb = self._heartbeat(100)
+            ws.send(ws.frame(ws.OP_BINARY, hb[:5], fin=False))
+            time.sleep(0.05)
+            ws.send(ws.frame(ws.OP_CONTINUATION, hb[5:12], fin=False))
+            time.sleep(0.05)
+            ws.send(ws.frame(ws.OP_CONTINUATION, hb[12:]))
+            self._expect_numbers(test_server, engineer, {100},
+                                 '%s fragmented' % transport)
+        finally:
+            self._finish(test_server, ws, engineer)
+
+    def test_ping_between_fragments(self, test_server, transport):
+        """a PING between the fragments of a message is answered with a
+        PONG carrying its payload, and the message still goes through"""
+        ws, engineer = self._start(test_server, transport)
+        try:
+            hb = self._heartbeat(200)
+            ws.send(ws.frame(ws.OP_BINARY, hb[:8], fin=False))
+            ws.send(ws.frame(ws.OP_PING, b'between'))
+            ws.send(ws.frame(ws.OP_CONTINUATION, hb[8:]))
+            assert ws.recv_control(ws.OP_PONG) == b'between', \
+                '%s: no PONG for the PING between fragments' % transport
+            self._expect_numbers(test_server, engineer, {200},
+                                 '%s ping between fragments' % transport)
+        finally:
+            self._finish(test_server, ws, engineer)
+
+    def test_frame_over_1k(self, test_server, transport):
+        """sixty HEARTBEATs in one frame, which needs the 16 bit length"""
+        ws, engineer = self._start(test_server, transport)
+        try:
+            numbers = set(range(300, 360))
+            payload = b''.join(self._heartbeat(n) for n in sorted(numbers))
+            assert len(payload) > 1024
+            ws.send(ws.frame(ws.OP_BINARY, payload))
+            self._expect_numbers(test_server, engineer, numbers,
+                                 '%s %d byte frame' % (transport, len(payload)))
+        finally:
+            self._finish(test_server, ws, engineer)
+
+    def test_frames_in_one_write(self, test_server, transport):
+        """ten frames in one write, so one TCP segment or TLS record"""
+        ws, engineer = self._start(test_server, transport)
+        try:
+            numbers = set(range(400, 410))
+            ws.send(b''.join(ws.frame(ws.OP_BINARY, self._heartbeat(n))
+                             for n in sorted(numbers)))
+            self._expect_numbers(test_server, engineer, numbers,
+                                 '%s frames in one write' % transport)
+        finally:
+            self._finish(test_server, ws, engineer)
+
+    def test_close_handshake(self, test_server, transport):
+        """a PING and a CLOSE in one write: the PONG comes first, then
+        the CLOSE echoing the status code, then the connection ends"""
+        ws, engineer = self._start(test_server, transport)
+        try:
+            ws.send(ws.frame(ws.OP_PING, b'last') +
+                    ws.frame(ws.OP_CLOSE, struct.pack('>H', 1000) + b'bye'))
+            frames = []
+            while True:
+                f = ws.recv_frame()
+                if f is None:
+                    break
+                if f[0] in (ws.OP_PONG, ws.OP_CLOSE):
+                    frames.append(f)
+            assert frames == [(ws.OP_PONG, b'last'),
+                              (ws.OP_CLOSE, struct.pack('>H', 1000))], \
+                '%s: expected PONG then CLOSE 1000, got %r' % (transport, frames)
+        finally:
+            self._finish(test_server, ws, engineer)
+
+
 if __name__ == "__main__":
     pytest.main([__file__, "-v"])
@@ -8,16 +8,18 @@ PID. Asserts that:
   * the user + the other engineer remain
   * a follow-up drop on conn_index=0 (user) ends the whole session
     (the proxy's parent reaps the child).
+
+Both run in each session mode of test_config.PROXY_MODES. In reactor
+mode the PID in connections.tdb is the proxy's own, and the session
+ends on a shard thread instead of in a child. With -p the session runs
+in a pre-forked worker, which exits and is reaped like a child.
 """
 import datetime
 import hashlib
 import os
-import signal
 import socket
 import struct
-import subprocess
 import sys
-import threading
 import time
 
 import pytest
@@ -29,6 +31,7 @@ if _REPO_ROOT not in sys.path:
 
 import conntdb_lib  # noqa: E402
 import keydb_lib  # noqa: E402
+from conftest import start_proxy, terminate_proxy, wait_for  # noqa: E402
 
 SUPPORTPROXY_BIN = os.path.join(_REPO_ROOT, 'supportproxy')
 
@@ -56,47 +59,8 @@ def proxy_workdir(tmp_path):
     return p
 
 
-def _start_proxy(workdir):
-    proc = subprocess.Popen(
-        [SUPPORTPROXY_BIN], cwd=str(workdir),
-        stdout=subprocess.PIPE, stderr=subprocess.STDOUT,
-        bufsize=1, text=True,
-    )
-    proc._lines = []
-    proc._ready = threading.Event()
-
-    def _drain():
-        for line in iter(proc.stdout.readline, ''):
-            proc._lines.append(line)
-            if 'Added port %d/%d' % (PORT_USER, PORT_ENG) in line:
-                proc._ready.set()
-        proc.stdout.close()
-
-    proc._thread = threading.Thread(target=_drain, daemon=True)
-    proc._thread.start()
-    if not proc._ready.wait(timeout=10):
-        proc.kill()
-        proc.wait(timeout=2)
-        raise RuntimeError('proxy did not load test port pair')
-    return proc
-
-
-def _terminate(proc):
-    proc.send_signal(signal.SIGTERM)
-    try:
-        proc.wait(timeout=5)
-    except subprocess.TimeoutExpired:
-        proc.kill()
-        proc.wait(timeout=2)
-
-
-def _wait(predicate, timeout=5.0):
-    deadline = time.time() + timeout
-    while time.time() < deadline:
-        if predicate():
-            return True
-        time.sleep(0.1)
-    return False
+def _start_proxy(workdir, args):
+    return start_proxy(workdir, args, PORT_USER, PORT_ENG)
 
 
 def _list_conn_indices(workdir, port2):
@@ -118,11 +82,11 @@ def _pid_for(workdir, port2, conn_index):
 @pytest.mark.skipif(not os.path.exists(SUPPORTPROXY_BIN),
                     reason='supportproxy binary not built')
 class TestKillDrop:
-    def test_drop_engineer_keeps_others(self, proxy_workdir):
+    def test_drop_engineer_keeps_others(self, proxy_workdir, proxy_args):
         from pymavlink import mavutil
         secret = hashlib.sha256(b'killpw').digest()
 
-        proc = _start_proxy(proxy_workdir)
+        proc = _start_proxy(proxy_workdir, proxy_args)
         try:
             user = mavutil.mavlink_connection(
                 'udpout:127.0.0.1:%d' % PORT_USER,
@@ -145,7 +109,7 @@ class TestKillDrop:
 
             # Wait for both engineer slots to appear in connections.tdb
             # (slots 1 and 2; slot 0 is user).
-            assert _wait(lambda: _list_conn_indices(
+            assert wait_for(lambda: _list_conn_indices(
                 proxy_workdir, PORT_ENG) == [0, 1, 2], timeout=5.0), \
                 'expected slots 0,1,2; got %r' % (
                     _list_conn_indices(proxy_workdir, PORT_ENG),)
@@ -157,7 +121,7 @@ class TestKillDrop:
             assert ok
 
             # Engineer #2 record should disappear; user + engineer #1 remain.
-            assert _wait(lambda: 2 not in _list_conn_indices(
+            assert wait_for(lambda: 2 not in _list_conn_indices(
                 proxy_workdir, PORT_ENG), timeout=5.0), \
                 'engineer #2 not removed; have %r' % (
                     _list_conn_indices(proxy_workdir, PORT_ENG),)
@@ -174,13 +138,13 @@ class TestKillDrop:
 
             user.close(); eng1.close(); eng2.close()
         finally:
-            _terminate(proc)
+            terminate_proxy(proc)
 
-    def test_drop_user_ends_session(self, proxy_workdir):
+    def test_drop_user_ends_session(self, proxy_workdir, proxy_args):
         from pymavlink import mavutil
         secret = hashlib.sha256(b'killpw').digest()
 
-        proc = _start_proxy(proxy_workdir)
+        proc = _start_proxy(proxy_workdir, proxy_args)
         try:
             user = mavutil.mavlink_connection(
                 'udpout:127.0.0.1:%d' % PORT_USER,
@@ -194,7 +158,7 @@ class TestKillDrop:
                 eng.mav.heartbeat_send(0, 0, 0, 0, 0)
                 time.sleep(0.1)
 
-            assert _wait(lambda: 0 in _list_conn_indices(
+            assert wait_for(lambda: 0 in _list_conn_indices(
                 proxy_workdir, PORT_ENG), timeout=5.0)
 
             child_pid = _pid_for(proxy_workdir, PORT_ENG, 0)
@@ -205,21 +169,25 @@ class TestKillDrop:
                 PORT_ENG, 0)
             assert ok
 
-            # Child should exit; parent reaps via check_children. The
-            # log line "[<port2>] Child <pid> exited" appears.
-            needle = '[%d] Child %d exited' % (PORT_ENG, child_pid)
-            assert _wait(lambda: any(needle in line
+            # Child should exit and the parent reap it: the log line
+            # "[<port2>] Child <pid> exited" appears. In reactor mode
+            # the shard ends the session instead.
+            if '-r' in proxy_args:
+                needle = '[%d] Session ended' % PORT_ENG
+            else:
+                needle = '[%d] Child %d exited' % (PORT_ENG, child_pid)
+            assert wait_for(lambda: any(needle in line
                                      for line in proc._lines),
                          timeout=5.0), \
-                'child did not exit; recent stdout:\n%s' % (
+                'session did not end; recent stdout:\n%s' % (
                     ''.join(proc._lines[-15:]))
 
             # connections.tdb for that port2 should be empty (parent's
             # check_children removes records after reap).
-            assert _wait(
+            assert wait_for(
                 lambda: not _list_conn_indices(proxy_workdir, PORT_ENG),
                 timeout=5.0)
 
             user.close(); eng.close()
         finally:
-            _terminate(proc)
+            terminate_proxy(proc)
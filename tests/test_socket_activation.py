@@ -0,0 +1,219 @@
+"""End-to-end test for listeners passed in LISTEN_FDS (systemd socket
+activation).
+
+The proxy keeps each passed socket for the life of the process and
+hands every reopen of its port a dup of it, so all of them share one
+open file description. A session that connect()ed the user UDP socket
+to its peer would leave every later reopen connected to that peer,
+and a new user's datagrams would be dropped by the kernel.
+
+Starts supportproxy with the UDP and TCP listeners of one port pair
+at fd 3 to 6, then runs two sessions in a row whose users send from
+different source ports, and checks that the engineer hears each user:
+over UDP in the first session and over the passed TCP listener in the
+second.
+
+Then the same with an upgrade (SIGUSR2) while the first session runs:
+the upgraded proxy has to keep dup'ing the passed sockets, busy port
+included, rather than bind the port again when the session ends.
+"""
+import fcntl
+import hashlib
+import os
+import signal
+import socket
+import sys
+import time
+
+import pytest
+
+_REPO_ROOT = os.path.abspath(os.path.join(os.path.dirname(__file__), os.pardir))
+if _REPO_ROOT not in sys.path:
+    sys.path.insert(0, _REPO_ROOT)
+
+import keydb_lib  # noqa: E402
+from conftest import start_proxy, terminate_proxy, wait_for  # noqa: E402
+
+SUPPORTPROXY_BIN = os.path.join(_REPO_ROOT, 'supportproxy')
+
+# Worker-aware ports so xdist runs don't fight over them.
+_W = int(os.environ.get('PYTEST_XDIST_WORKER', 'gw0')[2:]
+         if os.environ.get('PYTEST_XDIST_WORKER', 'gw0').startswith('gw') else 0)
+PORT_USER = 17800 + _W * 4
+PORT_ENG = 17801 + _W * 4
+
+os.environ.setdefault('MAVLINK_DIALECT', 'ardupilotmega')
+os.environ.setdefault('MAVLINK20', '1')
+
+
+@pytest.fixture
+def proxy_workdir(tmp_path):
+    p = tmp_path / 'work'
+    p.mkdir()
+    db = keydb_lib.init_db(str(p / 'keys.tdb'))
+    db.transaction_start()
+    keydb_lib.add_entry(db, PORT_USER, PORT_ENG, 'activation_test', 'actpw')
+    db.transaction_prepare_commit()
+    db.transaction_commit()
+    db.close()
+    return p
+
+
+def _bound_udp(port):
+    s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    s.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    s.bind(('0.0.0.0', port))
+    return s
+
+
+def _listening_tcp(port):
+    s = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    s.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    s.bind(('0.0.0.0', port))
+    s.listen(16)
+    return s
+
+
+def _activation_sockets():
+    return [_bound_udp(PORT_USER), _bound_udp(PORT_ENG),
+            _listening_tcp(PORT_USER), _listening_tcp(PORT_ENG)]
+
+
+def _start_proxy(workdir, args, socks):
+    """start supportproxy the way systemd does: the sockets at fd 3
+    onwards, LISTEN_FDS their count and LISTEN_PID the proxy's pid"""
+    fds = [s.fileno() for s in socks]
+
+    def _activate():
+        # copy above the target range first so no dup2 clobbers a
+        # source we haven't moved yet
+        moved = [fcntl.fcntl(fd, fcntl.F_DUPFD_CLOEXEC, 3 + len(fds))
+                 for fd in fds]
+        for i, fd in enumerate(moved):
+            os.dup2(fd, 3 + i)
+        os.environ['LISTEN_PID'] = str(os.getpid())
+        os.environ['LISTEN_FDS'] = str(len(fds))
+
+    return start_proxy(workdir, args, PORT_USER, PORT_ENG,
+                       close_fds=False, preexec_fn=_activate)
+
+
+def _session_ends(proc):
+    return sum(1 for line in proc._lines
+               if ('[%d] Child' % PORT_ENG in line and 'exited' in line)
+               or '[%d] Session ended' % PORT_ENG in line)
+
+
+def _engineer_hears_user(secret, user_sysid, eng_tcp=False):
+    """one session: a user on a fresh source port and a signed
+    engineer, on UDP or TCP. True if the engineer receives the user's
+    HEARTBEAT"""
+    from pymavlink import mavutil
+    user = mavutil.mavlink_connection(
+        'udpout:127.0.0.1:%d' % PORT_USER,
+        source_system=user_sysid, source_component=1)
+    eng = mavutil.mavlink_connection(
+        ('tcp:127.0.0.1:%d' if eng_tcp else 'udpout:127.0.0.1:%d') % PORT_ENG,
+        source_system=200, source_component=1)
+    eng.setup_signing(secret, sign_outgoing=True)
+    heard = False
+    try:
+        deadline = time.time() + 8.0
+        while time.time() < deadline and not heard:
+            user.mav.heartbeat_send(0, 0, 0, 0, 0)
+            eng.mav.heartbeat_send(0, 0, 0, 0, 0)
+            time.sleep(0.1)
+            while True:
+                m = eng.recv_match(type='HEARTBEAT', blocking=False)
+                if m is None:
+                    break
+                if m.get_srcSystem() == user_sysid:
+                    heard = True
+    finally:
+        user.close()
+        eng.close()
+    return heard
+
+
+@pytest.mark.skipif(not os.path.exists(SUPPORTPROXY_BIN),
+                    reason='supportproxy binary not built')
+class TestSocketActivation:
+    def test_two_sessions_from_different_ports(self, proxy_workdir, proxy_args):
+        secret = hashlib.sha256(b'actpw').digest()
+        socks = _activation_sockets()
+        proc = _start_proxy(proxy_workdir, proxy_args, socks)
+        # the proxy has its own copies now
+        for s in socks:
+            s.close()
+        try:
+            assert any('Using 4 listeners from socket activation' in line
+                       for line in proc._lines), \
+                'proxy did not take the passed sockets; stdout:\n%s' % (
+                    ''.join(proc._lines))
+
+            assert _engineer_hears_user(secret, 10), \
+                'first session: engineer never heard the user; recent stdout:\n%s' % (
+                    ''.join(proc._lines[-20:]))
+
+            # the session ends once both sides go quiet; its port is then
+            # reopened from the passed socket
+            assert wait_for(lambda: _session_ends(proc) >= 1, timeout=20.0), \
+                'first session did not end; recent stdout:\n%s' % (
+                    ''.join(proc._lines[-20:]))
+
+            # a new user, necessarily from a different source port, and
+            # the engineer on the passed TCP listener
+            assert _engineer_hears_user(secret, 11, eng_tcp=True), \
+                'second session: engineer never heard the new user; recent stdout:\n%s' % (
+                    ''.join(proc._lines[-20:]))
+        finally:
+            terminate_proxy(proc)
+
+    def test_upgrade_keeps_passed_sockets(self, proxy_workdir, proxy_args):
+        if '-r' in proxy_args:
+            pytest.skip('no upgrade on SIGUSR2 with -r')
+        from pymavlink import mavutil
+        secret = hashlib.sha256(b'actpw').digest()
+        socks = _activation_sockets()
+        proc = _start_proxy(proxy_workdir, proxy_args, socks)
+        for s in socks:
+            s.close()
+        try:
+            # a session that stays up across the upgrade
+            user = mavutil.mavlink_connection(
+                'udpout:127.0.0.1:%d' % PORT_USER,
+                source_system=10, source_component=1)
+            eng = mavutil.mavlink_connection(
+                'udpout:127.0.0.1:%d' % PORT_ENG,
+                source_system=200, source_component=1)
+            eng.setup_signing(secret, sign_outgoing=True)
+            try:
+                for _ in range(10):
+                    user.mav.heartbeat_send(0, 0, 0, 0, 0)
+                    eng.mav.heartbeat_send(0, 0, 0, 0, 0)
+                    time.sleep(0.1)
+                proc.send_signal(signal.SIGUSR2)
+                assert wait_for(lambda: any('Upgraded: 4 listeners and 1 running sessions' in line
+                                            for line in proc._lines), timeout=10.0), \
+                    'upgrade did not hand over the passed sockets and the session; stdout:\n%s' % (
+                        ''.join(proc._lines[-20:]))
+            finally:
+                user.close()
+                eng.close()
+
+            assert wait_for(lambda: _session_ends(proc) >= 1, timeout=20.0), \
+                'session did not end; recent stdout:\n%s' % (
+                    ''.join(proc._lines[-20:]))
+
+            # the port pair is open again, from the passed sockets
+            assert _engineer_hears_user(secret, 11), \
+                'engineer never heard the user after the upgrade; recent stdout:\n%s' % (
+                    ''.join(proc._lines[-20:]))
+            assert _engineer_hears_user(secret, 12, eng_tcp=True), \
+                'TCP engineer never heard the user after the upgrade; recent stdout:\n%s' % (
+                    ''.join(proc._lines[-20:]))
+            assert not any('Failed to open' in line for line in proc._lines), \
+                'a port was bound again instead of reusing the passed socket; stdout:\n%s' % (
+                    ''.join(proc._lines))
+        finally:
+            terminate_proxy(proc)
@@ -0,0 +1,169 @@
+"""End-to-end test for upgrading the binary in place on SIGUSR2.
+
+Starts a session, sends SIGUSR2 to the proxy while it runs and checks
+that:
+  * the proxy re-executes itself and hands the running session over
+  * the session keeps forwarding through the exec, in its old child
+  * once it ends, its port pair is reopened and a new session works
+  * no child is left a zombie; with -p the idle workers of the old
+    binary are reaped before the exec
+
+Runs in fork and -p mode. With -r sessions are threads of the proxy,
+so the upgrade is refused and the session just carries on.
+"""
+import hashlib
+import os
+import signal
+import sys
+import time
+
+import pytest
+
+_REPO_ROOT = os.path.abspath(os.path.join(os.path.dirname(__file__), os.pardir))
+if _REPO_ROOT not in sys.path:
+    sys.path.insert(0, _REPO_ROOT)
+
+import keydb_lib  # noqa: E402
+from conftest import start_proxy, terminate_proxy, wait_for  # noqa: E402
+
+SUPPORTPROXY_BIN = os.path.join(_REPO_ROOT, 'supportproxy')
+
+# Worker-aware ports so xdist runs don't fight over them.
+_W = int(os.environ.get('PYTEST_XDIST_WORKER', 'gw0')[2:]
+         if os.environ.get('PYTEST_XDIST_WORKER', 'gw0').startswith('gw') else 0)
+PORT_USER = 18000 + _W * 4
+PORT_ENG = 18001 + _W * 4
+
+os.environ.setdefault('MAVLINK_DIALECT', 'ardupilotmega')
+os.environ.setdefault('MAVLINK20', '1')
+
+
+@pytest.fixture
+def proxy_workdir(tmp_path):
+    p = tmp_path / 'work'
+    p.mkdir()
+    db = keydb_lib.init_db(str(p / 'keys.tdb'))
+    db.transaction_start()
+    keydb_lib.add_entry(db, PORT_USER, PORT_ENG, 'upgrade_test', 'uppw')
+    db.transaction_prepare_commit()
+    db.transaction_commit()
+    db.close()
+    return p
+
+
+class Session:
+    """a user and a signed engineer on UDP, open until close()"""
+
+    def __init__(self, secret, user_sysid):
+        from pymavlink import mavutil
+        self.user_sysid = user_sysid
+        self.user = mavutil.mavlink_connection(
+            'udpout:127.0.0.1:%d' % PORT_USER,
+            source_system=user_sysid, source_component=1)
+        self.eng = mavutil.mavlink_connection(
+            'udpout:127.0.0.1:%d' % PORT_ENG,
+            source_system=200, source_component=1)
+        self.eng.setup_signing(secret, sign_outgoing=True)
+
+    def engineer_hears_user(self, timeout=8.0):
+        deadline = time.time() + timeout
+        while time.time() < deadline:
+            self.user.mav.heartbeat_send(0, 0, 0, 0, 0)
+            self.eng.mav.heartbeat_send(0, 0, 0, 0, 0)
+            time.sleep(0.1)
+            while True:
+                m = self.eng.recv_match(type='HEARTBEAT', blocking=False)
+                if m is None:
+                    break
+                if m.get_srcSystem() == self.user_sysid:
+                    return True
+        return False
+
+    def close(self):
+        self.user.close()
+        self.eng.close()
+
+
+def _zombies(ppid):
+    """pids of exited children of ppid that nobody has waited for"""
+    found = []
+    for pid in os.listdir('/proc'):
+        if not pid.isdigit():
+            continue
+        try:
+            with open('/proc/%s/stat' % pid) as f:
+                stat = f.read()
+        except OSError:
+            continue
+        # the command name is in parentheses and may contain spaces
+        fields = stat[stat.rindex(')') + 2:].split()
+        if fields[0] == 'Z' and int(fields[1]) == ppid:
+            found.append(int(pid))
+    return found
+
+
+def _output(proc, n=30):
+    return ''.join(proc._lines[-n:])
+
+
+@pytest.mark.skipif(not os.path.exists(SUPPORTPROXY_BIN),
+                    reason='supportproxy binary not built')
+class TestUpgrade:
+    def test_session_survives_upgrade(self, proxy_workdir, proxy_args):
+        secret = hashlib.sha256(b'uppw').digest()
+        reactor = '-r' in proxy_args
+        proc = start_proxy(proxy_workdir, proxy_args, PORT_USER, PORT_ENG)
+        try:
+            session = Session(secret, 10)
+            try:
+                assert session.engineer_hears_user(), \
+                    'engineer never heard the user; recent stdout:\n%s' % _output(proc)
+
+                proc._lines.clear()
+                proc.send_signal(signal.SIGUSR2)
+                if reactor:
+                    assert wait_for(lambda: any('not supported with -r' in line
+                                                for line in proc._lines)), \
+                        'no refusal logged; stdout:\n%s' % _output(proc)
+                else:
+                    assert wait_for(lambda: any('Upgraded:' in line
+                                                for line in proc._lines),
+                                    timeout=10.0), \
+                        'proxy did not come back from the exec; stdout:\n%s' % _output(proc)
+                    assert any('1 running sessions handed over' in line
+                               for line in proc._lines), \
+                        'running session not handed over; stdout:\n%s' % _output(proc)
+                    assert wait_for(lambda: any('Added port %d/%d' % (PORT_USER, PORT_ENG)
+                                                in line for line in proc._lines)), \
+                        'port pair not loaded again; stdout:\n%s' % _output(proc)
+                assert proc.poll() is None, 'proxy exited'
+
+                # the same session, still running in its old child
+                assert session.engineer_hears_user(), \
+                    'session stopped forwarding across the upgrade; stdout:\n%s' % _output(proc)
+            finally:
+                session.close()
+
+            # both sides quiet: the session ends, and the upgraded proxy
+            # reaps its child and reopens the port pair
+            assert wait_for(lambda: any(
+                ('[%d] Child' % PORT_ENG in line and 'exited' in line)
+                or '[%d] Session ended' % PORT_ENG in line
+                for line in proc._lines), timeout=20.0), \
+                'session did not end; stdout:\n%s' % _output(proc)
+
+            session = Session(secret, 11)
+            try:
+                assert session.engineer_hears_user(), \
+                    'new session after the upgrade failed; stdout:\n%s' % _output(proc)
+            finally:
+                session.close()
+
+            assert not any('Failed to open' in line for line in proc._lines), \
+                'a port could not be reopened; stdout:\n%s' % _output(proc)
+            # children that exited have all been waited for, within the
+            # once a second sweep for those without a pidfd
+            assert wait_for(lambda: not _zombies(proc.pid), timeout=3.0), \
+                'zombie children %r; stdout:\n%s' % (_zombies(proc.pid), _output(proc))
+        finally:
+            terminate_proxy(proc)
@@ -0,0 +1,269 @@
+/*
+  hierarchical timer wheel driven by a timerfd
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "timerwheel.h"
+
+#include <stdio.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+Timer::~Timer()
+{
+    if (wheel != nullptr) {
+        wheel->cancel(*this);
+    }
+}
+
+TimerWheel::TimerWheel(EventLoop &_loop) :
+    loop(_loop),
+    origin_ns(monotonic_ns())
+{
+    tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (tfd == -1) {
+        perror("timerfd_create");
+        return;
+    }
+    loop.add(tfd, EPOLLIN, [this](uint32_t) { on_timerfd(); });
+}
+
+TimerWheel::~TimerWheel()
+{
+    for (unsigned l = 0; l < LEVELS; l++) {
+        for (unsigned s = 0; s < SLOTS; s++) {
+            while (slots[l][s] != nullptr) {
+                unlink(*slots[l][s]);
+            }
+        }
+    }
+    if (tfd != -1) {
+        loop.remove(tfd);
+        close(tfd);
+    }
+}
+
+uint64_t TimerWheel::monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+uint64_t TimerWheel::current_tick(void) const
+{
+    return (monotonic_ns() - origin_ns) / TICK_NS;
+}
+
+void TimerWheel::schedule(Timer &t, double delay_s, Timer::handler_t handler)
+{
+    if (t.wheel != nullptr) {
+        unlink(t);
+    }
+    const uint64_t cur = current_tick();
+    if (count[0] + count[1] + count[2] + count[3] == 0 && now_tick < cur) {
+        // nothing to expire in between, so skip the idle ticks
+        now_tick = cur;
+    }
+    uint64_t ticks = 1;
+    if (delay_s > 0) {
+        ticks = uint64_t(ceil(delay_s * 1.0e9 / TICK_NS));
+    }
+    if (ticks < 1) {
+        ticks = 1;
+    }
+    // at least one tick past the one being expired, so a handler that
+    // reschedules itself with no delay doesn't run again in this pass
+    uint64_t expires = cur + ticks;
+    if (expires < now_tick) {
+        expires = now_tick;
+    }
+    const uint64_t span = 1ULL << (SLOT_BITS * LEVELS);
+    if (expires - now_tick >= span) {
+        expires = now_tick + span - 1;
+    }
+    t.expires = expires;
+    t.handler = handler;
+    insert(t);
+    if (armed_tick == 0 || expires < armed_tick) {
+        arm(expires);
+    }
+}
+
+void TimerWheel::cancel(Timer &t)
+{
+    if (t.wheel == this) {
+        // the timerfd may fire for nothing; it is re-armed then
+        unlink(t);
+    }
+}
+
+/*
+  put t in the lowest level whose span covers its expiry
+ */
+void TimerWheel::insert(Timer &t)
+{
+    const uint64_t delta = t.expires - now_tick;
+    unsigned level = 0;
+    while (level < LEVELS - 1 && delta >= (1ULL << (SLOT_BITS * (level + 1)))) {
+        level++;
+    }
+    const unsigned idx = (t.expires >> (SLOT_BITS * level)) & SLOT_MASK;
+    Timer **head = &slots[level][idx];
+    t.wheel = this;
+    t.head = head;
+    t.level = level;
+    t.prev = nullptr;
+    t.next = *head;
+    if (*head != nullptr) {
+        (*head)->prev = &t;
+    }
+    *head = &t;
+    count[level]++;
+}
+
+void TimerWheel::unlink(Timer &t)
+{
+    if (t.prev != nullptr) {
+        t.prev->next = t.next;
+    } else {
+        *t.head = t.next;
+    }
+    if (t.next != nullptr) {
+        t.next->prev = t.prev;
+    }
+    count[t.level]--;
+    t.wheel = nullptr;
+    t.head = nullptr;
+    t.prev = nullptr;
+    t.next = nullptr;
+}
+
+/*
+  now_tick has reached the start of a slot of level: spread its
+  timers over the levels below. The level above goes first when this
+  level has wrapped, as its slot may hold timers for this one
+ */
+void TimerWheel::cascade(unsigned level)
+{
+    const unsigned idx = (now_tick >> (SLOT_BITS * level)) & SLOT_MASK;
+    if (idx == 0 && level + 1 < LEVELS) {
+        cascade(level + 1);
+    }
+    Timer *t = slots[level][idx];
+    slots[level][idx] = nullptr;
+    while (t != nullptr) {
+        Timer *next = t->next;
+        count[level]--;
+        insert(*t);
+        t = next;
+    }
+}
+
+/*
+  expire every timer due up to and including target
+ */
+void TimerWheel::advance(uint64_t target)
+{
+    while (now_tick <= target) {
+        if ((now_tick & SLOT_MASK) == 0) {
+            cascade(1);
+        }
+        if (count[0] == 0) {
+            // nothing in level 0: go straight to the next cascade
+            const uint64_t next = (now_tick | SLOT_MASK) + 1;
+            if (next > target) {
+                now_tick = target + 1;
+                break;
+            }
+            now_tick = next;
+            continue;
+        }
+        Timer **head = &slots[0][now_tick & SLOT_MASK];
+        while (*head != nullptr) {
+            Timer *t = *head;
+            unlink(*t);
+            // the handler may reschedule or destroy t
+            Timer::handler_t handler;
+            handler.swap(t->handler);
+            handler();
+        }
+        now_tick++;
+    }
+}
+
+/*
+  the first tick at which something can happen: a level 0 timer
+  expiring, or a slot of a higher level being cascaded
+ */
+uint64_t TimerWheel::next_expiry(void) const
+{
+    uint64_t best = 0;
+    if (count[0] != 0) {
+        for (uint64_t k = 0; k < SLOTS; k++) {
+            const uint64_t tick = now_tick + k;
+            if (slots[0][tick & SLOT_MASK] != nullptr) {
+                best = tick;
+                break;
+            }
+        }
+    }
+    for (unsigned level = 1; level < LEVELS; level++) {
+        if (count[level] == 0) {
+            continue;
+        }
+        const unsigned shift = SLOT_BITS * level;
+        const uint64_t base = now_tick >> shift;
+        // the current slot is still to be cascaded if now_tick is at
+        // its start, otherwise it only holds timers one lap ahead
+        const uint64_t first = (now_tick & ((1ULL << shift) - 1)) == 0 ? 0 : 1;
+        for (uint64_t j = first; j < first + SLOTS; j++) {
+            if (slots[level][(base + j) & SLOT_MASK] != nullptr) {
+                const uint64_t tick = (base + j) << shift;
+                if (best == 0 || tick < best) {
+                    best = tick;
+                }
+                break;
+            }
+        }
+    }
+    return best;
+}
+
+void TimerWheel::arm(uint64_t tick)
+{
+    armed_tick = tick;
+    struct itimerspec its {};
+    if (tick != 0) {
+        const uint64_t ns = origin_ns + tick * TICK_NS;
+        its.it_value.tv_sec = ns / 1000000000ULL;
+        its.it_value.tv_nsec = ns % 1000000000ULL;
+    }
+    if (timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, nullptr) != 0) {
+        perror("timerfd_settime");
+    }
+}
+
+void TimerWheel::on_timerfd(void)
+{
+    uint64_t expirations;
+    if (read(tfd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+        // already drained; advance anyway
+    }
+    armed_tick = 0;
+    advance(current_tick());
+    arm(next_expiry());
+}
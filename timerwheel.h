@@ -0,0 +1,94 @@
+/*
+  timers for an EventLoop: a hierarchical timer wheel driven by a
+  timerfd
+
+  Timers sit in LEVELS levels of SLOTS slots each. A level 0 slot is
+  one TICK_S tick; a slot of level n covers SLOTS^n ticks and is
+  spread into the levels below when the wheel reaches it. Scheduling
+  and cancelling are O(1). The timerfd is armed for the next occupied
+  slot only, so a process whose timers are all far off sleeps until
+  then. Delays beyond the span of the wheel (about 46 hours) are
+  clamped to it.
+ */
+#pragma once
+
+#include <stdint.h>
+
+#include <functional>
+
+#include "eventloop.h"
+
+class TimerWheel;
+
+/*
+  one timer, embedded in its owner. Destroying a pending timer cancels
+  it; the wheel must outlive it
+ */
+class Timer {
+public:
+    typedef std::function<void(void)> handler_t;
+
+    Timer() = default;
+    ~Timer();
+    Timer(const Timer &) = delete;
+    Timer &operator=(const Timer &) = delete;
+
+    bool pending(void) const { return wheel != nullptr; }
+
+private:
+    friend class TimerWheel;
+    TimerWheel *wheel = nullptr;
+    Timer **head = nullptr;
+    Timer *prev = nullptr;
+    Timer *next = nullptr;
+    uint64_t expires = 0;
+    uint8_t level = 0;
+    handler_t handler;
+};
+
+class TimerWheel {
+public:
+    explicit TimerWheel(EventLoop &loop);
+    ~TimerWheel();
+    TimerWheel(const TimerWheel &) = delete;
+    TimerWheel &operator=(const TimerWheel &) = delete;
+
+    bool ok() const { return tfd != -1; }
+
+    /*
+      call handler once, delay_s seconds from now (rounded up to the
+      next tick). Reschedules t if it is already pending. The handler
+      may schedule or cancel any timer, including t
+     */
+    void schedule(Timer &t, double delay_s, Timer::handler_t handler);
+
+    void cancel(Timer &t);
+
+private:
+    static constexpr unsigned LEVELS = 4;
+    static constexpr unsigned SLOT_BITS = 6;
+    static constexpr unsigned SLOTS = 1U << SLOT_BITS;
+    static constexpr uint64_t SLOT_MASK = SLOTS - 1;
+    static constexpr uint64_t TICK_NS = 10 * 1000 * 1000;
+
+    EventLoop &loop;
+    int tfd = -1;
+    // CLOCK_MONOTONIC time of tick 0
+    uint64_t origin_ns;
+    // next tick to expire
+    uint64_t now_tick = 0;
+    // tick the timerfd is set for, 0 if disarmed
+    uint64_t armed_tick = 0;
+    unsigned count[LEVELS] {};
+    Timer *slots[LEVELS][SLOTS] {};
+
+    static uint64_t monotonic_ns(void);
+    uint64_t current_tick(void) const;
+    void insert(Timer &t);
+    void unlink(Timer &t);
+    void cascade(unsigned level);
+    void advance(uint64_t target);
+    uint64_t next_expiry(void) const;
+    void arm(uint64_t tick);
+    void on_timerfd(void);
+};
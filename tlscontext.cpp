@@ -0,0 +1,236 @@
+/*
+  the TLS server context for WSS connections
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "tlscontext.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <openssl/err.h>
+
+#include <mutex>
+
+#ifndef SSL_CERT_DIR
+#define SSL_CERT_DIR "./"
+#endif
+
+static const char *cert_file = SSL_CERT_DIR "fullchain.pem";
+static const char *key_file  = SSL_CERT_DIR "privkey.pem";
+
+/*
+  ctx is swapped by the parent (or the main thread in reactor mode)
+  while reactor threads take SSLs from it. SSL_new() holds its own
+  reference, so the old context lives on until its last connection
+  closes
+ */
+static std::mutex ctx_mutex;
+static const int ctx_mutex_atfork = pthread_atfork(
+    []() { ctx_mutex.lock(); },
+    []() { ctx_mutex.unlock(); },
+    []() { ctx_mutex.unlock(); });
+static SSL_CTX *ctx;
+static bool use_ktls;
+
+// what the files looked like at the last load attempt
+struct FileStamp {
+    bool exists;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+
+    bool operator==(const FileStamp &o) const {
+        return exists == o.exists && dev == o.dev && ino == o.ino && size == o.size &&
+            mtime.tv_sec == o.mtime.tv_sec && mtime.tv_nsec == o.mtime.tv_nsec;
+    }
+};
+
+static FileStamp cert_stamp, key_stamp;
+
+// follows symlinks, so a renewal that repoints live/ to new files counts
+static FileStamp file_stamp(const char *path)
+{
+    FileStamp s {};
+    struct stat st;
+    if (stat(path, &st) == 0) {
+        s.exists = true;
+        s.dev = st.st_dev;
+        s.ino = st.st_ino;
+        s.size = st.st_size;
+        s.mtime = st.st_mtim;
+    }
+    return s;
+}
+
+/*
+  a new context from the files, with old's session ticket keys if
+  there is one
+ */
+static SSL_CTX *create_ctx(SSL_CTX *old)
+{
+    SSL_CTX *c = SSL_CTX_new(TLS_server_method());
+    if (c == nullptr) {
+        printf("SSL_CTX_new failed\n");
+        return nullptr;
+    }
+    if (SSL_CTX_use_certificate_chain_file(c, cert_file) <= 0 ||
+        SSL_CTX_use_PrivateKey_file(c, key_file, SSL_FILETYPE_PEM) <= 0 ||
+        SSL_CTX_check_private_key(c) <= 0) {
+        ERR_print_errors_fp(stdout);
+        SSL_CTX_free(c);
+        return nullptr;
+    }
+
+    /*
+      sessions resume from tickets, encrypted with keys every child
+      inherits. A server side cache would be per process and miss
+      whenever the reconnect lands in another session child
+     */
+    static const unsigned char sid_ctx[] = "supportproxy";
+    SSL_CTX_set_session_id_context(c, sid_ctx, sizeof(sid_ctx) - 1);
+    SSL_CTX_set_session_cache_mode(c, SSL_SESS_CACHE_OFF);
+#ifdef SSL_OP_ENABLE_KTLS
+    if (use_ktls) {
+        SSL_CTX_set_options(c, SSL_OP_ENABLE_KTLS);
+    }
+#endif
+
+    if (old != nullptr) {
+        // name, HMAC and AES keys
+        unsigned char keys[80];
+        if (SSL_CTX_get_tlsext_ticket_keys(old, keys, sizeof(keys)) == 1) {
+            SSL_CTX_set_tlsext_ticket_keys(c, keys, sizeof(keys));
+        }
+        OPENSSL_cleanse(keys, sizeof(keys));
+    }
+    return c;
+}
+
+bool tls_context_load(void)
+{
+    (void)ctx_mutex_atfork;
+    const FileStamp cert = file_stamp(cert_file);
+    const FileStamp key = file_stamp(key_file);
+
+    // read the files without holding up reactor threads' SSL_new()
+    std::unique_lock<std::mutex> lock(ctx_mutex);
+    cert_stamp = cert;
+    key_stamp = key;
+    SSL_CTX *old = ctx;
+    if (old != nullptr) {
+        SSL_CTX_up_ref(old);
+    }
+    lock.unlock();
+    SSL_CTX *c = create_ctx(old);
+    SSL_CTX_free(old);
+    if (c == nullptr) {
+        printf("TLS: failed to load %s and %s\n", cert_file, key_file);
+        return false;
+    }
+
+    lock.lock();
+    old = ctx;
+    ctx = c;
+    lock.unlock();
+    printf("TLS: %s %s\n", old ? "reloaded" : "loaded", cert_file);
+    SSL_CTX_free(old);
+    return true;
+}
+
+/*
+  see if the kernel takes the TLS upper layer protocol, which needs
+  an established TCP connection. This loads the tls module if it can
+ */
+static bool kernel_has_tls(void)
+{
+    struct sockaddr_in addr {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    const int listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    const int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int peer = -1;
+    bool ok = false;
+    if (listener != -1 && fd != -1 &&
+        bind(listener, (struct sockaddr *)&addr, sizeof(addr)) == 0 &&
+        listen(listener, 1) == 0 &&
+        getsockname(listener, (struct sockaddr *)&addr, &len) == 0 &&
+        connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0 &&
+        (peer = accept(listener, nullptr, nullptr)) != -1) {
+        ok = setsockopt(fd, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) == 0;
+    }
+    for (int s : { listener, fd, peer }) {
+        if (s != -1) {
+            close(s);
+        }
+    }
+    return ok;
+}
+
+bool tls_context_use_ktls(void)
+{
+#ifdef SSL_OP_ENABLE_KTLS
+    if (!kernel_has_tls()) {
+        printf("TLS: kernel TLS not available (no tls module), WSS stays in user space\n");
+        return false;
+    }
+    use_ktls = true;
+    return true;
+#else
+    printf("TLS: OpenSSL built without kernel TLS, WSS stays in user space\n");
+    return false;
+#endif
+}
+
+bool tls_context_check_reload(void)
+{
+    const FileStamp cert = file_stamp(cert_file);
+    const FileStamp key = file_stamp(key_file);
+    {
+        std::lock_guard<std::mutex> lock(ctx_mutex);
+        if (cert == cert_stamp && key == key_stamp) {
+            return false;
+        }
+    }
+    // a failure is reported once, then retried when the files change again
+    return tls_context_load();
+}
+
+SSL *tls_context_new_ssl(int fd)
+{
+    // a session child can outlive a renewal, so look here too
+    tls_context_check_reload();
+
+    std::unique_lock<std::mutex> lock(ctx_mutex);
+    if (ctx == nullptr) {
+        printf("TLS: no certificate loaded\n");
+        return nullptr;
+    }
+    SSL *ssl = SSL_new(ctx);
+    lock.unlock();
+    if (ssl == nullptr) {
+        ERR_print_errors_fp(stdout);
+        return nullptr;
+    }
+    SSL_set_fd(ssl, fd);
+    return ssl;
+}
@@ -0,0 +1,44 @@
+/*
+  the TLS server context for WSS connections
+
+  One SSL_CTX with SSL_CERT_DIR fullchain.pem and privkey.pem, loaded
+  by the parent before it forks session children or starts reactor
+  threads, so a connection costs an SSL_new() rather than a context
+  and two PEM files. Children inherit it, session ticket keys
+  included, so a ticket issued by one session child resumes the TLS
+  session in any other and a reconnecting engineer skips the full
+  handshake.
+
+  The parent checks the two files once a second, and a process checks
+  them again before each new connection, and loads a new context when
+  they have changed (a certificate renewal). Ticket keys are carried
+  over, so tickets issued before the renewal still resume.
+ */
+#pragma once
+
+#include <openssl/ssl.h>
+
+// load the context; false (with the reason printed) if it can't be
+bool tls_context_load(void);
+
+/*
+  hand connections to kernel TLS once the handshake is done, for
+  contexts loaded from now on: the kernel then encrypts and decrypts
+  on send() and recv(). Needs the tls module and an OpenSSL built
+  with kTLS; false, and nothing changes, if the kernel can't do it.
+  A connection whose cipher the kernel doesn't have stays in user
+  space
+ */
+bool tls_context_use_ktls(void);
+
+/*
+  load a new context if either file changed since the last attempt.
+  Returns true if a new context was loaded
+ */
+bool tls_context_check_reload(void);
+
+/*
+  a server SSL on fd with the current context, after a reload check.
+  nullptr if there is no usable context
+ */
+SSL *tls_context_new_ssl(int fd);
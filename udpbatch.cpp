@@ -0,0 +1,163 @@
+/*
+  batched UDP sends
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "udpbatch.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+#define MAX_QUEUED 64
+
+namespace {
+
+struct Queued {
+    int fd;
+    uint16_t len;
+    bool has_to;
+    struct sockaddr_in to;
+    socklen_t tolen;
+    uint8_t data[UDPSendBatch::SLOT_SIZE];
+};
+
+struct BatchState {
+    unsigned depth;
+    unsigned count;
+    Queued q[MAX_QUEUED];
+    std::vector<DeferredOutput *> deferred;
+};
+
+thread_local BatchState state;
+
+}
+
+UDPSendBatch::UDPSendBatch()
+{
+    state.depth++;
+}
+
+UDPSendBatch::~UDPSendBatch()
+{
+    if (--state.depth == 0) {
+        flush();
+    }
+}
+
+bool UDPSendBatch::queue(int fd, const void *buf, size_t len, const struct sockaddr_in *to, socklen_t tolen)
+{
+    if (len > SLOT_SIZE) {
+        return false;
+    }
+    uint8_t *slot = reserve(fd, to, tolen);
+    if (slot == nullptr) {
+        return false;
+    }
+    memcpy(slot, buf, len);
+    commit(len);
+    return true;
+}
+
+uint8_t *UDPSendBatch::reserve(int fd, const struct sockaddr_in *to, socklen_t tolen)
+{
+    if (state.depth == 0) {
+        return nullptr;
+    }
+    if (state.count == MAX_QUEUED) {
+        flush();
+    }
+    auto &e = state.q[state.count];
+    e.fd = fd;
+    e.has_to = to != nullptr;
+    if (e.has_to) {
+        e.to = *to;
+        e.tolen = tolen;
+    }
+    return e.data;
+}
+
+void UDPSendBatch::commit(size_t len)
+{
+    state.q[state.count++].len = len;
+}
+
+bool UDPSendBatch::defer(DeferredOutput *o)
+{
+    if (state.depth == 0) {
+        return false;
+    }
+    state.deferred.push_back(o);
+    return true;
+}
+
+void UDPSendBatch::cancel(DeferredOutput *o)
+{
+    auto &d = state.deferred;
+    d.erase(std::remove(d.begin(), d.end(), o), d.end());
+}
+
+/*
+  write the deferred stream output, then one sendmmsg() per socket,
+  keeping the order of the datagrams for each. A datagram the kernel
+  won't take is dropped, as a failed sendto() would have been
+ */
+void UDPSendBatch::flush(void)
+{
+    for (auto *o : state.deferred) {
+        o->flush_output();
+    }
+    state.deferred.clear();
+
+    struct mmsghdr msgs[MAX_QUEUED];
+    struct iovec iov[MAX_QUEUED];
+    bool sent[MAX_QUEUED] {};
+
+    for (unsigned i = 0; i < state.count; i++) {
+        if (sent[i]) {
+            continue;
+        }
+        const int fd = state.q[i].fd;
+        unsigned n = 0;
+        for (unsigned j = i; j < state.count; j++) {
+            auto &e = state.q[j];
+            if (sent[j] || e.fd != fd) {
+                continue;
+            }
+            sent[j] = true;
+            iov[n].iov_base = e.data;
+            iov[n].iov_len = e.len;
+            memset(&msgs[n], 0, sizeof(msgs[n]));
+            msgs[n].msg_hdr.msg_iov = &iov[n];
+            msgs[n].msg_hdr.msg_iovlen = 1;
+            if (e.has_to) {
+                msgs[n].msg_hdr.msg_name = &e.to;
+                msgs[n].msg_hdr.msg_namelen = e.tolen;
+            }
+            n++;
+        }
+        unsigned off = 0;
+        while (off < n) {
+            const int ret = sendmmsg(fd, &msgs[off], n - off, 0);
+            if (ret <= 0) {
+                // skip the datagram that failed and carry on
+                off++;
+                continue;
+            }
+            off += ret;
+        }
+    }
+    state.count = 0;
+}
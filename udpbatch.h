@@ -0,0 +1,74 @@
+/*
+  batched UDP sends
+
+  While a UDPSendBatch is open on a thread, UDP sends from MAVLink
+  links are queued and leave in one sendmmsg() per socket when it is
+  closed (or the queue fills up). Forwarding a burst of messages to
+  many UDP engineers then costs a syscall per socket per wakeup
+  rather than one per message per engineer. Session owners open one
+  around each event loop dispatch.
+
+  Stream links (TCP, WebSocket) hold their frames back the same way:
+  they register as DeferredOutput and are asked to write everything
+  they collected when the batch closes.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+/*
+  output written when the send batch on this thread closes
+ */
+class DeferredOutput {
+public:
+    virtual void flush_output(void) = 0;
+
+protected:
+    ~DeferredOutput() = default;
+};
+
+class UDPSendBatch {
+public:
+    UDPSendBatch();
+    ~UDPSendBatch();
+    UDPSendBatch(const UDPSendBatch &) = delete;
+    UDPSendBatch &operator=(const UDPSendBatch &) = delete;
+
+    /*
+      queue a datagram for fd, to `to` if given. Returns false if no
+      batch is open on this thread (or it is too big), in which case
+      the caller sends it itself
+     */
+    static bool queue(int fd, const void *buf, size_t len, const struct sockaddr_in *to, socklen_t tolen);
+
+    // largest datagram that can be queued
+    static constexpr size_t SLOT_SIZE = 300;
+
+    /*
+      claim the next queue entry for a datagram to fd, so the caller
+      can build it in place instead of in a buffer that queue() then
+      copies. Nothing is sent until commit() gives its length; a slot
+      that is not committed is reused by the next send. Returns
+      nullptr if no batch is open on this thread
+     */
+    static uint8_t *reserve(int fd, const struct sockaddr_in *to, socklen_t tolen);
+    static void commit(size_t len);
+
+    /*
+      have o->flush_output() called once when the batch on this thread
+      closes or is flushed. Returns false if no batch is open, in
+      which case the caller writes now. An object that goes away
+      before then must cancel()
+     */
+    static bool defer(DeferredOutput *o);
+    static void cancel(DeferredOutput *o);
+
+    /*
+      send everything queued on this thread now. Called before a
+      socket that may have sends queued is closed
+     */
+    static void flush(void);
+};
@@ -0,0 +1,329 @@
+/*
+  io_uring receive and send path for session sockets (-u)
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "uring.h"
+
+#ifdef HAVE_IO_URING
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <liburing.h>
+
+// the one provided-buffer group every receive selects from
+static const int BGID = 0;
+
+struct UringIO::Recv : Op {
+    int fd;
+    bool datagram;
+    bool live;
+    // a receive is in flight; its last completion lacks IORING_CQE_F_MORE
+    bool armed;
+    recv_handler_t handler;
+    // layout template for multishot recvmsg: room for the sender only
+    struct msghdr mh;
+};
+
+struct UringIO::SendSlot : Op {
+    struct msghdr mh;
+    struct iovec iov;
+    struct sockaddr_in to;
+    uint8_t data[MAX_SEND];
+};
+
+UringIO::UringIO(EventLoop &_loop) :
+    loop(_loop)
+{
+}
+
+UringIO *UringIO::create(EventLoop &loop)
+{
+    auto *u = new UringIO(loop);
+    if (!u->setup()) {
+        delete u;
+        return nullptr;
+    }
+    return u;
+}
+
+bool UringIO::setup(void)
+{
+    ring = new struct io_uring;
+    int ret = io_uring_queue_init(RING_ENTRIES, ring, 0);
+    if (ret < 0) {
+        printf("io_uring_queue_init: %s\n", strerror(-ret));
+        delete ring;
+        ring = nullptr;
+        return false;
+    }
+    buf_ring = io_uring_setup_buf_ring(ring, NUM_BUFS, BGID, 0, &ret);
+    if (buf_ring == nullptr) {
+        printf("io_uring_setup_buf_ring: %s\n", strerror(-ret));
+        return false;
+    }
+    bufs = (uint8_t *)malloc(NUM_BUFS * BUF_SIZE);
+    if (bufs == nullptr) {
+        return false;
+    }
+    for (unsigned i = 0; i < NUM_BUFS; i++) {
+        io_uring_buf_ring_add(buf_ring, bufs + i * BUF_SIZE, BUF_SIZE, i,
+                              io_uring_buf_ring_mask(NUM_BUFS), i);
+    }
+    io_uring_buf_ring_advance(buf_ring, NUM_BUFS);
+
+    send_slots.resize(NUM_SEND_SLOTS);
+    for (auto &s : send_slots) {
+        s.kind = Op::SEND;
+        free_slots.push_back(&s);
+    }
+
+    return loop.add(ring->ring_fd, EPOLLIN, [this](uint32_t) { handle_completions(); });
+}
+
+UringIO::~UringIO()
+{
+    if (ring == nullptr) {
+        return;
+    }
+    loop.remove(ring->ring_fd);
+    if (buf_ring != nullptr) {
+        io_uring_free_buf_ring(ring, buf_ring, NUM_BUFS, BGID);
+    }
+    // exiting the ring cancels whatever is still in flight
+    io_uring_queue_exit(ring);
+    for (auto &kv : recvs) {
+        delete kv.second;
+    }
+    for (auto *r : dead) {
+        delete r;
+    }
+    free(bufs);
+    delete ring;
+}
+
+bool UringIO::add_recv(int fd, bool datagram, recv_handler_t handler)
+{
+    if (fd < 0 || recvs.count(fd) != 0) {
+        return false;
+    }
+    auto *r = new Recv;
+    r->kind = Op::RECV;
+    r->fd = fd;
+    r->datagram = datagram;
+    r->live = true;
+    r->armed = false;
+    r->handler = std::move(handler);
+    memset(&r->mh, 0, sizeof(r->mh));
+    r->mh.msg_namelen = sizeof(struct sockaddr_in);
+    recvs[fd] = r;
+    arm(r);
+    submit();
+    return true;
+}
+
+void UringIO::remove(int fd)
+{
+    auto it = recvs.find(fd);
+    if (it == recvs.end()) {
+        return;
+    }
+    auto *r = it->second;
+    recvs.erase(it);
+    r->live = false;
+    if (r->armed) {
+        // don't return until the receive has dropped its reference to
+        // the socket; its -ECANCELED completion is reaped later
+        struct io_uring_sync_cancel_reg reg {};
+        reg.addr = uint64_t(uintptr_t(static_cast<Op *>(r)));
+        reg.timeout.tv_sec = -1;
+        reg.timeout.tv_nsec = -1;
+        io_uring_register_sync_cancel(ring, &reg);
+    }
+    dead.push_back(r);
+}
+
+void UringIO::arm(Recv *r)
+{
+    auto *sqe = io_uring_get_sqe(ring);
+    if (sqe == nullptr) {
+        io_uring_submit(ring);
+        sqe = io_uring_get_sqe(ring);
+    }
+    if (r->datagram) {
+        io_uring_prep_recvmsg_multishot(sqe, r->fd, &r->mh, 0);
+    } else {
+        io_uring_prep_recv_multishot(sqe, r->fd, nullptr, 0, 0);
+    }
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BGID;
+    io_uring_sqe_set_data(sqe, static_cast<Op *>(r));
+    r->armed = true;
+}
+
+/*
+  submit now, unless we are dispatching completions: then everything
+  the handlers queued goes out together at the end of the batch
+ */
+void UringIO::submit(void)
+{
+    if (!dispatching) {
+        io_uring_submit(ring);
+    }
+}
+
+void UringIO::recycle(unsigned bid)
+{
+    io_uring_buf_ring_add(buf_ring, bufs + bid * BUF_SIZE, BUF_SIZE, bid,
+                          io_uring_buf_ring_mask(NUM_BUFS), 0);
+    io_uring_buf_ring_advance(buf_ring, 1);
+}
+
+ssize_t UringIO::send(int fd, const void *buf, size_t len, const struct sockaddr_in *to, socklen_t tolen)
+{
+    if (free_slots.empty() || len > MAX_SEND) {
+        if (to != nullptr) {
+            return ::sendto(fd, buf, len, 0, (const struct sockaddr *)to, tolen);
+        }
+        return ::send(fd, buf, len, 0);
+    }
+    auto *s = free_slots.back();
+    free_slots.pop_back();
+    memcpy(s->data, buf, len);
+    s->iov.iov_base = s->data;
+    s->iov.iov_len = len;
+    memset(&s->mh, 0, sizeof(s->mh));
+    s->mh.msg_iov = &s->iov;
+    s->mh.msg_iovlen = 1;
+    if (to != nullptr) {
+        s->to = *to;
+        s->mh.msg_name = &s->to;
+        s->mh.msg_namelen = tolen;
+    }
+    auto *sqe = io_uring_get_sqe(ring);
+    if (sqe == nullptr) {
+        io_uring_submit(ring);
+        sqe = io_uring_get_sqe(ring);
+    }
+    io_uring_prep_sendmsg(sqe, fd, &s->mh, MSG_NOSIGNAL);
+    io_uring_sqe_set_data(sqe, static_cast<Op *>(s));
+    submit();
+    return len;
+}
+
+void UringIO::handle_completions(void)
+{
+    dispatching = true;
+    struct io_uring_cqe *cqe;
+    while (io_uring_peek_cqe(ring, &cqe) == 0) {
+        auto *op = (Op *)io_uring_cqe_get_data(cqe);
+        const int res = cqe->res;
+        const uint32_t flags = cqe->flags;
+        io_uring_cqe_seen(ring, cqe);
+
+        if (op->kind == Op::SEND) {
+            // UDP, so a failed send is just a lost packet
+            free_slots.push_back(static_cast<SendSlot *>(op));
+            continue;
+        }
+
+        auto *r = static_cast<Recv *>(op);
+        if ((flags & IORING_CQE_F_MORE) == 0) {
+            r->armed = false;
+        }
+        int bid = -1;
+        uint8_t *data = nullptr;
+        if (flags & IORING_CQE_F_BUFFER) {
+            bid = flags >> IORING_CQE_BUFFER_SHIFT;
+            data = bufs + bid * BUF_SIZE;
+        }
+
+        if (r->live && res != -ENOBUFS && res != -ECANCELED) {
+            if (res < 0) {
+                r->handler(nullptr, res, nullptr, 0);
+            } else if (r->datagram) {
+                auto *out = io_uring_recvmsg_validate(data, res, &r->mh);
+                if (out != nullptr) {
+                    r->handler((uint8_t *)io_uring_recvmsg_payload(out, &r->mh),
+                               io_uring_recvmsg_payload_length(out, res, &r->mh),
+                               (const struct sockaddr_in *)io_uring_recvmsg_name(out),
+                               out->namelen);
+                }
+            } else {
+                r->handler(data, res, nullptr, 0);
+            }
+        }
+        if (bid != -1) {
+            recycle(bid);
+        }
+
+        // the kernel ends a multishot receive when the buffers run dry
+        // (or for its own reasons); carry on unless the socket is done
+        if (!r->armed && r->live && (res > 0 || res == -ENOBUFS || (res == 0 && r->datagram))) {
+            arm(r);
+        }
+    }
+    dispatching = false;
+
+    for (auto it = dead.begin(); it != dead.end();) {
+        if (!(*it)->armed) {
+            delete *it;
+            it = dead.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    if (io_uring_sq_ready(ring) > 0) {
+        io_uring_submit(ring);
+    }
+}
+
+#else // HAVE_IO_URING
+
+struct UringIO::Recv {};
+struct UringIO::SendSlot {};
+
+UringIO::UringIO(EventLoop &_loop) :
+    loop(_loop)
+{
+}
+
+UringIO::~UringIO()
+{
+}
+
+UringIO *UringIO::create(EventLoop &loop)
+{
+    return nullptr;
+}
+
+bool UringIO::add_recv(int fd, bool datagram, recv_handler_t handler)
+{
+    return false;
+}
+
+void UringIO::remove(int fd)
+{
+}
+
+ssize_t UringIO::send(int fd, const void *buf, size_t len, const struct sockaddr_in *to, socklen_t tolen)
+{
+    return -1;
+}
+
+#endif // HAVE_IO_URING
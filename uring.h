@@ -0,0 +1,99 @@
+/*
+  io_uring receive and send path for session sockets (-u)
+
+  A socket handed to UringIO gets one multishot receive that stays
+  armed across packets, with the data landing in a ring of buffers the
+  kernel picks from, so a busy socket costs no syscall per packet.
+  Datagram sends queued while completions are being dispatched go out
+  in a single submit at the end of the batch. The ring fd is itself
+  watched by the EventLoop, so epoll keeps handling listeners,
+  WebSocket links and timers.
+
+  Only built with IO_URING=1 (liburing 2.4 or later, Linux 6.0 or
+  later); otherwise create() returns nullptr and callers stay on the
+  epoll path.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include <functional>
+#include <unordered_map>
+#include <vector>
+
+#include "eventloop.h"
+
+struct io_uring;
+struct io_uring_buf_ring;
+
+class UringIO {
+public:
+    /*
+      called for each received chunk. n >= 0 with from set is a
+      datagram; on a stream n > 0 is data and n == 0 is EOF. n < 0 is
+      -errno. The receive is over after EOF or an error
+     */
+    typedef std::function<void(uint8_t *data, ssize_t n, const struct sockaddr_in *from, socklen_t fromlen)> recv_handler_t;
+
+    // returns nullptr if io_uring is not built in or not usable
+    static UringIO *create(EventLoop &loop);
+    ~UringIO();
+    UringIO(const UringIO &) = delete;
+    UringIO &operator=(const UringIO &) = delete;
+
+    /*
+      start receiving on fd. datagram sockets report the sender of
+      each packet
+     */
+    bool add_recv(int fd, bool datagram, recv_handler_t handler);
+
+    /*
+      stop receiving on fd. Must be called before close(); returns
+      once the kernel has let go of the receive, so the port can be
+      bound again straight away. Safe to call from inside a handler
+     */
+    void remove(int fd);
+
+    bool contains(int fd) const { return recvs.count(fd) != 0; }
+
+    /*
+      queue a send of len bytes on fd, to `to` if given. Falls back to
+      a plain send when no slot is free. Returns len or -1
+     */
+    ssize_t send(int fd, const void *buf, size_t len, const struct sockaddr_in *to, socklen_t tolen);
+
+private:
+    static constexpr unsigned RING_ENTRIES = 256;
+    static constexpr unsigned NUM_BUFS = 64;
+    static constexpr unsigned BUF_SIZE = 4096;
+    static constexpr unsigned NUM_SEND_SLOTS = 256;
+    static constexpr unsigned MAX_SEND = 300;
+
+    struct Op {
+        enum Kind : uint8_t { RECV, SEND } kind;
+    };
+    struct Recv;
+    struct SendSlot;
+
+    explicit UringIO(EventLoop &loop);
+    bool setup(void);
+    void arm(Recv *r);
+    void submit(void);
+    void handle_completions(void);
+    void recycle(unsigned bid);
+
+    EventLoop &loop;
+    struct io_uring *ring = nullptr;
+    struct io_uring_buf_ring *buf_ring = nullptr;
+    uint8_t *bufs = nullptr;
+    bool dispatching = false;
+
+    std::unordered_map<int, Recv *> recvs;
+    // removed but still waiting for their last completion
+    std::vector<Recv *> dead;
+    std::vector<SendSlot> send_slots;
+    std::vector<SendSlot *> free_slots;
+};
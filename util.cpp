@@ -11,14 +11,14 @@
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <sys/wait.h>
-#include <sys/ioctl.h>
 #include <stddef.h>
-#include <poll.h>
 #include <sys/fcntl.h>
+#include <dirent.h>
 
-#ifdef __linux__
-#include <linux/sockios.h>   // SIOCOUTQ
-#endif
+#include <sys/syscall.h>
+
+#include <algorithm>
+#include <vector>
 
 double time_seconds(void)
 {
@@ -44,7 +44,7 @@ int open_socket_in_udp(int port)
     sock.sin_port = htons(port);
     sock.sin_family = AF_INET;
 
-    res = socket(AF_INET, SOCK_DGRAM, 0);
+    res = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
     if (res == -1) { 
         fprintf(stderr, "socket failed\n"); return -1; 
         return -1;
@@ -85,7 +85,7 @@ int open_socket_in_tcp(int port)
     sock.sin_port = htons(port);
     sock.sin_family = AF_INET;
 
-    res = socket(AF_INET, SOCK_STREAM, 0);
+    res = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
     if (res == -1) { 
         fprintf(stderr, "socket failed\n"); return -1; 
         return -1;
@@ -107,107 +107,109 @@ int open_socket_in_tcp(int port)
 }
 
 /*
-  convert address to string, uses a static return buffer
+  convert address to string, uses a per-thread static return buffer
  */
-const char *addr_to_str(struct sockaddr_in &addr)
+const char *addr_to_str(const struct sockaddr_in &addr)
 {
-    static char str[INET_ADDRSTRLEN+1];
+    static thread_local char str[INET_ADDRSTRLEN+1];
     inet_ntop(AF_INET, &addr.sin_addr, str, INET_ADDRSTRLEN);
     return str;
 }
 
 /*
-  return time as a string, using a static buffer
+  return time as a string, using a per-thread static buffer
  */
 const char *time_string(void)
 {
     time_t t = time(nullptr);
-    struct tm *tm = localtime(&t);
-    static char str[100] {};
-    strftime(str, sizeof(str)-1, "%F %T", tm);
+    struct tm tm;
+    localtime_r(&t, &tm);
+    static thread_local char str[100] {};
+    strftime(str, sizeof(str)-1, "%F %T", &tm);
     return str;
 }
 
-/*
-  Returns the number of bytes that can be written to fd without blocking.
-  On error returns -1 and sets errno.
-*/
-ssize_t tcp_writable_bytes(int fd)
+void set_nonblocking(int fd)
 {
-    int outq = 0;             // bytes currently queued in the send buffer
-#if defined(SIOCOUTQ)
-    if (ioctl(fd, SIOCOUTQ, &outq) == -1) {
-        return -1;
-    }
-#else
-# error "SIOCOUTQ not available on this platform"
-#endif
-
-    int sndbuf = 0;           // total size of the send buffer
-    socklen_t optlen = sizeof(sndbuf);
-    if (getsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, &optlen) == -1) {
-        return -1;
-    }
-
-    // Linux returns the kernel's accounting size for SO_SNDBUF (often doubled).
-    // The available space is the remainder; clamp at 0.
-    ssize_t avail = (ssize_t)sndbuf - (ssize_t)outq;
-    if (avail < 0) avail = 0;
-    return avail;
+    unsigned v = fcntl(fd, F_GETFL, 0);
+    fcntl(fd, F_SETFL, v | O_NONBLOCK);
 }
 
 /*
-  return true if a TCP socket is dead
-*/
-bool socket_is_dead(int fd)
+  close fd if open and mark it closed
+ */
+void close_fd(int &fd)
 {
-    // Verify it's a stream socket (TCP).
-    int type = 0;
-    socklen_t tlen = sizeof(type);
-    if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &tlen) == -1) {
-	return true;
-    }
-    if (type != SOCK_STREAM) {
-	return true;
+    if (fd != -1) {
+	close(fd);
+	fd = -1;
     }
+}
 
-    // Quick, non-blocking health probe.
-    struct pollfd pfd {};
-    pfd.fd = fd;
-    pfd.events = POLLOUT | POLLERR | POLLHUP | POLLNVAL;
-    int pr = poll(&pfd, 1, 0);
-    if (pr < 0) {
-	return true;
+/*
+  close descriptors lo..hi inclusive. One close_range() call where the
+  kernel has it (5.9+); otherwise walk /proc/self/fd, which is still
+  only a close() per open fd
+ */
+static void close_fd_range(unsigned lo, unsigned hi)
+{
+    if (lo > hi) {
+        return;
     }
-    if (pr == 1 && (pfd.revents & (POLLERR | POLLHUP | POLLNVAL))) {
-	return true;
+#ifdef SYS_close_range
+    if (syscall(SYS_close_range, lo, hi, 0) == 0) {
+        return;
     }
-
-    // Check for a queued asynchronous error even if poll() looked fine.
-    // (This also catches connect() failures on nonblocking sockets.)
-    int soerr = 0; socklen_t slen = sizeof(soerr);
-    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &soerr, &slen) == 0 && soerr != 0) {
-	return true;
+#endif
+    DIR *d = opendir("/proc/self/fd");
+    if (d == nullptr) {
+        return;
     }
-
-#ifdef TCP_INFO
-    // Inspect TCP state. Consider only states that are writable as "alive".
-    struct tcp_info ti;
-    socklen_t tilen = sizeof(ti);
-    if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &ti, &tilen) == 0) {
-        // Writable in practice: ESTABLISHED, and often CLOSE_WAIT (peer sent FIN, but we can still write).
-        if (ti.tcpi_state != TCP_ESTABLISHED && ti.tcpi_state != TCP_CLOSE_WAIT) {
-	    return true;
+    const int dfd = dirfd(d);
+    std::vector<int> fds;
+    struct dirent *de;
+    while ((de = readdir(d)) != nullptr) {
+        const int fd = atoi(de->d_name);
+        if (de->d_name[0] != '.' && fd != dfd && unsigned(fd) >= lo && unsigned(fd) <= hi) {
+            fds.push_back(fd);
         }
     }
-#endif
+    closedir(d);
+    for (int fd : fds) {
+        close(fd);
+    }
+}
 
-    // looks healthy for writing
-    return false;
+/*
+  close every descriptor >= lowfd. Used in a child forked from a
+  process whose threads own sockets the child can't know about
+ */
+void close_fds_from(int lowfd)
+{
+    close_fd_range(lowfd, ~0U);
 }
 
-void set_nonblocking(int fd)
+/*
+  close every descriptor above stderr except the n in keep (-1
+  entries are ignored). The cost doesn't depend on how many fds the
+  parent had open, which with one listener set per port pair can be
+  tens of thousands
+ */
+void close_fds_except(const int *keep, unsigned n)
 {
-    unsigned v = fcntl(fd, F_GETFL, 0);
-    fcntl(fd, F_SETFL, v | O_NONBLOCK);
+    std::vector<int> k;
+    for (unsigned i = 0; i < n; i++) {
+        if (keep[i] > 2) {
+            k.push_back(keep[i]);
+        }
+    }
+    std::sort(k.begin(), k.end());
+    unsigned lo = 3;
+    for (int fd : k) {
+        if (unsigned(fd) > lo) {
+            close_fd_range(lo, fd - 1);
+        }
+        lo = fd + 1;
+    }
+    close_fd_range(lo, ~0U);
 }
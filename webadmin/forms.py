@@ -85,6 +85,9 @@ class AdminEditForm(FlaskForm):
     binlog_enabled = BooleanField(
         'Record ArduPilot bin logs over MAVLink (.bin) — '
         'firmware must have LOG_BACKEND_TYPE mavlink bit set')
+    passthrough = BooleanField(
+        'Pass-through: engineers need not sign, and plain TCP links are '
+        'relayed by the kernel (no logging, no user signing)')
     log_retention_days = FloatField(
         'Log retention (days, 0 = keep forever) — '
         'covers both .tlog and .bin files',
@@ -193,6 +193,10 @@ def edit(port2):
                 ke.flags |= keydb_lib.FLAG_BINLOG
             else:
                 ke.flags &= ~keydb_lib.FLAG_BINLOG
+            if form.passthrough.data:
+                ke.flags |= keydb_lib.FLAG_PASSTHROUGH
+            else:
+                ke.flags &= ~keydb_lib.FLAG_PASSTHROUGH
             if form.log_retention_days.data is not None:
                 ke.log_retention_days = float(form.log_retention_days.data)
             # First-enable default for either recording flag.
@@ -225,6 +229,7 @@ def edit(port2):
         form.bidi_sign.data = bool(ke.flags & keydb_lib.FLAG_BIDI_SIGN)
         form.tlog_enabled.data = bool(ke.flags & keydb_lib.FLAG_TLOG)
         form.binlog_enabled.data = bool(ke.flags & keydb_lib.FLAG_BINLOG)
+        form.passthrough.data = bool(ke.flags & keydb_lib.FLAG_PASSTHROUGH)
         form.log_retention_days.data = ke.log_retention_days
         form.fc_sysid.data = ke.fc_sysid
     return render_template('admin_edit.html', form=form, entry=ke,
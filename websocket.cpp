@@ -2,6 +2,7 @@
   handle websocket connections
  */
 #include "websocket.h"
+#include "tlscontext.h"
 #include <sys/socket.h>
 #include <unistd.h>
 #include <string.h>
@@ -9,14 +10,15 @@
 #include <errno.h>
 #include <stdio.h>
 #include <string>
+#include <algorithm>
 #include <openssl/sha.h>
 #include <openssl/bio.h>
 #include <openssl/buffer.h>
 #include <openssl/evp.h>
 #include <openssl/err.h>
 
-#ifndef SSL_CERT_DIR
-#define SSL_CERT_DIR "./"
+#if defined(__SSE2__)
+#include <emmintrin.h>
 #endif
 
 static const char *ws_prefix = "GET / HTTP/1.1";
@@ -48,6 +50,7 @@ bool WebSocket::detect(int fd)
 WebSocket::WebSocket(int _fd)
 {
     fd = _fd;
+    in.resize(RECV_BUFFER_INITIAL);
     uint8_t peekbuf[14] {};
 
     const ssize_t peekn = ::recv(fd, peekbuf, sizeof(peekbuf), MSG_PEEK);
@@ -57,165 +60,400 @@ WebSocket::WebSocket(int _fd)
     }
 
     if (_is_SSL) {
-	/*
-	  setup SSL connection with OpenSSL
-	 */
-	const char *cert_file = SSL_CERT_DIR "fullchain.pem";
-	const char *key_file  = SSL_CERT_DIR "privkey.pem";
-	SSL_library_init();
-	OpenSSL_add_all_algorithms();
-	SSL_load_error_strings();
-	ctx = SSL_CTX_new(TLS_server_method());
-	if (!ctx) {
-	    printf("SSL_CTX_new failed");
+	// the context is shared, see tlscontext.h
+	ssl = tls_context_new_ssl(fd);
+	if (ssl == nullptr) {
 	    return;
 	}
-	if (SSL_CTX_use_certificate_chain_file(ctx, cert_file) <= 0) {
-	    ERR_print_errors_fp(stdout);
-	    return;
-	}
-	if (SSL_CTX_use_PrivateKey_file(ctx, key_file, SSL_FILETYPE_PEM) <= 0) {
-	    ERR_print_errors_fp(stdout);
-	    return;
-	}
-	ssl = SSL_new(ctx);
-	SSL_set_fd(ssl, fd);
+	// queued output is written in pieces and compacted between tries
+	SSL_set_mode(ssl, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
     }
 
-    fill_pending();
+    fill(0);
     check_headers();
 }
 
-void WebSocket::check_headers(void)
+WebSocket::~WebSocket()
+{
+    SSL_free(ssl);
+}
+
+/*
+  take the HTTP upgrade request once all of it is in and answer it.
+  Returns true when the handshake is done
+ */
+bool WebSocket::check_headers(void)
 {
-    auto len = strnlen((const char *)pending, npending);
-
-    // parse Sec-WebSocket-Key from HTTP headers
-    std::string headers(reinterpret_cast<const char *>(pending), len);
-    std::string key_marker = "Sec-WebSocket-Key: ";
-    size_t key_pos = headers.find(key_marker);
-    if (key_pos != std::string::npos) {
-        key_pos += key_marker.length();
-        size_t end = headers.find("\r\n", key_pos);
-        if (end != std::string::npos) {
-            std::string sec_key = headers.substr(key_pos, end - key_pos);
-            if (send_handshake(sec_key)) {
-                done_headers = true;
-                npending = 0;
-                printf("WebSocket: done headers\n");
+    const char *req = (const char *)&in[in_start];
+    const size_t len = in_end - in_start;
+    const char *end = (const char *)memmem(req, len, "\r\n\r\n", 4);
+    if (end == nullptr) {
+        if (len >= MAX_REQUEST_LEN) {
+            printf("WebSocket: request headers over %u bytes\n", unsigned(MAX_REQUEST_LEN));
+            closed = true;
+        }
+        return false;
+    }
+
+    // parse Sec-WebSocket-Key, header names are case insensitive
+    static const char key_marker[] = "Sec-WebSocket-Key:";
+    std::string sec_key;
+    for (const char *line = req; line < end; ) {
+        const char *eol = (const char *)memmem(line, end - line, "\r\n", 2);
+        if (eol == nullptr) {
+            eol = end;
+        }
+        if (size_t(eol - line) > strlen(key_marker) &&
+            strncasecmp(line, key_marker, strlen(key_marker)) == 0) {
+            const char *v = line + strlen(key_marker);
+            while (v < eol && (*v == ' ' || *v == '\t')) {
+                v++;
             }
+            const char *v_end = eol;
+            while (v_end > v && (v_end[-1] == ' ' || v_end[-1] == '\t')) {
+                v_end--;
+            }
+            sec_key.assign(v, v_end - v);
+            break;
         }
+        line = eol + 2;
+    }
+    if (sec_key.empty()) {
+        printf("WebSocket: no Sec-WebSocket-Key in request\n");
+        closed = true;
+        return false;
     }
+    if (!send_handshake(sec_key)) {
+        return false;
+    }
+    done_headers = true;
+    // a client may send frames straight after the request
+    in_start += (end + 4) - req;
+    printf("WebSocket: done headers\n");
+    return true;
 }
 
 /*
-  try to receive more data
+  make room for at least more bytes after in_end. Partly received
+  data moves to the front only when the space behind it runs out, so
+  in steady state a read lands behind the frames still being handed
+  out and nothing is copied
  */
-void WebSocket::fill_pending(void)
+void WebSocket::make_space(size_t more)
 {
-    // ensure always null terminated
-    auto space = (sizeof(pending)-1) - npending;
-    if (fd >= 0 && space > 0) {
-        ssize_t n = 0;
-        if (ssl) {
-            if (!SSL_handshake_complete) {
-                auto res = SSL_accept(ssl);
-                if (res <= 0) {
-                    int err = SSL_get_error(ssl, res);
-                    if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) {
-                        // still pending
-                        return;
-                    }
-                    ERR_print_errors_fp(stdout);
-                    close(fd);
-                    fd = -1;
-                    return;
-                }
-                printf("SSL handshake completed\n");
-                SSL_handshake_complete = true;
-            }
-            n = SSL_read(ssl, &pending[npending], space);
-            if (n <= 0) {
-                int err = SSL_get_error(ssl, n);
+    if (in_start == in_end) {
+        in_start = in_end = 0;
+    }
+    if (in.size() - in_end >= more) {
+        return;
+    }
+    if (in_start > 0) {
+        memmove(in.data(), &in[in_start], in_end - in_start);
+        in_end -= in_start;
+        in_start = 0;
+    }
+    size_t size = in.size();
+    while (size - in_end < more && size < RECV_BUFFER_MAX) {
+        size *= 2;
+    }
+    if (size > in.size()) {
+        in.resize(std::min(size, RECV_BUFFER_MAX));
+    }
+}
+
+/*
+  read what the socket, or TLS, has. more is how many bytes the frame
+  being received still lacks. Returns the bytes read, 0 if there are
+  none for now, -1 at EOF or on error
+ */
+ssize_t WebSocket::fill(size_t more)
+{
+    if (dead) {
+        return -1;
+    }
+    size_t want = std::max(more, RECV_READ_MIN);
+    if (ssl) {
+        if (!SSL_handshake_complete) {
+            auto res = SSL_accept(ssl);
+            if (res <= 0) {
+                int err = SSL_get_error(ssl, res);
                 if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) {
-                    return;
-                }
-                if (err == SSL_ERROR_ZERO_RETURN) {
-                    // orderly shutdown
-                    close(fd);
-                    fd = -1;
-                    return;
+                    // still pending
+                    return 0;
                 }
                 ERR_print_errors_fp(stdout);
-                close(fd);
-                fd = -1;
-                return;
+                dead = true;
+                return -1;
             }
-        } else {
-            n = ::recv(fd, &pending[npending], space, 0);
-            if (n < 0) {
-                if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                    return;
-                }
-                close(fd);
-                fd = -1;
-                return;
+            printf("SSL handshake completed\n");
+            SSL_handshake_complete = true;
+            ktls_send = BIO_get_ktls_send(SSL_get_wbio(ssl));
+            const bool ktls_recv = BIO_get_ktls_recv(SSL_get_rbio(ssl));
+            if (ktls_send || ktls_recv) {
+                printf("WebSocket: kernel TLS%s%s\n", ktls_send?" send":"", ktls_recv?" receive":"");
             }
-            if (n == 0) {
-                // EOF
-                close(fd);
-                fd = -1;
-                return;
+        }
+        // take all of a record TLS has already decrypted in one read
+        want = std::max(want, size_t(SSL_pending(ssl)));
+    }
+    make_space(want);
+    const size_t space = in.size() - in_end;
+    if (space == 0) {
+        printf("WebSocket: receive buffer full\n");
+        closed = true;
+        return -1;
+    }
+
+    ssize_t n = 0;
+    if (ssl) {
+        n = SSL_read(ssl, &in[in_end], space);
+        if (n <= 0) {
+            int err = SSL_get_error(ssl, n);
+            if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) {
+                return 0;
+            }
+            if (err == SSL_ERROR_ZERO_RETURN) {
+                // orderly shutdown
+                dead = true;
+                return -1;
             }
+            ERR_print_errors_fp(stdout);
+            dead = true;
+            return -1;
+        }
+    } else {
+        n = ::recv(fd, &in[in_end], space, 0);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                return 0;
+            }
+            dead = true;
+            return -1;
+        }
+        if (n == 0) {
+            // EOF
+            dead = true;
+            return -1;
         }
-        npending += n;
     }
+    in_end += n;
+    return n;
 }
 
 /*
-  decode an incoming WebSocket packet and overwrite buf with the decoded data
-  return the number of decoded payload bytes, or -1 on error
+  xor n bytes in place with the 4 byte mask, 16 or 8 bytes at a time
  */
-ssize_t WebSocket::decode(uint8_t *buf, size_t n, size_t &used)
+static void unmask(uint8_t *p, size_t n, const uint8_t mask[4])
 {
-    if (n < 2) return -1;
-
-    // NOTE: opcode currently unused, reserved for future handling of ping/close/etc.
-    [[maybe_unused]] uint8_t opcode = buf[0] & 0x0F;
-    bool masked = buf[1] & 0x80;
-    uint64_t payload_len = buf[1] & 0x7F;
-    size_t pos = 2;
-
-    if (payload_len == 126) {
-        if (n < 4) return -1;
-        payload_len = ntohs(*(uint16_t *)(buf + pos));
-        pos += 2;
-    } else if (payload_len == 127) {
-        if (n < 10) return -1;
-        payload_len = be64toh(*(uint64_t *)(buf + pos));
-        pos += 8;
-    }
-
-    if (masked) {
-	if (n < pos + 4 + payload_len) {
-	    return -1;
-	}
-	uint8_t mask[4];
-	memcpy(mask, buf + pos, 4);
-	pos += 4;
-	for (size_t i = 0; i < payload_len; i++) {
-	    buf[i] = buf[pos + i] ^ mask[i % 4];
-	}
-    } else {
-	if (n < pos + payload_len) {
-	    return -1;
-	}
-        memmove(buf, buf + pos, payload_len);
+    uint32_t m32;
+    memcpy(&m32, mask, 4);
+    const uint64_t m64 = (uint64_t(m32) << 32) | m32;
+    size_t i = 0;
+#if defined(__SSE2__)
+    const __m128i m128 = _mm_set1_epi32(int(m32));
+    for (; i + 16 <= n; i += 16) {
+        const __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        _mm_storeu_si128((__m128i *)(p + i), _mm_xor_si128(v, m128));
     }
+#endif
+    for (; i + 8 <= n; i += 8) {
+        uint64_t v;
+        memcpy(&v, p + i, 8);
+        v ^= m64;
+        memcpy(p + i, &v, 8);
+    }
+    for (; i < n; i++) {
+        p[i] ^= mask[i & 3];
+    }
+}
+
+/*
+  decode the frames at in_start up to the next data frame with a
+  payload, answering pings and a close on the way. Data frames of a
+  fragmented message are handed out as they come: the MAVLink parser
+  reads a byte stream, so message boundaries don't matter to it.
+  Returns the payload length with data pointing at it, unmasked in
+  place; 0 when the next frame isn't all here, with need set to the
+  bytes it takes from in_start; -1 to close the connection
+ */
+ssize_t WebSocket::next_frame(uint8_t *&data, size_t &need)
+{
+    while (true) {
+        uint8_t *p = &in[in_start];
+        const size_t avail = in_end - in_start;
+        if (avail < 2) {
+            need = 2;
+            return 0;
+        }
+        const bool fin = p[0] & 0x80;
+        const uint8_t opcode = p[0] & 0x0F;
+        const bool masked = p[1] & 0x80;
+        uint64_t payload_len = p[1] & 0x7F;
+        size_t pos = 2;
+        if (payload_len == 126) {
+            pos += 2;
+        } else if (payload_len == 127) {
+            pos += 8;
+        }
+        if (masked) {
+            pos += 4;
+        }
+        if (avail < pos) {
+            need = pos;
+            return 0;
+        }
+        if (payload_len == 126) {
+            uint16_t v;
+            memcpy(&v, p + 2, 2);
+            payload_len = ntohs(v);
+        } else if (payload_len == 127) {
+            uint64_t v;
+            memcpy(&v, p + 2, 8);
+            payload_len = be64toh(v);
+        }
 
-    used = pos + payload_len;
+        // no extensions are negotiated, so no reserved bits
+        if (p[0] & 0x70) {
+            return fail(CLOSE_PROTOCOL_ERROR, "reserved bits set");
+        }
+        if (opcode >= OP_CLOSE && (!fin || payload_len > 125)) {
+            return fail(CLOSE_PROTOCOL_ERROR, "bad control frame");
+        }
+        if (payload_len > MAX_FRAME_LEN) {
+            return fail(CLOSE_TOO_BIG, "frame too big");
+        }
+        if (avail < pos + payload_len) {
+            need = pos + payload_len;
+            return 0;
+        }
+        uint8_t *payload = p + pos;
+        if (masked) {
+            unmask(payload, payload_len, payload - 4);
+        }
+        in_start += pos + payload_len;
 
-    return payload_len;
+        switch (opcode) {
+        case OP_CONTINUATION:
+            if (!in_fragmented) {
+                return fail(CLOSE_PROTOCOL_ERROR, "continuation without a message");
+            }
+            in_fragmented = !fin;
+            break;
+        case OP_TEXT:
+        case OP_BINARY:
+            if (in_fragmented) {
+                return fail(CLOSE_PROTOCOL_ERROR, "message inside a fragmented one");
+            }
+            in_fragmented = !fin;
+            break;
+        case OP_CLOSE:
+            // echo the status code back, which completes the close
+            queue_control(OP_CLOSE, payload, payload_len >= 2 ? 2 : 0);
+            flush_control();
+            closed = true;
+            return -1;
+        case OP_PING:
+            queue_control(OP_PONG, payload, payload_len);
+            flush_control();
+            continue;
+        case OP_PONG:
+            continue;
+        default:
+            return fail(CLOSE_PROTOCOL_ERROR, "unknown opcode");
+        }
+        if (payload_len == 0) {
+            continue;
+        }
+        data = payload;
+        return payload_len;
+    }
+}
+
+/*
+  close the connection for a protocol error, telling the peer why
+ */
+ssize_t WebSocket::fail(uint16_t code, const char *why)
+{
+    printf("WebSocket: %s, closing\n", why);
+    const uint16_t code_be = htons(code);
+    queue_control(OP_CLOSE, (const uint8_t *)&code_be, 2);
+    flush_control();
+    closed = true;
+    return -1;
+}
+
+/*
+  set up a control frame to send. One that is already waiting stays,
+  as TLS may be holding it for a repeated write: a ping that comes
+  meanwhile is answered by the pong of the one before, and a close
+  goes out after it. Nothing is sent after a close
+ */
+void WebSocket::queue_control(uint8_t opcode, const uint8_t *payload, size_t n)
+{
+    if (close_queued) {
+        return;
+    }
+    if (opcode == OP_CLOSE) {
+        close_queued = true;
+    }
+    if (ctrl_len != 0) {
+        if (opcode == OP_CLOSE) {
+            close_out[0] = 0x80 | OP_CLOSE;
+            close_out[1] = n;
+            memcpy(&close_out[2], payload, n);
+            close_len = 2 + n;
+        }
+        return;
+    }
+    ctrl_out[0] = 0x80 | opcode;
+    ctrl_out[1] = n;
+    memcpy(&ctrl_out[2], payload, n);
+    ctrl_len = 2 + n;
+}
+
+/*
+  send the queued control frame if we are between data frames and no
+  TLS write is waiting to be repeated. Returns true once none is queued
+ */
+bool WebSocket::flush_control(void)
+{
+    if (out_frame_left != 0 || write_retry) {
+        return ctrl_len == 0;
+    }
+    while (ctrl_len != 0) {
+        while (ctrl_sent < ctrl_len) {
+            const ssize_t n = write_raw(&ctrl_out[ctrl_sent], ctrl_len - ctrl_sent);
+            if (n <= 0) {
+                return false;
+            }
+            ctrl_sent += n;
+        }
+        // the close behind it is next
+        memcpy(ctrl_out, close_out, close_len);
+        ctrl_len = close_len;
+        ctrl_sent = 0;
+        close_len = 0;
+    }
+    return true;
+}
+
+/*
+  the length of the frame our own unmasked header starts
+ */
+static size_t frame_length(const uint8_t *header)
+{
+    const uint8_t len = header[1] & 0x7F;
+    if (len == 126) {
+        uint16_t v;
+        memcpy(&v, header + 2, 2);
+        return 4 + ntohs(v);
+    }
+    if (len == 127) {
+        uint64_t v;
+        memcpy(&v, header + 2, 8);
+        return 10 + be64toh(v);
+    }
+    return 2 + len;
 }
 
 /*
@@ -278,7 +516,7 @@ bool WebSocket::send_handshake(const std::string &key)
                     return false; // try again later
                 }
                 ERR_print_errors_fp(stdout);
-                close(fd); fd = -1;
+                dead = true;
                 return false;
             }
         } else {
@@ -287,7 +525,7 @@ bool WebSocket::send_handshake(const std::string &key)
                 if (errno == EAGAIN || errno == EWOULDBLOCK) {
                     return false;
                 }
-                close(fd); fd = -1;
+                dead = true;
                 return false;
             }
         }
@@ -301,78 +539,140 @@ bool WebSocket::send_handshake(const std::string &key)
  */
 ssize_t WebSocket::send(const void *buf, size_t n)
 {
-    uint8_t header[10];
-    size_t header_len = 0;
+    uint8_t pkt[MAX_HEADER_LEN + n];
+    const size_t header_len = frame_header(n, pkt);
+    memcpy(&pkt[header_len], buf, n);
+    const ssize_t sent = write(pkt, header_len + n);
+    if (sent < ssize_t(header_len + n)) {
+        return sent < 0 ? -1 : 0; // partial; retry later
+    }
+    return n;
+}
+
+/*
+  fill in the header of a binary frame carrying n bytes. Returns its
+  length
+ */
+size_t WebSocket::frame_header(size_t n, uint8_t header[MAX_HEADER_LEN])
+{
     header[0] = 0x82; // FIN + binary opcode
 
     if (n <= 125) {
         header[1] = n;
-        header_len = 2;
-    } else if (n <= 65535) {
+        return 2;
+    }
+    if (n <= 65535) {
         header[1] = 126;
         *(uint16_t *)(header + 2) = htons(n);
-        header_len = 4;
-    } else {
-        header[1] = 127;
-        *(uint64_t *)(header + 2) = htobe64(n);
-        header_len = 10;
+        return 4;
     }
+    header[1] = 127;
+    *(uint64_t *)(header + 2) = htobe64(n);
+    return 10;
+}
 
-    uint8_t pkt[header_len + n];
-    memcpy(pkt, header, header_len);
-    memcpy(&pkt[header_len], buf, n);
+/*
+  write already framed bytes, through TLS if the connection uses it.
+  buf holds whole frames, apart from the rest of one that an earlier
+  write took part of. Returns how many were taken, 0 if none could be
+  for now, -1 on error. After a 0 with write_must_repeat() the next
+  write must start with the same n bytes. A queued pong or close goes
+  out first when we are between frames
+ */
+ssize_t WebSocket::write(const void *buf, size_t n)
+{
+    if (ctrl_len != 0 && out_frame_left == 0 && !write_retry && !flush_control()) {
+        return dead ? -1 : 0;
+    }
+    const ssize_t sent = write_raw(buf, n);
+    if (sent <= 0) {
+        write_retry = sent == 0 && write_must_repeat();
+        return sent;
+    }
+    write_retry = false;
+
+    // keep track of where our frames end, for control frames
+    const uint8_t *b = (const uint8_t *)buf;
+    size_t pos = 0;
+    while (pos < size_t(sent)) {
+        if (out_frame_left == 0) {
+            out_frame_left = frame_length(b + pos);
+        }
+        const size_t take = std::min(size_t(sent) - pos, out_frame_left);
+        out_frame_left -= take;
+        pos += take;
+    }
+    if (ctrl_len != 0) {
+        flush_control();
+    }
+    return sent;
+}
 
+/*
+  write bytes as they are. With kTLS the kernel makes the records, so
+  the bytes go out with a plain send() and no copy through OpenSSL;
+  reads stay with SSL_read(), which then only handles the records
+  that aren't application data (alerts, key updates)
+ */
+ssize_t WebSocket::write_raw(const void *buf, size_t n)
+{
+    if (dead) {
+        return -1;
+    }
     ssize_t sent;
-    if (_is_SSL && ssl) {
-        sent = SSL_write(ssl, pkt, sizeof(pkt));
+    if (_is_SSL && ssl && !ktls_send) {
+        sent = SSL_write(ssl, buf, n);
         if (sent <= 0) {
             int err = SSL_get_error(ssl, sent);
             if (err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ) {
                 return 0; // try again later
             }
             ERR_print_errors_fp(stdout);
-            close(fd); fd = -1;
+            dead = true;
             return -1;
         }
     } else {
-        sent = ::send(fd, pkt, sizeof(pkt), 0);
+        sent = ::send(fd, buf, n, MSG_NOSIGNAL);
         if (sent < 0) {
             if (errno == EAGAIN || errno == EWOULDBLOCK) {
                 return 0;
             }
-            close(fd); fd = -1;
+            dead = true;
             return -1;
         }
     }
-    if (sent < ssize_t(sizeof(pkt))) {
-        return 0; // partial; retry later
-    }
-    return sizeof(pkt) - header_len;
+    return sent;
 }
 
 /*
-  receive some data
+  receive the payload of the next data frame. data points at it,
+  unmasked where it arrived, until the next call. Returns its length,
+  0 when nothing more is ready (everything the socket and TLS held
+  has been read), -1 at EOF, on error or once the peer closed
  */
-ssize_t WebSocket::recv(void *buf, size_t n)
+ssize_t WebSocket::receive(uint8_t *&data)
 {
-    fill_pending();
-    if (fd < 0) {
-	return -1;
-    }
-    if (!done_headers) {
-	check_headers();
-    }
-    size_t used;
-    auto decode_len = decode(pending, npending, used);
-    if (decode_len == -1) {
-	return 0;
-    }
-    if (ssize_t(n) > decode_len) {
-	n = decode_len;
+    while (!dead && !closed) {
+        size_t need = 0;
+        if (done_headers) {
+            const ssize_t n = next_frame(data, need);
+            if (n != 0) {
+                return n;
+            }
+        } else if (check_headers()) {
+            continue;
+        }
+        if (closed) {
+            break;
+        }
+        const size_t avail = in_end - in_start;
+        const ssize_t n = fill(need > avail ? need - avail : 0);
+        if (n == 0) {
+            return 0;
+        }
+        if (n < 0) {
+            break;
+        }
     }
-
-    memcpy(buf, pending, n);
-    memmove(pending, &pending[used], npending-used);
-    npending -= used;
-    return n;
+    return -1;
 }
@@ -7,36 +7,99 @@
 #include <stdint.h>
 #include <unistd.h>
 #include <string>
+#include <vector>
 #include <openssl/ssl.h>
 
 class WebSocket {
 public:
     WebSocket(int fd);
+    ~WebSocket();
 
     static bool detect(int fd);
     ssize_t send(const void *buf, size_t n);
-    ssize_t recv(void *buf, size_t n);
+
+    // for callers that queue frames themselves, see websocket.cpp
+    static constexpr size_t MAX_HEADER_LEN = 10;
+    static size_t frame_header(size_t n, uint8_t header[MAX_HEADER_LEN]);
+    ssize_t write(const void *buf, size_t n);
+    // the next data frame's payload, see websocket.cpp
+    ssize_t receive(uint8_t *&data);
     bool is_SSL(void) const {
 	return _is_SSL;
     }
+    // a write() that took nothing must be repeated with the same bytes
+    bool write_must_repeat(void) const {
+	return _is_SSL && !ktls_send;
+    }
 
 private:
     int fd = -1;
     bool _is_SSL = false;
     bool SSL_handshake_complete = false;
-    uint8_t pending[1024] {};
-    uint32_t npending = 0;
+    // the kernel encrypts what is sent (kTLS), see tlscontext.h
+    bool ktls_send = false;
     SSL *ssl = nullptr;
-    SSL_CTX *ctx = nullptr;
     bool done_headers = false;
+    // a close frame came or went out, or the peer broke the protocol
+    bool closed = false;
+    /*
+      the socket hit EOF or an error. fd belongs to the session, which
+      closes it once we return -1: in reactor mode the fd table is
+      shared, so a second close could take another session's socket
+     */
+    bool dead = false;
+
+    /*
+      received bytes; frames are decoded from in_start. The buffer
+      grows to take a whole frame of up to MAX_FRAME_LEN
+     */
+    static constexpr size_t MAX_REQUEST_LEN = 16384;
+    static constexpr size_t MAX_FRAME_LEN = 65536;
+    static constexpr size_t RECV_BUFFER_INITIAL = 4096;
+    static constexpr size_t RECV_BUFFER_MAX = MAX_FRAME_LEN + MAX_HEADER_LEN + 4;
+    static constexpr size_t RECV_READ_MIN = 2048;
+    std::vector<uint8_t> in;
+    size_t in_start = 0;
+    size_t in_end = 0;
+    // in a message whose continuation frames are still to come
+    bool in_fragmented = false;
+
+    enum : uint8_t {
+        OP_CONTINUATION = 0x0,
+        OP_TEXT = 0x1,
+        OP_BINARY = 0x2,
+        OP_CLOSE = 0x8,
+        OP_PING = 0x9,
+        OP_PONG = 0xA,
+    };
+    static constexpr uint16_t CLOSE_PROTOCOL_ERROR = 1002;
+    static constexpr uint16_t CLOSE_TOO_BIG = 1009;
+
+    // a pong or close waiting to go out between our data frames
+    uint8_t ctrl_out[2 + 125] {};
+    size_t ctrl_len = 0;
+    size_t ctrl_sent = 0;
+    // a close queued behind the control frame in ctrl_out
+    uint8_t close_out[2 + 2] {};
+    size_t close_len = 0;
+    // nothing is queued after a close
+    bool close_queued = false;
+    // bytes of the data frame being written that are still to go
+    size_t out_frame_left = 0;
+    // the last write() took nothing and TLS wants the same bytes again
+    bool write_retry = false;
 
     char handshake_buf[512] {};
     size_t handshake_len = 0;
     size_t handshake_sent = 0;
 
-    
-    void fill_pending(void);
     bool send_handshake(const std::string &key);
-    void check_headers(void);
-    ssize_t decode(uint8_t *buf, size_t n, size_t &used);
+    bool check_headers(void);
+    void make_space(size_t more);
+    ssize_t fill(size_t more);
+    ssize_t next_frame(uint8_t *&data, size_t &need);
+    ssize_t fail(uint16_t code, const char *why);
+    void queue_control(uint8_t opcode, const uint8_t *payload, size_t n);
+    bool flush_control(void);
+    ssize_t write_raw(const void *buf, size_t n);
 };
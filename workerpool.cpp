@@ -0,0 +1,267 @@
+/*
+  pool of pre-forked session workers (-p)
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "workerpool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <algorithm>
+
+#include "util.h"
+
+// what the parent sends a worker, along with up to four sockets
+struct HandoffMsg {
+    int32_t port1;
+    int32_t port2;
+    uint32_t flags;
+    uint8_t fc_sysid;
+    // bit i set: socket i of sock1_udp, sock2_udp, sock1_tcp,
+    // sock2_listen is attached, in that order
+    uint8_t fd_mask;
+    // listen_port::sock1_udp_shared
+    uint8_t sock1_udp_shared;
+};
+
+#define MAX_HANDOFF_FDS 4
+
+WorkerPool::WorkerPool(session_fn_t _run_session, setup_fn_t _child_setup, spawned_fn_t _spawned) :
+    run_session(_run_session),
+    child_setup(_child_setup),
+    spawned(_spawned)
+{
+}
+
+void WorkerPool::set_size(unsigned _size)
+{
+    size = _size;
+    refill();
+}
+
+void WorkerPool::refill(void)
+{
+    while (idle.size() < size) {
+        if (!spawn()) {
+            break;
+        }
+    }
+}
+
+bool WorkerPool::spawn(void)
+{
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) != 0) {
+        perror("socketpair");
+        return false;
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork(worker)");
+        close(sv[0]);
+        close(sv[1]);
+        return false;
+    }
+    if (pid == 0) {
+        close(sv[0]);
+        worker_main(sv[1]);
+    }
+    close(sv[1]);
+    idle.push_back(Worker { pid, sv[0] });
+    if (spawned) {
+        spawned(pid);
+    }
+    return true;
+}
+
+/*
+  a worker: shed everything inherited from the parent, then wait for
+  a port pair
+ */
+void WorkerPool::worker_main(int ctrl)
+{
+    child_setup();
+    idle.clear();
+
+    // keep stdio and the control socket (moved to fd 3), close the
+    // rest: the listening sockets of every port pair, other workers'
+    // control sockets, the parent's epoll fd
+    if (ctrl != 3) {
+        dup2(ctrl, 3);
+        close(ctrl);
+        ctrl = 3;
+    }
+    close_fds_from(4);
+
+    // load the timezone now rather than on the first log line
+    tzset();
+
+    struct HandoffMsg m {};
+    struct iovec iov { &m, sizeof(m) };
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int) * MAX_HANDOFF_FDS)];
+    } cbuf;
+    struct msghdr mh {};
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = cbuf.buf;
+    mh.msg_controllen = sizeof(cbuf.buf);
+
+    ssize_t n;
+    do {
+        n = recvmsg(ctrl, &mh, MSG_CMSG_CLOEXEC);
+    } while (n == -1 && errno == EINTR);
+    if (n != sizeof(m)) {
+        // the parent is gone, or shrank the pool
+        _exit(0);
+    }
+
+    int fds[MAX_HANDOFF_FDS];
+    unsigned nfds = 0;
+    for (auto *c = CMSG_FIRSTHDR(&mh); c != nullptr; c = CMSG_NXTHDR(&mh, c)) {
+        if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS) {
+            nfds = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            nfds = std::min(nfds, unsigned(MAX_HANDOFF_FDS));
+            memcpy(fds, CMSG_DATA(c), nfds * sizeof(int));
+        }
+    }
+    close(ctrl);
+
+    struct listen_port lp {};
+    lp.next = nullptr;
+    lp.port1 = m.port1;
+    lp.port2 = m.port2;
+    lp.flags = m.flags;
+    lp.fc_sysid = m.fc_sysid;
+    lp.sock1_udp_shared = m.sock1_udp_shared != 0;
+    int *socks[MAX_HANDOFF_FDS] { &lp.sock1_udp, &lp.sock2_udp, &lp.sock1_tcp, &lp.sock2_listen };
+    unsigned next_fd = 0;
+    for (unsigned i = 0; i < MAX_HANDOFF_FDS; i++) {
+        *socks[i] = -1;
+        if ((m.fd_mask & (1U << i)) && next_fd < nfds) {
+            *socks[i] = fds[next_fd++];
+        }
+    }
+    lp.pid = 0;
+    lp.seen = true;
+    lp.removed = false;
+
+    run_session(&lp);
+    exit(0);
+}
+
+pid_t WorkerPool::hand_off(const struct listen_port *p)
+{
+    struct HandoffMsg m {};
+    m.port1 = p->port1;
+    m.port2 = p->port2;
+    m.flags = p->flags;
+    m.fc_sysid = p->fc_sysid;
+    m.sock1_udp_shared = p->sock1_udp_shared;
+
+    const int socks[MAX_HANDOFF_FDS] { p->sock1_udp, p->sock2_udp, p->sock1_tcp, p->sock2_listen };
+    int fds[MAX_HANDOFF_FDS];
+    unsigned nfds = 0;
+    for (unsigned i = 0; i < MAX_HANDOFF_FDS; i++) {
+        if (socks[i] != -1) {
+            m.fd_mask |= 1U << i;
+            fds[nfds++] = socks[i];
+        }
+    }
+
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int) * MAX_HANDOFF_FDS)];
+    } cbuf;
+    memset(&cbuf, 0, sizeof(cbuf));
+    struct iovec iov { &m, sizeof(m) };
+    struct msghdr mh {};
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    if (nfds > 0) {
+        mh.msg_control = cbuf.buf;
+        mh.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+        auto *c = CMSG_FIRSTHDR(&mh);
+        c->cmsg_level = SOL_SOCKET;
+        c->cmsg_type = SCM_RIGHTS;
+        c->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+        memcpy(CMSG_DATA(c), fds, sizeof(int) * nfds);
+    }
+
+    while (!idle.empty()) {
+        const Worker w = idle.back();
+        idle.pop_back();
+        const ssize_t ret = sendmsg(w.ctrl, &mh, MSG_NOSIGNAL);
+        close(w.ctrl);
+        if (ret == sizeof(m)) {
+            return w.pid;
+        }
+        // that worker died; the parent reaps it
+        lost.push_back(w.pid);
+    }
+    return -1;
+}
+
+bool WorkerPool::reap(pid_t pid)
+{
+    for (auto it = idle.begin(); it != idle.end(); ++it) {
+        if (it->pid == pid) {
+            close(it->ctrl);
+            idle.erase(it);
+            return true;
+        }
+    }
+    auto it = std::find(lost.begin(), lost.end(), pid);
+    if (it != lost.end()) {
+        lost.erase(it);
+        return true;
+    }
+    return false;
+}
+
+std::vector<pid_t> WorkerPool::stop(void)
+{
+    std::vector<pid_t> pids;
+    for (auto &w : idle) {
+        close(w.ctrl);
+        pids.push_back(w.pid);
+    }
+    idle.clear();
+    // those that died under a hand-off are still to be reaped too
+    pids.insert(pids.end(), lost.begin(), lost.end());
+    lost.clear();
+    size = 0;
+    for (pid_t pid : pids) {
+        while (waitpid(pid, nullptr, 0) == -1 && errno == EINTR) {
+        }
+    }
+    return pids;
+}
+
+void WorkerPool::close_in_child(void)
+{
+    for (auto &w : idle) {
+        close(w.ctrl);
+    }
+    idle.clear();
+    size = 0;
+}
@@ -0,0 +1,81 @@
+/*
+  pool of pre-forked session workers (-p)
+
+  Without a pool a session starts with a fork() after its first packet
+  or SYN has arrived, and the child then has to close the sockets of
+  every other port pair before it can forward anything. A pooled
+  worker is forked ahead of time, has already dropped everything it
+  inherited, and just waits on a control socket. When traffic arrives
+  the parent passes it the port pair and its listening sockets
+  (SCM_RIGHTS) and tops the pool up again off the critical path.
+
+  Workers are ordinary children of the parent, which is told about
+  each one as it is forked and sees it exit like any other session
+  child.
+ */
+#pragma once
+
+#include <sys/types.h>
+
+#include <functional>
+#include <vector>
+
+#include "listenport.h"
+
+class WorkerPool {
+public:
+    typedef std::function<void(struct listen_port *p)> session_fn_t;
+    typedef std::function<void(void)> setup_fn_t;
+    typedef std::function<void(pid_t pid)> spawned_fn_t;
+
+    /*
+      run_session is called in a worker with its port pair.
+      child_setup is called first thing in each new worker, to drop
+      parent-only state such as the parent's event loop. spawned, if
+      set, is called in the parent with each new worker's pid
+     */
+    WorkerPool(session_fn_t run_session, setup_fn_t child_setup, spawned_fn_t spawned = nullptr);
+
+    // start forking workers until size are idle
+    void set_size(unsigned size);
+    void refill(void);
+
+    /*
+      hand p and its sockets to an idle worker. Returns the worker's
+      pid, or -1 if none could take it; the caller then forks as usual.
+      The caller still owns (and closes) its copies of the sockets
+     */
+    pid_t hand_off(const struct listen_port *p);
+
+    /*
+      forget pid if it is an idle worker that exited. Returns true if
+      it was one of ours
+     */
+    bool reap(pid_t pid);
+
+    /*
+      close every idle worker's socket, which ends it, and reap them.
+      Returns their pids. No more are forked until set_size()
+     */
+    std::vector<pid_t> stop(void);
+
+    // in any other child: close our end of every idle worker's socket
+    void close_in_child(void);
+
+private:
+    struct Worker {
+        pid_t pid;
+        int ctrl;
+    };
+
+    session_fn_t run_session;
+    setup_fn_t child_setup;
+    spawned_fn_t spawned;
+    unsigned size = 0;
+    std::vector<Worker> idle;
+    // handed off to a worker that had already died
+    std::vector<pid_t> lost;
+
+    bool spawn(void);
+    [[noreturn]] void worker_main(int ctrl);
+};